@@ -12,6 +12,32 @@ CREATE FUNCTION spat_db_name()                  RETURNS TEXT      AS 'MODULE_PAT
 
 CREATE FUNCTION spat_db_created_at()            RETURNS TIMESTAMP  AS 'MODULE_PATHNAME' LANGUAGE C;
 
+CREATE FUNCTION spat_db_hash_function()         RETURNS TEXT      AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION sp_db_expire_stats(OUT expired_lazy bigint, OUT expired_active bigint, OUT expire_cycles bigint, OUT ttl_keys bigint) RETURNS record AS 'MODULE_PATHNAME' LANGUAGE C;
+CREATE FUNCTION sp_db_next_expiry()             RETURNS TIMESTAMPTZ AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION sp_db_memory_stats(OUT used_bytes bigint, OUT total_bytes bigint, OUT evictions bigint) RETURNS record AS 'MODULE_PATHNAME' LANGUAGE C;
+CREATE FUNCTION sp_local_cache_stats(OUT keys bigint, OUT bytes bigint, OUT hits bigint, OUT misses bigint, OUT invalidations bigint, OUT evictions bigint) RETURNS record AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION sp_hash_bench(nkeys int DEFAULT 100000, min_len int DEFAULT 8, max_len int DEFAULT 64,
+    OUT hash_function text, OUT avg_key_len float8, OUT ns_per_key float8, OUT avg_probes float8, OUT max_probes int)
+RETURNS SETOF record AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+
+CREATE FUNCTION spat_stats(
+    OUT keys bigint, OUT strings bigint, OUT lists bigint, OUT sets bigint, OUT hashes bigint, OUT zsets bigint, OUT ttl_keys bigint,
+    OUT used_bytes bigint, OUT key_bytes bigint, OUT string_bytes bigint, OUT list_bytes bigint,
+    OUT set_bytes bigint, OUT hash_bytes bigint, OUT zset_bytes bigint, OUT total_bytes bigint,
+    OUT evictions bigint, OUT expired_lazy bigint, OUT expired_active bigint, OUT expire_cycles bigint,
+    OUT blocked bigint
+) RETURNS record AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION spat_command_stats(
+    OUT command text, OUT calls bigint, OUT total_ms float8, OUT mean_ms float8, OUT p50_ms float8, OUT p99_ms float8,
+    OUT attach_ms float8, OUT lock_ms float8, OUT alloc_ms float8, OUT copy_ms float8, OUT histogram bigint[]
+) RETURNS SETOF record AS 'MODULE_PATHNAME' LANGUAGE C;
+CREATE FUNCTION spat_command_stats_reset() RETURNS void AS 'MODULE_PATHNAME' LANGUAGE C;
+
 /* -------------------- spvalue -------------------- */
 
 /*
@@ -20,7 +46,8 @@ CREATE FUNCTION spat_db_created_at()            RETURNS TIMESTAMP  AS 'MODULE_PA
 * To the user it's merely a shell type to facilitate output
 * and to be casted to other standard types (int, float, text, jsonb, vector etc.).
 * spvalue_in shouldn't be called in practice (throws error).
-* spvalue_out is called to display the underlying output.
+* spvalue_out is called to display the underlying output,
+* and spvalue_send to send it in binary, as text.
 * We use 8-byte alignment that works for all types:
 * both fixed and varlena
 */
@@ -31,13 +58,27 @@ CREATE FUNCTION spvalue_in(cstring, oid, integer) RETURNS spvalue   AS 'MODULE_P
 
 CREATE FUNCTION spvalue_out(spvalue)                RETURNS cstring AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 
+CREATE FUNCTION spvalue_send(spvalue)               RETURNS bytea   AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
 CREATE TYPE spvalue (
     INPUT = spvalue_in,
     OUTPUT = spvalue_out,
+    SEND = spvalue_send,
     INTERNALLENGTH = VARIABLE,
     ALIGNMENT = double -- 8-byte alignment
 );
 
+/* Values SET as the target type are returned as is, others are parsed from their text */
+CREATE FUNCTION spvalue_to_jsonb(spvalue) RETURNS jsonb AS 'MODULE_PATHNAME', 'spvalue_cast' LANGUAGE C STABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION spvalue_to_int8(spvalue) RETURNS bigint AS 'MODULE_PATHNAME', 'spvalue_cast' LANGUAGE C STABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION spvalue_to_int4(spvalue) RETURNS integer AS 'MODULE_PATHNAME', 'spvalue_cast' LANGUAGE C STABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION spvalue_to_float8(spvalue) RETURNS double precision AS 'MODULE_PATHNAME', 'spvalue_cast' LANGUAGE C STABLE STRICT PARALLEL SAFE;
+
+CREATE CAST (spvalue AS jsonb) WITH FUNCTION spvalue_to_jsonb(spvalue);
+CREATE CAST (spvalue AS bigint) WITH FUNCTION spvalue_to_int8(spvalue);
+CREATE CAST (spvalue AS integer) WITH FUNCTION spvalue_to_int4(spvalue);
+CREATE CAST (spvalue AS double precision) WITH FUNCTION spvalue_to_float8(spvalue);
+
 /* -------------------- SSET -------------------- */
 
 CREATE FUNCTION spset_generic(key text, value anyelement, ttl interval default null, nx boolean default null, xx boolean default null) RETURNS spvalue AS 'MODULE_PATHNAME' LANGUAGE C;
@@ -48,13 +89,54 @@ CREATE FUNCTION spset(text, text,    ttl interval default null, nx boolean defau
 /* numeric types */
 CREATE FUNCTION spset(text, integer,         ex interval DEFAULT null, nx boolean DEFAULT null, xx boolean DEFAULT null) RETURNS spvalue AS 'SELECT spset_generic($1, $2::integer, $3, $4, $5)' LANGUAGE SQL;
 
+/* any other type, kept in binary form if built-in, as text otherwise */
+CREATE FUNCTION spset(text, anyelement,    ttl interval default null, nx boolean default null, xx boolean default null) RETURNS spvalue  AS 'SELECT spset_generic($1, $2, $3, $4, $5)' LANGUAGE SQL;
+
 /* -------------------- GET -------------------- */
 
 CREATE FUNCTION spget(text) RETURNS spvalue AS 'MODULE_PATHNAME' LANGUAGE C PARALLEL SAFE;
+CREATE FUNCTION spget_text(key text) RETURNS text AS 'MODULE_PATHNAME' LANGUAGE C STRICT PARALLEL SAFE;
+CREATE FUNCTION spget_bytea(key text) RETURNS bytea AS 'MODULE_PATHNAME' LANGUAGE C STRICT PARALLEL SAFE;
+CREATE FUNCTION spget_jsonb(key text) RETURNS jsonb AS 'MODULE_PATHNAME' LANGUAGE C STRICT PARALLEL SAFE;
+CREATE FUNCTION spget_as(key text, type anyelement) RETURNS anyelement AS 'MODULE_PATHNAME' LANGUAGE C PARALLEL SAFE;
+CREATE FUNCTION spgetrange(key text, "offset" bigint, len bigint) RETURNS bytea AS 'MODULE_PATHNAME' LANGUAGE C STRICT PARALLEL SAFE;
+
+/* -------------------- COUNTERS -------------------- */
+
+CREATE FUNCTION incr(key text) RETURNS bigint AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+CREATE FUNCTION incrby(key text, increment bigint) RETURNS bigint AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+CREATE FUNCTION decr(key text) RETURNS bigint AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+CREATE FUNCTION decrby(key text, decrement bigint) RETURNS bigint AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+
+/* -------------------- MULTI-KEY -------------------- */
+
+CREATE FUNCTION spmget(text[]) RETURNS text[] AS 'MODULE_PATHNAME' LANGUAGE C STRICT PARALLEL SAFE;
+CREATE FUNCTION spmset(keys text[], vals text[], ttl interval default null) RETURNS void AS 'MODULE_PATHNAME' LANGUAGE C;
+CREATE FUNCTION spdel(text[]) RETURNS integer AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+CREATE FUNCTION spexec(commands jsonb) RETURNS jsonb AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+CREATE FUNCTION sp_load(query text, ttl interval default null) RETURNS bigint AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION sp_save(path text) RETURNS bigint AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+CREATE FUNCTION sp_load_snapshot(path text) RETURNS bigint AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+CREATE FUNCTION sp_replay_log(path text) RETURNS bigint AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+CREATE FUNCTION sp_db_log_stats(OUT lsn bigint, OUT logged_bytes bigint, OUT written_bytes bigint, OUT synced_bytes bigint) RETURNS record AS 'MODULE_PATHNAME' LANGUAGE C;
+
+/* -------------------- SCAN -------------------- */
+
+/*
+ * Each call reads its whole shard (or collection) to return count items, so a
+ * full scan reads it items / count times: size count to about 1/50 of the
+ * items per shard (keys / spat.shards) or more.
+ */
+
+CREATE FUNCTION spscan(cursor bigint default 0, match text default null, count int default 100, OUT next_cursor bigint, OUT keys text[]) RETURNS record AS 'MODULE_PATHNAME' LANGUAGE C;
+CREATE FUNCTION sscan(key text, cursor bigint default 0, match text default null, count int default 100, OUT next_cursor bigint, OUT members text[]) RETURNS record AS 'MODULE_PATHNAME' LANGUAGE C;
+CREATE FUNCTION hscan(key text, cursor bigint default 0, match text default null, count int default 100, OUT next_cursor bigint, OUT fields text[], OUT vals text[]) RETURNS record AS 'MODULE_PATHNAME' LANGUAGE C;
 
 /* -------------------- SPTYPE -------------------- */
 
 CREATE FUNCTION sptype(text) RETURNS text AS 'MODULE_PATHNAME' LANGUAGE C PARALLEL SAFE;
+CREATE FUNCTION spobject_encoding(text) RETURNS text AS 'MODULE_PATHNAME' LANGUAGE C PARALLEL SAFE;
 
 /* -------------------- DEL -------------------- */
 
@@ -71,22 +153,55 @@ CREATE FUNCTION sadd(text, text) RETURNS VOID AS 'MODULE_PATHNAME' LANGUAGE C;
 CREATE FUNCTION sismember(text, text) RETURNS boolean AS 'MODULE_PATHNAME' LANGUAGE C;
 CREATE FUNCTION scard(text) RETURNS INTEGER AS 'MODULE_PATHNAME' LANGUAGE C;
 CREATE FUNCTION srem(text, text) RETURNS INTEGER AS 'MODULE_PATHNAME' LANGUAGE C;
-CREATE FUNCTION sinter(text, text) RETURNS text[] AS 'MODULE_PATHNAME' LANGUAGE C;
+CREATE FUNCTION sinter(VARIADIC keys text[]) RETURNS SETOF text AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+CREATE FUNCTION sunion(VARIADIC keys text[]) RETURNS SETOF text AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+CREATE FUNCTION sdiff(VARIADIC keys text[]) RETURNS SETOF text AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+CREATE FUNCTION sinterstore(dest text, VARIADIC keys text[]) RETURNS INTEGER AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+CREATE FUNCTION sunionstore(dest text, VARIADIC keys text[]) RETURNS INTEGER AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+CREATE FUNCTION sdiffstore(dest text, VARIADIC keys text[]) RETURNS INTEGER AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
 
 /* -------------------- LISTS -------------------- */
 
 CREATE FUNCTION lpush(text, text) RETURNS VOID AS 'MODULE_PATHNAME' LANGUAGE C;
 CREATE FUNCTION lpop(text) RETURNS TEXT AS 'MODULE_PATHNAME' LANGUAGE C;
 
-CREATE FUNCTION rpush(text, text) RETURNS TEXT AS 'MODULE_PATHNAME' LANGUAGE C;
+CREATE FUNCTION rpush(text, text) RETURNS VOID AS 'MODULE_PATHNAME' LANGUAGE C;
 CREATE FUNCTION rpop(text) RETURNS TEXT AS 'MODULE_PATHNAME' LANGUAGE C;
 
 CREATE FUNCTION llen(text) RETURNS INTEGER AS 'MODULE_PATHNAME' LANGUAGE C;
 
+CREATE FUNCTION lindex(key text, index int) RETURNS TEXT AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+CREATE FUNCTION lrange(key text, start int, stop int) RETURNS TEXT[] AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+CREATE FUNCTION ltrim(key text, start int, stop int) RETURNS VOID AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+
+CREATE FUNCTION blpop(keys text[], timeout interval default null, OUT key text, OUT element text) RETURNS record AS 'MODULE_PATHNAME' LANGUAGE C;
+CREATE FUNCTION brpop(keys text[], timeout interval default null, OUT key text, OUT element text) RETURNS record AS 'MODULE_PATHNAME' LANGUAGE C;
+
 /* -------------------- HASHES -------------------- */
 
 CREATE FUNCTION hset(text, text, text) RETURNS VOID AS 'MODULE_PATHNAME' LANGUAGE C;
 CREATE FUNCTION hget(text, text) RETURNS TEXT AS 'MODULE_PATHNAME' LANGUAGE C;
+CREATE FUNCTION hincrby(key text, field text, increment bigint) RETURNS bigint AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+
+/* -------------------- SORTED SETS -------------------- */
+
+CREATE FUNCTION zadd(key text, score float8, member text) RETURNS INTEGER AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+CREATE FUNCTION zrem(key text, member text) RETURNS INTEGER AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+CREATE FUNCTION zscore(key text, member text) RETURNS float8 AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+CREATE FUNCTION zrank(key text, member text) RETURNS INTEGER AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+CREATE FUNCTION zcard(key text) RETURNS INTEGER AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+CREATE FUNCTION zrange(key text, start int, stop int, OUT member text, OUT score float8) RETURNS SETOF record AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+CREATE FUNCTION zrangebyscore(key text, min float8, max float8, OUT member text, OUT score float8) RETURNS SETOF record AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+CREATE FUNCTION zremrangebyscore(key text, min float8, max float8) RETURNS INTEGER AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+
+/* -------------------- PUB/SUB -------------------- */
+
+CREATE FUNCTION sppublish(channel text, message text) RETURNS integer AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+CREATE FUNCTION spsubscribe(channels text[]) RETURNS integer AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+CREATE FUNCTION spunsubscribe(channels text[] default null) RETURNS integer AS 'MODULE_PATHNAME' LANGUAGE C;
+CREATE FUNCTION spreceive(timeout interval default null, OUT channel text, OUT message text) RETURNS record AS 'MODULE_PATHNAME' LANGUAGE C;
+CREATE FUNCTION sp_pubsub_channels(OUT channel text, OUT subscribers int, OUT published bigint, OUT delivered bigint, OUT dropped bigint)
+RETURNS SETOF record AS 'MODULE_PATHNAME' LANGUAGE C;
 
 /* -------------------- DSS -------------------- */
 
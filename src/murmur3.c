@@ -40,10 +40,10 @@ static inline uint32_t fmix(uint32_t h)
 }
 
 //-----------------------------------------------------------------------------
-uint32_t hash_murmur3(const void *key, size_t len, void *arg) {
+uint32_t hash_murmur3_seeded(const void *key, size_t len, uint32_t seed) {
     const uint8_t *data = (const uint8_t *)key;
     const int nblocks = len / 4;
-    uint32_t h1 = 0xDEADBEEF; // Hardcoded seed value
+    uint32_t h1 = seed;
     uint32_t c1 = 0xcc9e2d51;
     uint32_t c2 = 0x1b873593;
 
@@ -86,3 +86,6 @@ uint32_t hash_murmur3(const void *key, size_t len, void *arg) {
     return h1;
 }
 
+uint32_t hash_murmur3(const void *key, size_t len, void *arg) {
+    return hash_murmur3_seeded(key, len, 0xDEADBEEF); // Hardcoded seed value
+}
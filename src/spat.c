@@ -15,6 +15,8 @@
  */
 #include "postgres.h"
 
+#include <sys/stat.h>
+
 #include "fmgr.h"
 #include "storage/dsm_registry.h"
 #include "storage/lwlock.h"
@@ -23,6 +25,7 @@
 #include "utils/builtins.h"
 #include "utils/memutils.h"
 #include "lib/dshash.h"
+#include "lib/ilist.h"
 #include "utils/guc.h"
 #include "utils/lsyscache.h"
 #include "utils/syscache.h"
@@ -30,7 +33,35 @@
 #include "utils/timestamp.h"
 #include "utils/datum.h"
 #include "utils/jsonb.h"
+#include "utils/numeric.h"
+#include "utils/array.h"
+#include "utils/float.h"
+#include "nodes/pg_list.h"
 #include "common/hashfn.h"
+#include "common/pg_prng.h"
+#include "access/htup_details.h"
+#include "access/transam.h"
+#include "access/tupmacs.h"
+#include "access/xact.h"
+#include "catalog/pg_authid.h"
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "funcapi.h"
+#include "libpq/pqformat.h"
+#include "mb/pg_wchar.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "port/atomics.h"
+#include "port/pg_bitutils.h"
+#include "port/pg_crc32c.h"
+#include "portability/instr_time.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "storage/condition_variable.h"
+#include "storage/fd.h"
+#include "storage/latch.h"
+#include "storage/procnumber.h"
+#include "utils/acl.h"
 #include "spat.h"
 
 PG_MODULE_MAGIC;
@@ -59,14 +90,58 @@ PG_MODULE_MAGIC;
 
 /*
  * A Dynamicaly-Shared String (DSS) is a null-terminated char* stored in a
- * DSA
+ * DSA.
+ *
+ * Lookup keys are DSS_LOCAL: str then holds a backend-local pointer straight
+ * into the caller's text, so read-only commands can hash and compare without
+ * allocating anything in the DSA. Such a dss is only ever used as a search
+ * key; whatever ends up in shared memory goes through dss_cpy_arg first.
+ *
+ * Strings of up to DSS_INLINE_SIZE bytes, terminator included, are DSS_INLINE
+ * instead: they're kept in the struct itself, so they need no allocation and
+ * hashing or comparing them touches no memory besides the dshash entry.
+ *
+ * A dss also caches its hash, 0 until it's first hashed. Search keys get it
+ * when dshash hashes them, and pass it on to the copy dshash inserts, so keys
+ * in a table always have it: comparing them rejects most mismatches without
+ * reading their strings, and scans don't need to rehash them. Flags share a
+ * word with len, which can't exceed MaxAllocSize anyway, so that the extra
+ * field costs nothing.
  */
+#define DSS_LOCAL 0x01
+#define DSS_INLINE 0x02
+
+#define DSS_INLINE_SIZE 24
+
 struct dss
 {
-    dsa_pointer str; /* = VARDATA_ANY(txt) */
-    Size len; /* = strlen + 1 = VARSIZE_ANY_EXHDR(t) + 1 */
+    union
+    {
+        dsa_pointer str; /* = VARDATA_ANY(txt) */
+        char inl[DSS_INLINE_SIZE];
+    } u;
+    uint32 len:30; /* = strlen + 1 = VARSIZE_ANY_EXHDR(t) + 1 */
+    uint32 flags:2;
+    uint32 hash;   /* see spdb_hash */
 };
 
+StaticAssertDecl(sizeof(dss) == 32, "dss must stay 32 bytes");
+
+#define DSS_IS_LOCAL(s) (((s)->flags & DSS_LOCAL) != 0)
+#define DSS_IS_INLINE(s) (((s)->flags & DSS_INLINE) != 0)
+
+static inline const char*
+dss_ptr(dsa_area* dsa, const dss* s)
+{
+    if (DSS_IS_INLINE(s))
+        return s->u.inl;
+
+    if (DSS_IS_LOCAL(s))
+        return (const char*)(uintptr_t)s->u.str;
+
+    return dsa_get_address(dsa, s->u.str);
+}
+
 int
 dss_cmp_arg(const void* a, const void* b, size_t size, void* arg)
 {
@@ -79,21 +154,50 @@ dss_cmp_arg(const void* a, const void* b, size_t size, void* arg)
         return (dss_a->len < dss_b->len) ? -1 : 1;
 
     /* Compare data byte-by-byte */
-    return memcmp(dsa_get_address(dsa, dss_a->str),
-                  dsa_get_address(dsa, dss_b->str),
+    return memcmp(dss_ptr(dsa, dss_a),
+                  dss_ptr(dsa, dss_b),
                   dss_a->len - 1); /* Exclude null terminator */
 }
 
-dshash_hash dss_hash_arg(const void* key, size_t size, void* arg)
+/*
+ * Where the time of commands goes, besides the rest of their own work, as
+ * timed with spat.track_timing. See "Timing".
+ */
+typedef enum SpatPhase
+{
+    SPAT_PHASE_ATTACH,                  /* mapping the DB or a shard */
+    SPAT_PHASE_LOCK,                    /* looking keys up and locking them or their collections */
+    SPAT_PHASE_ALLOC,                   /* dsa_allocate */
+    SPAT_PHASE_COPY                     /* copying values out of the DSA */
+} SpatPhase;
+
+#define SPAT_NPHASES (SPAT_PHASE_COPY + 1)
+
+static inline bool spat_timing_begin(SpatPhase phase);
+static inline void spat_timing_end(bool timed);
+
+/* Like dsa_allocate, but timed */
+static inline dsa_pointer spat_dsa_allocate_extended(dsa_area* dsa, Size size, int flags);
+
+#define spat_dsa_allocate(dsa, size) spat_dsa_allocate_extended((dsa), (size), 0)
+#define spat_dsa_allocate0(dsa, size) spat_dsa_allocate_extended((dsa), (size), DSA_ALLOC_ZERO)
+
+/* Make room for len bytes in s, inline if they fit. Returns where they go */
+static char*
+dss_alloc(dsa_area* dsa, dss* s, Size len)
 {
-    dsa_area* dsa = (dsa_area*)arg;
-    const dss* dss_key = (const dss*)key;
+    s->len = len;
+    s->hash = 0;
 
-#ifdef SPAT_MURMUR3
-    return hash_murmur3(dsa_get_address(dsa, dss_key->str), dss_key->len - 1, NULL);
-#else
-	return tag_hash(dsa_get_address(dsa, dss_key->str), dss_key->len - 1);
-#endif
+    if (len <= DSS_INLINE_SIZE)
+    {
+        s->flags = DSS_INLINE;
+        return s->u.inl;
+    }
+
+    s->flags = 0;
+    s->u.str = spat_dsa_allocate(dsa, len);
+    return dsa_get_address(dsa, s->u.str);
 }
 
 void
@@ -103,22 +207,17 @@ dss_cpy_arg(void* dest, const void* src, size_t size, void* arg)
     dss* dss_dest = (dss*)dest;
     const dss* dss_src = (const dss*)src;
 
-    /* Allocate memory in the destination DSS */
-    dss_dest->len = dss_src->len;
-    dss_dest->str = dsa_allocate(dsa, dss_src->len);
-
-    /* Copy the key data */
-    memcpy(dsa_get_address(dsa, dss_dest->str),
-           dsa_get_address(dsa, dss_src->str),
-           dss_src->len);
+    /* Copy the key data; a local source isn't null-terminated */
+    char* dest_str = dss_alloc(dsa, dss_dest, dss_src->len);
+    memcpy(dest_str, dss_ptr(dsa, dss_src), dss_src->len - 1);
+    dest_str[dss_src->len - 1] = '\0';
+    dss_dest->hash = dss_src->hash;
 }
 
 dss dss_new_extended(dsa_area* dsa, const char* str, Size len)
 {
     dss result;
-    result.str = dsa_allocate(dsa, len);
-    result.len = len;
-    memcpy(dsa_get_address(dsa, result.str), str, len);
+    memcpy(dss_alloc(dsa, &result, len), str, len);
     return result;
 }
 
@@ -128,11 +227,8 @@ dss dss_new(dsa_area* dsa, const text* txt)
 
     Size len = VARSIZE_ANY_EXHDR(txt) + 1;
 
-    result.str = dsa_allocate(dsa, len);
-    result.len = len;
-
     /* Copy the text payload into the allocated memory */
-    char* dest = dsa_get_address(dsa, result.str);
+    char* dest = dss_alloc(dsa, &result, len);
     memcpy(dest, VARDATA_ANY(txt), len - 1);
 
     /* Null-terminate the string */
@@ -141,16 +237,30 @@ dss dss_new(dsa_area* dsa, const text* txt)
     return result;
 }
 
+dss dss_new_local(const text* txt)
+{
+    dss result;
+
+    result.u.str = (dsa_pointer)(uintptr_t)VARDATA_ANY(txt);
+    result.len = VARSIZE_ANY_EXHDR(txt) + 1;
+    result.flags = DSS_LOCAL;
+    result.hash = 0;
+
+    return result;
+}
+
 text* dss_to_text(dsa_area* dsa, dss dss)
 {
     Size data_len = dss.len - 1; /* Exclude null terminator */
     text* result = (text*)palloc(data_len + VARHDRSZ);
+    bool timed = spat_timing_begin(SPAT_PHASE_COPY);
 
     /* Set the total size of the text object */
     SET_VARSIZE(result, data_len + VARHDRSZ);
 
     /* Copy the string data into the text structure */
-    memcpy(VARDATA(result), dsa_get_address(dsa, dss.str), data_len);
+    memcpy(VARDATA(result), dss_ptr(dsa, &dss), data_len);
+    spat_timing_end(timed);
 
     return result;
 }
@@ -158,7 +268,8 @@ text* dss_to_text(dsa_area* dsa, dss dss)
 void
 dss_free(dsa_area* dsa, dss* dss)
 {
-    dsa_free(dsa, dss->str);
+    if (!DSS_IS_LOCAL(dss) && !DSS_IS_INLINE(dss))
+        dsa_free(dsa, dss->u.str);
 }
 
 
@@ -172,6 +283,10 @@ const char* spTypeName(spValueType t)
         return "set";
     case SPVAL_LIST:
         return "list";
+    case SPVAL_HASH:
+        return "hash";
+    case SPVAL_ZSET:
+        return "zset";
     case SPVAL_NULL:
         return "null";
     case SPVAL_INVALID:
@@ -184,10 +299,13 @@ const char* spTypeName(spValueType t)
 typedef struct SPValue
 {
     spValueType typ;
+    bool isint;                 /* a SPAT_ENC_INT string, held by value in int_val */
+    Oid typid;                  /* the type of a SPAT_ENC_DATUM string, InvalidOid otherwise */
 
     union
     {
         struct varlena* varlena_val;
+        int64 int_val;
 
         struct
         {
@@ -198,6 +316,11 @@ typedef struct SPValue
         {
             uint32 size;
         } list;
+
+        struct
+        {
+            uint32 size;
+        } zset;
     } value;
 } SPValue;
 
@@ -205,10 +328,30 @@ typedef struct SPValue
 #define SpInvalidValDatum PointerGetDatum(NULL)
 #define SpMaxTTL DT_NOEND
 
+#define SPAT_LFU_INIT_VAL 5     /* so that new keys aren't evicted right away */
+#define SPAT_LFU_LOG_FACTOR 10
+#define SPAT_LFU_DECAY_SECS 60
+
 typedef dshash_table_handle dshash_set_handle;
 
-struct list_element;
-typedef struct list_element list_element;
+struct SpatListNode;
+typedef struct SpatListNode SpatListNode;
+
+/*
+ * How a value is laid out in the DSA. Collections start compact and are
+ * converted to their regular encoding once they grow, see "Compact
+ * encoding" below; either way they're the same type to the user.
+ */
+typedef enum SpatEncoding
+{
+    SPAT_ENC_RAW,               /* strings, or no value */
+    SPAT_ENC_INT,               /* strings holding an int64, inline in the entry */
+    SPAT_ENC_DATUM,             /* strings SET from another type than text, see spat_datum_get */
+    SPAT_ENC_LISTPACK,          /* small sets, hashes and lists: a SpatPack */
+    SPAT_ENC_HASHTABLE,         /* sets and hashes: a dshash_table */
+    SPAT_ENC_QUICKLIST,         /* lists: doubly-linked SpatListNodes of packed chunks */
+    SPAT_ENC_SKIPLIST           /* sorted sets: a SpatZSkiplist plus a dshash_table */
+} SpatEncoding;
 
 struct SpatDBEntry
 {
@@ -218,15 +361,49 @@ struct SpatDBEntry
     /* -------------------- Metadata -------------------- */
 
     TimestampTz expireat;
+    dsa_pointer expire_node;    /* SpatExpireNode in its shard's expiry heap, if it has a TTL */
+    uint64 lsn;                 /* last change logged for the key, see "Change log" */
+    uint32 atime;               /* last access, see spat_lru_clock */
+    uint8 lfu;                  /* logarithmic access frequency */
 
     /* -------------------- Value -------------------- */
 
-    spValueType valtyp;
+    uint8 valtyp;               /* spValueType, a byte so that lsn fits the padding */
+    uint8 encoding;             /* SpatEncoding of strings, collections keep theirs */
 
     union
     {
         dss string;
+        int64 integer;          /* strings, when SPAT_ENC_INT */
+        dsa_pointer coll;       /* SpatColl, for every other type */
+    } value;
+};
+
+/*
+ * Collections live behind a header of their own in the DSA, with their own
+ * lock, so that their entry is only locked to find them: a command pins the
+ * header, releases the entry and only then locks the collection, see
+ * spat_coll_lock. Working on a large collection thus never holds up the other
+ * keys of its dshash partition.
+ *
+ * Lock order is entry first, then collection; nothing takes an entry lock
+ * with a collection locked. Freeing the value of an entry locks its
+ * collection exclusively, frees its contents and marks it dropped, so that
+ * backends that had pinned it find it gone once they get to lock it; the
+ * header itself is freed with the last pin, the entry holding one of its own.
+ */
+typedef struct SpatColl
+{
+    LWLock lock;                /* protects everything below, and the contents */
+    pg_atomic_uint32 refcount;  /* the entry's reference, plus one per pin */
+    bool dropped;               /* no entry points to it anymore */
+    uint8 valtyp;               /* spValueType */
+    uint8 encoding;             /* SpatEncoding */
+    uint64 lsn;                 /* last change logged through the collection */
 
+    union
+    {
+        /* When compact, hndl (head for lists) points to the SpatPack instead */
         struct
         {
             dshash_set_handle hndl;
@@ -245,22 +422,266 @@ struct SpatDBEntry
             dshash_table_handle hndl;
             uint32 size;
         } hash;
+
+        struct
+        {
+            dsa_pointer zsl;    /* SpatZSkiplist */
+            dshash_table_handle dict;
+            uint32 size;
+        } zset;
     } value;
-};
+} SpatColl;
 
-struct SpatDB
+#define SPDB_ENTRY_HAS_COLL(e)          ((e)->valtyp > SPVAL_STRING)
+
+/*
+ * The keyspace of a SpatDB is split in nshards independent dshash_tables
+ * living in the same DSA. Keys are routed by hash, so writers on different
+ * shards never contend on the same partition locks or table resizes.
+ */
+#define SPAT_SHARDS_DEFAULT 1
+#define SPAT_SHARDS_MAX 1024
+
+/*
+ * Keys with a TTL are also indexed by expireat, in a per-shard binary min-heap
+ * living in the DSA, so that the expirer only ever touches keys that are due.
+ * Each heap item points to a node carrying its own copy of the key; the node
+ * remembers its position in the heap, so that removing or re-timing a key
+ * (DEL, SET with a new TTL) is O(log n) and never leaves stale items behind.
+ *
+ * Lock order is entry (dshash partition) lock first, then expire_lck. The
+ * expirer pops due nodes under expire_lck alone and only then looks their
+ * keys up; a node popped that way is marked SPAT_EXPIRE_NOT_QUEUED and is
+ * freed by the expirer, whether its entry still points to it or not.
+ */
+typedef struct SpatExpireItem
+{
+    TimestampTz expireat;
+    dsa_pointer node;                   /* SpatExpireNode */
+} SpatExpireItem;
+
+typedef struct SpatExpireNode
+{
+    dss key;                            /* own copy, the entry may be gone when due */
+    uint32 heap_index;                  /* position in the heap or SPAT_EXPIRE_NOT_QUEUED */
+} SpatExpireNode;
+
+#define SPAT_EXPIRE_NOT_QUEUED PG_UINT32_MAX
+#define SPAT_EXPIRE_HEAP_INITIAL 64
+
+typedef struct SpatDBShard
+{
+    dshash_table_handle htab_handle;    /* htab_handle pointing to the shard's dshash_table */
+
+    LWLock expire_lck;                  /* protects the expiry heap below */
+    dsa_pointer expire_heap;            /* SpatExpireItem[expire_cap] */
+    uint32 expire_size;
+    uint32 expire_cap;
+} SpatDBShard;
+
+/*
+ * The family keys are hashed with, for both routing them to shards and the
+ * dshash_tables themselves. It's fixed when the DB is created, together with
+ * a random seed, so that all backends agree on it and colliding keys can't be
+ * precomputed offline. CRC32C is the fastest on long keys, as Postgres
+ * computes it with SSE 4.2 or ARMv8 instructions where available, but it's
+ * linear: keys that collide do so under any seed.
+ */
+typedef enum SpatHashFunction
+{
+    SPAT_HASH_POSTGRES,                 /* hash_bytes_extended, Jenkins' lookup3 */
+    SPAT_HASH_MURMUR3,
+    SPAT_HASH_CRC32C
+} SpatHashFunction;
+
+typedef uint32 (*SpatHashFn) (const char* str, Size len, uint32 seed);
+
+#define SPAT_KEY_EPOCHS 4096        /* stripes of key epochs, a power of 2 */
+
+/* Commands timed with spat.track_timing, see "Timing" below */
+typedef enum SpatCommand
+{
+    SPAT_CMD_GET,
+    SPAT_CMD_GET_TEXT,
+    SPAT_CMD_GET_BYTEA,
+    SPAT_CMD_GET_JSONB,
+    SPAT_CMD_GET_AS,
+    SPAT_CMD_GETRANGE,
+    SPAT_CMD_SET,
+    SPAT_CMD_DEL,
+    SPAT_CMD_TYPE,
+    SPAT_CMD_GETEXPIREAT,
+    SPAT_CMD_INCR,
+    SPAT_CMD_INCRBY,
+    SPAT_CMD_DECR,
+    SPAT_CMD_DECRBY,
+    SPAT_CMD_MGET,
+    SPAT_CMD_MSET,
+    SPAT_CMD_MDEL,
+    SPAT_CMD_EXEC,
+    SPAT_CMD_LOAD,
+    SPAT_CMD_SCAN,
+    SPAT_CMD_SADD,
+    SPAT_CMD_SREM,
+    SPAT_CMD_SISMEMBER,
+    SPAT_CMD_SCARD,
+    SPAT_CMD_SINTER,
+    SPAT_CMD_SUNION,
+    SPAT_CMD_SDIFF,
+    SPAT_CMD_SINTERSTORE,
+    SPAT_CMD_SUNIONSTORE,
+    SPAT_CMD_SDIFFSTORE,
+    SPAT_CMD_SSCAN,
+    SPAT_CMD_LPUSH,
+    SPAT_CMD_RPUSH,
+    SPAT_CMD_LPOP,
+    SPAT_CMD_RPOP,
+    SPAT_CMD_LLEN,
+    SPAT_CMD_LINDEX,
+    SPAT_CMD_LRANGE,
+    SPAT_CMD_LTRIM,
+    SPAT_CMD_BLPOP,
+    SPAT_CMD_BRPOP,
+    SPAT_CMD_HSET,
+    SPAT_CMD_HGET,
+    SPAT_CMD_HINCRBY,
+    SPAT_CMD_HSCAN,
+    SPAT_CMD_ZADD,
+    SPAT_CMD_ZREM,
+    SPAT_CMD_ZSCORE,
+    SPAT_CMD_ZRANK,
+    SPAT_CMD_ZCARD,
+    SPAT_CMD_ZRANGE,
+    SPAT_CMD_ZRANGEBYSCORE,
+    SPAT_CMD_ZREMRANGEBYSCORE,
+    SPAT_CMD_SUBSCRIBE,
+    SPAT_CMD_UNSUBSCRIBE,
+    SPAT_CMD_PUBLISH,
+    SPAT_CMD_RECEIVE
+} SpatCommand;
+
+#define SPAT_NCOMMANDS (SPAT_CMD_RECEIVE + 1)
+
+/* Bucket 0 counts calls under 1 us, bucket i those in [2^(i-1), 2^i) us, the last also longer ones */
+#define SPAT_TIMING_BUCKETS 32
+
+typedef struct SpatCommandStats
+{
+    pg_atomic_uint64 calls;
+    pg_atomic_uint64 total_ns;
+    pg_atomic_uint64 phase_ns[SPAT_NPHASES];
+    pg_atomic_uint64 buckets[SPAT_TIMING_BUCKETS];
+} SpatCommandStats;
+
+/*
+ * Header of a SpatDB as stored in its named DSM segment. Everything here must
+ * be meaningful for every backend, so no backend-local pointers.
+ */
+typedef struct SpatDBShared
 {
     LWLock lck;
 
     dsa_handle dsa_handle;              /* dsa_handle to DSA area associated  with this DB */
-    dshash_table_handle htab_handle;    /* htab_handle pointing to the underlying dshash_table */
+
+    int nshards;                        /* fixed at creation from spat.shards */
+    dsa_pointer shards;                 /* SpatDBShard[nshards] */
+
+    int hash_function;                  /* SpatHashFunction, from spat.hash_function */
+    uint32 hash_seed;
 
     dsa_pointer name;                   /* Metadata about the db itself */
     TimestampTz created_at;
 
+    /* Expiration counters */
+    pg_atomic_uint64 expired_lazy;      /* reclaimed on access */
+    pg_atomic_uint64 expired_active;    /* reclaimed by the expirer */
+    pg_atomic_uint64 expire_cycles;     /* expirer cycles run */
+    pg_atomic_uint64 ttl_keys;          /* keys currently having a TTL */
+
+    pg_atomic_uint64 evictions;         /* keys evicted to honor spat.maxmemory */
+
+    /* Taken from spat.maxmemory* when the DB is created, so that every backend enforces the same */
+    uint64 maxmemory;                   /* bytes, 0 means no limit */
+    int maxmemory_policy;
+    int maxmemory_samples;
+
+    /* Likewise from spat.*_max_compact_*, so that backends agree on when collections convert */
+    int set_max_compact_entries;
+    int hash_max_compact_entries;
+    int list_max_compact_entries;
+    int max_compact_value;
+
+    /*
+     * Maintained in the insert/delete paths, so that spat_stats() never
+     * has to scan. Keys are counted by the type of value they hold, and
+     * bytes by the type of value they were allocated for; SPVAL_NULL holds
+     * the keys themselves, the entries and the expiry index. Unlike
+     * dsa_get_total_size, bytes go down again as keys are freed, so they
+     * tell how much memory eviction has made reusable.
+     */
+    pg_atomic_uint64 nkeys[SPVAL_NTYPES];
+    pg_atomic_uint64 nbytes[SPVAL_NTYPES];
+
+    /* Blocking pops sleep on list_cv; pushes only broadcast if there are waiters */
+    ConditionVariable list_cv;
+    pg_atomic_uint32 list_waiters;
+
+    /* Pub/Sub, see "Pub/Sub" below; both are created by the first subscriber */
+    LWLock pubsub_lck;                  /* protects creating them */
+    dshash_table_handle channels;       /* channel name -> SpatChannel */
+    dsa_pointer subscribers;            /* SpatSubscriber[MaxBackends], by ProcNumber */
+
+    /* Bumped by writers as they lock a key exclusively, see "Near cache" below */
+    pg_atomic_uint64 key_epochs[SPAT_KEY_EPOCHS];
+
+    /* Only maintained while spat.track_timing is on, see "Timing" below */
+    SpatCommandStats cmd_stats[SPAT_NCOMMANDS];
+
+    /*
+     * Change log, see "Change log" below. Positions are logical byte offsets
+     * into the log since startup; buffered bytes are [aof_written,
+     * aof_inserted) and live at their offset modulo SPAT_AOF_BUFSIZE.
+     */
+    pg_atomic_uint64 aof_lsn;           /* last LSN handed out */
+    LWLock aof_lck;                     /* protects the buffer and positions */
+    LWLock aof_write_lck;               /* held while writing the file, fsync included */
+    dsa_pointer aof_buf;                /* allocated on first use */
+    uint64 aof_inserted;
+    uint64 aof_written;
+    uint64 aof_synced;
+    uint64 aof_rotated;                 /* aof_written when the log was last rotated */
+    uint32 aof_generation;              /* bumped by rotations, so backends reopen the file */
+} SpatDBShared;
+
+/*
+ * A backend's attachment to a SpatDB. These live in a backend-local map keyed
+ * by the spat.db name, so that each backend maps a given DB only once.
+ */
+struct SpatDB
+{
+    char name[SPAT_NAME_MAXSIZE];       /* hash key, must be first */
+
+    SpatDBShared* shared;
+
     /* The following are set when the db is attached */
     dsa_area* g_dsa;
-    dshash_table* g_htab;
+    SpatDBShard* shard_hdrs;            /* = dsa_get_address(shared->shards) */
+    dshash_table** g_htabs;             /* per-shard, attached on first use */
+    SpatHashFn hash;                    /* = spat_hash_functions[shared->hash_function] */
+
+    /* The change log file, as last opened by this backend */
+    int aof_fd;
+    uint32 aof_generation;
+    uint64 aof_pending;                 /* end of the last record we logged, for spat.appendfsync = always */
+
+    /* Pub/Sub, once this backend has subscribed to a channel */
+    dshash_table* g_channels;           /* attached on first use */
+    struct SpatSubscriber* subscriber;  /* our slot in shared->subscribers */
+    List* channels;                     /* names we're subscribed to, in TopMemoryContext */
+
+    /* Only used by the expirer itself */
+    int expire_shard;                   /* where the expirer resumes */
+    TimestampTz aof_synced_at;          /* last time it fsynced the change log */
 };
 
 /*
@@ -272,1225 +693,10490 @@ struct SpatDB
  */
 
 
-bool
-spdb_is_attached(SpatDB* db)
+static dshash_table* spat_attach_shard(SpatDB* db, int shard);
+static void spdb_free_value(SpatDB* db, SpatDBEntry* entry);
+static Datum spat_datum_get(struct varlena* str);
+static char* spat_datum_cstring(struct varlena* str);
+
+/* Change log records, see "Change log" below */
+#define SPAT_AOF_SET 'S'            /* int64 expireat, value */
+#define SPAT_AOF_SETINT 'I'         /* int64 value, keeping the TTL */
+#define SPAT_AOF_SETDATUM 'T'       /* int64 expireat, datum payload */
+#define SPAT_AOF_DEL 'D'
+#define SPAT_AOF_SADD 'a'           /* member */
+#define SPAT_AOF_SREM 'r'           /* member */
+#define SPAT_AOF_PUSH 'p'           /* uint8 head, element */
+#define SPAT_AOF_DROP 'o'           /* uint8 head, uint32 n */
+#define SPAT_AOF_HSET 'h'           /* field, value */
+#define SPAT_AOF_ZADD 'z'           /* float8 score, member */
+#define SPAT_AOF_ZREM 'x'           /* member */
+#define SPAT_AOF_ZREMRANGE 'y'      /* float8 min, float8 max */
+
+static bool spat_aof_active(void);
+static bool spat_aof_begin(SpatDB* db, const dss* key, uint64* lsn, uint8 op);
+static void spat_aof_put(const void* data, Size len);
+static void spat_aof_put_str(const char* str, uint32 len);
+static void spat_aof_put_dss(SpatDB* db, const dss* s);
+static void spat_aof_end(SpatDB* db);
+static void spat_aof_advance_lsn(SpatDB* db, uint64 lsn);
+static inline uint32 spat_lru_clock(void);
+static inline void spdb_touch(SpatDB* db, SpatDBEntry* entry);
+
+#define SPDB_MEM_ADD(db, typ, n) pg_atomic_fetch_add_u64(&(db)->shared->nbytes[(typ)], (n))
+#define SPDB_MEM_SUB(db, typ, n) pg_atomic_fetch_sub_u64(&(db)->shared->nbytes[(typ)], (n))
+
+static inline uint64
+spdb_used_bytes(SpatDB* db)
 {
-    return db && db->g_dsa != NULL && db->g_htab != NULL;
-}
+    uint64 result = 0;
 
-#define SPDB_LOCK_SHARED(db)    LWLockAcquire(&(db)->lck, LW_SHARED)
-#define SPDB_LOCK_EXCLUSIVE(db) LWLockAcquire(&(db)->lck, LW_EXCLUSIVE)
-#define SPDB_LOCK_RELEASE(db)   LWLockRelease(&(db)->lck);
+    for (int i = 0; i < SPVAL_NTYPES; i++)
+        result += pg_atomic_read_u64(&db->shared->nbytes[i]);
 
+    return result;
+}
 
-SpatDBEntry*
-spdb_find(SpatDB* db, dss key, bool exclusive)
+/* Change the type of value an entry holds, keeping the per-type key counts */
+static inline void
+spdb_set_valtyp(SpatDB* db, SpatDBEntry* entry, spValueType valtyp)
 {
-    SpatDBEntry* entry = dshash_find(db->g_htab, &key, exclusive);
-    return entry;
-}
+    if (entry->valtyp == valtyp)
+        return;
 
+    pg_atomic_fetch_sub_u64(&db->shared->nkeys[entry->valtyp], 1);
+    pg_atomic_fetch_add_u64(&db->shared->nkeys[valtyp], 1);
+    entry->valtyp = valtyp;
+}
 
-SpatDBEntry*
-spdb_find_or_insert(SpatDB* db, dss key, bool* found)
+bool
+spdb_is_attached(SpatDB* db)
 {
-    SpatDBEntry* entry = dshash_find_or_insert(db->g_htab, &key, found);
-    if (entry == NULL)
-    {
-        elog(ERROR, "dshash_find_or_insert failed, probably out-of-memory");
-    }
-
-    return entry;
+    return db && db->g_dsa != NULL && db->g_htabs != NULL;
 }
 
+static uint32
+spat_hash_postgres(const char* str, Size len, uint32 seed)
+{
+    return (uint32) hash_bytes_extended((const unsigned char*) str, (int) len, seed);
+}
 
-void
-spdb_release_lock(SpatDB* db, SpatDBEntry* entry)
+static uint32
+spat_hash_murmur3(const char* str, Size len, uint32 seed)
 {
-    dshash_release_lock(db->g_htab, entry);
+    return hash_murmur3_seeded(str, len, seed);
 }
 
-/*
- * ---------------------------------------- GUC Variables
- * ----------------------------------------
- */
+/* CRC bits are linear in the input, so mix them before dshash takes the high ones */
+static uint32
+spat_hash_crc32c(const char* str, Size len, uint32 seed)
+{
+    pg_crc32c crc;
 
-static char* g_guc_spat_db_name = NULL; /* With this we identify a
-						 * shared SpatDB to
-						 * attach/detach */
+    INIT_CRC32C(crc);
+    crc ^= seed;
+    COMP_CRC32C(crc, str, len);
+    FIN_CRC32C(crc);
 
-/*
- * ---------------------------------------- Shared Memory Declarations
- * ----------------------------------------
- */
+    return murmurhash32(crc);
+}
 
-void _PG_init();
-static void spat_init_shmem(void* ptr);
-static void spat_attach_shmem(void);
+static const SpatHashFn spat_hash_functions[] = {
+    [SPAT_HASH_POSTGRES] = spat_hash_postgres,
+    [SPAT_HASH_MURMUR3] = spat_hash_murmur3,
+    [SPAT_HASH_CRC32C] = spat_hash_crc32c
+};
 
 /*
- * ---------------------------------------- Global state
- * ----------------------------------------
+ * The hash of key in db, computed only the first time; 0 is remapped, as it
+ * means the hash isn't cached yet. Only keys that aren't in any table yet
+ * can lack it, so caching it never writes to a key other backends can see.
  */
+static inline dshash_hash
+spdb_hash(SpatDB* db, dss* key)
+{
+    if (unlikely(key->hash == 0))
+    {
+        uint32 hash = db->hash(dss_ptr(db->g_dsa, key), key->len - 1, db->shared->hash_seed);
 
-static SpatDB* g_spat_db = NULL;
+        key->hash = hash != 0 ? hash : 1;
+    }
 
-int dss_cmp(const void* a, const void* b, size_t size, void* arg)
-{
-    return dss_cmp_arg(a, b, size, g_spat_db->g_dsa);
+    return key->hash;
 }
 
-dshash_hash dss_hash(const void* key, size_t size, void* arg)
+/* The epoch of key, which writers bump as they lock it exclusively */
+static inline pg_atomic_uint64*
+spdb_key_epoch(SpatDB* db, dss* key)
 {
-    return dss_hash_arg(key, size, g_spat_db->g_dsa);
+    return &db->shared->key_epochs[spdb_hash(db, key) & (SPAT_KEY_EPOCHS - 1)];
 }
 
-void dss_copy(void* dest, const void* src, size_t size, void* arg)
+/* Shard selection uses the low hash bits; dshash picks partitions from the high ones */
+static inline int
+spdb_shard_for(SpatDB* db, dss* key)
 {
-    dss_cpy_arg(dest, src, size, g_spat_db->g_dsa);
-}
-
-static const dshash_parameters default_hash_params = {
-    .key_size = sizeof(dss),
-    .entry_size = sizeof(SpatDBEntry),
-    .compare_function = dss_cmp,
-    .hash_function = dss_hash,
-    .copy_function = dss_copy
-};
+    if (db->shared->nshards == 1)
+        return 0;
 
-/*
- * ---------------------------------------- Shared Memory Implementation
- * ----------------------------------------
- */
+    return spdb_hash(db, key) % db->shared->nshards;
+}
 
-void
-_PG_init()
+static inline dshash_table*
+spdb_htab(SpatDB* db, int shard)
 {
-    DefineCustomStringVariable("spat.db",
-                               "Current DB name",
-                               "",
-                               &g_guc_spat_db_name,
-                               SPAT_NAME_DEFAULT,
-                               PGC_USERSET, 0,
-                               NULL, NULL, NULL);
+    dshash_table* htab = db->g_htabs[shard];
 
-    MarkGUCPrefixReserved("spat");
+    if (unlikely(htab == NULL))
+        htab = spat_attach_shard(db, shard);
 
-    //on_proc_exit(spat_clean_on_exit, (Datum) 0);
+    return htab;
 }
 
+#define SPDB_HTAB_FOR(db, key) spdb_htab((db), spdb_shard_for((db), (key)))
 
-static void
-spat_init_shmem(void* ptr)
-{
-    SpatDB* db = (SpatDB*)ptr;
+#define SPDB_LOCK_SHARED(db)    LWLockAcquire(&(db)->shared->lck, LW_SHARED)
+#define SPDB_LOCK_EXCLUSIVE(db) LWLockAcquire(&(db)->shared->lck, LW_EXCLUSIVE)
+#define SPDB_LOCK_RELEASE(db)   LWLockRelease(&(db)->shared->lck);
 
-    int tranche_id = LWLockNewTrancheId();
-    LWLockInitialize(&db->lck, tranche_id);
 
-    dsa_area* dsa = dsa_create(tranche_id);
-    dsa_pin(dsa);
+/*
+ * Keys are expired lazily on access: an expired entry is treated as missing
+ * and reclaimed on the spot. Only entries with a TTL pay for the clock read.
+ */
+#define SPDB_ENTRY_HAS_TTL(e)           ((e)->expireat != SpMaxTTL)
+#define SPDB_ENTRY_EXPIRED(e, now)      (SPDB_ENTRY_HAS_TTL(e) && (e)->expireat <= (now))
 
-    db->dsa_handle = dsa_get_handle(dsa);
+/*
+ * Note that when an expired entry has to be reclaimed, this may return an
+ * entry locked exclusively even if a shared lock was asked for.
+ *
+ * Found entries are touched for eviction even under a shared lock; atime and
+ * lfu are approximate anyway, so racing readers may only lose an update.
+ */
+SpatDBEntry*
+spdb_find(SpatDB* db, dss key, bool exclusive)
+{
+    dshash_table* htab = SPDB_HTAB_FOR(db, &key);
+    bool timed = spat_timing_begin(SPAT_PHASE_LOCK);
+    SpatDBEntry* entry = dshash_find(htab, &key, exclusive);
 
-    db->name = dsa_allocate0(dsa, SPAT_NAME_MAXSIZE); /* Allocate zeroed-out
-								 * memory */
-    memcpy(dsa_get_address(dsa, db->name), g_guc_spat_db_name, SPAT_NAME_MAXSIZE - 1);
+    spat_timing_end(timed);
+    if (entry && exclusive)
+        pg_atomic_fetch_add_u64(spdb_key_epoch(db, &key), 1);
 
-    db->created_at = GetCurrentTimestamp();
+    if (entry && SPDB_ENTRY_HAS_TTL(entry) && SPDB_ENTRY_EXPIRED(entry, GetCurrentTimestamp()))
+    {
+        if (!exclusive)
+        {
+            /* Reclaiming needs an exclusive lock; someone may beat us to it */
+            dshash_release_lock(htab, entry);
+            timed = spat_timing_begin(SPAT_PHASE_LOCK);
+            entry = dshash_find(htab, &key, true);
+            spat_timing_end(timed);
+        }
+
+        if (entry && SPDB_ENTRY_EXPIRED(entry, GetCurrentTimestamp()))
+        {
+            spdb_delete_entry(db, entry);
+            pg_atomic_fetch_add_u64(&db->shared->expired_lazy, 1);
+            entry = NULL;
+        }
+    }
 
-    dshash_table* htab = dshash_create(dsa, &default_hash_params, NULL);
-    db->htab_handle = dshash_get_hash_table_handle(htab);
+    if (entry)
+        spdb_touch(db, entry);
 
-    dsa_detach(dsa);
+    return entry;
 }
 
-static void
-spat_attach_shmem(void)
-{
-    bool found;
 
-    g_spat_db = GetNamedDSMSegment(g_guc_spat_db_name,
-                                   sizeof(SpatDB),
-                                   spat_init_shmem,
-                                   &found);
-    LWLockRegisterTranche(g_spat_db->lck.tranche, g_guc_spat_db_name);
+SpatDBEntry*
+spdb_find_or_insert(SpatDB* db, dss key, bool* found)
+{
+    dshash_table* htab = SPDB_HTAB_FOR(db, &key);
+    bool timed = spat_timing_begin(SPAT_PHASE_LOCK);
+    SpatDBEntry* entry = dshash_find_or_insert(htab, &key, found);
 
-    if (!g_spat_db->g_dsa)
+    spat_timing_end(timed);
+    if (entry == NULL)
     {
-        Assert(!g_spat_db->g_dsa);
-        SPDB_LOCK_SHARED(g_spat_db);
-        g_spat_db->g_dsa = dsa_attach(g_spat_db->dsa_handle);
-        SPDB_LOCK_RELEASE(g_spat_db);
+        elog(ERROR, "dshash_find_or_insert failed, probably out-of-memory");
     }
+    pg_atomic_fetch_add_u64(spdb_key_epoch(db, &key), 1);
 
-    if (!g_spat_db->g_htab)
+    if (*found && SPDB_ENTRY_EXPIRED(entry, GetCurrentTimestamp()))
+    {
+        /* Recycle the entry, keeping the key, as if it had just been inserted */
+        spdb_free_value(db, entry);
+        spdb_clear_expire(db, entry);
+        pg_atomic_fetch_add_u64(&db->shared->expired_lazy, 1);
+        *found = false;
+    }
+    else if (!*found)
     {
-        Assert(!g_spat_db->g_htab);
-        SPDB_LOCK_SHARED(g_spat_db);
-        g_spat_db->g_htab = dshash_attach(g_spat_db->g_dsa, &default_hash_params, g_spat_db->htab_handle, NULL);
-        SPDB_LOCK_RELEASE(g_spat_db);
+        entry->expireat = SpMaxTTL;
+        entry->expire_node = InvalidDsaPointer;
+        entry->lsn = 0;
+        entry->atime = spat_lru_clock();
+        entry->lfu = SPAT_LFU_INIT_VAL;
+        entry->valtyp = SPVAL_NULL;
+        entry->encoding = SPAT_ENC_RAW;
+        pg_atomic_fetch_add_u64(&db->shared->nkeys[SPVAL_NULL], 1);
+        SPDB_MEM_ADD(db, SPVAL_NULL, sizeof(SpatDBEntry) + entry->key.len);
     }
 
-    Assert(spdb_is_attached(g_spat_db));
+    spdb_touch(db, entry);
+
+    return entry;
 }
 
-static void
-spat_detach_shmem(void)
-{
-    if (g_spat_db->g_dsa)
-    {
-        dsa_detach(g_spat_db->g_dsa);
-        g_spat_db->g_dsa = NULL;
-    }
 
-    if (g_spat_db->g_htab)
-    {
-        dshash_detach(g_spat_db->g_htab);
-        g_spat_db->g_htab = NULL;
-    }
+void
+spdb_release_lock(SpatDB* db, SpatDBEntry* entry)
+{
+    dshash_release_lock(SPDB_HTAB_FOR(db, &entry->key), entry);
 }
 
 /*
- * ---------------------------------------- Commands Common
- * ----------------------------------------
+ * Delete an entry locked exclusively by the caller, together with its value
+ * and key. This releases the lock.
  */
+void
+spdb_delete_entry(SpatDB* db, SpatDBEntry* entry)
+{
+    dshash_table* htab = SPDB_HTAB_FOR(db, &entry->key);
 
-#define PG_GETARG_DSS(n)    dss_new(g_spat_db->g_dsa, PG_GETARG_TEXT_PP((n)))
-#define DSS_LEN(s)          dsa_get_address(g_dsa, (s))->len
-#define DSS_TO_TEXT(s)      dss_to_text(g_spat_db->g_dsa, (s))
-#define PG_RETURN_DSS(s)    PG_RETURN_POINTER(DSS_TO_TEXT(s))
+    /* Callers that didn't go through spdb_find locked it themselves */
+    pg_atomic_fetch_add_u64(spdb_key_epoch(db, &entry->key), 1);
+
+    /* Freeing a collection waits out the changes being logged through it */
+    spdb_free_value(db, entry);
+
+    /* Expired keys expire again on replay, so only live keys log their deletion */
+    if (spat_aof_active() && !SPDB_ENTRY_EXPIRED(entry, GetCurrentTimestamp()) &&
+        spat_aof_begin(db, &entry->key, &entry->lsn, SPAT_AOF_DEL))
+        spat_aof_end(db);
+
+    spdb_clear_expire(db, entry);
+
+    /* The key was copied to the DSA on insert; free it along with the entry */
+    pg_atomic_fetch_sub_u64(&db->shared->nkeys[SPVAL_NULL], 1);
+    SPDB_MEM_SUB(db, SPVAL_NULL, sizeof(SpatDBEntry) + entry->key.len);
+    dss_free(db->g_dsa, &entry->key);
+    dshash_delete_entry(htab, entry);
+}
 
 /*
- * ---------------------------------------- Commands Implementation
+ * ---------------------------------------- Expiry index
  * ----------------------------------------
+ *
+ * All of these are called with the shard's expire_lck held exclusively.
  */
 
-PG_FUNCTION_INFO_V1(spvalue_in);
+static inline void
+expire_heap_set(dsa_area* dsa, SpatExpireItem* heap, uint32 i, SpatExpireItem item)
+{
+    heap[i] = item;
+    ((SpatExpireNode*)dsa_get_address(dsa, item.node))->heap_index = i;
+}
 
+static void
+expire_heap_sift_up(dsa_area* dsa, SpatExpireItem* heap, uint32 i)
+{
+    SpatExpireItem item = heap[i];
+
+    while (i > 0)
+    {
+        uint32 parent = (i - 1) / 2;
+
+        if (heap[parent].expireat <= item.expireat)
+            break;
+        expire_heap_set(dsa, heap, i, heap[parent]);
+        i = parent;
+    }
+    expire_heap_set(dsa, heap, i, item);
+}
+
+static void
+expire_heap_sift_down(dsa_area* dsa, SpatExpireItem* heap, uint32 size, uint32 i)
+{
+    SpatExpireItem item = heap[i];
+
+    for (;;)
+    {
+        uint32 child = 2 * i + 1;
+
+        if (child >= size)
+            break;
+        if (child + 1 < size && heap[child + 1].expireat < heap[child].expireat)
+            child++;
+        if (item.expireat <= heap[child].expireat)
+            break;
+        expire_heap_set(dsa, heap, i, heap[child]);
+        i = child;
+    }
+    expire_heap_set(dsa, heap, i, item);
+}
+
+/* Restore the heap property after heap[i].expireat changed */
+static void
+expire_heap_fix(dsa_area* dsa, SpatDBShard* shard, uint32 i)
+{
+    SpatExpireItem* heap = dsa_get_address(dsa, shard->expire_heap);
+
+    if (i > 0 && heap[i].expireat < heap[(i - 1) / 2].expireat)
+        expire_heap_sift_up(dsa, heap, i);
+    else
+        expire_heap_sift_down(dsa, heap, shard->expire_size, i);
+}
+
+static void
+expire_heap_push(SpatDB* db, SpatDBShard* shard, TimestampTz expireat, dsa_pointer node)
+{
+    dsa_area* dsa = db->g_dsa;
+    SpatExpireItem* heap;
+
+    if (shard->expire_size == shard->expire_cap)
+    {
+        uint32 newcap = Max(shard->expire_cap * 2, SPAT_EXPIRE_HEAP_INITIAL);
+        dsa_pointer newheap = spat_dsa_allocate_extended(dsa, sizeof(SpatExpireItem) * newcap, DSA_ALLOC_HUGE);
+
+        if (DsaPointerIsValid(shard->expire_heap))
+        {
+            memcpy(dsa_get_address(dsa, newheap),
+                   dsa_get_address(dsa, shard->expire_heap),
+                   sizeof(SpatExpireItem) * shard->expire_size);
+            dsa_free(dsa, shard->expire_heap);
+        }
+        SPDB_MEM_ADD(db, SPVAL_NULL, sizeof(SpatExpireItem) * (newcap - shard->expire_cap));
+        shard->expire_heap = newheap;
+        shard->expire_cap = newcap;
+    }
+
+    heap = dsa_get_address(dsa, shard->expire_heap);
+    heap[shard->expire_size].expireat = expireat;
+    heap[shard->expire_size].node = node;
+    expire_heap_sift_up(dsa, heap, shard->expire_size++);
+}
+
+/* Take heap[i] out of the heap. The node itself is left to the caller */
+static void
+expire_heap_remove(dsa_area* dsa, SpatDBShard* shard, uint32 i)
+{
+    SpatExpireItem* heap = dsa_get_address(dsa, shard->expire_heap);
+
+    ((SpatExpireNode*)dsa_get_address(dsa, heap[i].node))->heap_index = SPAT_EXPIRE_NOT_QUEUED;
+
+    if (i == --shard->expire_size)
+        return;
+
+    /* Fill the hole with the last item */
+    expire_heap_set(dsa, heap, i, heap[shard->expire_size]);
+    expire_heap_fix(dsa, shard, i);
+}
+
+/*
+ * Set the TTL of an entry, indexing it in its shard's expiry heap. SpMaxTTL
+ * means no TTL at all.
+ */
+void
+spdb_set_expire(SpatDB* db, SpatDBEntry* entry, TimestampTz expireat)
+{
+    SpatDBShard* shard;
+    SpatExpireNode* node;
+    dsa_pointer nodeptr;
+
+    if (expireat == SpMaxTTL)
+    {
+        spdb_clear_expire(db, entry);
+        return;
+    }
+
+    shard = &db->shard_hdrs[spdb_shard_for(db, &entry->key)];
+    entry->expireat = expireat;
+
+    LWLockAcquire(&shard->expire_lck, LW_EXCLUSIVE);
+
+    if (DsaPointerIsValid(entry->expire_node))
+    {
+        node = dsa_get_address(db->g_dsa, entry->expire_node);
+        if (node->heap_index != SPAT_EXPIRE_NOT_QUEUED)
+        {
+            /* Already queued, just move it */
+            SpatExpireItem* heap = dsa_get_address(db->g_dsa, shard->expire_heap);
+
+            heap[node->heap_index].expireat = expireat;
+            expire_heap_fix(db->g_dsa, shard, node->heap_index);
+            LWLockRelease(&shard->expire_lck);
+            return;
+        }
+        /* Popped by the expirer, which frees it; queue a new one */
+    }
+    else
+        pg_atomic_fetch_add_u64(&db->shared->ttl_keys, 1);
+
+    nodeptr = spat_dsa_allocate(db->g_dsa, sizeof(SpatExpireNode));
+    node = dsa_get_address(db->g_dsa, nodeptr);
+    dss_cpy_arg(&node->key, &entry->key, sizeof(dss), db->g_dsa);
+    SPDB_MEM_ADD(db, SPVAL_NULL, sizeof(SpatExpireNode) + node->key.len);
+    expire_heap_push(db, shard, expireat, nodeptr);
+    entry->expire_node = nodeptr;
+
+    LWLockRelease(&shard->expire_lck);
+}
+
+/* Drop the TTL of an entry, if any */
+void
+spdb_clear_expire(SpatDB* db, SpatDBEntry* entry)
+{
+    SpatDBShard* shard;
+    SpatExpireNode* node;
+
+    entry->expireat = SpMaxTTL;
+    if (!DsaPointerIsValid(entry->expire_node))
+        return;
+
+    shard = &db->shard_hdrs[spdb_shard_for(db, &entry->key)];
+    node = dsa_get_address(db->g_dsa, entry->expire_node);
+
+    LWLockAcquire(&shard->expire_lck, LW_EXCLUSIVE);
+    if (node->heap_index != SPAT_EXPIRE_NOT_QUEUED)
+    {
+        expire_heap_remove(db->g_dsa, shard, node->heap_index);
+        SPDB_MEM_SUB(db, SPVAL_NULL, sizeof(SpatExpireNode) + node->key.len);
+        dss_free(db->g_dsa, &node->key);
+        dsa_free(db->g_dsa, entry->expire_node);
+    }
+    /* else the expirer popped it and will free it */
+    LWLockRelease(&shard->expire_lck);
+
+    entry->expire_node = InvalidDsaPointer;
+    pg_atomic_fetch_sub_u64(&db->shared->ttl_keys, 1);
+}
+
+/*
+ * ---------------------------------------- GUC Variables
+ * ----------------------------------------
+ */
+
+static char* g_guc_spat_db_name = NULL; /* With this we identify a
+						 * shared SpatDB to
+						 * attach/detach */
+static int g_guc_spat_shards = SPAT_SHARDS_DEFAULT; /* Only read when a DB is created */
+
+static const struct config_enum_entry spat_hash_function_options[] = {
+    {"postgres", SPAT_HASH_POSTGRES, false},
+    {"murmur3", SPAT_HASH_MURMUR3, false},
+    {"crc32c", SPAT_HASH_CRC32C, false},
+    {NULL, 0, false}
+};
+
+#ifdef SPAT_MURMUR3
+#define SPAT_HASH_FUNCTION_DEFAULT SPAT_HASH_MURMUR3
+#else
+#define SPAT_HASH_FUNCTION_DEFAULT SPAT_HASH_POSTGRES
+#endif
+
+static int g_guc_spat_hash_function = SPAT_HASH_FUNCTION_DEFAULT; /* Only read when a DB is created */
+
+/* Active expiration; only used when spat is in shared_preload_libraries */
+static int g_guc_spat_expire_interval = 100;        /* ms between expirer cycles */
+static int g_guc_spat_expire_keys_per_loop = 20;    /* due keys reclaimed per loop */
+
+/* Snapshots, saved and restored by the background worker */
+static char* g_guc_spat_snapshot_dir = NULL;        /* relative to the data directory, empty disables */
+static int g_guc_spat_snapshot_interval = 300;      /* s between saves, 0 only saves at shutdown */
+
+/* Change log, written next to the snapshots; only used when spat is preloaded */
+typedef enum SpatAppendfsync
+{
+    SPAT_APPENDFSYNC_ALWAYS,    /* at every commit */
+    SPAT_APPENDFSYNC_EVERYSEC,  /* by the worker, once a second */
+    SPAT_APPENDFSYNC_NO         /* left to the OS */
+} SpatAppendfsync;
+
+static const struct config_enum_entry spat_appendfsync_options[] = {
+    {"always", SPAT_APPENDFSYNC_ALWAYS, false},
+    {"everysec", SPAT_APPENDFSYNC_EVERYSEC, false},
+    {"no", SPAT_APPENDFSYNC_NO, false},
+    {NULL, 0, false}
+};
+
+static bool g_guc_spat_appendonly = false;
+static int g_guc_spat_appendfsync = SPAT_APPENDFSYNC_EVERYSEC;
+static int g_guc_spat_appendonly_rewrite_size = 64 * 1024;  /* kB of log before an early snapshot, 0 disables */
+
+/* Eviction, in the write path of every backend */
+typedef enum SpatMaxmemoryPolicy
+{
+    SPAT_MAXMEMORY_NOEVICTION,
+    SPAT_MAXMEMORY_ALLKEYS_LRU,
+    SPAT_MAXMEMORY_ALLKEYS_LFU,
+    SPAT_MAXMEMORY_VOLATILE_TTL
+} SpatMaxmemoryPolicy;
+
+static const struct config_enum_entry spat_maxmemory_policy_options[] = {
+    {"noeviction", SPAT_MAXMEMORY_NOEVICTION, false},
+    {"allkeys-lru", SPAT_MAXMEMORY_ALLKEYS_LRU, false},
+    {"allkeys-lfu", SPAT_MAXMEMORY_ALLKEYS_LFU, false},
+    {"volatile-ttl", SPAT_MAXMEMORY_VOLATILE_TTL, false},
+    {NULL, 0, false}
+};
+
+/* Only read when a DB is created */
+static int g_guc_spat_maxmemory = 0;                /* kB, 0 means no limit */
+static int g_guc_spat_maxmemory_policy = SPAT_MAXMEMORY_NOEVICTION;
+static int g_guc_spat_maxmemory_samples = 5;        /* keys sampled per eviction */
+
+static int g_guc_spat_local_cache_size = 0;         /* kB per backend, 0 disables the near cache */
+
+static bool g_guc_spat_track_timing = false;        /* per-command latencies, see "Timing" */
+
+#define SPAT_PUBSUB_BUFFER_MAX (1 << 20)
+
+static int g_guc_spat_pubsub_buffer_size = 1024;    /* messages pending per subscriber */
+
+/* Compact encoding thresholds, only read when a DB is created */
+static int g_guc_spat_set_max_compact_entries = 128;
+static int g_guc_spat_hash_max_compact_entries = 128;
+static int g_guc_spat_list_max_compact_entries = 128;
+static int g_guc_spat_max_compact_value = 64;       /* bytes */
+
+/*
+ * ---------------------------------------- Shared Memory Declarations
+ * ----------------------------------------
+ */
+
+void _PG_init();
+static void spat_init_shmem(void* ptr);
+static SpatDB* spat_attach_db(const char* name);
+static void spat_attach_shmem(void);
+static void spat_detach_all(int code, Datum arg);
+static void spat_pubsub_unsubscribe_all(SpatDB* db);
+static void spat_xact_callback(XactEvent event, void* arg);
+static void spat_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+                                  SubTransactionId parentSubid, void* arg);
+
+PGDLLEXPORT void spat_expirer_main(Datum main_arg);
+
+/*
+ * ---------------------------------------- Global state
+ * ----------------------------------------
+ */
+
+static HTAB* g_spat_attached = NULL;  /* spat.db name -> SpatDB, backend-local */
+static SpatDB* g_spat_db = NULL;        /* attachment for the current spat.db */
+static const char* g_spat_init_name = NULL; /* DB being created by spat_init_shmem */
+static bool g_spat_preloaded = false;   /* loaded by shared_preload_libraries, so the worker runs */
+static bool g_spat_aof_replaying = false;   /* restoring or replaying, which isn't logged */
+
+/*
+ * ---------------------------------------- Access tracking
+ * ----------------------------------------
+ *
+ * Like Redis, entries carry an approximate access clock (atime, seconds at
+ * statement granularity, which is plenty to rank keys) and a logarithmic
+ * access counter (lfu) that saturates at 255 and decays by one every
+ * SPAT_LFU_DECAY_SECS without accesses. They're only maintained while an LRU
+ * or LFU policy is in effect, so other workloads don't dirty the entries.
+ */
+
+static inline uint32
+spat_lru_clock(void)
+{
+    return (uint32)(GetCurrentStatementStartTimestamp() / USECS_PER_SEC);
+}
+
+static inline uint8
+spat_lfu_decayed(const SpatDBEntry* entry, uint32 now)
+{
+    uint32 periods = (now - entry->atime) / SPAT_LFU_DECAY_SECS;
+
+    return periods >= entry->lfu ? 0 : entry->lfu - periods;
+}
+
+static inline void
+spdb_touch(SpatDB* db, SpatDBEntry* entry)
+{
+    int policy = db->shared->maxmemory_policy;
+    uint32 now;
+
+    if (policy != SPAT_MAXMEMORY_ALLKEYS_LRU && policy != SPAT_MAXMEMORY_ALLKEYS_LFU)
+        return;
+
+    now = spat_lru_clock();
+
+    if (policy == SPAT_MAXMEMORY_ALLKEYS_LFU)
+    {
+        uint8 counter = spat_lfu_decayed(entry, now);
+
+        /* The higher the counter, the less likely it is to grow */
+        if (counter < PG_UINT8_MAX)
+        {
+            double p = 1.0 / (Max(counter - SPAT_LFU_INIT_VAL, 0) * SPAT_LFU_LOG_FACTOR + 1);
+
+            if (pg_prng_double(&pg_global_prng_state) < p)
+                counter++;
+        }
+        entry->lfu = counter;
+    }
+
+    entry->atime = now;
+}
+
+/* dshash only needs equality, so cached hashes can tell keys apart first */
+int dss_cmp(const void* a, const void* b, size_t size, void* arg)
+{
+    const dss* dss_a = (const dss*)a;
+    const dss* dss_b = (const dss*)b;
+
+    if (dss_a->hash != 0 && dss_b->hash != 0 && dss_a->hash != dss_b->hash)
+        return (dss_a->hash < dss_b->hash) ? -1 : 1;
+
+    return dss_cmp_arg(a, b, size, g_spat_db->g_dsa);
+}
+
+/* Caches the hash in the search key, so that dshash copies it on insert */
+dshash_hash dss_hash(const void* key, size_t size, void* arg)
+{
+    return spdb_hash(g_spat_db, (dss*)key);
+}
+
+void dss_copy(void* dest, const void* src, size_t size, void* arg)
+{
+    dss_cpy_arg(dest, src, size, g_spat_db->g_dsa);
+}
+
+static const dshash_parameters default_hash_params = {
+    .key_size = sizeof(dss),
+    .entry_size = sizeof(SpatDBEntry),
+    .compare_function = dss_cmp,
+    .hash_function = dss_hash,
+    .copy_function = dss_copy
+};
+
+/*
+ * dshash_create, with the partition locks in tranche_id, the DB's, so that
+ * waits on them show up under the DB's name in pg_stat_activity.
+ */
+static dshash_table*
+spat_dshash_create(dsa_area* dsa, const dshash_parameters* params, int tranche_id)
+{
+    dshash_parameters p = *params;
+
+    p.tranche_id = tranche_id;
+    return dshash_create(dsa, &p, NULL);
+}
+
+/*
+ * ---------------------------------------- Timing
+ * ----------------------------------------
+ *
+ * With spat.track_timing on, commands defined with SPAT_COMMAND time their
+ * calls, and add them to counters and a log2 histogram of latencies kept in
+ * the DB's header, so that spat_command_stats() can tell p99 from the mean
+ * without any sampling. Calls also accumulate the time spent in the phases
+ * of SpatPhase, just around the calls that make them up: phases never nest,
+ * a key copied into the DSA while it's being inserted only counts as lock
+ * time. Commands that error out aren't counted, and neither are those
+ * called from other commands, e.g. by sp_load()'s query.
+ *
+ * When it's off, all that costs a command is a branch; phases check a flag.
+ */
+
+typedef struct SpatTiming
+{
+    bool active;                        /* in a command being timed */
+    int phase;                          /* SpatPhase being timed, or -1 */
+    instr_time phase_start;
+    uint64 phase_ns[SPAT_NPHASES];
+} SpatTiming;
+
+static SpatTiming g_spat_timing = {.active = false, .phase = -1};
+
+static const char* const spat_command_names[SPAT_NCOMMANDS] = {
+    [SPAT_CMD_GET] = "SPGET",
+    [SPAT_CMD_GET_TEXT] = "SPGET_TEXT",
+    [SPAT_CMD_GET_BYTEA] = "SPGET_BYTEA",
+    [SPAT_CMD_GET_JSONB] = "SPGET_JSONB",
+    [SPAT_CMD_GET_AS] = "SPGET_AS",
+    [SPAT_CMD_GETRANGE] = "SPGETRANGE",
+    [SPAT_CMD_SET] = "SPSET",
+    [SPAT_CMD_DEL] = "DEL",
+    [SPAT_CMD_TYPE] = "SPTYPE",
+    [SPAT_CMD_GETEXPIREAT] = "GETEXPIREAT",
+    [SPAT_CMD_INCR] = "INCR",
+    [SPAT_CMD_INCRBY] = "INCRBY",
+    [SPAT_CMD_DECR] = "DECR",
+    [SPAT_CMD_DECRBY] = "DECRBY",
+    [SPAT_CMD_MGET] = "SPMGET",
+    [SPAT_CMD_MSET] = "SPMSET",
+    [SPAT_CMD_MDEL] = "SPDEL",
+    [SPAT_CMD_EXEC] = "SPEXEC",
+    [SPAT_CMD_LOAD] = "SP_LOAD",
+    [SPAT_CMD_SCAN] = "SPSCAN",
+    [SPAT_CMD_SADD] = "SADD",
+    [SPAT_CMD_SREM] = "SREM",
+    [SPAT_CMD_SISMEMBER] = "SISMEMBER",
+    [SPAT_CMD_SCARD] = "SCARD",
+    [SPAT_CMD_SINTER] = "SINTER",
+    [SPAT_CMD_SUNION] = "SUNION",
+    [SPAT_CMD_SDIFF] = "SDIFF",
+    [SPAT_CMD_SINTERSTORE] = "SINTERSTORE",
+    [SPAT_CMD_SUNIONSTORE] = "SUNIONSTORE",
+    [SPAT_CMD_SDIFFSTORE] = "SDIFFSTORE",
+    [SPAT_CMD_SSCAN] = "SSCAN",
+    [SPAT_CMD_LPUSH] = "LPUSH",
+    [SPAT_CMD_RPUSH] = "RPUSH",
+    [SPAT_CMD_LPOP] = "LPOP",
+    [SPAT_CMD_RPOP] = "RPOP",
+    [SPAT_CMD_LLEN] = "LLEN",
+    [SPAT_CMD_LINDEX] = "LINDEX",
+    [SPAT_CMD_LRANGE] = "LRANGE",
+    [SPAT_CMD_LTRIM] = "LTRIM",
+    [SPAT_CMD_BLPOP] = "BLPOP",
+    [SPAT_CMD_BRPOP] = "BRPOP",
+    [SPAT_CMD_HSET] = "HSET",
+    [SPAT_CMD_HGET] = "HGET",
+    [SPAT_CMD_HINCRBY] = "HINCRBY",
+    [SPAT_CMD_HSCAN] = "HSCAN",
+    [SPAT_CMD_ZADD] = "ZADD",
+    [SPAT_CMD_ZREM] = "ZREM",
+    [SPAT_CMD_ZSCORE] = "ZSCORE",
+    [SPAT_CMD_ZRANK] = "ZRANK",
+    [SPAT_CMD_ZCARD] = "ZCARD",
+    [SPAT_CMD_ZRANGE] = "ZRANGE",
+    [SPAT_CMD_ZRANGEBYSCORE] = "ZRANGEBYSCORE",
+    [SPAT_CMD_ZREMRANGEBYSCORE] = "ZREMRANGEBYSCORE",
+    [SPAT_CMD_SUBSCRIBE] = "SPSUBSCRIBE",
+    [SPAT_CMD_UNSUBSCRIBE] = "SPUNSUBSCRIBE",
+    [SPAT_CMD_PUBLISH] = "SPPUBLISH",
+    [SPAT_CMD_RECEIVE] = "SPRECEIVE"
+};
+
+static void
+spat_timing_init(SpatCommandStats* stats)
+{
+    for (int c = 0; c < SPAT_NCOMMANDS; c++)
+    {
+        pg_atomic_init_u64(&stats[c].calls, 0);
+        pg_atomic_init_u64(&stats[c].total_ns, 0);
+        for (int p = 0; p < SPAT_NPHASES; p++)
+            pg_atomic_init_u64(&stats[c].phase_ns[p], 0);
+        for (int b = 0; b < SPAT_TIMING_BUCKETS; b++)
+            pg_atomic_init_u64(&stats[c].buckets[b], 0);
+    }
+}
+
+/* An error ended the command being timed */
+static void
+spat_timing_reset(void)
+{
+    g_spat_timing.active = false;
+    g_spat_timing.phase = -1;
+}
+
+/* Start timing phase, unless no command is timed or another phase is. Pass the result to spat_timing_end */
+static inline bool
+spat_timing_begin(SpatPhase phase)
+{
+    if (likely(!g_spat_timing.active) || g_spat_timing.phase >= 0)
+        return false;
+
+    g_spat_timing.phase = phase;
+    INSTR_TIME_SET_CURRENT(g_spat_timing.phase_start);
+    return true;
+}
+
+static inline void
+spat_timing_end(bool timed)
+{
+    instr_time duration;
+
+    if (likely(!timed))
+        return;
+
+    INSTR_TIME_SET_CURRENT(duration);
+    INSTR_TIME_SUBTRACT(duration, g_spat_timing.phase_start);
+    g_spat_timing.phase_ns[g_spat_timing.phase] += INSTR_TIME_GET_NANOSEC(duration);
+    g_spat_timing.phase = -1;
+}
+
+static inline int
+spat_timing_bucket(uint64 ns)
+{
+    uint64 us = ns / NS_PER_US;
+
+    return us == 0 ? 0 : Min(pg_leftmost_one_pos64(us) + 1, SPAT_TIMING_BUCKETS - 1);
+}
+
+/* Call body for cmd, timing it into the DB it ran against if spat.track_timing is on */
+static Datum
+spat_track_call(FunctionCallInfo fcinfo, PGFunction body, SpatCommand cmd)
+{
+    instr_time start;
+    instr_time duration;
+    Datum result;
+    SpatCommandStats* stats;
+    uint64 ns;
+
+    if (likely(!g_guc_spat_track_timing) || g_spat_timing.active)
+        return body(fcinfo);
+
+    memset(g_spat_timing.phase_ns, 0, sizeof(g_spat_timing.phase_ns));
+    g_spat_timing.phase = -1;
+    g_spat_timing.active = true;
+
+    INSTR_TIME_SET_CURRENT(start);
+    result = body(fcinfo);
+    INSTR_TIME_SET_CURRENT(duration);
+    INSTR_TIME_SUBTRACT(duration, start);
+
+    g_spat_timing.active = false;
+
+    if (g_spat_db == NULL)
+        return result;
+
+    stats = &g_spat_db->shared->cmd_stats[cmd];
+    ns = INSTR_TIME_GET_NANOSEC(duration);
+
+    pg_atomic_fetch_add_u64(&stats->calls, 1);
+    pg_atomic_fetch_add_u64(&stats->total_ns, ns);
+    pg_atomic_fetch_add_u64(&stats->buckets[spat_timing_bucket(ns)], 1);
+    for (int p = 0; p < SPAT_NPHASES; p++)
+    {
+        if (g_spat_timing.phase_ns[p] != 0)
+            pg_atomic_fetch_add_u64(&stats->phase_ns[p], g_spat_timing.phase_ns[p]);
+    }
+
+    return result;
+}
+
+/*
+ * Defines the function fn, as PG_FUNCTION_INFO_V1 would, for a command timed
+ * as cmd. What follows is its body.
+ */
+#define SPAT_COMMAND(fn, cmd) \
+    static Datum fn##_command(PG_FUNCTION_ARGS); \
+    PG_FUNCTION_INFO_V1(fn); \
+    Datum fn(PG_FUNCTION_ARGS) { return spat_track_call(fcinfo, fn##_command, (cmd)); } \
+    static Datum fn##_command(PG_FUNCTION_ARGS)
+
+static inline dsa_pointer
+spat_dsa_allocate_extended(dsa_area* dsa, Size size, int flags)
+{
+    bool timed = spat_timing_begin(SPAT_PHASE_ALLOC);
+    dsa_pointer result = dsa_allocate_extended(dsa, size, flags);
+
+    spat_timing_end(timed);
+    return result;
+}
+
+/*
+ * Custom wait events, registered the first time they're waited for, as
+ * WaitEventExtensionNew needs shared memory. Waits on spat's LWLocks show up
+ * under the tranche of their DB instead, named after it.
+ */
+static uint32 g_spat_wait_bpop = 0;
+static uint32 g_spat_wait_receive = 0;
+static uint32 g_spat_wait_expirer = 0;
+static uint32 g_spat_wait_seed = 0;
+
+static uint32
+spat_wait_event(uint32* id, const char* name)
+{
+    if (*id == 0)
+        *id = WaitEventExtensionNew(name);
+
+    return *id;
+}
+
+PG_FUNCTION_INFO_V1(spat_command_stats);
+
+/*
+ * The commands timed in the current DB. Percentiles are the upper bounds of
+ * the buckets they fall in, so they're off by at most a factor of 2.
+ */
+Datum
+spat_command_stats(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo* rsinfo = (ReturnSetInfo*)fcinfo->resultinfo;
+
+    InitMaterializedSRF(fcinfo, MAT_SRF_USE_EXPECTED_DESC);
+
+    spat_attach_shmem();
+
+    for (int c = 0; c < SPAT_NCOMMANDS; c++)
+    {
+        SpatCommandStats* stats = &g_spat_db->shared->cmd_stats[c];
+        uint64 calls = pg_atomic_read_u64(&stats->calls);
+        uint64 buckets[SPAT_TIMING_BUCKETS];
+        Datum bucketdatums[SPAT_TIMING_BUCKETS];
+        const double percentiles[] = {0.5, 0.99};
+        Datum values[5 + lengthof(percentiles) + SPAT_NPHASES];
+        bool nulls[lengthof(values)];
+        int v = 0;
+        uint64 seen = 0;
+        int b = 0;
+
+        if (calls == 0)
+            continue;
+
+        memset(nulls, 0, sizeof(nulls));
+        for (int i = 0; i < SPAT_TIMING_BUCKETS; i++)
+        {
+            buckets[i] = pg_atomic_read_u64(&stats->buckets[i]);
+            bucketdatums[i] = Int64GetDatum((int64)buckets[i]);
+        }
+
+        values[v++] = CStringGetTextDatum(spat_command_names[c]);
+        values[v++] = Int64GetDatum((int64)calls);
+        values[v++] = Float8GetDatum((double)pg_atomic_read_u64(&stats->total_ns) / NS_PER_MS);
+        values[v++] = Float8GetDatum((double)pg_atomic_read_u64(&stats->total_ns) / NS_PER_MS / calls);
+
+        /* Buckets may be bumped after calls, so stop at the last one rather than overrun */
+        for (int p = 0; p < lengthof(percentiles); p++)
+        {
+            while (b < SPAT_TIMING_BUCKETS - 1 && seen + buckets[b] < percentiles[p] * calls)
+                seen += buckets[b++];
+            values[v++] = Float8GetDatum((double)(UINT64CONST(1) << b) / 1000);
+        }
+
+        for (int p = 0; p < SPAT_NPHASES; p++)
+            values[v++] = Float8GetDatum((double)pg_atomic_read_u64(&stats->phase_ns[p]) / NS_PER_MS);
+
+        values[v++] = PointerGetDatum(construct_array_builtin(bucketdatums, SPAT_TIMING_BUCKETS, INT8OID));
+
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+    }
+
+    return (Datum) 0;
+}
+
+PG_FUNCTION_INFO_V1(spat_command_stats_reset);
+
+Datum
+spat_command_stats_reset(PG_FUNCTION_ARGS)
+{
+    spat_attach_shmem();
+
+    for (int c = 0; c < SPAT_NCOMMANDS; c++)
+    {
+        SpatCommandStats* stats = &g_spat_db->shared->cmd_stats[c];
+
+        pg_atomic_write_u64(&stats->calls, 0);
+        pg_atomic_write_u64(&stats->total_ns, 0);
+        for (int p = 0; p < SPAT_NPHASES; p++)
+            pg_atomic_write_u64(&stats->phase_ns[p], 0);
+        for (int b = 0; b < SPAT_TIMING_BUCKETS; b++)
+            pg_atomic_write_u64(&stats->buckets[b], 0);
+    }
+
+    PG_RETURN_VOID();
+}
+
+/*
+ * ---------------------------------------- Shared Memory Implementation
+ * ----------------------------------------
+ */
+
+/*
+ * The catalog lists the names of all SpatDBs created since startup, so that
+ * the background expirer can find them; the DSM registry can't be iterated.
+ */
+#define SPAT_CATALOG_NAME "spat:catalog"
+#define SPAT_CATALOG_MAXDBS 128
+
+typedef char SpatDBName[SPAT_NAME_MAXSIZE];
+
+typedef struct SpatCatalog
+{
+    LWLock lck;
+    bool restored;              /* snapshots were restored, see spat_snapshot_restore_all */
+    bool seeded;                /* LSNs were seeded, see spat_snapshot_seed_lsns */
+    ConditionVariable seeded_cv;
+    int ndbs;
+    SpatDBName names[SPAT_CATALOG_MAXDBS];
+} SpatCatalog;
+
+static void
+spat_init_catalog(void* ptr)
+{
+    SpatCatalog* catalog = (SpatCatalog*)ptr;
+
+    LWLockInitialize(&catalog->lck, LWLockNewTrancheId());
+    catalog->restored = false;
+    catalog->seeded = false;
+    ConditionVariableInit(&catalog->seeded_cv);
+    catalog->ndbs = 0;
+}
+
+static SpatCatalog*
+spat_get_catalog(void)
+{
+    static SpatCatalog* catalog = NULL;
+    bool found;
+
+    if (!catalog)
+    {
+        catalog = GetNamedDSMSegment(SPAT_CATALOG_NAME, sizeof(SpatCatalog),
+                                     spat_init_catalog, &found);
+        LWLockRegisterTranche(catalog->lck.tranche, SPAT_CATALOG_NAME);
+    }
+
+    return catalog;
+}
+
+static void
+spat_catalog_add(const char* name)
+{
+    SpatCatalog* catalog = spat_get_catalog();
+
+    LWLockAcquire(&catalog->lck, LW_EXCLUSIVE);
+    if (catalog->ndbs < SPAT_CATALOG_MAXDBS)
+        strlcpy(catalog->names[catalog->ndbs++], name, SPAT_NAME_MAXSIZE);
+    else
+        elog(WARNING, "spat: too many DBs, \"%s\" won't be actively expired", name);
+    LWLockRelease(&catalog->lck);
+}
+
+static bool
+spat_db_name_check(char** newval, void** extra, GucSource source)
+{
+    if (strcmp(*newval, SPAT_CATALOG_NAME) == 0)
+    {
+        GUC_check_errdetail("\"%s\" is reserved.", SPAT_CATALOG_NAME);
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Switching spat.db only drops the shortcut to the current attachment. We
+ * can't attach from here (assign hooks must not fail), so the next command
+ * will pick up, or create, the attachment for the new name.
+ */
+static void
+spat_db_name_assign(const char* newval, void* extra)
+{
+    g_spat_db = NULL;
+}
+
+void
+_PG_init()
+{
+    DefineCustomStringVariable("spat.db",
+                               "Current DB name",
+                               "",
+                               &g_guc_spat_db_name,
+                               SPAT_NAME_DEFAULT,
+                               PGC_USERSET, 0,
+                               spat_db_name_check, spat_db_name_assign, NULL);
+
+    DefineCustomIntVariable("spat.shards",
+                            "Number of shards the keyspace of a new DB is split into",
+                            "Only takes effect when a DB is created.",
+                            &g_guc_spat_shards,
+                            SPAT_SHARDS_DEFAULT, 1, SPAT_SHARDS_MAX,
+                            PGC_USERSET, 0,
+                            NULL, NULL, NULL);
+
+    DefineCustomEnumVariable("spat.hash_function",
+                             "Hash function keys of a new DB are hashed with",
+                             "Only takes effect when a DB is created.",
+                             &g_guc_spat_hash_function,
+                             SPAT_HASH_FUNCTION_DEFAULT,
+                             spat_hash_function_options,
+                             PGC_USERSET, 0,
+                             NULL, NULL, NULL);
+
+    DefineCustomIntVariable("spat.expire_interval",
+                            "Time to sleep between active expiration cycles",
+                            NULL,
+                            &g_guc_spat_expire_interval,
+                            100, 1, 60 * 1000,
+                            PGC_SIGHUP, GUC_UNIT_MS,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("spat.expire_keys_per_loop",
+                            "Due keys reclaimed per active expiration loop",
+                            NULL,
+                            &g_guc_spat_expire_keys_per_loop,
+                            20, 1, 10000,
+                            PGC_SIGHUP, 0,
+                            NULL, NULL, NULL);
+
+    DefineCustomStringVariable("spat.snapshot_dir",
+                               "Directory the background worker saves DBs to and restores them from",
+                               "Relative to the data directory. Empty disables snapshots.",
+                               &g_guc_spat_snapshot_dir,
+                               "",
+                               PGC_SIGHUP, 0,
+                               NULL, NULL, NULL);
+
+    DefineCustomIntVariable("spat.snapshot_interval",
+                            "Time between snapshots of every DB",
+                            "0 only saves them at shutdown.",
+                            &g_guc_spat_snapshot_interval,
+                            300, 0, INT_MAX / 1000,
+                            PGC_SIGHUP, GUC_UNIT_S,
+                            NULL, NULL, NULL);
+
+    DefineCustomBoolVariable("spat.appendonly",
+                             "Log every write to a DB to a change log next to its snapshot",
+                             "Needs spat.snapshot_dir, and spat in shared_preload_libraries.",
+                             &g_guc_spat_appendonly,
+                             false,
+                             PGC_SIGHUP, 0,
+                             NULL, NULL, NULL);
+
+    DefineCustomEnumVariable("spat.appendfsync",
+                             "When the change log is flushed to disk",
+                             NULL,
+                             &g_guc_spat_appendfsync,
+                             SPAT_APPENDFSYNC_EVERYSEC,
+                             spat_appendfsync_options,
+                             PGC_SIGHUP, 0,
+                             NULL, NULL, NULL);
+
+    DefineCustomIntVariable("spat.appendonly_rewrite_size",
+                            "Size of a change log past which its DB is snapshotted early",
+                            "0 only rewrites logs every spat.snapshot_interval.",
+                            &g_guc_spat_appendonly_rewrite_size,
+                            64 * 1024, 0, INT_MAX,
+                            PGC_SIGHUP, GUC_UNIT_KB,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("spat.maxmemory",
+                            "Memory limit of a new DB, beyond which writes evict keys",
+                            "0 means no limit. Only takes effect when a DB is created.",
+                            &g_guc_spat_maxmemory,
+                            0, 0, INT_MAX,
+                            PGC_SUSET, GUC_UNIT_KB,
+                            NULL, NULL, NULL);
+
+    DefineCustomEnumVariable("spat.maxmemory_policy",
+                             "How keys of a new DB are picked for eviction once spat.maxmemory is reached",
+                             "Only takes effect when a DB is created.",
+                             &g_guc_spat_maxmemory_policy,
+                             SPAT_MAXMEMORY_NOEVICTION,
+                             spat_maxmemory_policy_options,
+                             PGC_SUSET, 0,
+                             NULL, NULL, NULL);
+
+    DefineCustomIntVariable("spat.maxmemory_samples",
+                            "Keys of a new DB sampled to pick each eviction victim",
+                            "Only takes effect when a DB is created.",
+                            &g_guc_spat_maxmemory_samples,
+                            5, 1, 64,
+                            PGC_SUSET, 0,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("spat.local_cache_size",
+                            "Memory each backend may use to cache strings it reads",
+                            "0 disables the cache.",
+                            &g_guc_spat_local_cache_size,
+                            0, 0, MAX_KILOBYTES,
+                            PGC_USERSET, GUC_UNIT_KB,
+                            NULL, NULL, NULL);
+
+    DefineCustomBoolVariable("spat.track_timing",
+                             "Collects per-command latencies and where they go",
+                             "Shown by spat_command_stats().",
+                             &g_guc_spat_track_timing,
+                             false,
+                             PGC_SUSET, 0,
+                             NULL, NULL, NULL);
+
+    DefineCustomIntVariable("spat.pubsub_buffer_size",
+                            "Messages a subscriber can have pending before new ones are dropped",
+                            "Rounded up to a power of 2, and only read when a backend first subscribes to a DB.",
+                            &g_guc_spat_pubsub_buffer_size,
+                            1024, 2, SPAT_PUBSUB_BUFFER_MAX,
+                            PGC_USERSET, 0,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("spat.set_max_compact_entries",
+                            "Members a set of a new DB can have and still be stored compactly",
+                            "Only takes effect when a DB is created.",
+                            &g_guc_spat_set_max_compact_entries,
+                            128, 0, INT_MAX,
+                            PGC_USERSET, 0,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("spat.hash_max_compact_entries",
+                            "Fields a hash of a new DB can have and still be stored compactly",
+                            "Only takes effect when a DB is created.",
+                            &g_guc_spat_hash_max_compact_entries,
+                            128, 0, INT_MAX,
+                            PGC_USERSET, 0,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("spat.list_max_compact_entries",
+                            "Elements a list of a new DB can have and still be stored compactly",
+                            "Only takes effect when a DB is created.",
+                            &g_guc_spat_list_max_compact_entries,
+                            128, 0, INT_MAX,
+                            PGC_USERSET, 0,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("spat.max_compact_value",
+                            "Longest member, field or value a compact collection of a new DB can hold",
+                            "Only takes effect when a DB is created.",
+                            &g_guc_spat_max_compact_value,
+                            64, 0, INT_MAX,
+                            PGC_USERSET, GUC_UNIT_BYTE,
+                            NULL, NULL, NULL);
+
+    MarkGUCPrefixReserved("spat");
+
+    /*
+     * Commits wait for their change log records with spat.appendfsync =
+     * always; aborts drop the collections an error left pinned
+     */
+    RegisterXactCallback(spat_xact_callback, NULL);
+    RegisterSubXactCallback(spat_subxact_callback, NULL);
+
+    /* The active expirer is only available when preloaded */
+    if (process_shared_preload_libraries_in_progress)
+    {
+        BackgroundWorker worker;
+
+        g_spat_preloaded = true;
+
+        memset(&worker, 0, sizeof(worker));
+        worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+        worker.bgw_start_time = BgWorkerStart_ConsistentState;
+        worker.bgw_restart_time = 10;
+        strlcpy(worker.bgw_library_name, "spat", BGW_MAXLEN);
+        strlcpy(worker.bgw_function_name, "spat_expirer_main", BGW_MAXLEN);
+        strlcpy(worker.bgw_name, "spat expirer", BGW_MAXLEN);
+        strlcpy(worker.bgw_type, "spat expirer", BGW_MAXLEN);
+        RegisterBackgroundWorker(&worker);
+    }
+}
+
+
+static void
+spat_init_shmem(void* ptr)
+{
+    SpatDBShared* db = (SpatDBShared*)ptr;
+
+    int tranche_id = LWLockNewTrancheId();
+    LWLockInitialize(&db->lck, tranche_id);
+
+    dsa_area* dsa = dsa_create(tranche_id);
+    dsa_pin(dsa);
+
+    db->dsa_handle = dsa_get_handle(dsa);
+
+    db->name = dsa_allocate0(dsa, SPAT_NAME_MAXSIZE); /* Allocate zeroed-out
+								 * memory */
+    strlcpy(dsa_get_address(dsa, db->name), g_spat_init_name, SPAT_NAME_MAXSIZE);
+
+    db->created_at = GetCurrentTimestamp();
+
+    pg_atomic_init_u64(&db->expired_lazy, 0);
+    pg_atomic_init_u64(&db->expired_active, 0);
+    pg_atomic_init_u64(&db->expire_cycles, 0);
+    pg_atomic_init_u64(&db->ttl_keys, 0);
+    pg_atomic_init_u64(&db->evictions, 0);
+    for (int i = 0; i < SPVAL_NTYPES; i++)
+    {
+        pg_atomic_init_u64(&db->nkeys[i], 0);
+        pg_atomic_init_u64(&db->nbytes[i], 0);
+    }
+
+    db->maxmemory = (uint64)g_guc_spat_maxmemory * 1024;
+    db->maxmemory_policy = g_guc_spat_maxmemory_policy;
+    db->maxmemory_samples = g_guc_spat_maxmemory_samples;
+
+    db->set_max_compact_entries = g_guc_spat_set_max_compact_entries;
+    db->hash_max_compact_entries = g_guc_spat_hash_max_compact_entries;
+    db->list_max_compact_entries = g_guc_spat_list_max_compact_entries;
+    db->max_compact_value = g_guc_spat_max_compact_value;
+
+    ConditionVariableInit(&db->list_cv);
+    pg_atomic_init_u32(&db->list_waiters, 0);
+
+    LWLockInitialize(&db->pubsub_lck, tranche_id);
+    db->channels = DSHASH_HANDLE_INVALID;
+    db->subscribers = InvalidDsaPointer;
+
+    for (int i = 0; i < SPAT_KEY_EPOCHS; i++)
+        pg_atomic_init_u64(&db->key_epochs[i], 0);
+
+    spat_timing_init(db->cmd_stats);
+
+    pg_atomic_init_u64(&db->aof_lsn, 0);
+    LWLockInitialize(&db->aof_lck, tranche_id);
+    LWLockInitialize(&db->aof_write_lck, tranche_id);
+    db->aof_buf = InvalidDsaPointer;
+    db->aof_inserted = 0;
+    db->aof_written = 0;
+    db->aof_synced = 0;
+    db->aof_rotated = 0;
+    db->aof_generation = 0;
+
+    db->hash_function = g_guc_spat_hash_function;
+    if (!pg_strong_random(&db->hash_seed, sizeof(db->hash_seed)))
+        db->hash_seed = pg_prng_uint32(&pg_global_prng_state);
+
+    db->nshards = g_guc_spat_shards;
+    db->shards = dsa_allocate0(dsa, sizeof(SpatDBShard) * db->nshards);
+
+    SpatDBShard* shards = dsa_get_address(dsa, db->shards);
+    for (int i = 0; i < db->nshards; i++)
+    {
+        dshash_table* htab = spat_dshash_create(dsa, &default_hash_params, tranche_id);
+        shards[i].htab_handle = dshash_get_hash_table_handle(htab);
+        dshash_detach(htab);
+
+        LWLockInitialize(&shards[i].expire_lck, tranche_id);
+        shards[i].expire_heap = InvalidDsaPointer;  /* allocated on first TTL */
+        shards[i].expire_size = 0;
+        shards[i].expire_cap = 0;
+    }
+
+    dsa_detach(dsa);
+}
+
+/*
+ * Returns this backend's attachment to the named DB, creating the DB or the
+ * attachment if needed. Attachments are kept until the backend exits.
+ */
+static SpatDB*
+spat_attach_db(const char* name)
+{
+    bool found;
+    SpatDB* db;
+    MemoryContext oldcontext;
+
+    if (!g_spat_attached)
+    {
+        HASHCTL ctl;
+
+        ctl.keysize = SPAT_NAME_MAXSIZE;
+        ctl.entrysize = sizeof(SpatDB);
+        g_spat_attached = hash_create("spat attached DBs", 8, &ctl, HASH_ELEM | HASH_STRINGS);
+
+        /*
+         * Detach before DSM is torn down; on_proc_exit callbacks run after
+         * dsm_backend_shutdown, when the mappings are already gone.
+         */
+        before_shmem_exit(spat_detach_all, (Datum)0);
+    }
+
+    db = hash_search(g_spat_attached, name, HASH_ENTER, &found);
+    if (!found)
+    {
+        db->shared = NULL;
+        db->g_dsa = NULL;
+        db->shard_hdrs = NULL;
+        db->g_htabs = NULL;
+        db->hash = NULL;
+        db->aof_fd = -1;
+        db->aof_generation = 0;
+        db->aof_pending = 0;
+        db->g_channels = NULL;
+        db->subscriber = NULL;
+        db->channels = NIL;
+        db->expire_shard = 0;
+        db->aof_synced_at = 0;
+    }
+
+    if (!spdb_is_attached(db))
+    {
+        /* The attachment outlives the current query */
+        oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+        g_spat_init_name = name;
+        db->shared = GetNamedDSMSegment(name,
+                                        sizeof(SpatDBShared),
+                                        spat_init_shmem,
+                                        &found);
+        LWLockRegisterTranche(db->shared->lck.tranche, name);
+
+        if (!found)
+            spat_catalog_add(name);
+
+        db->hash = spat_hash_functions[db->shared->hash_function];
+
+        if (!db->g_dsa)
+        {
+            db->g_dsa = dsa_attach(db->shared->dsa_handle);
+            dsa_pin_mapping(db->g_dsa);
+        }
+
+        if (!db->g_htabs)
+        {
+            db->shard_hdrs = dsa_get_address(db->g_dsa, db->shared->shards);
+            db->g_htabs = palloc0(sizeof(dshash_table*) * db->shared->nshards);
+        }
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    Assert(spdb_is_attached(db));
+    return db;
+}
+
+/*
+ * Logging has to wait for the worker to seed the LSNs of the DBs it restores,
+ * see spat_snapshot_seed_lsns, so backends wait for it before they first
+ * attach, with nothing locked yet.
+ */
+static void
+spat_wait_lsns_seeded(void)
+{
+    static bool seeded = false;
+    SpatCatalog* catalog;
+
+    if (seeded || !spat_aof_active())
+        return;
+
+    catalog = spat_get_catalog();
+    ConditionVariablePrepareToSleep(&catalog->seeded_cv);
+    for (;;)
+    {
+        LWLockAcquire(&catalog->lck, LW_SHARED);
+        seeded = catalog->seeded;
+        LWLockRelease(&catalog->lck);
+        if (seeded)
+            break;
+
+        (void) ConditionVariableTimedSleep(&catalog->seeded_cv, 1000,
+                                           spat_wait_event(&g_spat_wait_seed, "SpatSeedLSN"));
+    }
+    ConditionVariableCancelSleep();
+}
+
+static void
+spat_attach_shmem(void)
+{
+    bool timed;
+
+    /* Fast path: already attached to the current spat.db */
+    if (g_spat_db)
+        return;
+
+    spat_wait_lsns_seeded();
+    timed = spat_timing_begin(SPAT_PHASE_ATTACH);
+    g_spat_db = spat_attach_db(g_guc_spat_db_name);
+    spat_timing_end(timed);
+}
+
+static dshash_table*
+spat_attach_shard(SpatDB* db, int shard)
+{
+    MemoryContext oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+    bool timed = spat_timing_begin(SPAT_PHASE_ATTACH);
+
+    db->g_htabs[shard] = dshash_attach(db->g_dsa, &default_hash_params,
+                                       db->shard_hdrs[shard].htab_handle, NULL);
+
+    spat_timing_end(timed);
+    MemoryContextSwitchTo(oldcontext);
+    return db->g_htabs[shard];
+}
+
+static void
+spat_detach_all(int code, Datum arg)
+{
+    HASH_SEQ_STATUS status;
+    SpatDB* db;
+
+    g_spat_db = NULL;
+
+    hash_seq_init(&status, g_spat_attached);
+    while ((db = hash_seq_search(&status)) != NULL)
+    {
+        /* Publishers must stop seeing us before our buffer goes away */
+        if (db->subscriber)
+        {
+            g_spat_db = db;
+            spat_pubsub_unsubscribe_all(db);
+            g_spat_db = NULL;
+        }
+
+        if (db->g_channels)
+        {
+            dshash_detach(db->g_channels);
+            db->g_channels = NULL;
+        }
+
+        if (db->g_htabs)
+        {
+            for (int i = 0; i < db->shared->nshards; i++)
+            {
+                if (db->g_htabs[i])
+                    dshash_detach(db->g_htabs[i]);
+            }
+            pfree(db->g_htabs);
+            db->g_htabs = NULL;
+        }
+
+        if (db->aof_fd >= 0)
+        {
+            close(db->aof_fd);
+            db->aof_fd = -1;
+        }
+
+        if (db->g_dsa)
+        {
+            dsa_detach(db->g_dsa);
+            db->g_dsa = NULL;
+        }
+    }
+}
+
+/*
+ * ---------------------------------------- Eviction
+ * ----------------------------------------
+ *
+ * Once used_bytes exceeds spat.maxmemory, writes first evict keys, at most
+ * SPAT_EVICT_MAX_PER_CALL of them so that a single write never pays for a
+ * whole backlog. Victims are picked as in Redis: the best of
+ * spat.maxmemory_samples keys of a random shard for the allkeys-* policies,
+ * and the key closest to expiring, straight off the expiry index, for
+ * volatile-ttl. dshash can't be sampled at random, so a sample is a run of
+ * entries at a random offset among the first SPAT_EVICT_MAX_SKIP of a shard.
+ */
+
+#define SPAT_EVICT_MAX_PER_CALL 16
+#define SPAT_EVICT_MAX_SKIP 1024
+
+static bool
+spdb_over_maxmemory(SpatDB* db)
+{
+    uint64 limit = db->shared->maxmemory;
+
+    /*
+     * The DSA never shrinks much, so its size alone would have us evicting
+     * forever; what matters is whether the space we freed is reused.
+     */
+    return spdb_used_bytes(db) > limit &&
+        dsa_get_total_size(db->g_dsa) > limit;
+}
+
+/* Copy of the key of the best allkeys-* victim among a sample, or NULL if the shard is empty */
+static text*
+spdb_evict_sample(SpatDB* db, int shardno)
+{
+    dshash_table* htab = spdb_htab(db, shardno);
+    uint32 now = spat_lru_clock();
+    uint32 skip = pg_prng_uint32(&pg_global_prng_state) % SPAT_EVICT_MAX_SKIP;
+    text* victim = NULL;
+    int64 best = PG_INT64_MIN;
+
+    for (int attempt = 0; attempt < 2 && victim == NULL; attempt++)
+    {
+        dshash_seq_status status;
+        SpatDBEntry* entry;
+        uint32 pos = 0;
+        int sampled = 0;
+
+        dshash_seq_init(&status, htab, false);
+        while (sampled < db->shared->maxmemory_samples && (entry = dshash_seq_next(&status)) != NULL)
+        {
+            int64 score;
+
+            if (pos++ < skip)
+                continue;
+            sampled++;
+
+            /* The higher, the better a victim */
+            if (db->shared->maxmemory_policy == SPAT_MAXMEMORY_ALLKEYS_LFU)
+                score = PG_UINT8_MAX - spat_lfu_decayed(entry, now);
+            else
+                score = (int32)(now - entry->atime);
+
+            if (score > best)
+            {
+                if (victim)
+                    pfree(victim);
+                victim = dss_to_text(db->g_dsa, entry->key);
+                best = score;
+            }
+        }
+        dshash_seq_term(&status);
+
+        if (pos == 0)
+            break;
+
+        /* The shard is smaller than the offset, wrap around */
+        skip %= pos;
+    }
+
+    return victim;
+}
+
+/* Copy of the key expiring first in the DB, or NULL if no key has a TTL */
+static text*
+spdb_evict_soonest(SpatDB* db, int* shardno)
+{
+    TimestampTz best = SpMaxTTL;
+    text* victim = NULL;
+
+    for (int i = 0; i < db->shared->nshards; i++)
+    {
+        SpatDBShard* shard = &db->shard_hdrs[i];
+
+        LWLockAcquire(&shard->expire_lck, LW_SHARED);
+        if (shard->expire_size > 0)
+        {
+            SpatExpireItem* heap = dsa_get_address(db->g_dsa, shard->expire_heap);
+
+            if (heap[0].expireat < best)
+            {
+                SpatExpireNode* node = dsa_get_address(db->g_dsa, heap[0].node);
+
+                if (victim)
+                    pfree(victim);
+                victim = dss_to_text(db->g_dsa, node->key);
+                best = heap[0].expireat;
+                *shardno = i;
+            }
+        }
+        LWLockRelease(&shard->expire_lck);
+    }
+
+    return victim;
+}
+
+/* Returns false if there was nothing to evict */
+static bool
+spdb_evict_one(SpatDB* db)
+{
+    text* victim = NULL;
+    int shardno = 0;
+    dshash_table* htab;
+    SpatDBEntry* entry;
+    dss key;
+
+    if (db->shared->maxmemory_policy == SPAT_MAXMEMORY_VOLATILE_TTL)
+        victim = spdb_evict_soonest(db, &shardno);
+    else
+    {
+        int start = pg_prng_uint32(&pg_global_prng_state) % db->shared->nshards;
+
+        /* Move on to the next shard if this one is empty */
+        for (int i = 0; i < db->shared->nshards && victim == NULL; i++)
+        {
+            shardno = (start + i) % db->shared->nshards;
+            victim = spdb_evict_sample(db, shardno);
+        }
+    }
+
+    if (victim == NULL)
+        return false;
+
+    /* The victim may have been deleted meanwhile; that's just as good */
+    key = dss_new_local(victim);
+    htab = spdb_htab(db, shardno);
+    entry = dshash_find(htab, &key, true);
+    if (entry)
+    {
+        spdb_delete_entry(db, entry);
+        pg_atomic_fetch_add_u64(&db->shared->evictions, 1);
+    }
+
+    pfree(victim);
+    return true;
+}
+
+/*
+ * Called by commands that may grow the DB before they take any locks or
+ * allocate anything.
+ */
+static void
+spdb_evict_if_needed(SpatDB* db)
+{
+    if (likely(db->shared->maxmemory == 0))
+        return;
+
+    for (int n = 0; n < SPAT_EVICT_MAX_PER_CALL && spdb_over_maxmemory(db); n++)
+    {
+        if (db->shared->maxmemory_policy == SPAT_MAXMEMORY_NOEVICTION || !spdb_evict_one(db))
+            elog(ERROR, "spat: used memory of \"%s\" exceeds spat.maxmemory", db->name);
+    }
+}
+
+/*
+ * ---------------------------------------- Commands Common
+ * ----------------------------------------
+ */
+
+/* Lookup keys point into the argument; values to be stored are copied to the DSA */
+#define PG_GETARG_DSS(n)        dss_new_local(PG_GETARG_TEXT_PP((n)))
+#define PG_GETARG_DSS_SHARED(n) dss_new(g_spat_db->g_dsa, PG_GETARG_TEXT_PP((n)))
+#define DSS_LEN(s)          dsa_get_address(g_dsa, (s))->len
+#define DSS_TO_TEXT(s)      dss_to_text(g_spat_db->g_dsa, (s))
+#define PG_RETURN_DSS(s)    PG_RETURN_POINTER(DSS_TO_TEXT(s))
+
+/*
+ * ---------------------------------------- Commands Implementation
+ * ----------------------------------------
+ */
+
+PG_FUNCTION_INFO_V1(spvalue_in);
+
+Datum
+spvalue_in(PG_FUNCTION_ARGS)
+{
+    elog(ERROR, "spvalue_in shouldn't be called");
+}
+
+PG_FUNCTION_INFO_V1(spvalue_out);
+
+Datum
+spvalue_out(PG_FUNCTION_ARGS)
+{
+    SPValue* input = (SPValue*)PG_GETARG_POINTER(0);
+    StringInfoData output;
+
+    /* Strings are the common case, and need no StringInfo copy */
+    if (input->typ == SPVAL_STRING && OidIsValid(input->typid))
+        PG_RETURN_CSTRING(spat_datum_cstring(input->value.varlena_val));
+    if (input->typ == SPVAL_STRING && !input->isint)
+        PG_RETURN_CSTRING(text_to_cstring(input->value.varlena_val));
+
+    /* Initialize output string */
+    initStringInfo(&output);
+
+    /* Convert spval back to a string based on its type */
+    switch (input->typ)
+    {
+    case SPVAL_STRING:
+        appendStringInfo(&output, INT64_FORMAT, input->value.int_val);
+        break;
+    case SPVAL_INVALID:
+        appendStringInfoString(&output, "invalid");
+        break;
+    case SPVAL_NULL:
+        appendStringInfoString(&output, "null");
+        break;
+    case SPVAL_SET:
+        appendStringInfo(&output, "set (%d)", input->value.set.size);
+        break;
+    case SPVAL_LIST:
+        appendStringInfo(&output, "list (%d)", input->value.list.size);
+        break;
+    case SPVAL_ZSET:
+        appendStringInfo(&output, "zset (%d)", input->value.zset.size);
+        break;
+    default:
+        appendStringInfoString(&output, "invalid");
+        break;
+    }
+
+    PG_RETURN_CSTRING(output.data);
+}
+
+PG_FUNCTION_INFO_V1(spvalue_send);
+
+/*
+ * Binary output, as text. A string value already is its wire format, unless
+ * the client needs another encoding, so it's sent without any copy.
+ */
+Datum
+spvalue_send(PG_FUNCTION_ARGS)
+{
+    SPValue* input = (SPValue*)PG_GETARG_POINTER(0);
+    StringInfoData buf;
+    char* str;
+
+    if (input->typ == SPVAL_STRING && !input->isint && !OidIsValid(input->typid) &&
+        pg_get_client_encoding() == GetDatabaseEncoding())
+        PG_RETURN_BYTEA_P(input->value.varlena_val);
+
+    str = DatumGetCString(DirectFunctionCall1(spvalue_out, PointerGetDatum(input)));
+    pq_begintypsend(&buf);
+    pq_sendtext(&buf, str, strlen(str));
+    PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+/*
+ * value, a string, as a datum of type typid: the very datum it holds if it
+ * was SET as that type, otherwise what its text form parses to.
+ */
+static Datum
+spat_spvalue_as(SPValue* value, Oid typid)
+{
+    Oid typinput;
+    Oid typioparam;
+    char* str;
+
+    if (value->typ != SPVAL_STRING)
+        elog(ERROR, "value stored at key is not a string");
+
+    if (OidIsValid(value->typid) && value->typid == typid)
+        return spat_datum_get(value->value.varlena_val);
+
+    str = DatumGetCString(DirectFunctionCall1(spvalue_out, PointerGetDatum(value)));
+    getTypeInputInfo(typid, &typinput, &typioparam);
+    return OidInputFunctionCall(typinput, str, typioparam, -1);
+}
+
+PG_FUNCTION_INFO_V1(spvalue_cast);
+
+/* Casts from spvalue, to whichever type the cast declared this as returning */
+Datum
+spvalue_cast(PG_FUNCTION_ARGS)
+{
+    Oid* typid = fcinfo->flinfo->fn_extra;
+
+    if (typid == NULL)
+    {
+        typid = MemoryContextAlloc(fcinfo->flinfo->fn_mcxt, sizeof(Oid));
+        *typid = get_func_rettype(fcinfo->flinfo->fn_oid);
+        fcinfo->flinfo->fn_extra = typid;
+    }
+
+    PG_RETURN_DATUM(spat_spvalue_as((SPValue*)PG_GETARG_POINTER(0), *typid));
+}
+
+PG_FUNCTION_INFO_V1(spat_db_name);
+
+Datum
+spat_db_name(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_TEXT_P(cstring_to_text(g_guc_spat_db_name));
+}
+
+PG_FUNCTION_INFO_V1(spat_db_created_at);
+
+Datum
+spat_db_created_at(PG_FUNCTION_ARGS)
+{
+    spat_attach_shmem();
+
+    TimestampTz result;
+
+    SPDB_LOCK_SHARED(g_spat_db);
+
+    result = g_spat_db->shared->created_at;
+
+    SPDB_LOCK_RELEASE(g_spat_db);
+
+    PG_RETURN_TIMESTAMPTZ(result);
+}
+
+PG_FUNCTION_INFO_V1(spat_db_hash_function);
+
+Datum
+spat_db_hash_function(PG_FUNCTION_ARGS)
+{
+    spat_attach_shmem();
+
+    /* spat_hash_function_options is in SpatHashFunction order */
+    PG_RETURN_TEXT_P(cstring_to_text(spat_hash_function_options[g_spat_db->shared->hash_function].name));
+}
+
+/* The varlena of a SPAT_ENC_RAW string; short ones are inline in the entry */
+static inline struct varlena*
+spat_string_varlena(dsa_area* dsa, SpatDBEntry* entry)
+{
+    if (DSS_IS_INLINE(&entry->value.string))
+        return (struct varlena*) entry->value.string.u.inl;
+
+    return dsa_get_address(dsa, entry->value.string.u.str);
+}
+
+/*
+ * Strings SET from another type than text are kept as the binary image of
+ * their datum, after its type OID, so that reading them back as that type
+ * parses nothing:
+ *
+ *   payload  Oid typid, then the image: the datum itself for by-value types,
+ *            a varlena with a regular header, a NUL-terminated cstring, or
+ *            typlen bytes
+ *
+ * Stored with a header, the image is at SPAT_DATUM_HDRSZ, so it's as aligned
+ * as the string. A DB is shared by every database of the cluster, and so are
+ * its snapshots and change logs, but only built-in types have the same OID
+ * in all of them; see spat_datum_portable for the ones kept this way.
+ */
+#define SPAT_DATUM_HDRSZ (VARHDRSZ + sizeof(Oid))
+
+/*
+ * Whether values of typid can be kept as their binary image. Types created
+ * with CREATE TYPE or CREATE DOMAIN, e.g. pgvector's, get another OID in each
+ * database, enums are OIDs of pg_enum rows, and records point to a typmod
+ * only registered in the backend that made them, so only built-in base and
+ * range types qualify; SPSET stores the others as their text form.
+ */
+static bool
+spat_datum_portable(Oid typid)
+{
+    char typtype;
+
+    if (typid >= FirstGenbkiObjectId)
+        return false;
+
+    typtype = get_typtype(typid);
+    return typtype == TYPTYPE_BASE || typtype == TYPTYPE_RANGE || typtype == TYPTYPE_MULTIRANGE;
+}
+
+static inline Oid
+spat_datum_typid(const struct varlena* str)
+{
+    Oid typid;
+
+    memcpy(&typid, VARDATA(str), sizeof(Oid));
+    return typid;
+}
+
+/* The datum of str, a MAXALIGNed SPAT_ENC_DATUM string; by-reference datums point into it */
+static Datum
+spat_datum_get(struct varlena* str)
+{
+    int16 typlen;
+    bool typbyval;
+
+    get_typlenbyval(spat_datum_typid(str), &typlen, &typbyval);
+    return fetch_att((char*)str + SPAT_DATUM_HDRSZ, typbyval, typlen);
+}
+
+/* The text form of str, a MAXALIGNed SPAT_ENC_DATUM string, as its type outputs it */
+static char*
+spat_datum_cstring(struct varlena* str)
+{
+    Oid typoutput;
+    bool typisvarlena;
+
+    getTypeOutputInfo(spat_datum_typid(str), &typoutput, &typisvarlena);
+    return OidOutputFunctionCall(typoutput, spat_datum_get(str));
+}
+
+/* Append the payload of a SPAT_ENC_DATUM string holding value, of type typid, to buf */
+static void
+spat_datum_payload(StringInfo buf, Oid typid, Datum value)
+{
+    int16 typlen;
+    bool typbyval;
+
+    get_typlenbyval(typid, &typlen, &typbyval);
+    appendBinaryStringInfo(buf, (char*)&typid, sizeof(typid));
+
+    if (typbyval)
+    {
+        union
+        {
+            Datum d;
+            char c[sizeof(Datum)];
+        } image;
+
+        store_att_byval(image.c, value, typlen);
+        appendBinaryStringInfo(buf, image.c, typlen);
+    }
+    else if (typlen == -1)
+    {
+        /* Detoasted, and flattened if expanded */
+        struct varlena* v = PG_DETOAST_DATUM(value);
+
+        appendBinaryStringInfo(buf, (char*)v, VARSIZE(v));
+    }
+    else if (typlen == -2)
+        appendBinaryStringInfo(buf, DatumGetCString(value), strlen(DatumGetCString(value)) + 1);
+    else
+        appendBinaryStringInfo(buf, DatumGetPointer(value), typlen);
+}
+
+/* A palloc'd, hence MAXALIGNed, copy of the string in entry */
+static struct varlena*
+spat_string_copy(dsa_area* dsa, SpatDBEntry* entry)
+{
+    struct varlena* result = palloc(entry->value.string.len);
+    bool timed = spat_timing_begin(SPAT_PHASE_COPY);
+
+    memcpy(result, spat_string_varlena(dsa, entry), entry->value.string.len);
+    spat_timing_end(timed);
+
+    return result;
+}
+
+static SPValue* makeSpvalFromEntry(dsa_area* dsa, SpatDBEntry* entry)
+{
+    SPValue* result = (SPValue*)palloc0(sizeof(SPValue));
+
+    switch (entry->valtyp)
+    {
+    case SPVAL_INVALID:
+    case SPVAL_NULL:
+        break;
+    case SPVAL_STRING:
+        if (entry->encoding == SPAT_ENC_INT)
+        {
+            result->typ = SPVAL_STRING;
+            result->isint = true;
+            result->value.int_val = entry->value.integer;
+            break;
+        }
+        else
+        {
+            text* text_result = spat_string_copy(dsa, entry);
+
+            result->typ = SPVAL_STRING;
+            if (entry->encoding == SPAT_ENC_DATUM)
+                result->typid = spat_datum_typid(text_result);
+            result->value.varlena_val = text_result;
+            break;
+        }
+    case SPVAL_SET:
+    case SPVAL_LIST:
+    case SPVAL_ZSET:
+        {
+            SpatColl* coll = dsa_get_address(dsa, entry->value.coll);
+
+            /* Sizes change under the collection lock, not the entry's */
+            LWLockAcquire(&coll->lock, LW_SHARED);
+            result->typ = entry->valtyp;
+            if (entry->valtyp == SPVAL_SET)
+                result->value.set.size = coll->value.set.size;
+            else if (entry->valtyp == SPVAL_LIST)
+                result->value.list.size = coll->value.list.size;
+            else
+                result->value.zset.size = coll->value.zset.size;
+            LWLockRelease(&coll->lock);
+            break;
+        }
+    }
+
+    return result;
+}
+
+/* When a key SET now with the given TTL expires; SpMaxTTL if there's none */
+static TimestampTz
+spat_expireat(Interval* ttl)
+{
+    if (ttl == NULL)
+        return SpMaxTTL;
+
+    return DatumGetTimestampTz(DirectFunctionCall2(timestamptz_pl_interval,
+                                                   TimestampTzGetDatum(GetCurrentTimestamp()),
+                                                   PointerGetDatum(ttl)));
+}
+
+/*
+ * String chunks are allocated rounded up to a size class, so that a SET over
+ * a string of the same class can write in place instead of freeing and
+ * allocating. The classes follow dsa.c's own: 8-byte steps up to 64 bytes,
+ * then 4 per power of 2, then whole pages past SPAT_CHUNK_MAX_CLASS, so the
+ * rounding mostly costs nothing the DSA wouldn't have spent anyway.
+ */
+#define SPAT_CHUNK_MAX_CLASS 8192
+#define SPAT_CHUNK_PAGE 4096
+
+static Size
+spat_chunk_size(Size len)
+{
+    Size step;
+
+    if (len <= 64)
+        return TYPEALIGN(8, len);
+
+    if (len > SPAT_CHUNK_MAX_CLASS)
+        return TYPEALIGN(SPAT_CHUNK_PAGE, len);
+
+    step = (Size) 1 << (pg_leftmost_one_pos64(len - 1) - 2);
+    return TYPEALIGN(step, len);
+}
+
+/* Whether a string of len bytes can overwrite the string s in place */
+static bool
+spat_string_fits(const dss* s, Size len)
+{
+    if (DSS_IS_INLINE(s))
+        return len <= DSS_INLINE_SIZE;
+
+    return len > DSS_INLINE_SIZE && spat_chunk_size(s->len) == spat_chunk_size(len);
+}
+
+/*
+ * Store a string in entry, locked exclusively, and set its TTL. SET discards
+ * any previous TTL, so SpMaxTTL clears it. Whatever the entry held is freed
+ * first, unless it's a string whose chunk can be reused. The string is len
+ * bytes of data, text for SPAT_ENC_RAW or a datum payload for SPAT_ENC_DATUM.
+ */
+static void
+spdb_store_value(SpatDB* db, SpatDBEntry* entry, bool found, SpatEncoding encoding,
+                 const char* data, Size datalen, TimestampTz expireat)
+{
+    Size len = datalen + VARHDRSZ;
+    struct varlena* str;
+
+    spdb_set_expire(db, entry, expireat);
+
+    if (found && entry->valtyp == SPVAL_STRING && entry->encoding != SPAT_ENC_INT &&
+        spat_string_fits(&entry->value.string, len))
+    {
+        /* Overwrite in place */
+        SPDB_MEM_SUB(db, SPVAL_STRING, entry->value.string.len);
+    }
+    else
+    {
+        if (found)
+            spdb_free_value(db, entry);
+
+        spdb_set_valtyp(db, entry, SPVAL_STRING);
+        if (len <= DSS_INLINE_SIZE)
+            entry->value.string.flags = DSS_INLINE;
+        else
+        {
+            entry->value.string.flags = 0;
+            entry->value.string.u.str = spat_dsa_allocate(db->g_dsa, spat_chunk_size(len));
+        }
+    }
+
+    entry->encoding = encoding;
+    entry->value.string.len = len;
+    entry->value.string.hash = 0;
+    SPDB_MEM_ADD(db, SPVAL_STRING, len);
+
+    /* Stored with a regular header, whatever the input had */
+    str = spat_string_varlena(db->g_dsa, entry);
+    SET_VARSIZE(str, len);
+    memcpy(VARDATA(str), data, datalen);
+
+    if (spat_aof_begin(db, &entry->key, &entry->lsn,
+                       encoding == SPAT_ENC_DATUM ? SPAT_AOF_SETDATUM : SPAT_AOF_SET))
+    {
+        spat_aof_put(&expireat, sizeof(expireat));
+        spat_aof_put_str(data, datalen);
+        spat_aof_end(db);
+    }
+}
+
+static void
+spdb_store_string(SpatDB* db, SpatDBEntry* entry, bool found, const text* value, TimestampTz expireat)
+{
+    spdb_store_value(db, entry, found, SPAT_ENC_RAW, VARDATA_ANY(value), VARSIZE_ANY_EXHDR(value), expireat);
+}
+
+/* Store a string at key, inserting the key if needed. Returns the entry locked exclusively */
+static SpatDBEntry*
+spdb_set_string(SpatDB* db, dss key, const text* value, TimestampTz expireat)
+{
+    bool found;
+    SpatDBEntry* entry = spdb_find_or_insert(db, key, &found);
+
+    spdb_store_string(db, entry, found, value, expireat);
+
+    return entry;
+}
+
+SPAT_COMMAND(spset_generic, SPAT_CMD_SET)
+{
+    spat_attach_shmem();
+    spdb_evict_if_needed(g_spat_db);
+
+    /* Input */
+    dss key = PG_GETARG_DSS(0);
+    Datum value = PG_GETARG_DATUM(1);
+    Interval* ex = PG_ARGISNULL(2) ? NULL : PG_GETARG_INTERVAL_P(2);
+    bool nx = PG_ARGISNULL(3) ? NULL : PG_GETARG_BOOL(3);
+    bool xx = PG_ARGISNULL(4) ? NULL : PG_GETARG_BOOL(4);
+
+    /* Info about value */
+    bool valueIsNull = PG_ARGISNULL(1);
+    Oid valueTypeOid;
+
+    SpatDBEntry* entry;
+
+    /* Input validation */
+    if (nx || xx)
+        elog(ERROR, "nx and xx are not implemented yet");
+
+    if (valueIsNull)
+        elog(ERROR, "value cannot be NULL");
+
+    /* Get value type info. We need this for the copying part */
+    valueTypeOid = get_fn_expr_argtype(fcinfo->flinfo, 1);
+
+    /* Insert the key; built-in types other than text keep their binary form */
+    if (valueTypeOid == TEXTOID)
+        entry = spdb_set_string(g_spat_db, key, DatumGetTextPP(value), spat_expireat(ex));
+    else if (!spat_datum_portable(valueTypeOid))
+    {
+        Oid typoutput;
+        bool typisvarlena;
+
+        getTypeOutputInfo(valueTypeOid, &typoutput, &typisvarlena);
+        entry = spdb_set_string(g_spat_db, key,
+                                cstring_to_text(OidOutputFunctionCall(typoutput, value)),
+                                spat_expireat(ex));
+    }
+    else
+    {
+        StringInfoData payload;
+        bool found;
+
+        initStringInfo(&payload);
+        spat_datum_payload(&payload, valueTypeOid, value);
+
+        entry = spdb_find_or_insert(g_spat_db, key, &found);
+        spdb_store_value(g_spat_db, entry, found, SPAT_ENC_DATUM, payload.data, payload.len,
+                         spat_expireat(ex));
+    }
+
+    /* Prepare the SPvalue to echo / return */
+    SPValue* result = makeSpvalFromEntry(g_spat_db->g_dsa, entry);
+
+    spdb_release_lock(g_spat_db, entry);
+
+
+    PG_RETURN_POINTER(result);
+}
+
+/*
+ * ---------------------------------------- Near cache
+ * ----------------------------------------
+ *
+ * With spat.local_cache_size set, SPGET keeps a backend-local copy of the
+ * strings it reads, so that reading a hot key again takes neither a partition
+ * lock nor a copy out of the DSA. A copy is only served while the epoch of its
+ * key is the one it was read under, which takes a single atomic read: writers
+ * bump it as they lock the key exclusively, before changing anything, and
+ * copies are made with the key locked, so no write can fall in between.
+ *
+ * Epochs are striped over SPAT_KEY_EPOCHS counters by key hash, rather than
+ * kept in entries, since an entry may be freed and its memory reused while a
+ * backend looks at it without a lock; a write to another key of the stripe
+ * only costs a miss. Copies are not served past the TTL of their key, whether
+ * it has been reclaimed yet or not, and are evicted least recently used first
+ * once they take more than spat.local_cache_size.
+ */
+
+typedef struct SpatNearKey
+{
+    SpatDB* db;
+    uint32 hash;                        /* spdb_hash of the key */
+    uint32 len;
+    const char* str;
+} SpatNearKey;
+
+typedef struct SpatNearEntry
+{
+    SpatNearKey key;                    /* hash key, must be first */
+    dlist_node lru_node;                /* most recently used first */
+    uint64 epoch;
+    TimestampTz expireat;
+    Size size;                          /* counted against spat.local_cache_size */
+    char* data;                         /* the varlena of value, then the key */
+    SPValue value;
+} SpatNearEntry;
+
+static HTAB* g_spat_near = NULL;
+static MemoryContext g_spat_near_cxt = NULL;
+static dlist_head g_spat_near_lru = DLIST_STATIC_INIT(g_spat_near_lru);
+static Size g_spat_near_size = 0;
+
+static struct
+{
+    uint64 hits;
+    uint64 misses;
+    uint64 invalidations;               /* copies found stale or expired */
+    uint64 evictions;
+} g_spat_near_stats;
+
+static uint32
+spat_near_hash(const void* key, Size keysize)
+{
+    const SpatNearKey* k = key;
+
+    return hash_combine(k->hash, murmurhash32((uint32)(uintptr_t)k->db));
+}
+
+static int
+spat_near_match(const void* a, const void* b, Size keysize)
+{
+    const SpatNearKey* ka = a;
+    const SpatNearKey* kb = b;
+
+    if (ka->db != kb->db || ka->hash != kb->hash || ka->len != kb->len)
+        return 1;
+
+    return memcmp(ka->str, kb->str, ka->len);
+}
+
+static void
+spat_near_remove(SpatNearEntry* e)
+{
+    char* data = e->data;
+
+    dlist_delete(&e->lru_node);
+    g_spat_near_size -= e->size;
+    hash_search(g_spat_near, &e->key, HASH_REMOVE, NULL);
+    pfree(data);
+}
+
+/* Drop every copy, once spat.local_cache_size has been turned off */
+static void
+spat_near_reset(void)
+{
+    hash_destroy(g_spat_near);
+    g_spat_near = NULL;
+    MemoryContextReset(g_spat_near_cxt);
+    dlist_init(&g_spat_near_lru);
+    g_spat_near_size = 0;
+}
+
+static inline bool
+spat_near_enabled(void)
+{
+    if (likely(g_guc_spat_local_cache_size == 0))
+    {
+        if (unlikely(g_spat_near != NULL))
+            spat_near_reset();
+        return false;
+    }
+
+    return true;
+}
+
+static inline SpatNearKey
+spat_near_key(SpatDB* db, dss* key)
+{
+    SpatNearKey k;
+
+    k.db = db;
+    k.hash = spdb_hash(db, key);
+    k.len = key->len - 1;
+    k.str = dss_ptr(db->g_dsa, key);
+
+    return k;
+}
+
+/* The value of key as cached by this backend, if still current; NULL otherwise */
+static SPValue*
+spat_near_get(SpatDB* db, dss* key)
+{
+    SpatNearKey k;
+    SpatNearEntry* e;
+    SPValue* result;
+
+    if (!spat_near_enabled())
+        return NULL;
+
+    k = spat_near_key(db, key);
+    e = g_spat_near ? hash_search(g_spat_near, &k, HASH_FIND, NULL) : NULL;
+    if (e == NULL)
+    {
+        g_spat_near_stats.misses++;
+        return NULL;
+    }
+
+    if (e->epoch != pg_atomic_read_u64(spdb_key_epoch(db, key)) ||
+        (e->expireat != SpMaxTTL && e->expireat <= GetCurrentTimestamp()))
+    {
+        spat_near_remove(e);
+        g_spat_near_stats.invalidations++;
+        g_spat_near_stats.misses++;
+        return NULL;
+    }
+
+    dlist_move_head(&g_spat_near_lru, &e->lru_node);
+    g_spat_near_stats.hits++;
+
+    result = palloc(sizeof(SPValue));
+    *result = e->value;
+    if (!result->isint)
+    {
+        Size len = VARSIZE(e->value.value.varlena_val);
+
+        result->value.varlena_val = palloc(len);
+        memcpy(result->value.varlena_val, e->value.value.varlena_val, len);
+    }
+
+    return result;
+}
+
+/* Cache value, a string read from entry with its key still locked */
+static void
+spat_near_put(SpatDB* db, dss* key, SpatDBEntry* entry, const SPValue* value)
+{
+    SpatNearKey k;
+    SpatNearEntry* e;
+    Size vallen = value->isint ? 0 : VARSIZE(value->value.varlena_val);
+    Size size = sizeof(SpatNearEntry) + key->len + vallen;
+    bool found;
+
+    if (!spat_near_enabled() || size > (Size)g_guc_spat_local_cache_size * 1024)
+        return;
+
+    if (g_spat_near == NULL)
+    {
+        HASHCTL ctl;
+
+        if (g_spat_near_cxt == NULL)
+            g_spat_near_cxt = AllocSetContextCreate(TopMemoryContext, "spat near cache",
+                                                    ALLOCSET_DEFAULT_SIZES);
+
+        ctl.keysize = sizeof(SpatNearKey);
+        ctl.entrysize = sizeof(SpatNearEntry);
+        ctl.hash = spat_near_hash;
+        ctl.match = spat_near_match;
+        ctl.hcxt = g_spat_near_cxt;
+        g_spat_near = hash_create("spat near cache", 256, &ctl,
+                                  HASH_ELEM | HASH_FUNCTION | HASH_COMPARE | HASH_CONTEXT);
+    }
+
+    k = spat_near_key(db, key);
+    e = hash_search(g_spat_near, &k, HASH_ENTER, &found);
+    if (found)
+    {
+        dlist_delete(&e->lru_node);
+        g_spat_near_size -= e->size;
+        pfree(e->data);
+    }
+
+    e->epoch = pg_atomic_read_u64(spdb_key_epoch(db, key));
+    e->expireat = entry->expireat;
+    e->size = size;
+    e->data = MemoryContextAlloc(g_spat_near_cxt, k.len + vallen);
+    memcpy(e->data + vallen, k.str, k.len);
+    e->key.str = e->data + vallen;
+    e->value = *value;
+    if (!value->isint)
+    {
+        e->value.value.varlena_val = (struct varlena*)e->data;
+        memcpy(e->data, value->value.varlena_val, vallen);
+    }
+
+    dlist_push_head(&g_spat_near_lru, &e->lru_node);
+    g_spat_near_size += size;
+
+    /* The new copy fits on its own, so it's never the one evicted */
+    while (g_spat_near_size > (Size)g_guc_spat_local_cache_size * 1024)
+    {
+        spat_near_remove(dlist_tail_element(SpatNearEntry, lru_node, &g_spat_near_lru));
+        g_spat_near_stats.evictions++;
+    }
+}
+
+PG_FUNCTION_INFO_V1(sp_local_cache_stats);
+
+/* This backend's near cache, across DBs */
+Datum
+sp_local_cache_stats(PG_FUNCTION_ARGS)
+{
+    TupleDesc tupdesc;
+    Datum values[6];
+    bool nulls[6] = {0};
+
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        elog(ERROR, "return type must be a row type");
+
+    values[0] = Int64GetDatum(g_spat_near ? hash_get_num_entries(g_spat_near) : 0);
+    values[1] = Int64GetDatum(g_spat_near_size);
+    values[2] = Int64GetDatum(g_spat_near_stats.hits);
+    values[3] = Int64GetDatum(g_spat_near_stats.misses);
+    values[4] = Int64GetDatum(g_spat_near_stats.invalidations);
+    values[5] = Int64GetDatum(g_spat_near_stats.evictions);
+
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+SPAT_COMMAND(spget, SPAT_CMD_GET)
+{
+    bool found = false;
+    SPValue* result;
+
+    /* Begin processing */
+    spat_attach_shmem();
+    dss key = PG_GETARG_DSS(0);
+
+    result = spat_near_get(g_spat_db, &key);
+    if (result)
+        PG_RETURN_POINTER(result);
+
+    SpatDBEntry* entry = spdb_find(g_spat_db, key, false);
+    if (entry)
+    {
+        found = true;
+        result = makeSpvalFromEntry(g_spat_db->g_dsa, entry);
+        if (entry->valtyp == SPVAL_STRING)
+            spat_near_put(g_spat_db, &key, entry, result);
+        spdb_release_lock(g_spat_db, entry);
+    }
+
+
+    if (!found)
+    {
+        PG_RETURN_NULL();
+    }
+
+    PG_RETURN_POINTER(result);
+}
+
+/*
+ * Typed getters copy a string once, from the DSA straight into their result,
+ * instead of into an SPValue that its output function copies again.
+ * INT-encoded strings are formatted directly, and strings SET from another
+ * type are converted through their text form, unless they have the type
+ * asked for.
+ */
+
+/*
+ * A copy of the string at entry, which the caller has locked. Strings SET
+ * from another type are copied in their binary form, with *datum set, for the
+ * caller to convert once the key is unlocked.
+ */
+static struct varlena*
+spat_entry_string(SpatDB* db, SpatDBEntry* entry, bool* datum)
+{
+    if (entry->valtyp != SPVAL_STRING)
+        elog(ERROR, "value stored at key is not a string");
+
+    *datum = entry->encoding == SPAT_ENC_DATUM;
+    if (entry->encoding == SPAT_ENC_INT)
+        return (struct varlena*)cstring_to_text(psprintf(INT64_FORMAT, entry->value.integer));
+
+    return spat_string_copy(db->g_dsa, entry);
+}
+
+/* The string at key as a varlena with a regular header, or NULL if there's no key */
+static struct varlena*
+spat_get_string(SpatDB* db, dss key)
+{
+    SpatDBEntry* entry = spdb_find(db, key, false);
+    struct varlena* result;
+    bool datum;
+
+    if (entry == NULL)
+        return NULL;
+
+    result = spat_entry_string(db, entry, &datum);
+    spdb_release_lock(db, entry);
+
+    return datum ? (struct varlena*)cstring_to_text(spat_datum_cstring(result)) : result;
+}
+
+SPAT_COMMAND(spget_text, SPAT_CMD_GET_TEXT)
+{
+    struct varlena* result;
+
+    spat_attach_shmem();
+    result = spat_get_string(g_spat_db, PG_GETARG_DSS(0));
+    if (result == NULL)
+        PG_RETURN_NULL();
+
+    PG_RETURN_TEXT_P(result);
+}
+
+/* Strings are stored as text, which has the same layout as bytea */
+SPAT_COMMAND(spget_bytea, SPAT_CMD_GET_BYTEA)
+{
+    struct varlena* result;
+
+    spat_attach_shmem();
+    result = spat_get_string(g_spat_db, PG_GETARG_DSS(0));
+    if (result == NULL)
+        PG_RETURN_NULL();
+
+    PG_RETURN_BYTEA_P(result);
+}
+
+/* Parsed from a NUL-terminated copy made under the key's lock, as jsonb_in needs one, unless SET as jsonb */
+SPAT_COMMAND(spget_jsonb, SPAT_CMD_GET_JSONB)
+{
+    dss key;
+    SpatDBEntry* entry;
+    char* str;
+
+    spat_attach_shmem();
+    key = PG_GETARG_DSS(0);
+
+    entry = spdb_find(g_spat_db, key, false);
+    if (entry == NULL)
+        PG_RETURN_NULL();
+
+    if (entry->valtyp != SPVAL_STRING)
+    {
+        spdb_release_lock(g_spat_db, entry);
+        elog(ERROR, "value stored at key is not a string");
+    }
+
+    if (entry->encoding == SPAT_ENC_DATUM)
+    {
+        struct varlena* v = spat_string_copy(g_spat_db->g_dsa, entry);
+
+        spdb_release_lock(g_spat_db, entry);
+        if (spat_datum_typid(v) == JSONBOID)
+            PG_RETURN_DATUM(spat_datum_get(v));
+        str = spat_datum_cstring(v);
+    }
+    else
+    {
+        if (entry->encoding == SPAT_ENC_INT)
+            str = psprintf(INT64_FORMAT, entry->value.integer);
+        else
+        {
+            struct varlena* v = spat_string_varlena(g_spat_db->g_dsa, entry);
+
+            str = pnstrdup(VARDATA(v), VARSIZE(v) - VARHDRSZ);
+        }
+        spdb_release_lock(g_spat_db, entry);
+    }
+
+    PG_RETURN_DATUM(DirectFunctionCall1(jsonb_in, CStringGetDatum(str)));
+}
+
+/*
+ * The string at key as the type of the second argument, for types that have
+ * no cast from spvalue, e.g. SPGET_AS(key, NULL::vector).
+ */
+SPAT_COMMAND(spget_as, SPAT_CMD_GET_AS)
+{
+    Oid typid = get_fn_expr_argtype(fcinfo->flinfo, 1);
+    SpatDBEntry* entry;
+    SPValue* value;
+
+    if (PG_ARGISNULL(0))
+        PG_RETURN_NULL();
+
+    if (!OidIsValid(typid))
+        elog(ERROR, "could not determine the type to get the value as");
+
+    spat_attach_shmem();
+
+    entry = spdb_find(g_spat_db, PG_GETARG_DSS(0), false);
+    if (entry == NULL)
+        PG_RETURN_NULL();
+
+    value = makeSpvalFromEntry(g_spat_db->g_dsa, entry);
+    spdb_release_lock(g_spat_db, entry);
+
+    PG_RETURN_DATUM(spat_spvalue_as(value, typid));
+}
+
+/*
+ * Up to len bytes of the string at key, from offset on; a negative offset
+ * counts from the end. Only the range is copied, so large values can be read
+ * in chunks.
+ */
+SPAT_COMMAND(spgetrange, SPAT_CMD_GETRANGE)
+{
+    dss key;
+    int64 offset = PG_GETARG_INT64(1);
+    int64 len = PG_GETARG_INT64(2);
+    SpatDBEntry* entry;
+    const char* data;
+    int64 size;
+    char numbuf[MAXINT8LEN + 1];
+    bytea* result;
+
+    if (len < 0)
+        elog(ERROR, "length cannot be negative");
+
+    spat_attach_shmem();
+    key = PG_GETARG_DSS(0);
+
+    entry = spdb_find(g_spat_db, key, false);
+    if (entry == NULL)
+        PG_RETURN_NULL();
+
+    if (entry->valtyp != SPVAL_STRING)
+    {
+        spdb_release_lock(g_spat_db, entry);
+        elog(ERROR, "value stored at key is not a string");
+    }
+
+    if (entry->encoding == SPAT_ENC_INT)
+    {
+        size = pg_lltoa(entry->value.integer, numbuf);
+        data = numbuf;
+    }
+    else if (entry->encoding == SPAT_ENC_DATUM)
+    {
+        /* A range of its text form, converted once the key is unlocked */
+        struct varlena* v = spat_string_copy(g_spat_db->g_dsa, entry);
+
+        spdb_release_lock(g_spat_db, entry);
+        entry = NULL;
+        data = spat_datum_cstring(v);
+        size = strlen(data);
+    }
+    else
+    {
+        struct varlena* v = spat_string_varlena(g_spat_db->g_dsa, entry);
+
+        size = VARSIZE(v) - VARHDRSZ;
+        data = VARDATA(v);
+    }
+
+    if (offset < 0)
+        offset = Max(size + offset, 0);
+    offset = Min(offset, size);
+    len = Min(len, size - offset);
+
+    result = palloc(VARHDRSZ + len);
+    SET_VARSIZE(result, VARHDRSZ + len);
+    memcpy(VARDATA(result), data + offset, len);
+    if (entry)
+        spdb_release_lock(g_spat_db, entry);
+
+    PG_RETURN_BYTEA_P(result);
+}
+
+SPAT_COMMAND(sptype, SPAT_CMD_TYPE)
+{
+    spValueType result = SPVAL_NULL;
+
+    /* Begin processing */
+    spat_attach_shmem();
+    dss key = PG_GETARG_DSS(0);
+
+    SpatDBEntry* entry = spdb_find(g_spat_db, key, false);
+    if (entry)
+    {
+        result = entry->valtyp;
+        elog(DEBUG1, "valtyp=%d", entry->valtyp);
+        spdb_release_lock(g_spat_db, entry);
+    }
+
+
+    PG_RETURN_TEXT_P(cstring_to_text(spTypeName(result)));
+}
+
+
+SPAT_COMMAND(getexpireat, SPAT_CMD_GETEXPIREAT)
+{
+    spat_attach_shmem();
+
+    dss key = PG_GETARG_DSS(0);
+
+
+    /* Output */
+    TimestampTz result;
+
+    bool found;
+    SpatDBEntry* entry = spdb_find(g_spat_db, key, false);
+    if (!entry)
+    {
+        found = false;
+    }
+    else
+    {
+        found = true;
+        result = entry->expireat;
+        spdb_release_lock(g_spat_db, entry);
+    }
+
+    if (!found || result == SpMaxTTL)
+        PG_RETURN_NULL();
+    PG_RETURN_TIMESTAMPTZ(result);
+}
+
+PG_FUNCTION_INFO_V1(sp_db_nitems);
+
+Datum
+sp_db_nitems(PG_FUNCTION_ARGS)
+{
+    uint64 nitems = 0;
+
+    spat_attach_shmem();
+
+    for (int i = 0; i < SPVAL_NTYPES; i++)
+        nitems += pg_atomic_read_u64(&g_spat_db->shared->nkeys[i]);
+
+    PG_RETURN_INT32((int32) nitems);
+}
+
+PG_FUNCTION_INFO_V1(sp_db_expire_stats);
+
+Datum
+sp_db_expire_stats(PG_FUNCTION_ARGS)
+{
+    TupleDesc tupdesc;
+    Datum values[4];
+    bool nulls[4] = {0};
+
+    spat_attach_shmem();
+
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        elog(ERROR, "return type must be a row type");
+
+    values[0] = Int64GetDatum(pg_atomic_read_u64(&g_spat_db->shared->expired_lazy));
+    values[1] = Int64GetDatum(pg_atomic_read_u64(&g_spat_db->shared->expired_active));
+    values[2] = Int64GetDatum(pg_atomic_read_u64(&g_spat_db->shared->expire_cycles));
+    values[3] = Int64GetDatum(pg_atomic_read_u64(&g_spat_db->shared->ttl_keys));
+
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+PG_FUNCTION_INFO_V1(sp_db_memory_stats);
+
+Datum
+sp_db_memory_stats(PG_FUNCTION_ARGS)
+{
+    TupleDesc tupdesc;
+    Datum values[3];
+    bool nulls[3] = {0};
+
+    spat_attach_shmem();
+
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        elog(ERROR, "return type must be a row type");
+
+    values[0] = Int64GetDatum(spdb_used_bytes(g_spat_db));
+    values[1] = Int64GetDatum(dsa_get_total_size(g_spat_db->g_dsa));
+    values[2] = Int64GetDatum(pg_atomic_read_u64(&g_spat_db->shared->evictions));
+
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+PG_FUNCTION_INFO_V1(spat_stats);
+
+/* All the maintained counters of the current DB in one row; never scans */
+Datum
+spat_stats(PG_FUNCTION_ARGS)
+{
+    static const spValueType types[] = {SPVAL_STRING, SPVAL_LIST, SPVAL_SET, SPVAL_HASH, SPVAL_ZSET};
+
+    TupleDesc tupdesc;
+    Datum values[20];
+    bool nulls[20] = {0};
+    uint64 nkeys = 0;
+    int n = 0;
+    SpatDBShared* shared;
+
+    spat_attach_shmem();
+    shared = g_spat_db->shared;
+
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        elog(ERROR, "return type must be a row type");
+
+    for (int i = 0; i < SPVAL_NTYPES; i++)
+        nkeys += pg_atomic_read_u64(&shared->nkeys[i]);
+
+    values[n++] = Int64GetDatum(nkeys);
+    for (int i = 0; i < lengthof(types); i++)
+        values[n++] = Int64GetDatum(pg_atomic_read_u64(&shared->nkeys[types[i]]));
+    values[n++] = Int64GetDatum(pg_atomic_read_u64(&shared->ttl_keys));
+
+    values[n++] = Int64GetDatum(spdb_used_bytes(g_spat_db));
+    values[n++] = Int64GetDatum(pg_atomic_read_u64(&shared->nbytes[SPVAL_NULL]));
+    for (int i = 0; i < lengthof(types); i++)
+        values[n++] = Int64GetDatum(pg_atomic_read_u64(&shared->nbytes[types[i]]));
+    values[n++] = Int64GetDatum(dsa_get_total_size(g_spat_db->g_dsa));
+
+    values[n++] = Int64GetDatum(pg_atomic_read_u64(&shared->evictions));
+    values[n++] = Int64GetDatum(pg_atomic_read_u64(&shared->expired_lazy));
+    values[n++] = Int64GetDatum(pg_atomic_read_u64(&shared->expired_active));
+    values[n++] = Int64GetDatum(pg_atomic_read_u64(&shared->expire_cycles));
+
+    values[n++] = Int64GetDatum(pg_atomic_read_u32(&shared->list_waiters));
+
+    Assert(n == lengthof(values));
+
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+PG_FUNCTION_INFO_V1(sp_db_next_expiry);
+
+/* The earliest expireat in the DB, from the top of each shard's expiry heap */
+Datum
+sp_db_next_expiry(PG_FUNCTION_ARGS)
+{
+    TimestampTz result = SpMaxTTL;
+
+    spat_attach_shmem();
+
+    for (int i = 0; i < g_spat_db->shared->nshards; i++)
+    {
+        SpatDBShard* shard = &g_spat_db->shard_hdrs[i];
+
+        LWLockAcquire(&shard->expire_lck, LW_SHARED);
+        if (shard->expire_size > 0)
+        {
+            SpatExpireItem* heap = dsa_get_address(g_spat_db->g_dsa, shard->expire_heap);
+
+            result = Min(result, heap[0].expireat);
+        }
+        LWLockRelease(&shard->expire_lck);
+    }
+
+    if (result == SpMaxTTL)
+        PG_RETURN_NULL();
+
+    PG_RETURN_TIMESTAMPTZ(result);
+}
+
+PG_FUNCTION_INFO_V1(sp_db_size_bytes);
+
+Datum
+sp_db_size_bytes(PG_FUNCTION_ARGS)
+{
+    spat_attach_shmem();
+    Size result = -1;
+    result = dsa_get_total_size(g_spat_db->g_dsa);
+    PG_RETURN_INT64(result);
+}
+
+PG_FUNCTION_INFO_V1(dss_echo);
+
+Datum
+dss_echo(PG_FUNCTION_ARGS)
+{
+    spat_attach_shmem();
+    dss arg0 = PG_GETARG_DSS(0);
+    text* result = DSS_TO_TEXT(arg0);
+
+
+    PG_RETURN_TEXT_P(result);
+}
+
+#define SPAT_HASH_BENCH_ROUNDS 10
+
+PG_FUNCTION_INFO_V1(sp_hash_bench);
+
+/*
+ * Hashes nkeys generated keys with every hash family, and reports how fast
+ * that is and the chains they'd make in a dshash_table holding those keys,
+ * which picks buckets from the high hash bits and grows past 75% load.
+ * Keys look like "key:<n>", padded with random letters to a length picked
+ * uniformly in [min_len, max_len], and are the same on every call.
+ */
+Datum
+sp_hash_bench(PG_FUNCTION_ARGS)
+{
+    int32 nkeys = PG_GETARG_INT32(0);
+    int32 min_len = PG_GETARG_INT32(1);
+    int32 max_len = PG_GETARG_INT32(2);
+    ReturnSetInfo* rsinfo = (ReturnSetInfo*)fcinfo->resultinfo;
+    pg_prng_state prng;
+    char** keys;
+    Size* lens;
+    uint32* chains;
+    int size_log2 = 7;                  /* DSHASH_NUM_PARTITIONS_LOG2 */
+    double total_len = 0;
+
+    if (nkeys < 1)
+        elog(ERROR, "nkeys must be positive");
+    if (min_len < 1 || max_len < min_len)
+        elog(ERROR, "invalid key length range");
+
+    InitMaterializedSRF(fcinfo, MAT_SRF_USE_EXPECTED_DESC);
+
+    pg_prng_seed(&prng, 0x5eed);
+    keys = palloc(sizeof(char*) * nkeys);
+    lens = palloc(sizeof(Size) * nkeys);
+    for (int i = 0; i < nkeys; i++)
+    {
+        char prefix[32];
+        int plen = snprintf(prefix, sizeof(prefix), "key:%d", i);
+        Size len = min_len + pg_prng_uint64_range(&prng, 0, max_len - min_len);
+
+        /* The digits end where the padding starts, so keys stay unique */
+        len = Max(len, plen);
+        keys[i] = palloc(len);
+        memcpy(keys[i], prefix, plen);
+        for (Size j = plen; j < len; j++)
+            keys[i][j] = 'a' + pg_prng_uint32(&prng) % 26;
+
+        lens[i] = len;
+        total_len += len;
+    }
+
+    while ((UINT64CONST(3) << size_log2) / 4 < (uint64)nkeys)
+        size_log2++;
+    chains = palloc(sizeof(uint32) << size_log2);
+
+    for (int f = 0; f < lengthof(spat_hash_functions); f++)
+    {
+        SpatHashFn hash = spat_hash_functions[f];
+        uint32 seed = pg_prng_uint32(&prng);
+        volatile uint32 sink = 0;
+        instr_time start;
+        instr_time duration;
+        double probes = 0;
+        uint32 max_chain = 0;
+        Datum values[5];
+        bool nulls[5] = {0};
+
+        INSTR_TIME_SET_CURRENT(start);
+        for (int r = 0; r < SPAT_HASH_BENCH_ROUNDS; r++)
+            for (int i = 0; i < nkeys; i++)
+                sink = hash(keys[i], lens[i], seed);
+        INSTR_TIME_SET_CURRENT(duration);
+        INSTR_TIME_SUBTRACT(duration, start);
+
+        memset(chains, 0, sizeof(uint32) << size_log2);
+        for (int i = 0; i < nkeys; i++)
+            chains[hash(keys[i], lens[i], seed) >> (32 - size_log2)]++;
+
+        /* A successful lookup walks half its chain, on average */
+        for (uint64 b = 0; b < (UINT64CONST(1) << size_log2); b++)
+        {
+            probes += (double)chains[b] * (chains[b] + 1) / 2;
+            max_chain = Max(max_chain, chains[b]);
+        }
+
+        values[0] = CStringGetTextDatum(spat_hash_function_options[f].name);
+        values[1] = Float8GetDatum(total_len / nkeys);
+        values[2] = Float8GetDatum((double)INSTR_TIME_GET_NANOSEC(duration) /
+                                   ((double)nkeys * SPAT_HASH_BENCH_ROUNDS));
+        values[3] = Float8GetDatum(probes / nkeys);
+        values[4] = Int32GetDatum((int32)max_chain);
+
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+    }
+
+    return (Datum) 0;
+}
+
+
+/*
+ * ---------------------------------------- COUNTERS
+ * ----------------------------------------
+ *
+ * A string that INCR and friends have touched keeps its int64 inline in the
+ * entry, as SPAT_ENC_INT, so counting needs no DSA allocation at all; the
+ * whole read-modify-write happens under the entry lock that
+ * spdb_find_or_insert takes. Every other command reads it like any string.
+ */
+
+/* Parse a Redis-style integer: optional '-', digits, nothing else */
+static bool
+spat_parse_int64(const char* str, uint32 len, int64* result)
+{
+    char buf[32];
+    char* end;
+
+    if (len == 0 || len >= sizeof(buf) || !(isdigit((unsigned char) str[0]) || str[0] == '-'))
+        return false;
+
+    memcpy(buf, str, len);
+    buf[len] = '\0';
+
+    errno = 0;
+    *result = strtoi64(buf, &end, 10);
+
+    return errno == 0 && end == buf + len;
+}
+
+/*
+ * Add delta to (or subtract it from) the integer at entry, which the caller
+ * got from spdb_find_or_insert, and return the result. Errors out with the
+ * entry still locked, for the abort to release.
+ */
+static int64
+spat_incr_entry(SpatDB* db, SpatDBEntry* entry, bool found, int64 delta, bool decrement)
+{
+    int64 value = 0;
+
+    if (found && entry->valtyp != SPVAL_NULL && entry->valtyp != SPVAL_STRING)
+        elog(ERROR, "value stored at key is not a string");
+
+    if (found && entry->valtyp == SPVAL_STRING && entry->encoding == SPAT_ENC_INT)
+        value = entry->value.integer;
+    else if (found && entry->valtyp == SPVAL_STRING && entry->encoding == SPAT_ENC_DATUM)
+    {
+        /* Counted from its text form, e.g. if it was SET as an integer */
+        char* str = spat_datum_cstring(spat_string_copy(db->g_dsa, entry));
+
+        if (!spat_parse_int64(str, strlen(str), &value))
+            elog(ERROR, "value is not an integer or out of range");
+    }
+    else if (found && entry->valtyp == SPVAL_STRING)
+    {
+        struct varlena* str = spat_string_varlena(db->g_dsa, entry);
+
+        if (!spat_parse_int64(VARDATA(str), VARSIZE(str) - VARHDRSZ, &value))
+            elog(ERROR, "value is not an integer or out of range");
+    }
+
+    if (decrement ? pg_sub_s64_overflow(value, delta, &value) : pg_add_s64_overflow(value, delta, &value))
+        elog(ERROR, "increment or decrement would overflow");
+
+    /* From here on the value lives inline; any TTL is kept, as in Redis */
+    if (entry->valtyp == SPVAL_STRING && entry->encoding != SPAT_ENC_INT)
+        spdb_free_value(db, entry);
+
+    spdb_set_valtyp(db, entry, SPVAL_STRING);
+    entry->encoding = SPAT_ENC_INT;
+    entry->value.integer = value;
+
+    if (spat_aof_begin(db, &entry->key, &entry->lsn, SPAT_AOF_SETINT))
+    {
+        spat_aof_put(&value, sizeof(value));
+        spat_aof_end(db);
+    }
+
+    return value;
+}
+
+static Datum
+spat_incr_generic(FunctionCallInfo fcinfo, int64 delta, bool decrement)
+{
+    spat_attach_shmem();
+    spdb_evict_if_needed(g_spat_db);
+
+    dss key = PG_GETARG_DSS(0);
+    bool found;
+    int64 value;
+
+    SpatDBEntry* entry = spdb_find_or_insert(g_spat_db, key, &found);
+
+    value = spat_incr_entry(g_spat_db, entry, found, delta, decrement);
+    spdb_release_lock(g_spat_db, entry);
+
+    PG_RETURN_INT64(value);
+}
+
+SPAT_COMMAND(incr, SPAT_CMD_INCR)
+{
+    return spat_incr_generic(fcinfo, 1, false);
+}
+
+SPAT_COMMAND(incrby, SPAT_CMD_INCRBY)
+{
+    return spat_incr_generic(fcinfo, PG_GETARG_INT64(1), false);
+}
+
+SPAT_COMMAND(decr, SPAT_CMD_DECR)
+{
+    return spat_incr_generic(fcinfo, 1, true);
+}
+
+SPAT_COMMAND(decrby, SPAT_CMD_DECRBY)
+{
+    return spat_incr_generic(fcinfo, PG_GETARG_INT64(1), true);
+}
+
+/*
+ * ---------------------------------------- Collections
+ * ----------------------------------------
+ *
+ * Commands find a collection through its entry, pin it and lock it, see
+ * SpatColl. Most pin one at a time; set algebra pins all of its sets before
+ * it locks any, so that it never waits for an entry with a collection
+ * locked. An error raised with collections pinned leaves the pins to the
+ * (sub)transaction abort, which has released the locks already.
+ */
+
+typedef struct SpatPin
+{
+    SpatColl* coll;
+    dsa_pointer ptr;
+} SpatPin;
+
+static SpatDB* g_spat_pinned_db = NULL;
+static SpatPin* g_spat_pins = NULL;     /* in TopMemoryContext */
+static int g_spat_npins = 0;
+static int g_spat_maxpins = 0;
+
+static inline SpatColl*
+spat_coll(SpatDB* db, SpatDBEntry* entry)
+{
+    return dsa_get_address(db->g_dsa, entry->value.coll);
+}
+
+/* Give entry, holding no value, an empty collection header */
+static SpatColl*
+spat_coll_new(SpatDB* db, SpatDBEntry* entry, spValueType typ, SpatEncoding encoding)
+{
+    dsa_pointer ptr = spat_dsa_allocate(db->g_dsa, sizeof(SpatColl));
+    SpatColl* coll = dsa_get_address(db->g_dsa, ptr);
+
+    LWLockInitialize(&coll->lock, db->shared->lck.tranche);
+    pg_atomic_init_u32(&coll->refcount, 1);
+    coll->dropped = false;
+    coll->valtyp = typ;
+    coll->encoding = encoding;
+    coll->lsn = 0;
+    SPDB_MEM_ADD(db, typ, sizeof(SpatColl));
+
+    spdb_set_valtyp(db, entry, typ);
+    entry->encoding = SPAT_ENC_RAW;
+    entry->value.coll = ptr;
+
+    return coll;
+}
+
+/* Drop a reference to the header at ptr, freeing it with the last one */
+static void
+spat_coll_unref(SpatDB* db, dsa_pointer ptr)
+{
+    SpatColl* coll = dsa_get_address(db->g_dsa, ptr);
+
+    if (pg_atomic_sub_fetch_u32(&coll->refcount, 1) == 0)
+    {
+        Assert(coll->dropped);
+        SPDB_MEM_SUB(db, coll->valtyp, sizeof(SpatColl));
+        dsa_free(db->g_dsa, ptr);
+    }
+}
+
+/* Pin the collection of entry, which the caller has locked, and release the entry */
+static SpatColl*
+spat_coll_pin(SpatDB* db, SpatDBEntry* entry)
+{
+    SpatColl* coll = spat_coll(db, entry);
+
+    Assert(g_spat_npins == 0 || g_spat_pinned_db == db);
+
+    /* Make room first, so that an error can't leak the reference */
+    if (g_spat_npins == g_spat_maxpins)
+    {
+        int maxpins = Max(8, g_spat_maxpins * 2);
+
+        g_spat_pins = g_spat_pins == NULL
+            ? MemoryContextAlloc(TopMemoryContext, maxpins * sizeof(SpatPin))
+            : repalloc(g_spat_pins, maxpins * sizeof(SpatPin));
+        g_spat_maxpins = maxpins;
+    }
+
+    pg_atomic_fetch_add_u32(&coll->refcount, 1);
+    g_spat_pinned_db = db;
+    g_spat_pins[g_spat_npins].coll = coll;
+    g_spat_pins[g_spat_npins].ptr = entry->value.coll;
+    g_spat_npins++;
+    spdb_release_lock(db, entry);
+
+    return coll;
+}
+
+/* Drop a pin taken by spat_coll_pin, the lock being released already */
+static void
+spat_coll_unpin(SpatDB* db, SpatColl* coll)
+{
+    for (int i = g_spat_npins - 1; i >= 0; i--)
+    {
+        if (g_spat_pins[i].coll == coll)
+        {
+            dsa_pointer ptr = g_spat_pins[i].ptr;
+
+            g_spat_pins[i] = g_spat_pins[--g_spat_npins];
+            spat_coll_unref(db, ptr);
+            return;
+        }
+    }
+
+    Assert(false);
+}
+
+/* Release and unpin a collection locked by spat_coll_lock */
+static void
+spat_coll_unlock(SpatDB* db, SpatColl* coll)
+{
+    LWLockRelease(&coll->lock);
+    spat_coll_unpin(db, coll);
+}
+
+/*
+ * Lock a pinned collection in mode. Returns false, holding only the pin, if
+ * it was dropped since it was pinned.
+ */
+static bool
+spat_coll_lock_pinned(SpatDB* db, SpatColl* coll, LWLockMode mode)
+{
+    bool timed = spat_timing_begin(SPAT_PHASE_LOCK);
+
+    LWLockAcquire(&coll->lock, mode);
+    spat_timing_end(timed);
+    if (coll->dropped)
+    {
+        LWLockRelease(&coll->lock);
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Pin the collection of entry, which the caller has locked, release the
+ * entry and lock the collection in mode. Returns NULL, holding nothing, if
+ * the collection was dropped in between.
+ */
+static SpatColl*
+spat_coll_lock(SpatDB* db, SpatDBEntry* entry, LWLockMode mode)
+{
+    SpatColl* coll = spat_coll_pin(db, entry);
+
+    if (!spat_coll_lock_pinned(db, coll, mode))
+    {
+        spat_coll_unpin(db, coll);
+        return NULL;
+    }
+
+    return coll;
+}
+
+/* Let go of the collections an error left pinned. Their locks are released already */
+static void
+spat_coll_unpin_all(void)
+{
+    int npins = g_spat_npins;
+
+    g_spat_npins = 0;
+    if (npins == 0 || !spdb_is_attached(g_spat_pinned_db))
+        return;
+
+    for (int i = 0; i < npins; i++)
+        spat_coll_unref(g_spat_pinned_db, g_spat_pins[i].ptr);
+}
+
+/* A savepoint rolled back after an error, the pin goes with it as with a whole transaction */
+static void
+spat_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+                      SubTransactionId parentSubid, void* arg)
+{
+    if (event == SUBXACT_EVENT_ABORT_SUB)
+    {
+        spat_coll_unpin_all();
+        spat_timing_reset();
+    }
+}
+
+static void
+spat_coll_type_error(spValueType typ)
+{
+    elog(ERROR, "value stored at key is not a %s", typ == SPVAL_ZSET ? "sorted set" : spTypeName(typ));
+}
+
+/*
+ * The collection of typ at key, locked in mode, or NULL if there's none.
+ * Other types error out, or count as none unless strict.
+ */
+static SpatColl*
+spat_coll_find(SpatDB* db, dss key, spValueType typ, LWLockMode mode, bool strict)
+{
+    SpatDBEntry* entry = spdb_find(db, key, SPDB_ENTRY_LOCK_SHARED);
+
+    if (entry && entry->valtyp != typ)
+    {
+        spdb_release_lock(db, entry);
+        if (strict)
+            spat_coll_type_error(typ);
+        return NULL;
+    }
+
+    return entry ? spat_coll_lock(db, entry, mode) : NULL;
+}
+
+/*
+ * The collection of typ at key, locked exclusively, made by init if there's
+ * none. Errors out if key holds another type. If the collection found is
+ * dropped before we lock it, the key is looked up again.
+ */
+static SpatColl*
+spat_coll_for_write(SpatDB* db, dss key, spValueType typ,
+                    SpatColl* (*init) (SpatDB* db, SpatDBEntry* entry))
+{
+    for (;;)
+    {
+        bool found;
+        SpatDBEntry* entry = spdb_find_or_insert(db, key, &found);
+        SpatColl* coll;
+
+        if (!found || entry->valtyp == SPVAL_NULL)
+            init(db, entry);
+        else if (entry->valtyp != typ)
+        {
+            spdb_release_lock(db, entry);
+            spat_coll_type_error(typ);
+        }
+
+        if ((coll = spat_coll_lock(db, entry, LW_EXCLUSIVE)) != NULL)
+            return coll;
+    }
+}
+
+/*
+ * The collection of typ at entry, which the caller keeps locked, locked in
+ * mode as well, or NULL if entry holds something else. For paths that work
+ * on the entry too; release with LWLockRelease, as there's no pin.
+ */
+static SpatColl*
+spat_coll_held(SpatDB* db, SpatDBEntry* entry, spValueType typ, LWLockMode mode)
+{
+    SpatColl* coll;
+    bool timed;
+
+    if (entry->valtyp != typ)
+        return NULL;
+
+    coll = spat_coll(db, entry);
+    timed = spat_timing_begin(SPAT_PHASE_LOCK);
+    LWLockAcquire(&coll->lock, mode);
+    spat_timing_end(timed);
+
+    return coll;
+}
+
+/*
+ * The LSN of the last change logged for entry, which must be locked. A
+ * collection keeps the LSN of the changes logged through it, which are newer
+ * than those of its entry: whatever an entry logs frees its collection first.
+ */
+static uint64
+spdb_lsn(SpatDB* db, SpatDBEntry* entry)
+{
+    if (!SPDB_ENTRY_HAS_COLL(entry))
+        return entry->lsn;
+
+    return Max(entry->lsn, spat_coll(db, entry)->lsn);
+}
+
+/*
+ * ---------------------------------------- Compact encoding
+ * ----------------------------------------
+ *
+ * A dshash_table per set or hash, or a pair of allocations per list element,
+ * costs far more than the data of a small collection. So, listpack-style,
+ * small collections keep their items back to back in a single DSA chunk
+ * (a SpatPack), each item a uint32 length followed by that many bytes, and
+ * are searched by scanning. A hash keeps each field followed by its value.
+ *
+ * A collection is converted to its regular encoding, for good, once a write
+ * would take it past spat.{set,hash,list}_max_compact_entries items or
+ * store an item longer than spat.max_compact_value, as they were when its DB
+ * was created.
+ */
+
+typedef struct SpatPack
+{
+    uint32 used;                /* bytes of items */
+    uint32 cap;                 /* bytes available for items */
+} SpatPack;
+
+#define SPAT_PACK_ITEMS(p)      ((char*)(p) + sizeof(SpatPack))
+#define SPAT_PACK_END(p)        (SPAT_PACK_ITEMS(p) + (p)->used)
+#define SPAT_PACK_ITEM_HDRSZ    sizeof(uint32)
+#define SPAT_PACK_INITIAL       64
+
+static inline uint32
+spat_pack_item_len(const char* item)
+{
+    uint32 len;
+
+    memcpy(&len, item, sizeof(uint32));
+    return len;
+}
+
+static inline char*
+spat_pack_item_next(char* item)
+{
+    return item + SPAT_PACK_ITEM_HDRSZ + spat_pack_item_len(item);
+}
+
+/* A lookup-only dss for an item, e.g. to copy it to the DSA with dss_cpy_arg */
+static inline dss
+spat_pack_item_dss(const char* item)
+{
+    dss result;
+
+    result.u.str = (dsa_pointer)(uintptr_t)(item + SPAT_PACK_ITEM_HDRSZ);
+    result.len = spat_pack_item_len(item) + 1;
+    result.flags = DSS_LOCAL;
+    result.hash = 0;
+
+    return result;
+}
+
+static inline text*
+spat_pack_item_text(const char* item)
+{
+    return cstring_to_text_with_len(item + SPAT_PACK_ITEM_HDRSZ, spat_pack_item_len(item));
+}
+
+/* Whether a collection of n items may stay compact after storing one of len bytes */
+static inline bool
+spat_pack_fits(SpatDB* db, uint32 n, uint32 len, int max_entries)
+{
+    return n <= (uint32) max_entries && len <= (uint32) db->shared->max_compact_value;
+}
+
+static dsa_pointer
+spat_pack_new(SpatDB* db, spValueType typ)
+{
+    dsa_pointer packptr = spat_dsa_allocate(db->g_dsa, sizeof(SpatPack) + SPAT_PACK_INITIAL);
+    SpatPack* pack = dsa_get_address(db->g_dsa, packptr);
+
+    pack->used = 0;
+    pack->cap = SPAT_PACK_INITIAL;
+    SPDB_MEM_ADD(db, typ, sizeof(SpatPack) + SPAT_PACK_INITIAL);
+
+    return packptr;
+}
+
+static void
+spat_pack_free(SpatDB* db, spValueType typ, dsa_pointer packptr)
+{
+    SpatPack* pack = dsa_get_address(db->g_dsa, packptr);
+
+    SPDB_MEM_SUB(db, typ, sizeof(SpatPack) + pack->cap);
+    dsa_free(db->g_dsa, packptr);
+}
+
+/*
+ * The first item equal to str among every stride-th item, or NULL. Hashes
+ * search with a stride of 2, so that only fields are compared.
+ */
+static char*
+spat_pack_find(SpatPack* pack, const char* str, uint32 len, int stride)
+{
+    char* item = SPAT_PACK_ITEMS(pack);
+
+    while (item < SPAT_PACK_END(pack))
+    {
+        if (spat_pack_item_len(item) == len &&
+            memcmp(item + SPAT_PACK_ITEM_HDRSZ, str, len) == 0)
+            return item;
+
+        for (int i = 0; i < stride; i++)
+            item = spat_pack_item_next(item);
+    }
+
+    return NULL;
+}
+
+/*
+ * Insert an item at byte offset off, moving the pack to a chunk twice as
+ * large if it doesn't fit. Returns the pack, which may have moved.
+ */
+static dsa_pointer
+spat_pack_insert(SpatDB* db, spValueType typ, dsa_pointer packptr, uint32 off,
+                 const char* str, uint32 len)
+{
+    SpatPack* pack = dsa_get_address(db->g_dsa, packptr);
+    uint32 need = pack->used + SPAT_PACK_ITEM_HDRSZ + len;
+    char* item;
+
+    if (need > pack->cap)
+    {
+        uint32 newcap = Max(pack->cap * 2, need);
+        dsa_pointer newptr = spat_dsa_allocate(db->g_dsa, sizeof(SpatPack) + newcap);
+        SpatPack* newpack = dsa_get_address(db->g_dsa, newptr);
+
+        newpack->used = pack->used;
+        newpack->cap = newcap;
+        memcpy(SPAT_PACK_ITEMS(newpack), SPAT_PACK_ITEMS(pack), pack->used);
+        SPDB_MEM_ADD(db, typ, newcap - pack->cap);
+        dsa_free(db->g_dsa, packptr);
+
+        packptr = newptr;
+        pack = newpack;
+    }
+
+    item = SPAT_PACK_ITEMS(pack) + off;
+    memmove(item + SPAT_PACK_ITEM_HDRSZ + len, item, pack->used - off);
+    memcpy(item, &len, sizeof(uint32));
+    memcpy(item + SPAT_PACK_ITEM_HDRSZ, str, len);
+    pack->used = need;
+
+    return packptr;
+}
+
+/* The n-th item, or the end of the pack if there aren't that many */
+static char*
+spat_pack_nth(SpatPack* pack, uint32 n)
+{
+    char* item = SPAT_PACK_ITEMS(pack);
+
+    while (n-- > 0 && item < SPAT_PACK_END(pack))
+        item = spat_pack_item_next(item);
+
+    return item;
+}
+
+/* Remove nitems items starting at item. Packs never shrink */
+static void
+spat_pack_delete(SpatPack* pack, char* item, int nitems)
+{
+    char* end = item;
+
+    for (int i = 0; i < nitems; i++)
+        end = spat_pack_item_next(end);
+
+    memmove(item, end, SPAT_PACK_END(pack) - end);
+    pack->used -= end - item;
+}
+
+static const char*
+spat_encoding_name(SpatEncoding enc)
+{
+    switch (enc)
+    {
+    case SPAT_ENC_RAW:
+        return "raw";
+    case SPAT_ENC_INT:
+        return "int";
+    case SPAT_ENC_DATUM:
+        return "datum";
+    case SPAT_ENC_LISTPACK:
+        return "listpack";
+    case SPAT_ENC_HASHTABLE:
+        return "hashtable";
+    case SPAT_ENC_QUICKLIST:
+        return "quicklist";
+    case SPAT_ENC_SKIPLIST:
+        return "skiplist";
+    default:
+        return "invalid";
+    }
+}
+
+/* Like Redis' OBJECT ENCODING: how the value at key is stored, NULL if none */
+PG_FUNCTION_INFO_V1(spobject_encoding);
+
+Datum
+spobject_encoding(PG_FUNCTION_ARGS)
+{
+    const char* result = NULL;
+
+    spat_attach_shmem();
+    dss key = PG_GETARG_DSS(0);
+
+    SpatDBEntry* entry = spdb_find(g_spat_db, key, false);
+    if (entry)
+    {
+        if (entry->valtyp == SPVAL_STRING && entry->encoding == SPAT_ENC_RAW &&
+            DSS_IS_INLINE(&entry->value.string))
+            result = "embstr";
+        else if (SPDB_ENTRY_HAS_COLL(entry))
+        {
+            SpatColl* coll = spat_coll(g_spat_db, entry);
+
+            LWLockAcquire(&coll->lock, LW_SHARED);
+            result = spat_encoding_name(coll->encoding);
+            LWLockRelease(&coll->lock);
+        }
+        else
+            result = spat_encoding_name(entry->encoding);
+        spdb_release_lock(g_spat_db, entry);
+    }
+
+    if (result == NULL)
+        PG_RETURN_NULL();
+
+    PG_RETURN_TEXT_P(cstring_to_text(result));
+}
+
+/* ---------------------------------------- SETS  ---------------------------------------- */
+
+static const dshash_parameters params_hashset = {
+    .key_size = sizeof(dss),
+    .entry_size = sizeof(dss),
+    .compare_function = dss_cmp,
+    .hash_function = dss_hash,
+    .copy_function = dss_copy
+};
+
+/* Add elem to a compact set; false if the set has to be converted first */
+static bool
+spat_set_pack_add(SpatDB* db, SpatColl* coll, const dss* elem)
+{
+    SpatPack* pack = dsa_get_address(db->g_dsa, coll->value.set.hndl);
+    const char* str = dss_ptr(db->g_dsa, elem);
+    uint32 len = elem->len - 1;
+
+    if (spat_pack_find(pack, str, len, 1) != NULL)
+        return true;
+
+    if (!spat_pack_fits(db, coll->value.set.size + 1, len, db->shared->set_max_compact_entries))
+        return false;
+
+    coll->value.set.hndl = spat_pack_insert(db, SPVAL_SET, coll->value.set.hndl, pack->used, str, len);
+    coll->value.set.size++;
+
+    return true;
+}
+
+/* Move the members of a compact set to a dshash_table */
+static void
+spat_set_convert(SpatDB* db, SpatColl* coll)
+{
+    dsa_pointer packptr = coll->value.set.hndl;
+    SpatPack* pack = dsa_get_address(db->g_dsa, packptr);
+    dshash_table* htab = spat_dshash_create(db->g_dsa, &params_hashset, db->shared->lck.tranche);
+
+    for (char* item = SPAT_PACK_ITEMS(pack); item < SPAT_PACK_END(pack); item = spat_pack_item_next(item))
+    {
+        dss member = spat_pack_item_dss(item);
+        bool found;
+        dss* elem = dshash_find_or_insert(htab, &member, &found);
+
+        SPDB_MEM_ADD(db, SPVAL_SET, sizeof(dss) + elem->len);
+        dshash_release_lock(htab, elem);
+    }
+
+    coll->value.set.hndl = dshash_get_hash_table_handle(htab);
+    coll->encoding = SPAT_ENC_HASHTABLE;
+    dshash_detach(htab);
+
+    spat_pack_free(db, SPVAL_SET, packptr);
+}
+
+/* Make an entry holding no value an empty set; new sets start compact */
+static SpatColl*
+spat_set_init(SpatDB* db, SpatDBEntry* entry)
+{
+    SpatColl* coll = spat_coll_new(db, entry, SPVAL_SET, SPAT_ENC_LISTPACK);
+
+    coll->value.set.hndl = spat_pack_new(db, SPVAL_SET);
+    coll->value.set.size = 0;
+
+    return coll;
+}
+
+/* Add elem to the set at key, converting the set if it outgrows its encoding */
+static void
+spat_set_add(SpatDB* db, SpatColl* coll, const dss* key, const dss* elem_dss)
+{
+    if (coll->encoding == SPAT_ENC_LISTPACK &&
+        !spat_set_pack_add(db, coll, elem_dss))
+        spat_set_convert(db, coll);
+
+    if (coll->encoding == SPAT_ENC_HASHTABLE)
+    {
+        dshash_table* htab = dshash_attach(db->g_dsa, &params_hashset, coll->value.set.hndl, NULL);
+
+        /* Insert the dss element into the set */
+        bool setelementfound;
+        dss* elem = dshash_find_or_insert(htab, elem_dss, &setelementfound);
+        //Using dss as element
+        if (!setelementfound)
+        {
+            coll->value.set.size++;
+            SPDB_MEM_ADD(db, SPVAL_SET, sizeof(dss) + elem->len);
+        }
+
+        /* Release locks */
+        dshash_release_lock(htab, elem);
+        dshash_detach(htab);
+    }
+
+    if (spat_aof_begin(db, key, &coll->lsn, SPAT_AOF_SADD))
+    {
+        spat_aof_put_dss(db, elem_dss);
+        spat_aof_end(db);
+    }
+}
+
+/* Remove elem from the set at key. True if it was a member */
+static bool
+spat_set_remove(SpatDB* db, SpatColl* coll, const dss* key, const dss* elem_dss)
+{
+    bool deleted;
+
+    if (coll->encoding == SPAT_ENC_LISTPACK)
+    {
+        SpatPack* pack = dsa_get_address(db->g_dsa, coll->value.set.hndl);
+        char* item = spat_pack_find(pack, dss_ptr(db->g_dsa, elem_dss), elem_dss->len - 1, 1);
+
+        deleted = item != NULL;
+        if (deleted)
+        {
+            spat_pack_delete(pack, item, 1);
+            coll->value.set.size--;
+        }
+    }
+    else
+    {
+        dshash_table* htab = dshash_attach(db->g_dsa, &params_hashset, coll->value.set.hndl, NULL);
+        dss* elem = dshash_find(htab, elem_dss, true);
+
+        deleted = elem != NULL;
+        if (deleted)
+        {
+            SPDB_MEM_SUB(db, SPVAL_SET, sizeof(dss) + elem->len);
+            dss_free(db->g_dsa, elem);
+            dshash_delete_entry(htab, elem);
+            coll->value.set.size--;
+        }
+
+        dshash_detach(htab);
+    }
+
+    if (deleted && spat_aof_begin(db, key, &coll->lsn, SPAT_AOF_SREM))
+    {
+        spat_aof_put_dss(db, elem_dss);
+        spat_aof_end(db);
+    }
+
+    return deleted;
+}
+
+SPAT_COMMAND(sadd, SPAT_CMD_SADD)
+{
+    spat_attach_shmem();
+    spdb_evict_if_needed(g_spat_db);
+
+    dss key = PG_GETARG_DSS(0);
+    dss elem_dss = PG_GETARG_DSS(1);
+
+    /* Insert/find the set in the global hash table */
+    SpatColl* coll = spat_coll_for_write(g_spat_db, key, SPVAL_SET, spat_set_init);
+
+    spat_set_add(g_spat_db, coll, &key, &elem_dss);
+
+    spat_coll_unlock(g_spat_db, coll);
+
+
+    PG_RETURN_VOID();
+}
+
+/* Whether elem is a member of the set coll */
+static bool
+spat_set_contains(SpatDB* db, SpatColl* coll, const dss* elem_dss)
+{
+    bool result = false;
+
+    if (coll->encoding == SPAT_ENC_LISTPACK)
+    {
+        SpatPack* pack = dsa_get_address(db->g_dsa, coll->value.set.hndl);
+
+        result = spat_pack_find(pack, dss_ptr(db->g_dsa, elem_dss), elem_dss->len - 1, 1) != NULL;
+    }
+    else
+    {
+        dshash_table* htab = dshash_attach(db->g_dsa, &params_hashset, coll->value.set.hndl, NULL);
+
+        dss* elem = dshash_find(htab, elem_dss, false);
+        if (elem)
+        {
+            dshash_release_lock(htab, elem);
+            result = true;
+        }
+        dshash_detach(htab);
+    }
+
+    return result;
+}
+
+SPAT_COMMAND(sismember, SPAT_CMD_SISMEMBER)
+{
+    spat_attach_shmem();
+    dss key = PG_GETARG_DSS(0);
+
+    dss elem_dss = PG_GETARG_DSS(1);
+
+    bool result = false;
+
+    SpatColl* coll = spat_coll_find(g_spat_db, key, SPVAL_SET, LW_SHARED, true);
+    if (coll)
+    {
+        result = spat_set_contains(g_spat_db, coll, &elem_dss);
+        spat_coll_unlock(g_spat_db, coll);
+    }
+
+    PG_RETURN_BOOL(result);
+}
+
+/*
+ * Remove the specified members from the set stored at key. Specified members
+ * that are not a member of this set are ignored. If key does not exist, it
+ * is treated as an empty set and this command returns 0. An error is
+ * returned when the value stored at key is not a set.
+ */
+SPAT_COMMAND(srem, SPAT_CMD_SREM)
+{
+    spat_attach_shmem();
+
+    dss key = PG_GETARG_DSS(0);
+    dss elem_dss = PG_GETARG_DSS(1);
+
+    int32 result;
+
+    SpatColl* coll = spat_coll_find(g_spat_db, key, SPVAL_SET, LW_EXCLUSIVE, true);
+    if (coll)
+    {
+        result = spat_set_remove(g_spat_db, coll, &key, &elem_dss) ? 1 : 0;
+        spat_coll_unlock(g_spat_db, coll);
+    }
+    else
+    {
+        result = 0;
+    }
+
+    PG_RETURN_BOOL(result);
+}
+
+SPAT_COMMAND(scard, SPAT_CMD_SCARD)
+{
+    spat_attach_shmem();
+
+    /* Input key and value */
+    dss key = PG_GETARG_DSS(0);
+
+    uint32 result;
+    SpatColl* coll = spat_coll_find(g_spat_db, key, SPVAL_SET, LW_SHARED, false);
+
+    if (coll == NULL)
+        PG_RETURN_NULL();
+
+    result = coll->value.set.size;
+    spat_coll_unlock(g_spat_db, coll);
+
+    PG_RETURN_INT32(result);
+}
+
+/*
+ * Set algebra. Results stream into a tuplestore, that of the SRF or, for the
+ * STORE variants, one of their own, rather than being built in memory.
+ *
+ * The sets of a command are all pinned before any of them is locked, as the
+ * lock order allows no entry lookup with a collection locked. SINTER then
+ * iterates its smallest set and SDIFF its first, keeping that one locked
+ * while probing the others for each batch of SPAT_SET_BATCH members; those
+ * are locked only while they're probed, so a backend holds at most two of
+ * them at once. The cost is O(card(first) * nkeys). SUNION iterates its sets
+ * one after the other, skipping the members a local hash table says were
+ * emitted already.
+ */
+
+#define SPAT_SET_BATCH 128
+
+typedef enum SpatSetOp
+{
+    SPAT_SET_INTER,
+    SPAT_SET_UNION,
+    SPAT_SET_DIFF
+} SpatSetOp;
+
+typedef struct SpatSetAlgebra
+{
+    SpatDB* db;
+    SpatSetOp op;
+    int nsets;
+    SpatColl** sets;                    /* pinned, NULL for keys with no set */
+    int first;                          /* the set SINTER and SDIFF iterate */
+    Tuplestorestate* tupstore;
+    TupleDesc desc;
+    uint32 count;                       /* members emitted */
+} SpatSetAlgebra;
+
+/*
+ * Iterates the members of a locked set as lookup keys, with their hash. They
+ * point into the set, so they're only valid as long as it stays locked.
+ */
+typedef struct SpatSetIter
+{
+    SpatPack* pack;
+    char* item;
+    dshash_table* htab;
+    dshash_seq_status status;
+} SpatSetIter;
+
+static void
+spat_set_iter_init(SpatDB* db, SpatColl* coll, SpatSetIter* it)
+{
+    it->htab = NULL;
+    if (coll->encoding == SPAT_ENC_LISTPACK)
+    {
+        it->pack = dsa_get_address(db->g_dsa, coll->value.set.hndl);
+        it->item = SPAT_PACK_ITEMS(it->pack);
+    }
+    else
+    {
+        it->htab = dshash_attach(db->g_dsa, &params_hashset, coll->value.set.hndl, NULL);
+        dshash_seq_init(&it->status, it->htab, false);
+    }
+}
+
+static bool
+spat_set_iter_next(SpatDB* db, SpatSetIter* it, dss* member)
+{
+    if (it->htab == NULL)
+    {
+        if (it->item >= SPAT_PACK_END(it->pack))
+            return false;
+        *member = spat_pack_item_dss(it->item);
+        it->item = spat_pack_item_next(it->item);
+    }
+    else
+    {
+        dss* elem = dshash_seq_next(&it->status);
+
+        if (elem == NULL)
+            return false;
+        *member = *elem;
+    }
+
+    spdb_hash(db, member);
+    return true;
+}
+
+static void
+spat_set_iter_term(SpatSetIter* it)
+{
+    if (it->htab)
+    {
+        dshash_seq_term(&it->status);
+        dshash_detach(it->htab);
+    }
+}
+
+static void
+spat_set_emit(SpatSetAlgebra* sa, text* member)
+{
+    Datum value = PointerGetDatum(member);
+    bool isnull = false;
+
+    tuplestore_putvalues(sa->tupstore, sa->desc, &value, &isnull);
+    sa->count++;
+}
+
+/* Like spat_set_contains, for a set whose contents are attached already, as pack or htab */
+static bool
+spat_set_contains_in(SpatDB* db, SpatPack* pack, dshash_table* htab, dss* member)
+{
+    dss* elem;
+
+    if (pack)
+        return spat_pack_find(pack, dss_ptr(db->g_dsa, member), member->len - 1, 1) != NULL;
+
+    elem = dshash_find(htab, member, false);
+    if (elem)
+        dshash_release_lock(htab, elem);
+
+    return elem != NULL;
+}
+
+/*
+ * Emit those of the n members of the first set that are in every other set
+ * (SINTER), or in none of them (SDIFF). The first set being locked, a key
+ * that repeats it needs no probing.
+ */
+static void
+spat_set_probe(SpatSetAlgebra* sa, dss* members, int n)
+{
+    SpatDB* db = sa->db;
+    SpatColl* first = sa->sets[sa->first];
+    bool keep[SPAT_SET_BATCH];
+    bool inter = sa->op == SPAT_SET_INTER;
+
+    for (int j = 0; j < n; j++)
+        keep[j] = true;
+
+    for (int i = 0; i < sa->nsets; i++)
+    {
+        SpatColl* coll = sa->sets[i];
+        SpatPack* pack = NULL;
+        dshash_table* htab = NULL;
+
+        if (i == sa->first)
+            continue;
+
+        if (coll == first)
+        {
+            if (!inter)
+                return;
+            continue;
+        }
+
+        /* A set dropped since it was pinned counts as none */
+        if (coll == NULL || !spat_coll_lock_pinned(db, coll, LW_SHARED))
+        {
+            if (inter)
+                return;
+            continue;
+        }
+
+        if (coll->encoding == SPAT_ENC_LISTPACK)
+            pack = dsa_get_address(db->g_dsa, coll->value.set.hndl);
+        else
+            htab = dshash_attach(db->g_dsa, &params_hashset, coll->value.set.hndl, NULL);
+
+        for (int j = 0; j < n; j++)
+        {
+            if (keep[j])
+                keep[j] = spat_set_contains_in(db, pack, htab, &members[j]) == inter;
+        }
+
+        if (htab)
+            dshash_detach(htab);
+        LWLockRelease(&coll->lock);
+    }
+
+    for (int j = 0; j < n; j++)
+    {
+        if (keep[j])
+        {
+            text* member = dss_to_text(db->g_dsa, members[j]);
+
+            spat_set_emit(sa, member);
+            pfree(member);
+        }
+    }
+}
+
+/* SINTER and SDIFF: iterate the first set, probing the others batch by batch */
+static void
+spat_set_filter(SpatSetAlgebra* sa)
+{
+    SpatDB* db = sa->db;
+    SpatColl* first = sa->sets[sa->first];
+    SpatSetIter it;
+    dss members[SPAT_SET_BATCH];
+    int n = 0;
+
+    if (first == NULL || !spat_coll_lock_pinned(db, first, LW_SHARED))
+        return;
+
+    spat_set_iter_init(db, first, &it);
+    while (spat_set_iter_next(db, &it, &members[n]))
+    {
+        if (++n == SPAT_SET_BATCH)
+        {
+            spat_set_probe(sa, members, n);
+            n = 0;
+        }
+    }
+    if (n > 0)
+        spat_set_probe(sa, members, n);
+    spat_set_iter_term(&it);
+
+    LWLockRelease(&first->lock);
+}
+
+/* A member SUNION has emitted, pointing to its copy */
+typedef struct SpatSetSeen
+{
+    uint32 hash;                        /* spdb_hash of the member */
+    uint32 len;
+    const char* str;
+} SpatSetSeen;
+
+static uint32
+spat_set_seen_hash(const void* key, Size keysize)
+{
+    return ((const SpatSetSeen*)key)->hash;
+}
+
+static int
+spat_set_seen_match(const void* a, const void* b, Size keysize)
+{
+    const SpatSetSeen* ka = a;
+    const SpatSetSeen* kb = b;
+
+    if (ka->hash != kb->hash || ka->len != kb->len)
+        return 1;
+
+    return memcmp(ka->str, kb->str, ka->len);
+}
+
+/*
+ * SUNION: emit the members of each set in turn, unless an earlier set had
+ * them. Those of the last set are only looked up, nothing comes after it.
+ */
+static void
+spat_set_union(SpatSetAlgebra* sa)
+{
+    SpatDB* db = sa->db;
+    HASHCTL ctl;
+    HTAB* seen;
+    int last = sa->nsets - 1;
+
+    while (last >= 0 && sa->sets[last] == NULL)
+        last--;
+
+    ctl.keysize = sizeof(SpatSetSeen);
+    ctl.entrysize = sizeof(SpatSetSeen);
+    ctl.hash = spat_set_seen_hash;
+    ctl.match = spat_set_seen_match;
+    ctl.hcxt = CurrentMemoryContext;
+    seen = hash_create("spat set union", 256, &ctl,
+                       HASH_ELEM | HASH_FUNCTION | HASH_COMPARE | HASH_CONTEXT);
+
+    for (int i = 0; i <= last; i++)
+    {
+        SpatColl* coll = sa->sets[i];
+        SpatSetIter it;
+        dss member;
+        bool repeated = false;
+
+        for (int j = 0; j < i && !repeated; j++)
+            repeated = sa->sets[j] == coll;
+
+        if (coll == NULL || repeated || !spat_coll_lock_pinned(db, coll, LW_SHARED))
+            continue;
+
+        spat_set_iter_init(db, coll, &it);
+        while (spat_set_iter_next(db, &it, &member))
+        {
+            SpatSetSeen k;
+            SpatSetSeen* e;
+            bool found;
+            text* copy;
+
+            k.hash = member.hash;
+            k.len = member.len - 1;
+            k.str = dss_ptr(db->g_dsa, &member);
+
+            e = hash_search(seen, &k, i == last ? HASH_FIND : HASH_ENTER, &found);
+            if (found)
+                continue;
+
+            copy = dss_to_text(db->g_dsa, member);
+            spat_set_emit(sa, copy);
+            if (e)
+                e->str = VARDATA(copy);
+            else
+                pfree(copy);
+        }
+        spat_set_iter_term(&it);
+
+        LWLockRelease(&coll->lock);
+    }
+
+    hash_destroy(seen);
+}
+
+/*
+ * Emit the members resulting from op over the sets at keys into tupstore,
+ * in rows of desc. Returns how many there are.
+ */
+static uint32
+spat_set_algebra(SpatDB* db, SpatSetOp op, ArrayType* keysarr,
+                 Tuplestorestate* tupstore, TupleDesc desc)
+{
+    SpatSetAlgebra sa;
+    Datum* keys;
+    bool* nulls;
+    uint32 smallest = PG_UINT32_MAX;
+    bool empty = false;
+
+    deconstruct_array_builtin(keysarr, TEXTOID, &keys, &nulls, &sa.nsets);
+    for (int i = 0; i < sa.nsets; i++)
+        if (nulls[i])
+            elog(ERROR, "keys cannot be NULL");
+
+    sa.db = db;
+    sa.op = op;
+    sa.sets = palloc0(Max(sa.nsets, 1) * sizeof(SpatColl*));
+    sa.first = 0;
+    sa.tupstore = tupstore;
+    sa.desc = desc;
+    sa.count = 0;
+
+    /*
+     * Sizes are read with only the entry locked, which is racy, but they
+     * only pick the set SINTER iterates. A missing key makes it empty.
+     */
+    for (int i = 0; i < sa.nsets && !empty; i++)
+    {
+        SpatDBEntry* entry = spdb_find(db, dss_new_local(DatumGetTextPP(keys[i])), SPDB_ENTRY_LOCK_SHARED);
+        uint32 size;
+
+        if (entry == NULL)
+        {
+            empty = op == SPAT_SET_INTER;
+            continue;
+        }
+
+        if (entry->valtyp != SPVAL_SET)
+        {
+            spdb_release_lock(db, entry);
+            spat_coll_type_error(SPVAL_SET);
+        }
+
+        size = spat_coll(db, entry)->value.set.size;
+        if (op == SPAT_SET_INTER && size < smallest)
+        {
+            smallest = size;
+            sa.first = i;
+        }
+        sa.sets[i] = spat_coll_pin(db, entry);
+    }
+
+    if (op == SPAT_SET_UNION)
+        spat_set_union(&sa);
+    else if (!empty && sa.nsets > 0)
+        spat_set_filter(&sa);
+
+    for (int i = 0; i < sa.nsets; i++)
+    {
+        if (sa.sets[i])
+            spat_coll_unpin(db, sa.sets[i]);
+    }
+    pfree(sa.sets);
+
+    return sa.count;
+}
+
+/* SINTER, SUNION and SDIFF return their members as a set of rows */
+static Datum
+spat_set_algebra_srf(FunctionCallInfo fcinfo, SpatSetOp op)
+{
+    ReturnSetInfo* rsinfo = (ReturnSetInfo*)fcinfo->resultinfo;
+
+    spat_attach_shmem();
+
+    InitMaterializedSRF(fcinfo, MAT_SRF_USE_EXPECTED_DESC);
+
+    spat_set_algebra(g_spat_db, op, PG_GETARG_ARRAYTYPE_P(0), rsinfo->setResult, rsinfo->setDesc);
+
+    return (Datum) 0;
+}
+
+/*
+ * The STORE variants replace whatever dest held, TTL included, with the
+ * resulting set, or delete it if the result is empty. Returns its cardinality.
+ */
+static Datum
+spat_set_algebra_store(FunctionCallInfo fcinfo, SpatSetOp op)
+{
+    TupleDesc desc;
+    Tuplestorestate* members;
+    TupleTableSlot* slot;
+    uint32 count;
+    SpatDBEntry* entry;
+    SpatColl* coll;
+    bool found;
+
+    spat_attach_shmem();
+    spdb_evict_if_needed(g_spat_db);
+
+    /* Computed before touching dest, which may be one of the keys */
+    desc = CreateTemplateTupleDesc(1);
+    TupleDescInitEntry(desc, (AttrNumber) 1, "member", TEXTOID, -1, 0);
+    members = tuplestore_begin_heap(false, false, work_mem);
+    count = spat_set_algebra(g_spat_db, op, PG_GETARG_ARRAYTYPE_P(1), members, desc);
+
+    if (count == 0)
+    {
+        tuplestore_end(members);
+        entry = spdb_find(g_spat_db, PG_GETARG_DSS(0), SPDB_ENTRY_LOCK_EXCLUSIVE);
+        if (entry)
+            spdb_delete_entry(g_spat_db, entry);
+        PG_RETURN_INT32(0);
+    }
+
+    entry = spdb_find_or_insert(g_spat_db, PG_GETARG_DSS(0), &found);
+    spdb_free_value(g_spat_db, entry);
+
+    /* The members are logged one by one, onto nothing */
+    if (found && spat_aof_begin(g_spat_db, &entry->key, &entry->lsn, SPAT_AOF_DEL))
+        spat_aof_end(g_spat_db);
+
+    spdb_clear_expire(g_spat_db, entry);
+
+    /* Nobody can pin the new set before we release its entry */
+    coll = spat_set_init(g_spat_db, entry);
+    slot = MakeSingleTupleTableSlot(desc, &TTSOpsMinimalTuple);
+    while (tuplestore_gettupleslot(members, true, false, slot))
+    {
+        bool isnull;
+        dss elem = dss_new_local(DatumGetTextPP(slot_getattr(slot, 1, &isnull)));
+
+        spat_set_add(g_spat_db, coll, &entry->key, &elem);
+    }
+
+    spdb_release_lock(g_spat_db, entry);
+
+    ExecDropSingleTupleTableSlot(slot);
+    tuplestore_end(members);
+
+    PG_RETURN_INT32(count);
+}
+
+SPAT_COMMAND(sinter, SPAT_CMD_SINTER)
+{
+    return spat_set_algebra_srf(fcinfo, SPAT_SET_INTER);
+}
+
+SPAT_COMMAND(sunion, SPAT_CMD_SUNION)
+{
+    return spat_set_algebra_srf(fcinfo, SPAT_SET_UNION);
+}
+
+SPAT_COMMAND(sdiff, SPAT_CMD_SDIFF)
+{
+    return spat_set_algebra_srf(fcinfo, SPAT_SET_DIFF);
+}
+
+SPAT_COMMAND(sinterstore, SPAT_CMD_SINTERSTORE)
+{
+    return spat_set_algebra_store(fcinfo, SPAT_SET_INTER);
+}
+
+SPAT_COMMAND(sunionstore, SPAT_CMD_SUNIONSTORE)
+{
+    return spat_set_algebra_store(fcinfo, SPAT_SET_UNION);
+}
+
+SPAT_COMMAND(sdiffstore, SPAT_CMD_SDIFFSTORE)
+{
+    return spat_set_algebra_store(fcinfo, SPAT_SET_DIFF);
+}
+
+/*
+ * ---------------------------------------- LISTS ----------------------------------------
+ *
+ * Lists past the compact thresholds are quicklists: a doubly-linked list of
+ * nodes, each holding a chunk of up to spat.list_max_compact_entries
+ * elements in a SpatPack. Pushes and pops only touch the node at their end,
+ * allocating a node per chunk rather than per element, and indexed access
+ * skips whole nodes by their count.
+ */
+
+struct SpatListNode
+{
+    dsa_pointer prev;
+    dsa_pointer next;
+    dsa_pointer pack;           /* SpatPack with the elements of the chunk */
+    uint32 count;
+};
+
+#define LIST_NIL InvalidDsaPointer
+
+/* A node past this many bytes of elements takes no more, whatever its count */
+#define SPAT_LIST_CHUNK_BYTES 8192
+
+/* Position in a list, kept by spat_list_seek and spat_list_next */
+typedef struct SpatListIter
+{
+    dsa_pointer node;           /* LIST_NIL for a compact list */
+    SpatPack* pack;
+    char* item;
+} SpatListIter;
+
+static inline SpatListNode*
+spat_list_node(SpatDB* db, dsa_pointer nodeptr)
+{
+    return dsa_get_address(db->g_dsa, nodeptr);
+}
+
+/* Link a new, empty node at either end of a quicklist */
+static SpatListNode*
+spat_list_node_new(SpatDB* db, SpatColl* coll, dsa_pointer pack, bool head)
+{
+    dsa_pointer nodeptr = spat_dsa_allocate(db->g_dsa, sizeof(SpatListNode));
+    SpatListNode* node = spat_list_node(db, nodeptr);
+    dsa_pointer* end = head ? &coll->value.list.head : &coll->value.list.tail;
+
+    node->pack = pack;
+    node->count = 0;
+    node->prev = head ? LIST_NIL : *end;
+    node->next = head ? *end : LIST_NIL;
+    SPDB_MEM_ADD(db, SPVAL_LIST, sizeof(SpatListNode));
+
+    if (*end == LIST_NIL)
+        coll->value.list.head = coll->value.list.tail = nodeptr;
+    else
+    {
+        if (head)
+            spat_list_node(db, *end)->prev = nodeptr;
+        else
+            spat_list_node(db, *end)->next = nodeptr;
+        *end = nodeptr;
+    }
+
+    return node;
+}
+
+/* Unlink a node from a quicklist and free it along with its chunk */
+static void
+spat_list_node_free(SpatDB* db, SpatColl* coll, dsa_pointer nodeptr)
+{
+    SpatListNode* node = spat_list_node(db, nodeptr);
+
+    if (node->prev == LIST_NIL)
+        coll->value.list.head = node->next;
+    else
+        spat_list_node(db, node->prev)->next = node->next;
+
+    if (node->next == LIST_NIL)
+        coll->value.list.tail = node->prev;
+    else
+        spat_list_node(db, node->next)->prev = node->prev;
+
+    spat_pack_free(db, SPVAL_LIST, node->pack);
+    dsa_free(db->g_dsa, nodeptr);
+    SPDB_MEM_SUB(db, SPVAL_LIST, sizeof(SpatListNode));
+}
+
+/* A compact list becomes a quicklist of one node, which takes over its pack */
+static void
+spat_list_convert(SpatDB* db, SpatColl* coll)
+{
+    dsa_pointer pack = coll->value.list.head;
+    SpatListNode* node;
+
+    coll->value.list.head = coll->value.list.tail = LIST_NIL;
+    coll->encoding = SPAT_ENC_QUICKLIST;
+
+    node = spat_list_node_new(db, coll, pack, true);
+    node->count = coll->value.list.size;
+}
+
+/* Push to either end of the list at key, converting a compact list that outgrows it */
+static void
+spat_list_push(SpatDB* db, SpatColl* coll, const dss* key, const dss* elem, bool head)
+{
+    const char* str = dss_ptr(db->g_dsa, elem);
+    uint32 len = elem->len - 1;
+    int chunk = Max(db->shared->list_max_compact_entries, 1);
+    SpatListNode* node = NULL;
+    dsa_pointer* pack;
+    SpatPack* p;
+
+    if (coll->encoding == SPAT_ENC_LISTPACK &&
+        !spat_pack_fits(db, coll->value.list.size + 1, len, db->shared->list_max_compact_entries))
+        spat_list_convert(db, coll);
+
+    if (coll->encoding == SPAT_ENC_LISTPACK)
+        pack = &coll->value.list.head;
+    else
+    {
+        dsa_pointer nodeptr = head ? coll->value.list.head : coll->value.list.tail;
+
+        if (nodeptr != LIST_NIL)
+        {
+            node = spat_list_node(db, nodeptr);
+            p = dsa_get_address(db->g_dsa, node->pack);
+
+            /* Full; an oversized element still gets a node of its own */
+            if (node->count >= chunk ||
+                (node->count > 0 && p->used + SPAT_PACK_ITEM_HDRSZ + len > SPAT_LIST_CHUNK_BYTES))
+                node = NULL;
+        }
+
+        if (node == NULL)
+            node = spat_list_node_new(db, coll, spat_pack_new(db, SPVAL_LIST), head);
+
+        pack = &node->pack;
+        node->count++;
+    }
+
+    p = dsa_get_address(db->g_dsa, *pack);
+    *pack = spat_pack_insert(db, SPVAL_LIST, *pack, head ? 0 : p->used, str, len);
+    coll->value.list.size++;
+
+    if (spat_aof_begin(db, key, &coll->lsn, SPAT_AOF_PUSH))
+    {
+        uint8 h = head;
+
+        spat_aof_put(&h, sizeof(h));
+        spat_aof_put_dss(db, elem);
+        spat_aof_end(db);
+    }
+}
+
+/*
+ * Position the iterator at index, which must be within the list. Starts from
+ * the closer end, and skips whole nodes on the way.
+ */
+static void
+spat_list_seek(SpatDB* db, SpatColl* coll, uint32 index, SpatListIter* it)
+{
+    if (coll->encoding == SPAT_ENC_LISTPACK)
+    {
+        it->node = LIST_NIL;
+        it->pack = dsa_get_address(db->g_dsa, coll->value.list.head);
+    }
+    else if (index < coll->value.list.size / 2)
+    {
+        SpatListNode* node;
+
+        it->node = coll->value.list.head;
+        while (index >= (node = spat_list_node(db, it->node))->count)
+        {
+            index -= node->count;
+            it->node = node->next;
+        }
+        it->pack = dsa_get_address(db->g_dsa, node->pack);
+    }
+    else
+    {
+        SpatListNode* node;
+        uint32 after = coll->value.list.size - 1 - index;    /* elements past index */
+
+        it->node = coll->value.list.tail;
+        while (after >= (node = spat_list_node(db, it->node))->count)
+        {
+            after -= node->count;
+            it->node = node->prev;
+        }
+        index = node->count - 1 - after;
+        it->pack = dsa_get_address(db->g_dsa, node->pack);
+    }
+
+    it->item = spat_pack_nth(it->pack, index);
+}
+
+/* The element at the iterator, moving it to the next one; NULL past the end */
+static char*
+spat_list_next(SpatDB* db, SpatListIter* it)
+{
+    char* result;
+
+    while (it->item >= SPAT_PACK_END(it->pack))
+    {
+        if (it->node == LIST_NIL || (it->node = spat_list_node(db, it->node)->next) == LIST_NIL)
+            return NULL;
+
+        it->pack = dsa_get_address(db->g_dsa, spat_list_node(db, it->node)->pack);
+        it->item = SPAT_PACK_ITEMS(it->pack);
+    }
+
+    result = it->item;
+    it->item = spat_pack_item_next(it->item);
+
+    return result;
+}
+
+/* Remove n elements from either end of the list at key, dropping whole nodes at once */
+static void
+spat_list_drop(SpatDB* db, SpatColl* coll, const dss* key, uint32 n, bool head)
+{
+    Assert(n <= coll->value.list.size);
+
+    if (n > 0 && spat_aof_begin(db, key, &coll->lsn, SPAT_AOF_DROP))
+    {
+        uint8 h = head;
+
+        spat_aof_put(&h, sizeof(h));
+        spat_aof_put(&n, sizeof(n));
+        spat_aof_end(db);
+    }
+
+    if (coll->encoding == SPAT_ENC_LISTPACK)
+    {
+        SpatPack* pack = dsa_get_address(db->g_dsa, coll->value.list.head);
+
+        if (n > 0)
+            spat_pack_delete(pack, spat_pack_nth(pack, head ? 0 : coll->value.list.size - n), n);
+        coll->value.list.size -= n;
+        return;
+    }
+
+    coll->value.list.size -= n;
+    while (n > 0)
+    {
+        dsa_pointer nodeptr = head ? coll->value.list.head : coll->value.list.tail;
+        SpatListNode* node = spat_list_node(db, nodeptr);
+
+        if (n >= node->count)
+        {
+            n -= node->count;
+            spat_list_node_free(db, coll, nodeptr);
+        }
+        else
+        {
+            SpatPack* pack = dsa_get_address(db->g_dsa, node->pack);
+
+            spat_pack_delete(pack, spat_pack_nth(pack, head ? 0 : node->count - n), n);
+            node->count -= n;
+            n = 0;
+        }
+    }
+}
+
+/* Make an entry holding no value an empty list; new lists start compact */
+static SpatColl*
+spat_list_init(SpatDB* db, SpatDBEntry* entry)
+{
+    SpatColl* coll = spat_coll_new(db, entry, SPVAL_LIST, SPAT_ENC_LISTPACK);
+
+    coll->value.list.size = 0;
+    coll->value.list.head = spat_pack_new(db, SPVAL_LIST);
+    coll->value.list.tail = LIST_NIL;
+
+    return coll;
+}
+
+/*
+ * The list at key for a push, locked exclusively, creating it compact if
+ * there's none. Errors out if key holds another type.
+ */
+static SpatColl*
+spat_list_for_push(SpatDB* db, dss key)
+{
+    return spat_coll_for_write(db, key, SPVAL_LIST, spat_list_init);
+}
+
+/*
+ * The list at key, locked in mode, or NULL if there's none. Errors out if key
+ * holds another type.
+ */
+static SpatColl*
+spat_list_find(SpatDB* db, dss key, LWLockMode mode)
+{
+    return spat_coll_find(db, key, SPVAL_LIST, mode, true);
+}
+
+/* Redis-style index, negative from the end, as an offset; -1 if out of range */
+static int64
+spat_list_index(SpatColl* coll, int32 index)
+{
+    int64 size = coll->value.list.size;
+    int64 result = index < 0 ? size + index : index;
+
+    return result >= 0 && result < size ? result : -1;
+}
+
+/*
+ * Clamp a Redis-style [start, stop] range to a list or sorted set of the given
+ * size. Returns false if it's empty.
+ */
+static bool
+spat_index_range(int64 size, int32 start, int32 stop, uint32* from, uint32* to)
+{
+    int64 s = start < 0 ? size + start : start;
+    int64 e = stop < 0 ? size + stop : stop;
+
+    s = Max(s, 0);
+    e = Min(e, size - 1);
+
+    if (s > e)
+        return false;
+
+    *from = (uint32) s;
+    *to = (uint32) e;
+    return true;
+}
+
+static Datum
+spat_push_generic(FunctionCallInfo fcinfo, bool head)
+{
+    spat_attach_shmem();
+    spdb_evict_if_needed(g_spat_db);
+
+    dss key = PG_GETARG_DSS(0);
+    dss elem = PG_GETARG_DSS(1);
+
+    SpatColl* coll = spat_list_for_push(g_spat_db, key);
+
+    spat_list_push(g_spat_db, coll, &key, &elem, head);
+
+    spat_coll_unlock(g_spat_db, coll);
+
+    /*
+     * A blocked pop checks the lists under their locks after announcing
+     * itself, so either it sees the element or we see it waiting.
+     */
+    pg_memory_barrier();
+    if (pg_atomic_read_u32(&g_spat_db->shared->list_waiters) > 0)
+        ConditionVariableBroadcast(&g_spat_db->shared->list_cv);
+
+    PG_RETURN_VOID();
+}
+
+/* Pop from either end of the list coll at key, locked exclusively; NULL if it's empty */
+static text*
+spat_list_take(SpatDB* db, SpatColl* coll, const dss* key, bool head)
+{
+    text* result = NULL;
+
+    if (coll->value.list.size > 0)
+    {
+        SpatListIter it;
+
+        spat_list_seek(db, coll, head ? 0 : coll->value.list.size - 1, &it);
+        result = spat_pack_item_text(it.item);
+        spat_list_drop(db, coll, key, 1, head);
+    }
+
+    return result;
+}
+
+/* Pop from either end of the list at key; NULL if it's missing or empty */
+static text*
+spat_list_pop(SpatDB* db, dss key, bool head)
+{
+    text* result = NULL;
+    SpatColl* coll = spat_list_find(db, key, LW_EXCLUSIVE);
+
+    if (coll)
+    {
+        result = spat_list_take(db, coll, &key, head);
+        spat_coll_unlock(db, coll);
+    }
+
+    return result;
+}
+
+static Datum
+spat_pop_generic(FunctionCallInfo fcinfo, bool head)
+{
+    spat_attach_shmem();
+
+    dss key = PG_GETARG_DSS(0);
+    text* result = spat_list_pop(g_spat_db, key, head);
+
+    if (result == NULL)
+        PG_RETURN_NULL();
+
+    PG_RETURN_TEXT_P(result);
+}
+
+SPAT_COMMAND(lpush, SPAT_CMD_LPUSH)
+{
+    return spat_push_generic(fcinfo, true);
+}
+
+SPAT_COMMAND(rpush, SPAT_CMD_RPUSH)
+{
+    return spat_push_generic(fcinfo, false);
+}
+
+SPAT_COMMAND(lpop, SPAT_CMD_LPOP)
+{
+    return spat_pop_generic(fcinfo, true);
+}
+
+SPAT_COMMAND(rpop, SPAT_CMD_RPOP)
+{
+    return spat_pop_generic(fcinfo, false);
+}
+
+/*
+ * Pop from the first non-empty list among keys, or sleep until a push wakes
+ * us up to try again. Without a timeout (or with a zero one) this waits
+ * forever, or until the query is cancelled: the sleep checks for interrupts,
+ * and the cleanup below runs on error too.
+ */
+static Datum
+spat_bpop_generic(FunctionCallInfo fcinfo, bool head)
+{
+    ArrayType* keysarr;
+    Interval* timeout = PG_ARGISNULL(1) ? NULL : PG_GETARG_INTERVAL_P(1);
+    Datum* keys;
+    bool* nulls;
+    int nkeys;
+    TimestampTz deadline = 0;
+    SpatDBShared* shared;
+    text* key = NULL;
+    text* elem = NULL;
+    TupleDesc tupdesc;
+    Datum values[2];
+    bool isnull[2] = {0};
+
+    if (PG_ARGISNULL(0))
+        elog(ERROR, "keys cannot be NULL");
+
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        elog(ERROR, "return type must be a row type");
+
+    keysarr = PG_GETARG_ARRAYTYPE_P(0);
+    deconstruct_array_builtin(keysarr, TEXTOID, &keys, &nulls, &nkeys);
+
+    if (timeout)
+    {
+        TimestampTz now = GetCurrentTimestamp();
+
+        deadline = DatumGetTimestampTz(DirectFunctionCall2(timestamptz_pl_interval,
+                                                           TimestampTzGetDatum(now),
+                                                           PointerGetDatum(timeout)));
+        if (deadline < now)
+            elog(ERROR, "timeout cannot be negative");
+
+        /* A zero timeout waits forever, as in Redis */
+        if (deadline == now)
+            deadline = 0;
+    }
+
+    spat_attach_shmem();
+    shared = g_spat_db->shared;
+
+    pg_atomic_fetch_add_u32(&shared->list_waiters, 1);
+    PG_TRY();
+    {
+        /* Before looking, so that a push right after can't be missed */
+        ConditionVariablePrepareToSleep(&shared->list_cv);
+
+        for (;;)
+        {
+            long timeout_ms = -1;
+
+            for (int i = 0; i < nkeys && elem == NULL; i++)
+            {
+                if (nulls[i])
+                    continue;
+
+                elem = spat_list_pop(g_spat_db, dss_new_local(DatumGetTextPP(keys[i])), head);
+                if (elem)
+                    key = DatumGetTextPP(keys[i]);
+            }
+
+            if (elem)
+                break;
+
+            if (deadline)
+            {
+                TimestampTz now = GetCurrentTimestamp();
+
+                if (now >= deadline)
+                    break;
+                timeout_ms = TimestampDifferenceMilliseconds(now, deadline);
+            }
+
+            (void) ConditionVariableTimedSleep(&shared->list_cv, timeout_ms,
+                                               spat_wait_event(&g_spat_wait_bpop, "SpatBlockingPop"));
+        }
+    }
+    PG_FINALLY();
+    {
+        ConditionVariableCancelSleep();
+        pg_atomic_fetch_sub_u32(&shared->list_waiters, 1);
+    }
+    PG_END_TRY();
+
+    if (elem == NULL)
+        PG_RETURN_NULL();
+
+    values[0] = PointerGetDatum(key);
+    values[1] = PointerGetDatum(elem);
+
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, isnull)));
+}
+
+SPAT_COMMAND(blpop, SPAT_CMD_BLPOP)
+{
+    return spat_bpop_generic(fcinfo, true);
+}
+
+SPAT_COMMAND(brpop, SPAT_CMD_BRPOP)
+{
+    return spat_bpop_generic(fcinfo, false);
+}
+
+SPAT_COMMAND(llen, SPAT_CMD_LLEN)
+{
+    spat_attach_shmem();
+
+    /* Retrieve the key argument */
+    dss key = PG_GETARG_DSS(0);
+
+    uint32 result;
+
+    SpatColl* coll = spat_coll_find(g_spat_db, key, SPVAL_LIST, LW_SHARED, false);
+
+    if (coll == NULL)
+        PG_RETURN_NULL();
+
+    result = coll->value.list.size;
+    spat_coll_unlock(g_spat_db, coll);
+
+    PG_RETURN_INT32(result);
+}
+
+/* The element at index, negative counting from the end, or NULL */
+SPAT_COMMAND(lindex, SPAT_CMD_LINDEX)
+{
+    spat_attach_shmem();
+
+    dss key = PG_GETARG_DSS(0);
+    int32 index = PG_GETARG_INT32(1);
+    text* result = NULL;
+    SpatColl* coll = spat_list_find(g_spat_db, key, LW_SHARED);
+
+    if (coll)
+    {
+        int64 offset = spat_list_index(coll, index);
+
+        if (offset >= 0)
+        {
+            SpatListIter it;
+
+            spat_list_seek(g_spat_db, coll, (uint32) offset, &it);
+            result = spat_pack_item_text(it.item);
+        }
+        spat_coll_unlock(g_spat_db, coll);
+    }
+
+    if (result == NULL)
+        PG_RETURN_NULL();
+
+    PG_RETURN_TEXT_P(result);
+}
+
+/* The elements from start to stop, both inclusive and negative counting from the end */
+SPAT_COMMAND(lrange, SPAT_CMD_LRANGE)
+{
+    spat_attach_shmem();
+
+    dss key = PG_GETARG_DSS(0);
+    int32 start = PG_GETARG_INT32(1);
+    int32 stop = PG_GETARG_INT32(2);
+    Datum* elems = NULL;
+    int n = 0;
+    SpatColl* coll = spat_list_find(g_spat_db, key, LW_SHARED);
+
+    if (coll)
+    {
+        uint32 from, to;
+
+        if (spat_index_range(coll->value.list.size, start, stop, &from, &to))
+        {
+            SpatListIter it;
+
+            elems = palloc(sizeof(Datum) * (to - from + 1));
+            spat_list_seek(g_spat_db, coll, from, &it);
+            while (n < to - from + 1)
+                elems[n++] = PointerGetDatum(spat_pack_item_text(spat_list_next(g_spat_db, &it)));
+        }
+        spat_coll_unlock(g_spat_db, coll);
+    }
+
+    if (n == 0)
+        PG_RETURN_ARRAYTYPE_P(construct_empty_array(TEXTOID));
+
+    PG_RETURN_ARRAYTYPE_P(construct_array_builtin(elems, n, TEXTOID));
+}
+
+/* Keep only the elements from start to stop, like lrange; the rest are dropped */
+SPAT_COMMAND(ltrim, SPAT_CMD_LTRIM)
+{
+    spat_attach_shmem();
+
+    dss key = PG_GETARG_DSS(0);
+    int32 start = PG_GETARG_INT32(1);
+    int32 stop = PG_GETARG_INT32(2);
+    SpatColl* coll = spat_list_find(g_spat_db, key, LW_EXCLUSIVE);
+
+    if (coll)
+    {
+        uint32 from, to;
+
+        if (spat_index_range(coll->value.list.size, start, stop, &from, &to))
+        {
+            spat_list_drop(g_spat_db, coll, &key, coll->value.list.size - 1 - to, false);
+            spat_list_drop(g_spat_db, coll, &key, from, true);
+        }
+        else
+            spat_list_drop(g_spat_db, coll, &key, coll->value.list.size, true);
+
+        spat_coll_unlock(g_spat_db, coll);
+    }
+
+    PG_RETURN_VOID();
+}
+
+/*
+ * ---------------------------------------- HASHES
+ * ----------------------------------------
+ */
+
+typedef struct sphash_entry
+{
+    dss field;
+    dss value;
+} sphash_entry;
+
+static const dshash_parameters sphash_params = {
+    .key_size = sizeof(dss),
+    .entry_size = sizeof(sphash_entry),
+    .compare_function = dss_cmp,
+    .hash_function = dss_hash,
+    .copy_function = dss_copy
+};
+
+/* Set a field of a compact hash; false if the hash has to be converted first */
+static bool
+spat_hash_pack_set(SpatDB* db, SpatColl* coll, const dss* field, const dss* value)
+{
+    SpatPack* pack = dsa_get_address(db->g_dsa, coll->value.hash.hndl);
+    const char* fstr = dss_ptr(db->g_dsa, field);
+    const char* vstr = dss_ptr(db->g_dsa, value);
+    uint32 flen = field->len - 1;
+    uint32 vlen = value->len - 1;
+    char* item = spat_pack_find(pack, fstr, flen, 2);
+
+    if (!spat_pack_fits(db, coll->value.hash.size + (item ? 0 : 1), Max(flen, vlen),
+                        db->shared->hash_max_compact_entries))
+        return false;
+
+    if (item)
+    {
+        /* Replace the value, which follows its field */
+        char* old = spat_pack_item_next(item);
+        uint32 off = old - SPAT_PACK_ITEMS(pack);
+
+        spat_pack_delete(pack, old, 1);
+        coll->value.hash.hndl = spat_pack_insert(db, SPVAL_HASH, coll->value.hash.hndl, off, vstr, vlen);
+    }
+    else
+    {
+        coll->value.hash.hndl = spat_pack_insert(db, SPVAL_HASH, coll->value.hash.hndl, pack->used, fstr, flen);
+        pack = dsa_get_address(db->g_dsa, coll->value.hash.hndl);
+        coll->value.hash.hndl = spat_pack_insert(db, SPVAL_HASH, coll->value.hash.hndl, pack->used, vstr, vlen);
+        coll->value.hash.size++;
+    }
+
+    return true;
+}
+
+/* Move the fields of a compact hash to a dshash_table */
+static void
+spat_hash_convert(SpatDB* db, SpatColl* coll)
+{
+    dsa_pointer packptr = coll->value.hash.hndl;
+    SpatPack* pack = dsa_get_address(db->g_dsa, packptr);
+    dshash_table* htab = spat_dshash_create(db->g_dsa, &sphash_params, db->shared->lck.tranche);
+    char* item = SPAT_PACK_ITEMS(pack);
+
+    while (item < SPAT_PACK_END(pack))
+    {
+        dss field = spat_pack_item_dss(item);
+        char* valitem = spat_pack_item_next(item);
+        dss value = spat_pack_item_dss(valitem);
+        bool found;
+        sphash_entry* sphsntry = dshash_find_or_insert(htab, &field, &found);
+
+        dss_cpy_arg(&sphsntry->value, &value, sizeof(dss), db->g_dsa);
+        SPDB_MEM_ADD(db, SPVAL_HASH, sizeof(sphash_entry) + sphsntry->field.len + sphsntry->value.len);
+        dshash_release_lock(htab, sphsntry);
+
+        item = spat_pack_item_next(valitem);
+    }
+
+    coll->value.hash.hndl = dshash_get_hash_table_handle(htab);
+    coll->encoding = SPAT_ENC_HASHTABLE;
+    dshash_detach(htab);
+
+    spat_pack_free(db, SPVAL_HASH, packptr);
+}
+
+/* Make an entry holding no value an empty hash; new hashes start compact */
+static SpatColl*
+spat_hash_init(SpatDB* db, SpatDBEntry* entry)
+{
+    SpatColl* coll = spat_coll_new(db, entry, SPVAL_HASH, SPAT_ENC_LISTPACK);
+
+    coll->value.hash.hndl = spat_pack_new(db, SPVAL_HASH);
+    coll->value.hash.size = 0;
+
+    return coll;
+}
+
+/* The hash at key, locked exclusively, inserted empty if it didn't exist */
+static SpatColl*
+spat_hash_for_write(SpatDB* db, dss key)
+{
+    return spat_coll_for_write(db, key, SPVAL_HASH, spat_hash_init);
+}
+
+/* Set field to value in the hash at key, converting it if it outgrows its encoding */
+static void
+spat_hash_set(SpatDB* db, SpatColl* coll, const dss* key, const dss* field, const dss* value_arg)
+{
+    if (coll->encoding == SPAT_ENC_LISTPACK &&
+        !spat_hash_pack_set(db, coll, field, value_arg))
+        spat_hash_convert(db, coll);
+
+    if (coll->encoding == SPAT_ENC_HASHTABLE)
+    {
+        dshash_table* htab = dshash_attach(db->g_dsa, &sphash_params, coll->value.hash.hndl, NULL);
+        dss value;
+
+        dss_cpy_arg(&value, value_arg, sizeof(dss), db->g_dsa);
+
+        bool sphsntry_found;
+        sphash_entry* sphsntry = dshash_find_or_insert(htab, field, &sphsntry_found);
+
+        SPDB_MEM_ADD(db, SPVAL_HASH, value.len);
+
+        if (!sphsntry_found)
+        {
+            /* field has already been copied to the DSA by dss_copy */
+            sphsntry->value = value;
+            coll->value.hash.size++;
+            SPDB_MEM_ADD(db, SPVAL_HASH, sizeof(sphash_entry) + sphsntry->field.len);
+        }
+        else
+        {
+            /* Overwriting a field frees its previous value */
+            SPDB_MEM_SUB(db, SPVAL_HASH, sphsntry->value.len);
+            dss_free(db->g_dsa, &sphsntry->value);
+            sphsntry->value = value;
+        }
+
+        dshash_release_lock(htab, sphsntry);
+        dshash_detach(htab);
+    }
+
+    if (spat_aof_begin(db, key, &coll->lsn, SPAT_AOF_HSET))
+    {
+        spat_aof_put_dss(db, field);
+        spat_aof_put_dss(db, value_arg);
+        spat_aof_end(db);
+    }
+}
+
+/* A copy of the value of field in the hash coll, NULL if there's none */
+static text*
+spat_hash_get(SpatDB* db, SpatColl* coll, const dss* field)
+{
+    text* result = NULL;
+
+    if (coll->encoding == SPAT_ENC_LISTPACK)
+    {
+        SpatPack* pack = dsa_get_address(db->g_dsa, coll->value.hash.hndl);
+        char* item = spat_pack_find(pack, dss_ptr(db->g_dsa, field), field->len - 1, 2);
+
+        if (item)
+            result = spat_pack_item_text(spat_pack_item_next(item));
+    }
+    else
+    {
+        dshash_table* htab = dshash_attach(db->g_dsa, &sphash_params,
+                                           coll->value.hash.hndl, NULL);
+
+        sphash_entry* sphsntry = dshash_find(htab, field, false);
+        if (sphsntry != NULL)
+        {
+            result = dss_to_text(db->g_dsa, sphsntry->value);
+            dshash_release_lock(htab, sphsntry);
+        }
+
+        dshash_detach(htab);
+    }
+
+    return result;
+}
+
+SPAT_COMMAND(hset, SPAT_CMD_HSET)
+{
+    spat_attach_shmem();
+    spdb_evict_if_needed(g_spat_db);
+
+    dss key = PG_GETARG_DSS(0);
+    dss field = PG_GETARG_DSS(1);
+    dss value_arg = PG_GETARG_DSS(2);
+
+    SpatColl* coll = spat_hash_for_write(g_spat_db, key);
+
+    spat_hash_set(g_spat_db, coll, &key, &field, &value_arg);
+
+    spat_coll_unlock(g_spat_db, coll);
+
+    PG_RETURN_VOID();
+}
+
+SPAT_COMMAND(hget, SPAT_CMD_HGET)
+{
+    spat_attach_shmem();
+
+    dss key = PG_GETARG_DSS(0);
+    dss field = PG_GETARG_DSS(1);
+
+    text* result = NULL;
+
+    SpatColl* coll = spat_coll_find(g_spat_db, key, SPVAL_HASH, LW_SHARED, false);
+
+    if (coll)
+    {
+        result = spat_hash_get(g_spat_db, coll, &field);
+        spat_coll_unlock(g_spat_db, coll);
+    }
+
+    if (result)
+        PG_RETURN_TEXT_P(result);
+
+    PG_RETURN_NULL();
+}
+
+/*
+ * Add increment to the integer at field of the hash coll at key, locked
+ * exclusively, 0 if it's missing. Unlike strings, fields stay text: the new
+ * value is written back in decimal. Errors out with coll still locked, for
+ * the abort to release.
+ */
+static int64
+spat_hash_incrby(SpatDB* db, SpatColl* coll, const dss* key, const dss* field, int64 increment)
+{
+    int64 value = 0;
+    text* oldval = spat_hash_get(db, coll, field);
+    text* newval;
+    dss newval_dss;
+
+    if (oldval && !spat_parse_int64(VARDATA_ANY(oldval), VARSIZE_ANY_EXHDR(oldval), &value))
+        elog(ERROR, "hash value is not an integer");
+
+    if (pg_add_s64_overflow(value, increment, &value))
+        elog(ERROR, "increment or decrement would overflow");
+
+    newval = cstring_to_text(psprintf(INT64_FORMAT, value));
+    newval_dss = dss_new_local(newval);
+    spat_hash_set(db, coll, key, field, &newval_dss);
+
+    return value;
+}
+
+/* Add increment to the integer at field, 0 if it's missing, see spat_hash_incrby */
+SPAT_COMMAND(hincrby, SPAT_CMD_HINCRBY)
+{
+    spat_attach_shmem();
+    spdb_evict_if_needed(g_spat_db);
+
+    dss key = PG_GETARG_DSS(0);
+    dss field = PG_GETARG_DSS(1);
+    int64 increment = PG_GETARG_INT64(2);
+    int64 value;
+
+    SpatColl* coll = spat_hash_for_write(g_spat_db, key);
+
+    value = spat_hash_incrby(g_spat_db, coll, &key, &field, increment);
+    spat_coll_unlock(g_spat_db, coll);
+
+    PG_RETURN_INT64(value);
+}
+
+/*
+ * ---------------------------------------- SORTED SETS
+ * ----------------------------------------
+ *
+ * As in Redis, a sorted set is a skiplist ordered by (score, member) plus a
+ * member -> score dshash, so that ZSCORE is a single probe and ZADD and ZREM
+ * know where to look in the skiplist. Each forward link also carries its
+ * span, the number of nodes it skips at level 0, so ranks are summed along
+ * the search path: ZRANK, ZRANGE and the *BYSCORE commands are all O(log n),
+ * plus the size of the range.
+ *
+ * The skiplist nodes don't own their member: they share the string the
+ * dshash copied in, which is freed along with the dshash entry.
+ */
+
+#define SPAT_ZSKIPLIST_MAXLEVEL 32
+#define SPAT_ZSKIPLIST_P 0.25
+
+typedef struct SpatZLevel
+{
+    dsa_pointer forward;
+    uint32 span;
+} SpatZLevel;
+
+typedef struct SpatZNode
+{
+    double score;
+    dss member;
+    dsa_pointer backward;       /* InvalidDsaPointer for the first node */
+    int level;
+    SpatZLevel levels[FLEXIBLE_ARRAY_MEMBER];
+} SpatZNode;
+
+typedef struct SpatZSkiplist
+{
+    dsa_pointer header;         /* a SPAT_ZSKIPLIST_MAXLEVEL node without a member */
+    dsa_pointer tail;
+    int level;
+} SpatZSkiplist;
+
+typedef struct spzset_entry
+{
+    dss member;
+    double score;
+} spzset_entry;
+
+static const dshash_parameters spzset_params = {
+    .key_size = sizeof(dss),
+    .entry_size = sizeof(spzset_entry),
+    .compare_function = dss_cmp,
+    .hash_function = dss_hash,
+    .copy_function = dss_copy
+};
+
+#define SPAT_ZNODE(db, ptr) ((SpatZNode*)dsa_get_address((db)->g_dsa, (ptr)))
+#define SPAT_ZNODE_SIZE(level) (offsetof(SpatZNode, levels) + (level) * sizeof(SpatZLevel))
+
+static SpatZSkiplist*
+spat_zsl(SpatDB* db, SpatColl* coll)
+{
+    return dsa_get_address(db->g_dsa, coll->value.zset.zsl);
+}
+
+/* Members with equal scores are ordered bytewise */
+static int
+spat_zmember_cmp(SpatDB* db, const dss* a, const dss* b)
+{
+    uint32 la = a->len - 1;
+    uint32 lb = b->len - 1;
+    int cmp = memcmp(dss_ptr(db->g_dsa, a), dss_ptr(db->g_dsa, b), Min(la, lb));
+
+    if (cmp != 0)
+        return cmp;
+
+    return la < lb ? -1 : (la > lb ? 1 : 0);
+}
+
+static int
+spat_znode_cmp(SpatDB* db, const SpatZNode* node, double score, const dss* member)
+{
+    if (node->score != score)
+        return node->score < score ? -1 : 1;
+
+    return spat_zmember_cmp(db, &node->member, member);
+}
+
+static int
+spat_zrandom_level(void)
+{
+    int level = 1;
+
+    while (level < SPAT_ZSKIPLIST_MAXLEVEL && pg_prng_double(&pg_global_prng_state) < SPAT_ZSKIPLIST_P)
+        level++;
+
+    return level;
+}
+
+static dsa_pointer
+spat_znode_new(SpatDB* db, int level, double score, dss member)
+{
+    dsa_pointer nodeptr = spat_dsa_allocate0(db->g_dsa, SPAT_ZNODE_SIZE(level));
+    SpatZNode* node = SPAT_ZNODE(db, nodeptr);
+
+    node->score = score;
+    node->member = member;
+    node->backward = InvalidDsaPointer;
+    node->level = level;
+    for (int i = 0; i < level; i++)
+        node->levels[i].forward = InvalidDsaPointer;
+
+    SPDB_MEM_ADD(db, SPVAL_ZSET, SPAT_ZNODE_SIZE(level));
+
+    return nodeptr;
+}
+
+static void
+spat_znode_free(SpatDB* db, dsa_pointer nodeptr)
+{
+    SPDB_MEM_SUB(db, SPVAL_ZSET, SPAT_ZNODE_SIZE(SPAT_ZNODE(db, nodeptr)->level));
+    dsa_free(db->g_dsa, nodeptr);
+}
+
+/* Make an entry holding no value an empty sorted set */
+static SpatColl*
+spat_zset_init(SpatDB* db, SpatDBEntry* entry)
+{
+    SpatColl* coll;
+    dsa_pointer zslptr = spat_dsa_allocate(db->g_dsa, sizeof(SpatZSkiplist));
+    SpatZSkiplist* zsl = dsa_get_address(db->g_dsa, zslptr);
+    dshash_table* dict = spat_dshash_create(db->g_dsa, &spzset_params, db->shared->lck.tranche);
+    dss none = {0};
+
+    zsl->header = spat_znode_new(db, SPAT_ZSKIPLIST_MAXLEVEL, 0, none);
+    zsl->tail = InvalidDsaPointer;
+    zsl->level = 1;
+    SPDB_MEM_ADD(db, SPVAL_ZSET, sizeof(SpatZSkiplist));
+
+    coll = spat_coll_new(db, entry, SPVAL_ZSET, SPAT_ENC_SKIPLIST);
+    coll->value.zset.zsl = zslptr;
+    coll->value.zset.dict = dshash_get_hash_table_handle(dict);
+    coll->value.zset.size = 0;
+
+    dshash_detach(dict);
+
+    return coll;
+}
+
+/*
+ * The last node before (score, member) at each level, in update, and the
+ * rank of each of them, in rank if given.
+ */
+static void
+spat_zsl_search(SpatDB* db, SpatZSkiplist* zsl, double score, const dss* member,
+                dsa_pointer* update, uint32* rank)
+{
+    dsa_pointer xptr = zsl->header;
+    SpatZNode* x = SPAT_ZNODE(db, xptr);
+    uint32 traversed = 0;
+
+    for (int i = zsl->level - 1; i >= 0; i--)
+    {
+        while (x->levels[i].forward != InvalidDsaPointer)
+        {
+            SpatZNode* next = SPAT_ZNODE(db, x->levels[i].forward);
+
+            if (spat_znode_cmp(db, next, score, member) >= 0)
+                break;
+
+            traversed += x->levels[i].span;
+            xptr = x->levels[i].forward;
+            x = next;
+        }
+
+        update[i] = xptr;
+        if (rank)
+            rank[i] = traversed;
+    }
+}
+
+/* Link a new node for member, which must not be in the skiplist already */
+static void
+spat_zsl_insert(SpatDB* db, SpatColl* coll, double score, dss member)
+{
+    SpatZSkiplist* zsl = spat_zsl(db, coll);
+    dsa_pointer update[SPAT_ZSKIPLIST_MAXLEVEL];
+    uint32 rank[SPAT_ZSKIPLIST_MAXLEVEL];
+    int level = spat_zrandom_level();
+    dsa_pointer nodeptr;
+    SpatZNode* node;
+
+    spat_zsl_search(db, zsl, score, &member, update, rank);
+
+    if (level > zsl->level)
+    {
+        SpatZNode* header = SPAT_ZNODE(db, zsl->header);
+
+        for (int i = zsl->level; i < level; i++)
+        {
+            rank[i] = 0;
+            update[i] = zsl->header;
+            header->levels[i].span = coll->value.zset.size;
+        }
+        zsl->level = level;
+    }
+
+    nodeptr = spat_znode_new(db, level, score, member);
+    node = SPAT_ZNODE(db, nodeptr);
+
+    for (int i = 0; i < level; i++)
+    {
+        SpatZNode* prev = SPAT_ZNODE(db, update[i]);
+
+        node->levels[i].forward = prev->levels[i].forward;
+        prev->levels[i].forward = nodeptr;
+
+        node->levels[i].span = prev->levels[i].span - (rank[0] - rank[i]);
+        prev->levels[i].span = (rank[0] - rank[i]) + 1;
+    }
+
+    /* Links above the new node now skip one more */
+    for (int i = level; i < zsl->level; i++)
+        SPAT_ZNODE(db, update[i])->levels[i].span++;
+
+    node->backward = update[0] == zsl->header ? InvalidDsaPointer : update[0];
+    if (node->levels[0].forward != InvalidDsaPointer)
+        SPAT_ZNODE(db, node->levels[0].forward)->backward = nodeptr;
+    else
+        zsl->tail = nodeptr;
+
+    coll->value.zset.size++;
+}
+
+/* Unlink and free the node at nodeptr, given its predecessors at each level */
+static void
+spat_zsl_unlink(SpatDB* db, SpatColl* coll, SpatZSkiplist* zsl, dsa_pointer nodeptr,
+                dsa_pointer* update)
+{
+    SpatZNode* node = SPAT_ZNODE(db, nodeptr);
+    SpatZNode* header = SPAT_ZNODE(db, zsl->header);
+
+    for (int i = 0; i < zsl->level; i++)
+    {
+        SpatZNode* prev = SPAT_ZNODE(db, update[i]);
+
+        if (prev->levels[i].forward == nodeptr)
+        {
+            prev->levels[i].span += node->levels[i].span - 1;
+            prev->levels[i].forward = node->levels[i].forward;
+        }
+        else
+            prev->levels[i].span--;
+    }
+
+    if (node->levels[0].forward != InvalidDsaPointer)
+        SPAT_ZNODE(db, node->levels[0].forward)->backward = node->backward;
+    else
+        zsl->tail = node->backward;
+
+    while (zsl->level > 1 && header->levels[zsl->level - 1].forward == InvalidDsaPointer)
+        zsl->level--;
+
+    spat_znode_free(db, nodeptr);
+    coll->value.zset.size--;
+}
+
+static void
+spat_zsl_delete(SpatDB* db, SpatColl* coll, double score, const dss* member)
+{
+    SpatZSkiplist* zsl = spat_zsl(db, coll);
+    dsa_pointer update[SPAT_ZSKIPLIST_MAXLEVEL];
+    dsa_pointer nodeptr;
+
+    spat_zsl_search(db, zsl, score, member, update, NULL);
+
+    nodeptr = SPAT_ZNODE(db, update[0])->levels[0].forward;
+    Assert(nodeptr != InvalidDsaPointer && spat_znode_cmp(db, SPAT_ZNODE(db, nodeptr), score, member) == 0);
+
+    spat_zsl_unlink(db, coll, zsl, nodeptr, update);
+}
+
+/* The 1-based rank of (score, member), which must be in the skiplist */
+static uint32
+spat_zsl_rank(SpatDB* db, SpatZSkiplist* zsl, double score, const dss* member)
+{
+    dsa_pointer update[SPAT_ZSKIPLIST_MAXLEVEL];
+    uint32 rank[SPAT_ZSKIPLIST_MAXLEVEL];
+
+    spat_zsl_search(db, zsl, score, member, update, rank);
+
+    return rank[0] + 1;
+}
+
+/* The node at the given 1-based rank, or InvalidDsaPointer */
+static dsa_pointer
+spat_zsl_by_rank(SpatDB* db, SpatZSkiplist* zsl, uint32 rank)
+{
+    dsa_pointer xptr = zsl->header;
+    SpatZNode* x = SPAT_ZNODE(db, xptr);
+    uint32 traversed = 0;
+
+    for (int i = zsl->level - 1; i >= 0; i--)
+    {
+        while (x->levels[i].forward != InvalidDsaPointer && traversed + x->levels[i].span <= rank)
+        {
+            traversed += x->levels[i].span;
+            xptr = x->levels[i].forward;
+            x = SPAT_ZNODE(db, xptr);
+        }
+
+        if (traversed == rank)
+            return xptr;
+    }
+
+    return InvalidDsaPointer;
+}
+
+/*
+ * The last node scoring below min at each level, in update. Returns the
+ * first node scoring within [min, max], or InvalidDsaPointer.
+ */
+static dsa_pointer
+spat_zsl_first_in_range(SpatDB* db, SpatZSkiplist* zsl, double min, double max, dsa_pointer* update)
+{
+    dsa_pointer xptr = zsl->header;
+    SpatZNode* x = SPAT_ZNODE(db, xptr);
+
+    for (int i = zsl->level - 1; i >= 0; i--)
+    {
+        while (x->levels[i].forward != InvalidDsaPointer &&
+               SPAT_ZNODE(db, x->levels[i].forward)->score < min)
+        {
+            xptr = x->levels[i].forward;
+            x = SPAT_ZNODE(db, xptr);
+        }
+
+        update[i] = xptr;
+    }
+
+    xptr = x->levels[0].forward;
+    if (xptr == InvalidDsaPointer || SPAT_ZNODE(db, xptr)->score > max)
+        return InvalidDsaPointer;
+
+    return xptr;
+}
+
+/* Free every node and member, leaving the sorted set without any */
+static void
+spat_zset_free(SpatDB* db, SpatColl* coll)
+{
+    SpatZSkiplist* zsl = spat_zsl(db, coll);
+    dsa_pointer nodeptr = SPAT_ZNODE(db, zsl->header)->levels[0].forward;
+    dshash_table* dict;
+    dshash_seq_status status;
+    spzset_entry* ze;
+
+    while (nodeptr != InvalidDsaPointer)
+    {
+        dsa_pointer next = SPAT_ZNODE(db, nodeptr)->levels[0].forward;
+
+        spat_znode_free(db, nodeptr);
+        nodeptr = next;
+    }
+    spat_znode_free(db, zsl->header);
+
+    dict = dshash_attach(db->g_dsa, &spzset_params, coll->value.zset.dict, NULL);
+    dshash_seq_init(&status, dict, true);
+    while ((ze = dshash_seq_next(&status)) != NULL)
+    {
+        SPDB_MEM_SUB(db, SPVAL_ZSET, sizeof(spzset_entry) + ze->member.len);
+        dss_free(db->g_dsa, &ze->member);
+        dshash_delete_current(&status);
+    }
+    dshash_seq_term(&status);
+    dshash_destroy(dict);
+
+    dsa_free(db->g_dsa, coll->value.zset.zsl);
+    SPDB_MEM_SUB(db, SPVAL_ZSET, sizeof(SpatZSkiplist));
+
+    coll->value.zset.zsl = InvalidDsaPointer;
+    coll->value.zset.dict = DSHASH_HANDLE_INVALID;
+    coll->value.zset.size = 0;
+}
+
+/* Like spat_list_find, for sorted sets */
+static SpatColl*
+spat_zset_find(SpatDB* db, dss key, LWLockMode mode)
+{
+    return spat_coll_find(db, key, SPVAL_ZSET, mode, true);
+}
+
+/* The score of member, looked up in the dict; false if it's not in the set */
+static bool
+spat_zset_score(SpatDB* db, SpatColl* coll, const dss* member, double* score)
+{
+    dshash_table* dict = dshash_attach(db->g_dsa, &spzset_params, coll->value.zset.dict, NULL);
+    spzset_entry* ze = dshash_find(dict, member, false);
+
+    if (ze)
+    {
+        *score = ze->score;
+        dshash_release_lock(dict, ze);
+    }
+    dshash_detach(dict);
+
+    return ze != NULL;
+}
+
+static void
+spat_zrange_bounds_check(double min, double max)
+{
+    if (isnan(min) || isnan(max))
+        elog(ERROR, "min or max is not a number");
+}
+
+/* Emit (member, score) rows from nodeptr on, visiting at most n nodes or up to max */
+static void
+spat_zrange_emit(FunctionCallInfo fcinfo, SpatDB* db, dsa_pointer nodeptr, uint32 n, double max)
+{
+    ReturnSetInfo* rsinfo = (ReturnSetInfo*)fcinfo->resultinfo;
+
+    while (nodeptr != InvalidDsaPointer && n-- > 0)
+    {
+        SpatZNode* node = SPAT_ZNODE(db, nodeptr);
+        Datum values[2];
+        bool nulls[2] = {0};
+
+        if (node->score > max)
+            break;
+
+        values[0] = PointerGetDatum(dss_to_text(db->g_dsa, node->member));
+        values[1] = Float8GetDatum(node->score);
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+
+        nodeptr = node->levels[0].forward;
+    }
+}
+
+/* Add member with score to the sorted set at key, or update its score. True if it's new */
+static bool
+spat_zset_add(SpatDB* db, SpatColl* coll, const dss* key, double score, const dss* member)
+{
+    dshash_table* dict = dshash_attach(db->g_dsa, &spzset_params, coll->value.zset.dict, NULL);
+    bool found;
+    spzset_entry* ze = dshash_find_or_insert(dict, member, &found);
+
+    if (!found)
+    {
+        ze->score = score;
+        SPDB_MEM_ADD(db, SPVAL_ZSET, sizeof(spzset_entry) + ze->member.len);
+        spat_zsl_insert(db, coll, score, ze->member);
+    }
+    else if (ze->score != score)
+    {
+        /* Move it: unlink at the old score, relink at the new one */
+        spat_zsl_delete(db, coll, ze->score, &ze->member);
+        ze->score = score;
+        spat_zsl_insert(db, coll, score, ze->member);
+    }
+
+    dshash_release_lock(dict, ze);
+    dshash_detach(dict);
+
+    if (spat_aof_begin(db, key, &coll->lsn, SPAT_AOF_ZADD))
+    {
+        spat_aof_put(&score, sizeof(score));
+        spat_aof_put_dss(db, member);
+        spat_aof_end(db);
+    }
+
+    return !found;
+}
+
+/* Remove member from the sorted set at key. True if it was there */
+static bool
+spat_zset_remove(SpatDB* db, SpatColl* coll, const dss* key, const dss* member)
+{
+    dshash_table* dict = dshash_attach(db->g_dsa, &spzset_params, coll->value.zset.dict, NULL);
+    spzset_entry* ze = dshash_find(dict, member, true);
+    bool deleted = ze != NULL;
+
+    if (deleted)
+    {
+        spat_zsl_delete(db, coll, ze->score, &ze->member);
+        SPDB_MEM_SUB(db, SPVAL_ZSET, sizeof(spzset_entry) + ze->member.len);
+        dss_free(db->g_dsa, &ze->member);
+        dshash_delete_entry(dict, ze);
+    }
+    dshash_detach(dict);
+
+    if (deleted && spat_aof_begin(db, key, &coll->lsn, SPAT_AOF_ZREM))
+    {
+        spat_aof_put_dss(db, member);
+        spat_aof_end(db);
+    }
+
+    return deleted;
+}
+
+/* Remove the members of the sorted set at key scoring within [min, max]. Returns how many */
+static int32
+spat_zset_remove_range(SpatDB* db, SpatColl* coll, const dss* key, double min, double max)
+{
+    SpatZSkiplist* zsl = spat_zsl(db, coll);
+    dsa_pointer update[SPAT_ZSKIPLIST_MAXLEVEL];
+    dsa_pointer nodeptr = spat_zsl_first_in_range(db, zsl, min, max, update);
+    dshash_table* dict = dshash_attach(db->g_dsa, &spzset_params, coll->value.zset.dict, NULL);
+    int32 result = 0;
+
+    /* update stays the predecessors of each next node, as they're unlinked in order */
+    while (nodeptr != InvalidDsaPointer && SPAT_ZNODE(db, nodeptr)->score <= max)
+    {
+        SpatZNode* node = SPAT_ZNODE(db, nodeptr);
+        dsa_pointer next = node->levels[0].forward;
+        spzset_entry* ze = dshash_find(dict, &node->member, true);
+
+        Assert(ze != NULL);
+        spat_zsl_unlink(db, coll, zsl, nodeptr, update);
+
+        SPDB_MEM_SUB(db, SPVAL_ZSET, sizeof(spzset_entry) + ze->member.len);
+        dss_free(db->g_dsa, &ze->member);
+        dshash_delete_entry(dict, ze);
+
+        nodeptr = next;
+        result++;
+    }
+    dshash_detach(dict);
+
+    if (result > 0 && spat_aof_begin(db, key, &coll->lsn, SPAT_AOF_ZREMRANGE))
+    {
+        spat_aof_put(&min, sizeof(min));
+        spat_aof_put(&max, sizeof(max));
+        spat_aof_end(db);
+    }
+
+    return result;
+}
+
+/* Add member with score, or update its score. Returns 1 if member is new */
+SPAT_COMMAND(zadd, SPAT_CMD_ZADD)
+{
+    spat_attach_shmem();
+    spdb_evict_if_needed(g_spat_db);
+
+    dss key = PG_GETARG_DSS(0);
+    double score = PG_GETARG_FLOAT8(1);
+    dss member = PG_GETARG_DSS(2);
+    bool added;
+
+    if (isnan(score))
+        elog(ERROR, "score is not a number");
+
+    SpatColl* coll = spat_coll_for_write(g_spat_db, key, SPVAL_ZSET, spat_zset_init);
+
+    added = spat_zset_add(g_spat_db, coll, &key, score, &member);
+    spat_coll_unlock(g_spat_db, coll);
+
+    PG_RETURN_INT32(added ? 1 : 0);
+}
+
+SPAT_COMMAND(zrem, SPAT_CMD_ZREM)
+{
+    spat_attach_shmem();
+
+    dss key = PG_GETARG_DSS(0);
+    dss member = PG_GETARG_DSS(1);
+    int32 result = 0;
+    SpatColl* coll = spat_zset_find(g_spat_db, key, LW_EXCLUSIVE);
+
+    if (coll)
+    {
+        result = spat_zset_remove(g_spat_db, coll, &key, &member) ? 1 : 0;
+        spat_coll_unlock(g_spat_db, coll);
+    }
+
+    PG_RETURN_INT32(result);
+}
+
+SPAT_COMMAND(zscore, SPAT_CMD_ZSCORE)
+{
+    spat_attach_shmem();
+
+    dss key = PG_GETARG_DSS(0);
+    dss member = PG_GETARG_DSS(1);
+    double score;
+    bool found = false;
+    SpatColl* coll = spat_zset_find(g_spat_db, key, LW_SHARED);
+
+    if (coll)
+    {
+        found = spat_zset_score(g_spat_db, coll, &member, &score);
+        spat_coll_unlock(g_spat_db, coll);
+    }
+
+    if (!found)
+        PG_RETURN_NULL();
+
+    PG_RETURN_FLOAT8(score);
+}
+
+/* The 0-based position of member, by ascending score; NULL if it's not in the set */
+SPAT_COMMAND(zrank, SPAT_CMD_ZRANK)
+{
+    spat_attach_shmem();
+
+    dss key = PG_GETARG_DSS(0);
+    dss member = PG_GETARG_DSS(1);
+    double score;
+    int32 result = -1;
+    SpatColl* coll = spat_zset_find(g_spat_db, key, LW_SHARED);
+
+    if (coll)
+    {
+        if (spat_zset_score(g_spat_db, coll, &member, &score))
+            result = spat_zsl_rank(g_spat_db, spat_zsl(g_spat_db, coll), score, &member) - 1;
+        spat_coll_unlock(g_spat_db, coll);
+    }
+
+    if (result < 0)
+        PG_RETURN_NULL();
+
+    PG_RETURN_INT32(result);
+}
+
+SPAT_COMMAND(zcard, SPAT_CMD_ZCARD)
+{
+    spat_attach_shmem();
+
+    dss key = PG_GETARG_DSS(0);
+    int32 result = 0;
+    SpatColl* coll = spat_zset_find(g_spat_db, key, LW_SHARED);
+
+    if (coll)
+    {
+        result = coll->value.zset.size;
+        spat_coll_unlock(g_spat_db, coll);
+    }
+
+    PG_RETURN_INT32(result);
+}
+
+/* Members from rank start to stop, like lrange, with their scores */
+SPAT_COMMAND(zrange, SPAT_CMD_ZRANGE)
+{
+    spat_attach_shmem();
+
+    dss key = PG_GETARG_DSS(0);
+    int32 start = PG_GETARG_INT32(1);
+    int32 stop = PG_GETARG_INT32(2);
+    SpatColl* coll;
+
+    InitMaterializedSRF(fcinfo, MAT_SRF_USE_EXPECTED_DESC);
+
+    coll = spat_zset_find(g_spat_db, key, LW_SHARED);
+    if (coll)
+    {
+        uint32 from, to;
+
+        if (spat_index_range(coll->value.zset.size, start, stop, &from, &to))
+        {
+            SpatZSkiplist* zsl = spat_zsl(g_spat_db, coll);
+
+            spat_zrange_emit(fcinfo, g_spat_db, spat_zsl_by_rank(g_spat_db, zsl, from + 1),
+                             to - from + 1, get_float8_infinity());
+        }
+        spat_coll_unlock(g_spat_db, coll);
+    }
+
+    return (Datum) 0;
+}
+
+/* Members scoring within [min, max], with their scores */
+SPAT_COMMAND(zrangebyscore, SPAT_CMD_ZRANGEBYSCORE)
+{
+    spat_attach_shmem();
+
+    dss key = PG_GETARG_DSS(0);
+    double min = PG_GETARG_FLOAT8(1);
+    double max = PG_GETARG_FLOAT8(2);
+    SpatColl* coll;
+
+    spat_zrange_bounds_check(min, max);
+
+    InitMaterializedSRF(fcinfo, MAT_SRF_USE_EXPECTED_DESC);
+
+    coll = spat_zset_find(g_spat_db, key, LW_SHARED);
+    if (coll)
+    {
+        dsa_pointer update[SPAT_ZSKIPLIST_MAXLEVEL];
+        dsa_pointer first = spat_zsl_first_in_range(g_spat_db, spat_zsl(g_spat_db, coll), min, max, update);
+
+        spat_zrange_emit(fcinfo, g_spat_db, first, PG_UINT32_MAX, max);
+        spat_coll_unlock(g_spat_db, coll);
+    }
+
+    return (Datum) 0;
+}
+
+/* Remove the members scoring within [min, max]. Returns how many were removed */
+SPAT_COMMAND(zremrangebyscore, SPAT_CMD_ZREMRANGEBYSCORE)
+{
+    spat_attach_shmem();
+
+    dss key = PG_GETARG_DSS(0);
+    double min = PG_GETARG_FLOAT8(1);
+    double max = PG_GETARG_FLOAT8(2);
+    int32 result = 0;
+    SpatColl* coll;
+
+    spat_zrange_bounds_check(min, max);
+
+    coll = spat_zset_find(g_spat_db, key, LW_EXCLUSIVE);
+    if (coll)
+    {
+        result = spat_zset_remove_range(g_spat_db, coll, &key, min, max);
+        spat_coll_unlock(g_spat_db, coll);
+    }
+
+    PG_RETURN_INT32(result);
+}
+
+/*
+ * Free the contents of the collection at entry under its lock, waiting out
+ * whoever has it locked, and mark it dropped so that backends still pinning
+ * it let go. The header goes with the last reference.
+ */
+static void
+spat_coll_drop(SpatDB* db, SpatDBEntry* entry)
+{
+    dsa_pointer ptr = entry->value.coll;
+    SpatColl* coll = spat_coll(db, entry);
+
+    LWLockAcquire(&coll->lock, LW_EXCLUSIVE);
+
+    switch (coll->valtyp)
+    {
+    case SPVAL_LIST:
+        {
+            if (coll->encoding == SPAT_ENC_LISTPACK)
+                spat_pack_free(db, SPVAL_LIST, coll->value.list.head);
+            else
+            {
+                /* Free whole nodes, chunks of elements at a time */
+                while (coll->value.list.head != LIST_NIL)
+                    spat_list_node_free(db, coll, coll->value.list.head);
+            }
+
+            /* Reset the list metadata */
+            coll->value.list.head = InvalidDsaPointer;
+            coll->value.list.tail = InvalidDsaPointer;
+            coll->value.list.size = 0;
+
+            break;
+        }
+
+    case SPVAL_HASH:
+        {
+            if (coll->encoding == SPAT_ENC_LISTPACK)
+            {
+                spat_pack_free(db, SPVAL_HASH, coll->value.hash.hndl);
+                coll->value.hash.hndl = InvalidDsaPointer;
+                coll->value.hash.size = 0;
+                break;
+            }
+
+            /* Attach to the hash table */
+            dshash_table_handle htabhandl = coll->value.hash.hndl;
+            dshash_table* htab = dshash_attach(db->g_dsa, &sphash_params, htabhandl, NULL);
+
+            /* Iterate over all elements and delete them */
+            dshash_seq_status status;
+            sphash_entry* sphsntry;
+            dshash_seq_init(&status, htab, true);
+
+            while ((sphsntry = dshash_seq_next(&status)) != NULL)
+            {
+                SPDB_MEM_SUB(db, SPVAL_HASH, sizeof(sphash_entry) + sphsntry->field.len + sphsntry->value.len);
+                dss_free(db->g_dsa, &sphsntry->field);
+                dss_free(db->g_dsa, &sphsntry->value);
+                dshash_delete_current(&status);
+            }
+
+            dshash_seq_term(&status);
+
+            /* Destroy the hash table */
+            dshash_destroy(htab);
+
+            /* Reset hash metadata */
+            coll->value.hash.hndl = InvalidDsaPointer;
+            coll->value.hash.size = 0;
+
+            break;
+        }
+
+    case SPVAL_ZSET:
+        spat_zset_free(db, coll);
+        break;
+
+    case SPVAL_SET:
+        {
+            if (coll->encoding == SPAT_ENC_LISTPACK)
+            {
+                spat_pack_free(db, SPVAL_SET, coll->value.set.hndl);
+                coll->value.set.hndl = InvalidDsaPointer;
+                coll->value.set.size = 0;
+                break;
+            }
+
+            /* Attach to the hash table */
+            dshash_table_handle htabhandl = coll->value.set.hndl;
+            dshash_table* htab = dshash_attach(db->g_dsa, &params_hashset, htabhandl, NULL);
+
+            /* Iterate over all elements and delete them */
+            dshash_seq_status status;
+            dss* elem;
+            dshash_seq_init(&status, htab, true);
+
+            while ((elem = dshash_seq_next(&status)) != NULL)
+            {
+                SPDB_MEM_SUB(db, SPVAL_SET, sizeof(dss) + elem->len);
+                dss_free(db->g_dsa, elem);
+                dshash_delete_current(&status);
+            }
+
+            /* Terminate sequence scan */
+            dshash_seq_term(&status);
+
+            /* Destroy the hash table */
+            dshash_destroy(htab);
+
+            /* Reset set metadata */
+            coll->value.set.hndl = InvalidDsaPointer;
+            coll->value.set.size = 0;
+
+            break;
+        }
+
+    default:
+        break;
+    }
+
+    coll->dropped = true;
+    LWLockRelease(&coll->lock);
+
+    entry->value.coll = InvalidDsaPointer;
+    spat_coll_unref(db, ptr);
+}
+
+/*
+ * It's not enought to remove an entry, we also have to cleanup the value
+ * itself based on the value type. Leaves the entry holding SPVAL_NULL.
+ */
+static void
+spdb_free_value(SpatDB* db, SpatDBEntry* entry)
+{
+    /* toggle on the valtype to clean up properly */
+    switch (entry->valtyp)
+    {
+    case SPVAL_STRING:
+        {
+            if (entry->encoding == SPAT_ENC_INT)
+                break;
+
+            dss_free(db->g_dsa, &entry->value.string);
+            SPDB_MEM_SUB(db, SPVAL_STRING, entry->value.string.len);
+            break;
+        }
+
+    case SPVAL_SET:
+    case SPVAL_LIST:
+    case SPVAL_HASH:
+    case SPVAL_ZSET:
+        spat_coll_drop(db, entry);
+        break;
+
+    case SPVAL_INVALID:
+    case SPVAL_NULL:
+    default:
+        break;
+    }
+
+    spdb_set_valtyp(db, entry, SPVAL_NULL);
+    entry->encoding = SPAT_ENC_RAW;
+}
+
+/*
+ * To delete an entry we attempt to find it first If its not found do
+ * nothing. If it's found though, spdb_delete_entry cleans up the value too.
+ */
+SPAT_COMMAND(del, SPAT_CMD_DEL)
+{
+    bool found = false;
+    spat_attach_shmem();
+
+    dss key = PG_GETARG_DSS(0);
+
+    /*
+     * Look up for the entry and if it's found lock it exclusively. That only
+     * locks the entry's partition within its own shard.
+     */
+    SpatDBEntry* entry = spdb_find(g_spat_db, key, SPDB_ENTRY_LOCK_EXCLUSIVE);
+    if (entry)
+    {
+        found = true;
+        spdb_delete_entry(g_spat_db, entry);
+    }
+    else
+    {
+        /* key not found - do nothing */
+        found = false;
+    }
+
+    PG_RETURN_BOOL(found);
+}
+
+/*
+ * ---------------------------------------- Multi-key commands
+ * ----------------------------------------
+ *
+ * A batch takes the attachment once and visits its keys sorted by shard and
+ * then by hash, so that consecutive lookups go to the same table and mostly
+ * the same partition while it's still in cache. dshash can't hold a
+ * partition lock across lookups, so each key still locks its partition on
+ * its own; what the batch saves is the per-call overhead.
+ */
+
+typedef struct SpatBatchKey
+{
+    int idx;                    /* position in the input array */
+    int shard;
+    dshash_hash hash;
+    dss key;
+} SpatBatchKey;
+
+static int
+spat_batch_key_cmp(const void* a, const void* b)
+{
+    const SpatBatchKey* ka = (const SpatBatchKey*)a;
+    const SpatBatchKey* kb = (const SpatBatchKey*)b;
+
+    if (ka->shard != kb->shard)
+        return ka->shard < kb->shard ? -1 : 1;
+    if (ka->hash != kb->hash)
+        return ka->hash < kb->hash ? -1 : 1;
+    return ka->idx - kb->idx;
+}
+
+/* Sort keys, whose key and idx are set, in visiting order */
+static void
+spat_batch_sort(SpatDB* db, SpatBatchKey* keys, int nkeys)
+{
+    for (int i = 0; i < nkeys; i++)
+    {
+        keys[i].hash = spdb_hash(db, &keys[i].key);
+        keys[i].shard = keys[i].hash % db->shared->nshards;
+    }
+
+    qsort(keys, nkeys, sizeof(SpatBatchKey), spat_batch_key_cmp);
+}
+
+/* The keys of a text[] in visiting order. Lookup-only, like PG_GETARG_DSS */
+static SpatBatchKey*
+spat_batch_keys(SpatDB* db, ArrayType* arr, int* nkeys)
+{
+    Datum* elems;
+    bool* nulls;
+    SpatBatchKey* keys;
+
+    deconstruct_array_builtin(arr, TEXTOID, &elems, &nulls, nkeys);
+    keys = palloc(sizeof(SpatBatchKey) * Max(*nkeys, 1));
+
+    for (int i = 0; i < *nkeys; i++)
+    {
+        if (nulls[i])
+            elog(ERROR, "keys cannot be NULL");
+
+        keys[i].idx = i;
+        keys[i].key = dss_new_local(DatumGetTextPP(elems[i]));
+    }
+
+    spat_batch_sort(db, keys, *nkeys);
+
+    return keys;
+}
+
+/* Values of the given keys, in order. Missing keys and non-strings are NULL */
+SPAT_COMMAND(spmget, SPAT_CMD_MGET)
+{
+    ArrayType* keysarr = PG_GETARG_ARRAYTYPE_P(0);
+    SpatBatchKey* keys;
+    Datum* values;
+    bool* nulls;
+    int nkeys;
+    int dims[1];
+    int lbs[1] = {1};
+
+    spat_attach_shmem();
+
+    keys = spat_batch_keys(g_spat_db, keysarr, &nkeys);
+    if (nkeys == 0)
+        PG_RETURN_ARRAYTYPE_P(construct_empty_array(TEXTOID));
+
+    values = palloc(sizeof(Datum) * nkeys);
+    nulls = palloc(sizeof(bool) * nkeys);
+
+    for (int i = 0; i < nkeys; i++)
+    {
+        int idx = keys[i].idx;
+        SpatDBEntry* entry = spdb_find(g_spat_db, keys[i].key, false);
+
+        nulls[idx] = true;
+        if (entry)
+        {
+            if (entry->valtyp == SPVAL_STRING && entry->encoding == SPAT_ENC_INT)
+            {
+                values[idx] = PointerGetDatum(cstring_to_text(psprintf(INT64_FORMAT, entry->value.integer)));
+                nulls[idx] = false;
+            }
+            else if (entry->valtyp == SPVAL_STRING)
+            {
+                struct varlena* str = spat_string_copy(g_spat_db->g_dsa, entry);
+                bool datum = entry->encoding == SPAT_ENC_DATUM;
+
+                /* Strings SET from another type are converted once the key is unlocked */
+                spdb_release_lock(g_spat_db, entry);
+                values[idx] = PointerGetDatum(datum ? cstring_to_text(spat_datum_cstring(str)) : str);
+                nulls[idx] = false;
+                continue;
+            }
+            spdb_release_lock(g_spat_db, entry);
+        }
+    }
+
+    dims[0] = nkeys;
+    PG_RETURN_ARRAYTYPE_P(construct_md_array(values, nulls, 1, dims, lbs, TEXTOID, -1, false, TYPALIGN_INT));
+}
+
+/* SET every key to the value at the same position, with the same TTL */
+SPAT_COMMAND(spmset, SPAT_CMD_MSET)
+{
+    SpatBatchKey* keys;
+    Datum* values;
+    bool* nulls;
+    int nkeys;
+    int nvalues;
+    TimestampTz expireat;
+
+    if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
+        elog(ERROR, "keys and values cannot be NULL");
+
+    spat_attach_shmem();
+
+    keys = spat_batch_keys(g_spat_db, PG_GETARG_ARRAYTYPE_P(0), &nkeys);
+    deconstruct_array_builtin(PG_GETARG_ARRAYTYPE_P(1), TEXTOID, &values, &nulls, &nvalues);
+
+    if (nkeys != nvalues)
+        elog(ERROR, "got %d keys but %d values", nkeys, nvalues);
+    for (int i = 0; i < nvalues; i++)
+    {
+        if (nulls[i])
+            elog(ERROR, "value cannot be NULL");
+    }
+
+    /* All keys expire together, as if SET in the same instant */
+    expireat = spat_expireat(PG_ARGISNULL(2) ? NULL : PG_GETARG_INTERVAL_P(2));
+
+    for (int i = 0; i < nkeys; i++)
+    {
+        SpatDBEntry* entry;
+
+        spdb_evict_if_needed(g_spat_db);
+        entry = spdb_set_string(g_spat_db, keys[i].key, DatumGetTextPP(values[keys[i].idx]), expireat);
+        spdb_release_lock(g_spat_db, entry);
+    }
+
+    PG_RETURN_VOID();
+}
+
+/* DEL many keys; returns how many of them existed */
+SPAT_COMMAND(spdel, SPAT_CMD_MDEL)
+{
+    SpatBatchKey* keys;
+    int nkeys;
+    int32 ndeleted = 0;
+
+    spat_attach_shmem();
+
+    keys = spat_batch_keys(g_spat_db, PG_GETARG_ARRAYTYPE_P(0), &nkeys);
+
+    for (int i = 0; i < nkeys; i++)
+    {
+        SpatDBEntry* entry = spdb_find(g_spat_db, keys[i].key, SPDB_ENTRY_LOCK_EXCLUSIVE);
+
+        if (entry)
+        {
+            spdb_delete_entry(g_spat_db, entry);
+            ndeleted++;
+        }
+    }
+
+    PG_RETURN_INT32(ndeleted);
+}
+
+/*
+ * ---------------------------------------- Batches
+ * ----------------------------------------
+ *
+ * SPEXEC runs an array of commands, each an array of its name and arguments,
+ * e.g. [["INCR", "hits"], ["HGET", "user:1", "name"]], under one attachment,
+ * and returns their results as an array in the same order. Commands run the
+ * same code as their SQL functions, and return what they do. The whole batch
+ * is parsed before anything runs, so a malformed one changes nothing.
+ *
+ * Consecutive commands on the same key keep it locked in between, so they
+ * are atomic together: no session sees the key between the GET and the SET
+ * of [["GET", "k"], ["SET", "k", "v"]]. The key is locked exclusively if any
+ * of them writes, and its collection, if it holds one, is locked under it in
+ * the same mode until the last of them. dshash won't let us hold two
+ * partition locks though (see "Multi-key commands"), so different keys are
+ * locked one at a time, and a batch isn't atomic across them.
+ *
+ * A failing command raises its error like its SQL function would. As spat
+ * isn't transactional, the commands that ran before it keep their effect.
+ */
+
+#define SPAT_EXEC_MAXARGS 3
+
+typedef enum SpatExecOp
+{
+    SPAT_EXEC_GET,
+    SPAT_EXEC_SET,
+    SPAT_EXEC_DEL,
+    SPAT_EXEC_INCR,
+    SPAT_EXEC_INCRBY,
+    SPAT_EXEC_DECR,
+    SPAT_EXEC_DECRBY,
+    SPAT_EXEC_LPUSH,
+    SPAT_EXEC_RPUSH,
+    SPAT_EXEC_LPOP,
+    SPAT_EXEC_RPOP,
+    SPAT_EXEC_LLEN,
+    SPAT_EXEC_RPOPLPUSH,
+    SPAT_EXEC_SADD,
+    SPAT_EXEC_SREM,
+    SPAT_EXEC_SISMEMBER,
+    SPAT_EXEC_SCARD,
+    SPAT_EXEC_HSET,
+    SPAT_EXEC_HGET,
+    SPAT_EXEC_HINCRBY,
+    SPAT_EXEC_ZADD,
+    SPAT_EXEC_ZREM,
+    SPAT_EXEC_ZSCORE,
+    SPAT_EXEC_ZCARD
+} SpatExecOp;
+
+/* How a command gets to its key */
+typedef enum SpatExecMode
+{
+    SPAT_EXEC_READ,             /* locks it shared */
+    SPAT_EXEC_WRITE,            /* locks it exclusively, if it's there */
+    SPAT_EXEC_CREATE            /* inserts it if it's not */
+} SpatExecMode;
+
+typedef struct SpatExecCommand
+{
+    const char* name;
+    SpatExecOp op;
+    SpatExecMode mode;
+    int minargs;                /* the key included */
+    int maxargs;
+} SpatExecCommand;
+
+static const SpatExecCommand spat_exec_commands[] = {
+    {"GET", SPAT_EXEC_GET, SPAT_EXEC_READ, 1, 1},
+    {"SET", SPAT_EXEC_SET, SPAT_EXEC_CREATE, 2, 3},
+    {"DEL", SPAT_EXEC_DEL, SPAT_EXEC_WRITE, 1, 1},
+    {"INCR", SPAT_EXEC_INCR, SPAT_EXEC_CREATE, 1, 1},
+    {"INCRBY", SPAT_EXEC_INCRBY, SPAT_EXEC_CREATE, 2, 2},
+    {"DECR", SPAT_EXEC_DECR, SPAT_EXEC_CREATE, 1, 1},
+    {"DECRBY", SPAT_EXEC_DECRBY, SPAT_EXEC_CREATE, 2, 2},
+    {"LPUSH", SPAT_EXEC_LPUSH, SPAT_EXEC_CREATE, 2, 2},
+    {"RPUSH", SPAT_EXEC_RPUSH, SPAT_EXEC_CREATE, 2, 2},
+    {"LPOP", SPAT_EXEC_LPOP, SPAT_EXEC_WRITE, 1, 1},
+    {"RPOP", SPAT_EXEC_RPOP, SPAT_EXEC_WRITE, 1, 1},
+    {"LLEN", SPAT_EXEC_LLEN, SPAT_EXEC_READ, 1, 1},
+    {"RPOPLPUSH", SPAT_EXEC_RPOPLPUSH, SPAT_EXEC_WRITE, 2, 2},
+    {"SADD", SPAT_EXEC_SADD, SPAT_EXEC_CREATE, 2, 2},
+    {"SREM", SPAT_EXEC_SREM, SPAT_EXEC_WRITE, 2, 2},
+    {"SISMEMBER", SPAT_EXEC_SISMEMBER, SPAT_EXEC_READ, 2, 2},
+    {"SCARD", SPAT_EXEC_SCARD, SPAT_EXEC_READ, 1, 1},
+    {"HSET", SPAT_EXEC_HSET, SPAT_EXEC_CREATE, 3, 3},
+    {"HGET", SPAT_EXEC_HGET, SPAT_EXEC_READ, 2, 2},
+    {"HINCRBY", SPAT_EXEC_HINCRBY, SPAT_EXEC_CREATE, 3, 3},
+    {"ZADD", SPAT_EXEC_ZADD, SPAT_EXEC_CREATE, 3, 3},
+    {"ZREM", SPAT_EXEC_ZREM, SPAT_EXEC_WRITE, 2, 2},
+    {"ZSCORE", SPAT_EXEC_ZSCORE, SPAT_EXEC_READ, 2, 2},
+    {"ZCARD", SPAT_EXEC_ZCARD, SPAT_EXEC_READ, 1, 1},
+};
+
+typedef struct SpatExecCall
+{
+    const SpatExecCommand* cmd;
+    int nargs;
+    JsonbValue args[SPAT_EXEC_MAXARGS];
+    text* key;                  /* args[0] */
+} SpatExecCall;
+
+typedef enum SpatExecResultKind
+{
+    SPAT_EXEC_RES_NULL,
+    SPAT_EXEC_RES_TEXT,
+    SPAT_EXEC_RES_DATUM,        /* a string SET from another type, see spat_datum_cstring */
+    SPAT_EXEC_RES_INT,
+    SPAT_EXEC_RES_FLOAT,
+    SPAT_EXEC_RES_BOOL
+} SpatExecResultKind;
+
+typedef struct SpatExecResult
+{
+    SpatExecResultKind kind;
+
+    union
+    {
+        struct varlena* str;
+        int64 integer;
+        double score;
+        bool boolean;
+    } value;
+} SpatExecResult;
+
+/* The key a run of calls holds, and the collection it holds under it */
+typedef struct SpatExecKey
+{
+    SpatDBEntry* entry;         /* NULL if there's no key, or it's been deleted */
+    bool exclusive;
+    SpatColl* coll;             /* locked in the mode of the entry, when used */
+} SpatExecKey;
+
+static const SpatExecCommand*
+spat_exec_command(const JsonbValue* name)
+{
+    for (int i = 0; i < lengthof(spat_exec_commands); i++)
+    {
+        const SpatExecCommand* cmd = &spat_exec_commands[i];
+
+        if (strlen(cmd->name) == name->val.string.len &&
+            pg_strncasecmp(cmd->name, name->val.string.val, name->val.string.len) == 0)
+            return cmd;
+    }
+
+    elog(ERROR, "unknown command \"%.*s\"", name->val.string.len, name->val.string.val);
+    return NULL;
+}
+
+/* Argument i of call as text, numbers in their JSON form */
+static text*
+spat_exec_text(const SpatExecCall* call, int i)
+{
+    const JsonbValue* v = &call->args[i];
+
+    if (v->type == jbvNumeric)
+        return cstring_to_text(DatumGetCString(DirectFunctionCall1(numeric_out,
+                                                                   NumericGetDatum(v->val.numeric))));
+
+    return cstring_to_text_with_len(v->val.string.val, v->val.string.len);
+}
+
+static inline dss
+spat_exec_dss(const SpatExecCall* call, int i)
+{
+    return dss_new_local(spat_exec_text(call, i));
+}
+
+static int64
+spat_exec_int64(const SpatExecCall* call, int i)
+{
+    const JsonbValue* v = &call->args[i];
+    int64 result;
+
+    if (v->type == jbvNumeric)
+        return DatumGetInt64(DirectFunctionCall1(numeric_int8, NumericGetDatum(v->val.numeric)));
+
+    if (!spat_parse_int64(v->val.string.val, v->val.string.len, &result))
+        elog(ERROR, "argument %d of %s is not an integer", i + 1, call->cmd->name);
+
+    return result;
+}
+
+static double
+spat_exec_float8(const SpatExecCall* call, int i)
+{
+    const JsonbValue* v = &call->args[i];
+
+    if (v->type == jbvNumeric)
+        return DatumGetFloat8(DirectFunctionCall1(numeric_float8, NumericGetDatum(v->val.numeric)));
+
+    return DatumGetFloat8(DirectFunctionCall1(float8in, CStringGetDatum(text_to_cstring(spat_exec_text(call, i)))));
+}
+
+/* The TTL of a SET, NULL if it has none */
+static Interval*
+spat_exec_interval(const SpatExecCall* call, int i)
+{
+    if (i >= call->nargs || call->args[i].type == jbvNull)
+        return NULL;
+
+    return DatumGetIntervalP(DirectFunctionCall3(interval_in,
+                                                 CStringGetDatum(text_to_cstring(spat_exec_text(call, i))),
+                                                 ObjectIdGetDatum(InvalidOid), Int32GetDatum(-1)));
+}
+
+/* Parse and check every command of cmds */
+static SpatExecCall*
+spat_exec_parse(Jsonb* cmds, int* ncalls)
+{
+    SpatExecCall* calls;
+
+    if (!JB_ROOT_IS_ARRAY(cmds) || JB_ROOT_IS_SCALAR(cmds))
+        elog(ERROR, "commands must be an array of arrays");
+
+    *ncalls = JB_ROOT_COUNT(cmds);
+    calls = palloc0(sizeof(SpatExecCall) * Max(*ncalls, 1));
+
+    for (int i = 0; i < *ncalls; i++)
+    {
+        SpatExecCall* call = &calls[i];
+        JsonbValue* v = getIthJsonbValueFromContainer(&cmds->root, i);
+        JsonbContainer* c;
+        JsonbValue* name;
+        int n;
+
+        if (v->type != jbvBinary || !JsonContainerIsArray(v->val.binary.data))
+            elog(ERROR, "command %d is not an array", i + 1);
+
+        c = v->val.binary.data;
+        n = JsonContainerSize(c);
+        name = n > 0 ? getIthJsonbValueFromContainer(c, 0) : NULL;
+        if (name == NULL || name->type != jbvString)
+            elog(ERROR, "command %d has no name", i + 1);
+
+        call->cmd = spat_exec_command(name);
+        call->nargs = n - 1;
+        if (call->nargs < call->cmd->minargs || call->nargs > call->cmd->maxargs)
+            elog(ERROR, "wrong number of arguments for %s", call->cmd->name);
+
+        for (int j = 0; j < call->nargs; j++)
+        {
+            JsonbValue* arg = getIthJsonbValueFromContainer(c, j + 1);
+
+            /* Only the TTL of a SET may be null */
+            if (arg->type != jbvString && arg->type != jbvNumeric &&
+                !(arg->type == jbvNull && call->cmd->op == SPAT_EXEC_SET && j == 2))
+                elog(ERROR, "argument %d of %s must be a string or a number", j + 1, call->cmd->name);
+
+            call->args[j] = *arg;
+        }
+
+        call->key = spat_exec_text(call, 0);
+    }
+
+    return calls;
+}
+
+/* Whether call runs on the key a run of calls holds, see spexec */
+static bool
+spat_exec_same_key(const SpatExecCall* call, const SpatExecCall* run)
+{
+    return call->cmd->op != SPAT_EXEC_RPOPLPUSH && run->cmd->op != SPAT_EXEC_RPOPLPUSH &&
+        VARSIZE_ANY_EXHDR(call->key) == VARSIZE_ANY_EXHDR(run->key) &&
+        memcmp(VARDATA_ANY(call->key), VARDATA_ANY(run->key), VARSIZE_ANY_EXHDR(call->key)) == 0;
+}
+
+/* Let go of the collection of k, before its value is freed or the key released */
+static void
+spat_exec_release_coll(SpatExecKey* k)
+{
+    if (k->coll)
+        LWLockRelease(&k->coll->lock);
+    k->coll = NULL;
+}
+
+static void
+spat_exec_release(SpatDB* db, SpatExecKey* k)
+{
+    spat_exec_release_coll(k);
+    if (k->entry)
+        spdb_release_lock(db, k->entry);
+    k->entry = NULL;
+}
+
+/*
+ * The collection of typ at the key k holds, locked until the run is over, or
+ * NULL if there's none. Another type errors out, or counts as none unless
+ * strict, as for spat_coll_find.
+ */
+static SpatColl*
+spat_exec_coll(SpatDB* db, SpatExecKey* k, spValueType typ, bool strict)
+{
+    if (k->entry == NULL || k->entry->valtyp == SPVAL_NULL)
+        return NULL;
+
+    if (k->entry->valtyp != typ)
+    {
+        if (strict)
+            spat_coll_type_error(typ);
+        return NULL;
+    }
+
+    if (k->coll == NULL)
+        k->coll = spat_coll_held(db, k->entry, typ, k->exclusive ? LW_EXCLUSIVE : LW_SHARED);
+
+    return k->coll;
+}
+
+/* Like spat_exec_coll, for a write that makes the collection with init if there's none */
+static SpatColl*
+spat_exec_coll_for_write(SpatDB* db, SpatExecKey* k, spValueType typ,
+                         SpatColl* (*init) (SpatDB* db, SpatDBEntry* entry))
+{
+    Assert(k->exclusive);
+
+    /* Nobody can pin the new collection before we release its entry */
+    if (k->entry->valtyp == SPVAL_NULL)
+    {
+        k->coll = init(db, k->entry);
+        LWLockAcquire(&k->coll->lock, LW_EXCLUSIVE);
+    }
+
+    return spat_exec_coll(db, k, typ, true);
+}
+
+/* Run call on the key k holds, into result. Returns whether it pushed to a list */
+static bool
+spat_exec_run(SpatDB* db, SpatExecCall* call, SpatExecKey* k, SpatExecResult* result)
+{
+    dss key = dss_new_local(call->key);
+    bool found = k->entry != NULL;
+    bool head = false;
+    SpatColl* coll;
+
+    result->kind = SPAT_EXEC_RES_NULL;
+
+    /* Only a DEL earlier in the run leaves nothing held for a write */
+    if (call->cmd->mode == SPAT_EXEC_CREATE && k->entry == NULL)
+    {
+        k->entry = spdb_find_or_insert(db, key, &found);
+        k->exclusive = true;
+    }
+
+    switch (call->cmd->op)
+    {
+    case SPAT_EXEC_GET:
+        if (k->entry && k->entry->valtyp != SPVAL_NULL)
+        {
+            bool datum;
+
+            result->value.str = spat_entry_string(db, k->entry, &datum);
+            result->kind = datum ? SPAT_EXEC_RES_DATUM : SPAT_EXEC_RES_TEXT;
+        }
+        break;
+
+    case SPAT_EXEC_SET:
+        {
+            text* value = spat_exec_text(call, 1);
+
+            spat_exec_release_coll(k);
+            spdb_store_string(db, k->entry, found, value, spat_expireat(spat_exec_interval(call, 2)));
+            result->kind = SPAT_EXEC_RES_TEXT;
+            result->value.str = value;
+            break;
+        }
+
+    case SPAT_EXEC_DEL:
+        result->kind = SPAT_EXEC_RES_BOOL;
+        result->value.boolean = k->entry != NULL;
+        if (k->entry)
+        {
+            spat_exec_release_coll(k);
+            spdb_delete_entry(db, k->entry);
+            k->entry = NULL;
+        }
+        break;
+
+    case SPAT_EXEC_INCR:
+    case SPAT_EXEC_INCRBY:
+    case SPAT_EXEC_DECR:
+    case SPAT_EXEC_DECRBY:
+        {
+            bool by = call->cmd->op == SPAT_EXEC_INCRBY || call->cmd->op == SPAT_EXEC_DECRBY;
+            bool decrement = call->cmd->op == SPAT_EXEC_DECR || call->cmd->op == SPAT_EXEC_DECRBY;
+
+            spat_exec_release_coll(k);
+            result->kind = SPAT_EXEC_RES_INT;
+            result->value.integer = spat_incr_entry(db, k->entry, found, by ? spat_exec_int64(call, 1) : 1,
+                                                    decrement);
+            break;
+        }
+
+    case SPAT_EXEC_LPUSH:
+    case SPAT_EXEC_RPUSH:
+        {
+            dss elem = spat_exec_dss(call, 1);
+
+            coll = spat_exec_coll_for_write(db, k, SPVAL_LIST, spat_list_init);
+            spat_list_push(db, coll, &key, &elem, call->cmd->op == SPAT_EXEC_LPUSH);
+            return true;
+        }
+
+    case SPAT_EXEC_LPOP:
+        head = true;
+        /* FALLTHROUGH */
+    case SPAT_EXEC_RPOP:
+        if ((coll = spat_exec_coll(db, k, SPVAL_LIST, true)) != NULL)
+        {
+            result->value.str = spat_list_take(db, coll, &key, head);
+            if (result->value.str)
+                result->kind = SPAT_EXEC_RES_TEXT;
+        }
+        break;
+
+    case SPAT_EXEC_LLEN:
+        if ((coll = spat_exec_coll(db, k, SPVAL_LIST, false)) != NULL)
+        {
+            result->kind = SPAT_EXEC_RES_INT;
+            result->value.integer = coll->value.list.size;
+        }
+        break;
+
+    case SPAT_EXEC_RPOPLPUSH:
+        {
+            /* Holds nothing: the element is in neither list for a moment */
+            text* elem = spat_list_pop(db, key, false);
+            dss dest = spat_exec_dss(call, 1);
+            dss elem_dss;
+
+            if (elem == NULL)
+                break;
+
+            spdb_evict_if_needed(db);
+            elem_dss = dss_new_local(elem);
+            coll = spat_list_for_push(db, dest);
+            spat_list_push(db, coll, &dest, &elem_dss, true);
+            spat_coll_unlock(db, coll);
+
+            result->kind = SPAT_EXEC_RES_TEXT;
+            result->value.str = elem;
+            return true;
+        }
+
+    case SPAT_EXEC_SADD:
+        {
+            dss elem = spat_exec_dss(call, 1);
+
+            coll = spat_exec_coll_for_write(db, k, SPVAL_SET, spat_set_init);
+            spat_set_add(db, coll, &key, &elem);
+            break;
+        }
+
+    case SPAT_EXEC_SREM:
+    case SPAT_EXEC_SISMEMBER:
+        {
+            dss elem = spat_exec_dss(call, 1);
+            bool srem = call->cmd->op == SPAT_EXEC_SREM;
+            bool member = false;
+
+            if ((coll = spat_exec_coll(db, k, SPVAL_SET, true)) != NULL)
+                member = srem ? spat_set_remove(db, coll, &key, &elem) : spat_set_contains(db, coll, &elem);
+
+            result->kind = srem ? SPAT_EXEC_RES_INT : SPAT_EXEC_RES_BOOL;
+            if (srem)
+                result->value.integer = member ? 1 : 0;
+            else
+                result->value.boolean = member;
+            break;
+        }
+
+    case SPAT_EXEC_SCARD:
+        if ((coll = spat_exec_coll(db, k, SPVAL_SET, false)) != NULL)
+        {
+            result->kind = SPAT_EXEC_RES_INT;
+            result->value.integer = coll->value.set.size;
+        }
+        break;
+
+    case SPAT_EXEC_HSET:
+        {
+            dss field = spat_exec_dss(call, 1);
+            dss value = spat_exec_dss(call, 2);
+
+            coll = spat_exec_coll_for_write(db, k, SPVAL_HASH, spat_hash_init);
+            spat_hash_set(db, coll, &key, &field, &value);
+            break;
+        }
+
+    case SPAT_EXEC_HGET:
+        {
+            dss field = spat_exec_dss(call, 1);
+
+            if ((coll = spat_exec_coll(db, k, SPVAL_HASH, false)) != NULL)
+            {
+                result->value.str = spat_hash_get(db, coll, &field);
+                if (result->value.str)
+                    result->kind = SPAT_EXEC_RES_TEXT;
+            }
+            break;
+        }
+
+    case SPAT_EXEC_HINCRBY:
+        {
+            dss field = spat_exec_dss(call, 1);
+            int64 increment = spat_exec_int64(call, 2);
+
+            coll = spat_exec_coll_for_write(db, k, SPVAL_HASH, spat_hash_init);
+            result->kind = SPAT_EXEC_RES_INT;
+            result->value.integer = spat_hash_incrby(db, coll, &key, &field, increment);
+            break;
+        }
+
+    case SPAT_EXEC_ZADD:
+        {
+            double score = spat_exec_float8(call, 1);
+            dss member = spat_exec_dss(call, 2);
+
+            if (isnan(score))
+                elog(ERROR, "score is not a number");
+
+            coll = spat_exec_coll_for_write(db, k, SPVAL_ZSET, spat_zset_init);
+            result->kind = SPAT_EXEC_RES_INT;
+            result->value.integer = spat_zset_add(db, coll, &key, score, &member) ? 1 : 0;
+            break;
+        }
+
+    case SPAT_EXEC_ZREM:
+        {
+            dss member = spat_exec_dss(call, 1);
+
+            result->kind = SPAT_EXEC_RES_INT;
+            result->value.integer = 0;
+            if ((coll = spat_exec_coll(db, k, SPVAL_ZSET, true)) != NULL)
+                result->value.integer = spat_zset_remove(db, coll, &key, &member) ? 1 : 0;
+            break;
+        }
+
+    case SPAT_EXEC_ZSCORE:
+        {
+            dss member = spat_exec_dss(call, 1);
+
+            if ((coll = spat_exec_coll(db, k, SPVAL_ZSET, true)) != NULL &&
+                spat_zset_score(db, coll, &member, &result->value.score))
+                result->kind = SPAT_EXEC_RES_FLOAT;
+            break;
+        }
+
+    case SPAT_EXEC_ZCARD:
+        result->kind = SPAT_EXEC_RES_INT;
+        result->value.integer = 0;
+        if ((coll = spat_exec_coll(db, k, SPVAL_ZSET, true)) != NULL)
+            result->value.integer = coll->value.zset.size;
+        break;
+    }
+
+    return false;
+}
+
+/* The results of a batch as a jsonb array, once nothing is locked */
+static Jsonb*
+spat_exec_result_jsonb(SpatExecResult* results, int n)
+{
+    JsonbParseState* state = NULL;
+    JsonbValue* array;
+
+    pushJsonbValue(&state, WJB_BEGIN_ARRAY, NULL);
+
+    for (int i = 0; i < n; i++)
+    {
+        SpatExecResult* r = &results[i];
+        JsonbValue v;
+
+        switch (r->kind)
+        {
+        case SPAT_EXEC_RES_NULL:
+            v.type = jbvNull;
+            break;
+        case SPAT_EXEC_RES_DATUM:
+            r->value.str = (struct varlena*)cstring_to_text(spat_datum_cstring(r->value.str));
+            /* FALLTHROUGH */
+        case SPAT_EXEC_RES_TEXT:
+            v.type = jbvString;
+            v.val.string.val = VARDATA_ANY(r->value.str);
+            v.val.string.len = VARSIZE_ANY_EXHDR(r->value.str);
+            break;
+        case SPAT_EXEC_RES_INT:
+            v.type = jbvNumeric;
+            v.val.numeric = int64_to_numeric(r->value.integer);
+            break;
+        case SPAT_EXEC_RES_FLOAT:
+            /* JSON has no infinities; Redis replies with these too */
+            if (isinf(r->value.score))
+            {
+                v.type = jbvString;
+                v.val.string.val = r->value.score > 0 ? "inf" : "-inf";
+                v.val.string.len = strlen(v.val.string.val);
+                break;
+            }
+            v.type = jbvNumeric;
+            v.val.numeric = DatumGetNumeric(DirectFunctionCall1(float8_numeric,
+                                                                Float8GetDatum(r->value.score)));
+            break;
+        case SPAT_EXEC_RES_BOOL:
+            v.type = jbvBool;
+            v.val.boolean = r->value.boolean;
+            break;
+        }
+
+        pushJsonbValue(&state, WJB_ELEM, &v);
+    }
+
+    array = pushJsonbValue(&state, WJB_END_ARRAY, NULL);
+
+    return JsonbValueToJsonb(array);
+}
+
+/* Run a batch of commands, returning their results in order, see "Batches" */
+SPAT_COMMAND(spexec, SPAT_CMD_EXEC)
+{
+    SpatExecCall* calls;
+    SpatExecResult* results;
+    SpatExecKey k = {0};
+    int ncalls;
+    int runend = 0;
+    bool pushed = false;
+
+    spat_attach_shmem();
+
+    calls = spat_exec_parse(PG_GETARG_JSONB_P(0), &ncalls);
+    results = palloc0(sizeof(SpatExecResult) * Max(ncalls, 1));
+
+    for (int i = 0; i < ncalls; i++)
+    {
+        if (i == runend)
+        {
+            bool exclusive = calls[i].cmd->mode != SPAT_EXEC_READ;
+
+            /* A new run: let go of the previous key before locking its own */
+            spat_exec_release(g_spat_db, &k);
+
+            for (runend = i + 1; runend < ncalls && spat_exec_same_key(&calls[runend], &calls[i]); runend++)
+                exclusive |= calls[runend].cmd->mode != SPAT_EXEC_READ;
+
+            if (exclusive)
+                spdb_evict_if_needed(g_spat_db);
+
+            k.exclusive = exclusive;
+            if (calls[i].cmd->op != SPAT_EXEC_RPOPLPUSH)
+                k.entry = spdb_find(g_spat_db, dss_new_local(calls[i].key), exclusive);
+        }
+
+        pushed |= spat_exec_run(g_spat_db, &calls[i], &k, &results[i]);
+    }
+
+    spat_exec_release(g_spat_db, &k);
+
+    /* As for LPUSH, see spat_push_generic */
+    pg_memory_barrier();
+    if (pushed && pg_atomic_read_u32(&g_spat_db->shared->list_waiters) > 0)
+        ConditionVariableBroadcast(&g_spat_db->shared->list_cv);
+
+    PG_RETURN_JSONB_P(spat_exec_result_jsonb(results, ncalls));
+}
+
+/*
+ * ---------------------------------------- Pub/Sub
+ * ----------------------------------------
+ *
+ * Unlike NOTIFY, publishing never goes through a global queue. Every
+ * subscribed backend has its own ring of pending messages in the DSA, and
+ * SPPUBLISH copies the message once and queues a reference to it on the ring
+ * of each of the channel's subscribers, then wakes them up. Messages are
+ * delivered right away, not at commit, and there's no limit on their size.
+ *
+ * Rings are bounded MPSC queues after Vyukov's: a publisher claims a cell by
+ * moving head past it with a CAS, fills it, and only then bumps its sequence
+ * to publish it; the subscriber alone moves tail. So each cell has a single
+ * producer at a time, and neither side ever takes a lock. When a ring is
+ * full, publishers drop the message for that subscriber only and count it
+ * against the channel, so a slow subscriber never holds up the others.
+ *
+ * Channels live in a dshash_table of their own, created along with the
+ * subscriber slots by the first subscriber. A channel records its
+ * subscribers as a bitmap of ProcNumbers, and only exists while it has any:
+ * publishing to a channel nobody listens to is a lookup and nothing else.
+ * Publishers hold the channel's entry lock, shared, while they queue, and
+ * subscribers take it exclusively to leave, so once a backend has left all
+ * its channels no publisher can be touching its ring anymore.
+ */
+
+typedef struct SpatChannel
+{
+    dss name;
+    uint32 nsubscribers;
+    dsa_pointer subscribers;            /* uint64[], bit i is ProcNumber i */
+
+    /* Bumped by publishers under a shared lock */
+    pg_atomic_uint64 published;         /* SPPUBLISH calls */
+    pg_atomic_uint64 delivered;         /* queued on a subscriber's ring */
+    pg_atomic_uint64 dropped;           /* not queued, the ring was full */
+} SpatChannel;
+
+static const dshash_parameters spchannel_params = {
+    .key_size = sizeof(dss),
+    .entry_size = sizeof(SpatChannel),
+    .compare_function = dss_cmp,
+    .hash_function = dss_hash,
+    .copy_function = dss_copy
+};
+
+/* Shared by all the rings it's queued on, freed by whoever drops the last reference */
+typedef struct SpatMessage
+{
+    pg_atomic_uint32 refcount;
+    uint32 chanlen;
+    uint32 len;
+    char data[FLEXIBLE_ARRAY_MEMBER];   /* channel, then message, unterminated */
+} SpatMessage;
+
+/* A cell holds a message once seq = pos + 1, and is free for pos + size once seq = pos + size */
+typedef struct SpatRingCell
+{
+    pg_atomic_uint64 seq;
+    dsa_pointer msg;                    /* SpatMessage */
+} SpatRingCell;
+
+typedef struct SpatRing
+{
+    uint32 mask;                        /* size - 1, a power of 2 */
+    pg_atomic_uint64 head;              /* next position to claim, by publishers */
+    uint64 tail;                        /* next position to receive, by the subscriber alone */
+    SpatRingCell cells[FLEXIBLE_ARRAY_MEMBER];
+} SpatRing;
+
+typedef struct SpatSubscriber
+{
+    dsa_pointer ring;                   /* SpatRing, only set while subscribed */
+    ConditionVariable cv;
+    pg_atomic_uint32 sleeping;          /* publishers only signal cv if set */
+} SpatSubscriber;
+
+#define SPAT_CHANNEL_WORDS ((MaxBackends + 63) / 64)
+
+static SpatMessage*
+spat_message_get(SpatDB* db, dsa_pointer msgptr)
+{
+    return (SpatMessage*)dsa_get_address(db->g_dsa, msgptr);
+}
+
+static void
+spat_message_release(SpatDB* db, dsa_pointer msgptr)
+{
+    if (pg_atomic_sub_fetch_u32(&spat_message_get(db, msgptr)->refcount, 1) == 0)
+        dsa_free(db->g_dsa, msgptr);
+}
+
+/* Queue msgptr on ring; false if the ring is full */
+static bool
+spat_ring_push(SpatRing* ring, dsa_pointer msgptr)
+{
+    uint64 pos = pg_atomic_read_u64(&ring->head);
+
+    for (;;)
+    {
+        SpatRingCell* cell = &ring->cells[pos & ring->mask];
+        int64 diff = (int64)(pg_atomic_read_u64(&cell->seq) - pos);
+
+        if (diff == 0)
+        {
+            /* A failed CAS leaves the current head in pos */
+            if (pg_atomic_compare_exchange_u64(&ring->head, &pos, pos + 1))
+            {
+                cell->msg = msgptr;
+                pg_write_barrier();
+                pg_atomic_write_u64(&cell->seq, pos + 1);
+                return true;
+            }
+        }
+        else if (diff < 0)
+            return false;   /* the subscriber hasn't received this cell's last lap yet */
+        else
+            pos = pg_atomic_read_u64(&ring->head);
+    }
+}
+
+/* The oldest message on ring, or InvalidDsaPointer. Only the subscriber may call this */
+static dsa_pointer
+spat_ring_pop(SpatRing* ring)
+{
+    uint64 pos = ring->tail;
+    SpatRingCell* cell = &ring->cells[pos & ring->mask];
+    dsa_pointer msgptr;
+
+    /* Claimed but not filled in yet counts as empty; its publisher will wake us */
+    if (pg_atomic_read_u64(&cell->seq) != pos + 1)
+        return InvalidDsaPointer;
+
+    pg_read_barrier();
+    msgptr = cell->msg;
+
+    /* Hand the cell over to the next lap only once we're done reading it */
+    pg_memory_barrier();
+    pg_atomic_write_u64(&cell->seq, pos + ring->mask + 1);
+    ring->tail = pos + 1;
+
+    return msgptr;
+}
+
+/*
+ * The channels table of db, attaching to it first if needed. Unless create,
+ * returns NULL if nobody has subscribed to anything in db yet.
+ */
+static dshash_table*
+spat_pubsub_channels(SpatDB* db, bool create)
+{
+    SpatDBShared* shared = db->shared;
+    MemoryContext oldcontext;
+
+    if (db->g_channels)
+        return db->g_channels;
+
+    LWLockAcquire(&shared->pubsub_lck, create ? LW_EXCLUSIVE : LW_SHARED);
+
+    if (shared->channels == DSHASH_HANDLE_INVALID && create)
+    {
+        dshash_table* htab = spat_dshash_create(db->g_dsa, &spchannel_params, shared->lck.tranche);
+        SpatSubscriber* subs;
+
+        shared->subscribers = spat_dsa_allocate(db->g_dsa, sizeof(SpatSubscriber) * MaxBackends);
+        subs = dsa_get_address(db->g_dsa, shared->subscribers);
+        for (int i = 0; i < MaxBackends; i++)
+        {
+            subs[i].ring = InvalidDsaPointer;
+            ConditionVariableInit(&subs[i].cv);
+            pg_atomic_init_u32(&subs[i].sleeping, 0);
+        }
+
+        shared->channels = dshash_get_hash_table_handle(htab);
+        dshash_detach(htab);
+    }
+
+    if (shared->channels != DSHASH_HANDLE_INVALID)
+    {
+        oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+        db->g_channels = dshash_attach(db->g_dsa, &spchannel_params, shared->channels, NULL);
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    LWLockRelease(&shared->pubsub_lck);
+
+    return db->g_channels;
+}
+
+/* Our slot in db, giving it a ring first if we're not subscribed yet */
+static SpatSubscriber*
+spat_pubsub_subscriber(SpatDB* db)
+{
+    SpatSubscriber* sub;
+    SpatRing* ring;
+    uint32 size;
+
+    if (db->subscriber)
+        return db->subscriber;
+
+    if (MyProcNumber < 0 || MyProcNumber >= MaxBackends)
+        elog(ERROR, "this process cannot subscribe to channels");
+
+    (void) spat_pubsub_channels(db, true);
+    sub = (SpatSubscriber*)dsa_get_address(db->g_dsa, db->shared->subscribers) + MyProcNumber;
+
+    size = pg_nextpower2_32((uint32)g_guc_spat_pubsub_buffer_size);
+    sub->ring = spat_dsa_allocate(db->g_dsa, offsetof(SpatRing, cells) + sizeof(SpatRingCell) * size);
+
+    ring = dsa_get_address(db->g_dsa, sub->ring);
+    ring->mask = size - 1;
+    pg_atomic_init_u64(&ring->head, 0);
+    ring->tail = 0;
+    for (uint32 i = 0; i < size; i++)
+    {
+        pg_atomic_init_u64(&ring->cells[i].seq, i);
+        ring->cells[i].msg = InvalidDsaPointer;
+    }
+
+    db->subscriber = sub;
+    return sub;
+}
+
+static bool
+spat_pubsub_subscribed(SpatDB* db, const char* channel)
+{
+    ListCell* lc;
+
+    foreach(lc, db->channels)
+    {
+        if (strcmp((char*)lfirst(lc), channel) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+/* Add us to the subscribers of channel, creating it if it has none */
+static void
+spat_pubsub_join(SpatDB* db, text* channel)
+{
+    dss key = dss_new_local(channel);
+    bool found;
+    SpatChannel* chan;
+    uint64* bits;
+
+    chan = dshash_find_or_insert(spat_pubsub_channels(db, true), &key, &found);
+    if (!found)
+    {
+        chan->nsubscribers = 0;
+        chan->subscribers = spat_dsa_allocate0(db->g_dsa, sizeof(uint64) * SPAT_CHANNEL_WORDS);
+        pg_atomic_init_u64(&chan->published, 0);
+        pg_atomic_init_u64(&chan->delivered, 0);
+        pg_atomic_init_u64(&chan->dropped, 0);
+    }
+
+    bits = dsa_get_address(db->g_dsa, chan->subscribers);
+    bits[MyProcNumber / 64] |= UINT64CONST(1) << (MyProcNumber % 64);
+    chan->nsubscribers++;
+
+    dshash_release_lock(db->g_channels, chan);
+}
+
+/*
+ * Remove us from the subscribers of channel, and the channel itself if it has
+ * no others. We may not be in it, if joining it failed.
+ */
+static void
+spat_pubsub_leave(SpatDB* db, const char* channel)
+{
+    text* name = cstring_to_text(channel);
+    dss key = dss_new_local(name);
+    SpatChannel* chan = dshash_find(db->g_channels, &key, true);
+    uint64* bits;
+    uint64 bit = UINT64CONST(1) << (MyProcNumber % 64);
+
+    pfree(name);
+    if (chan == NULL)
+        return;
+
+    bits = dsa_get_address(db->g_dsa, chan->subscribers);
+    if ((bits[MyProcNumber / 64] & bit) == 0)
+    {
+        dshash_release_lock(db->g_channels, chan);
+        return;
+    }
+
+    if (--chan->nsubscribers == 0)
+    {
+        dsa_free(db->g_dsa, chan->subscribers);
+        dss_free(db->g_dsa, &chan->name);
+        dshash_delete_entry(db->g_channels, chan);
+        return;
+    }
+
+    bits[MyProcNumber / 64] &= ~bit;
+    dshash_release_lock(db->g_channels, chan);
+}
+
+/* Once we've left every channel: drop whatever is still pending, and our ring */
+static void
+spat_pubsub_release_ring(SpatDB* db)
+{
+    SpatSubscriber* sub = db->subscriber;
+    SpatRing* ring = dsa_get_address(db->g_dsa, sub->ring);
+    dsa_pointer msgptr;
+
+    while ((msgptr = spat_ring_pop(ring)) != InvalidDsaPointer)
+        spat_message_release(db, msgptr);
+
+    dsa_free(db->g_dsa, sub->ring);
+    sub->ring = InvalidDsaPointer;
+    db->subscriber = NULL;
+}
+
+static void
+spat_pubsub_unsubscribe_all(SpatDB* db)
+{
+    ListCell* lc;
+
+    foreach(lc, db->channels)
+        spat_pubsub_leave(db, (char*)lfirst(lc));
+
+    list_free_deep(db->channels);
+    db->channels = NIL;
+
+    spat_pubsub_release_ring(db);
+}
+
+/* Returns the number of subscribers the message was queued for */
+SPAT_COMMAND(sppublish, SPAT_CMD_PUBLISH)
+{
+    text* channel = PG_GETARG_TEXT_PP(0);
+    text* message = PG_GETARG_TEXT_PP(1);
+    dss key = dss_new_local(channel);
+    dshash_table* htab;
+    SpatChannel* chan;
+    SpatSubscriber* subs;
+    uint64* bits;
+    dsa_pointer msgptr;
+    SpatMessage* msg;
+    int32 nqueued = 0;
+
+    spat_attach_shmem();
+
+    htab = spat_pubsub_channels(g_spat_db, false);
+    if (htab == NULL)
+        PG_RETURN_INT32(0);
+
+    chan = dshash_find(htab, &key, false);
+    if (chan == NULL)
+        PG_RETURN_INT32(0);
+
+    pg_atomic_fetch_add_u64(&chan->published, 1);
+
+    msgptr = spat_dsa_allocate(g_spat_db->g_dsa, offsetof(SpatMessage, data) +
+                          VARSIZE_ANY_EXHDR(channel) + VARSIZE_ANY_EXHDR(message));
+    msg = spat_message_get(g_spat_db, msgptr);
+    pg_atomic_init_u32(&msg->refcount, 1);    /* ours, until we're done queueing */
+    msg->chanlen = VARSIZE_ANY_EXHDR(channel);
+    msg->len = VARSIZE_ANY_EXHDR(message);
+    memcpy(msg->data, VARDATA_ANY(channel), msg->chanlen);
+    memcpy(msg->data + msg->chanlen, VARDATA_ANY(message), msg->len);
+
+    subs = dsa_get_address(g_spat_db->g_dsa, g_spat_db->shared->subscribers);
+    bits = dsa_get_address(g_spat_db->g_dsa, chan->subscribers);
+    for (int w = 0; w < SPAT_CHANNEL_WORDS; w++)
+    {
+        uint64 word = bits[w];
+
+        while (word != 0)
+        {
+            int i = w * 64 + pg_rightmost_one_pos64(word);
+            SpatSubscriber* sub = &subs[i];
+
+            word &= word - 1;
+
+            /* The subscriber may receive it before we're past the push */
+            pg_atomic_fetch_add_u32(&msg->refcount, 1);
+            if (!spat_ring_push(dsa_get_address(g_spat_db->g_dsa, sub->ring), msgptr))
+            {
+                pg_atomic_fetch_sub_u32(&msg->refcount, 1);
+                pg_atomic_fetch_add_u64(&chan->dropped, 1);
+                continue;
+            }
+
+            pg_atomic_fetch_add_u64(&chan->delivered, 1);
+            nqueued++;
+
+            /* Pairs with the barrier in spreceive, so that a subscriber going to sleep can't miss it */
+            pg_memory_barrier();
+            if (pg_atomic_read_u32(&sub->sleeping) != 0)
+                ConditionVariableSignal(&sub->cv);
+        }
+    }
+
+    dshash_release_lock(htab, chan);
+    spat_message_release(g_spat_db, msgptr);
+
+    PG_RETURN_INT32(nqueued);
+}
+
+/* Returns the number of channels we're subscribed to in the current DB */
+SPAT_COMMAND(spsubscribe, SPAT_CMD_SUBSCRIBE)
+{
+    ArrayType* channelsarr = PG_GETARG_ARRAYTYPE_P(0);
+    Datum* channels;
+    bool* nulls;
+    int nchannels;
+
+    deconstruct_array_builtin(channelsarr, TEXTOID, &channels, &nulls, &nchannels);
+
+    spat_attach_shmem();
+
+    for (int i = 0; i < nchannels; i++)
+    {
+        text* channel;
+        char* name;
+        MemoryContext oldcontext;
+
+        if (nulls[i])
+            elog(ERROR, "channel cannot be NULL");
+
+        channel = DatumGetTextPP(channels[i]);
+        name = text_to_cstring(channel);
+        if (spat_pubsub_subscribed(g_spat_db, name))
+            continue;
+
+        (void) spat_pubsub_subscriber(g_spat_db);
+
+        /* Remember the channel first, so that an error can't leave us in it without knowing */
+        oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+        g_spat_db->channels = lappend(g_spat_db->channels, pstrdup(name));
+        MemoryContextSwitchTo(oldcontext);
+
+        spat_pubsub_join(g_spat_db, channel);
+    }
+
+    PG_RETURN_INT32(list_length(g_spat_db->channels));
+}
+
+/* Leaves the given channels, or all of them. Returns the number we're still subscribed to */
+SPAT_COMMAND(spunsubscribe, SPAT_CMD_UNSUBSCRIBE)
+{
+    spat_attach_shmem();
+
+    if (g_spat_db->subscriber == NULL)
+        PG_RETURN_INT32(0);
+
+    if (PG_ARGISNULL(0))
+    {
+        spat_pubsub_unsubscribe_all(g_spat_db);
+        PG_RETURN_INT32(0);
+    }
+    else
+    {
+        ArrayType* channelsarr = PG_GETARG_ARRAYTYPE_P(0);
+        Datum* channels;
+        bool* nulls;
+        int nchannels;
+
+        deconstruct_array_builtin(channelsarr, TEXTOID, &channels, &nulls, &nchannels);
+
+        for (int i = 0; i < nchannels; i++)
+        {
+            char* name;
+            ListCell* lc;
+
+            if (nulls[i])
+                continue;
+
+            name = TextDatumGetCString(channels[i]);
+            foreach(lc, g_spat_db->channels)
+            {
+                char* subscribed = (char*)lfirst(lc);
+
+                if (strcmp(subscribed, name) == 0)
+                {
+                    spat_pubsub_leave(g_spat_db, subscribed);
+                    g_spat_db->channels = foreach_delete_current(g_spat_db->channels, lc);
+                    pfree(subscribed);
+                    break;
+                }
+            }
+        }
+
+        if (g_spat_db->channels == NIL)
+            spat_pubsub_release_ring(g_spat_db);
+    }
+
+    PG_RETURN_INT32(list_length(g_spat_db->channels));
+}
+
+/*
+ * Returns the oldest message pending for us in the current DB, and the
+ * channel it was published to, waiting for one like BLPOP does.
+ */
+SPAT_COMMAND(spreceive, SPAT_CMD_RECEIVE)
+{
+    Interval* timeout = PG_ARGISNULL(0) ? NULL : PG_GETARG_INTERVAL_P(0);
+    TimestampTz deadline = 0;
+    SpatSubscriber* sub;
+    SpatRing* ring;
+    dsa_pointer msgptr;
+    SpatMessage* msg;
+    TupleDesc tupdesc;
+    Datum values[2];
+    bool isnull[2] = {0};
+
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        elog(ERROR, "return type must be a row type");
+
+    if (timeout)
+    {
+        TimestampTz now = GetCurrentTimestamp();
+
+        deadline = DatumGetTimestampTz(DirectFunctionCall2(timestamptz_pl_interval,
+                                                           TimestampTzGetDatum(now),
+                                                           PointerGetDatum(timeout)));
+        if (deadline < now)
+            elog(ERROR, "timeout cannot be negative");
+
+        /* A zero timeout waits forever, as in Redis */
+        if (deadline == now)
+            deadline = 0;
+    }
+
+    spat_attach_shmem();
+
+    sub = g_spat_db->subscriber;
+    if (sub == NULL)
+        elog(ERROR, "not subscribed to any channel");
+
+    ring = dsa_get_address(g_spat_db->g_dsa, sub->ring);
+    msgptr = spat_ring_pop(ring);
+
+    if (msgptr == InvalidDsaPointer)
+    {
+        PG_TRY();
+        {
+            /* Before looking again, so that a publisher either sees us sleeping or we see its message */
+            ConditionVariablePrepareToSleep(&sub->cv);
+            pg_atomic_write_u32(&sub->sleeping, 1);
+            pg_memory_barrier();
+
+            for (;;)
+            {
+                long timeout_ms = -1;
+
+                msgptr = spat_ring_pop(ring);
+                if (msgptr != InvalidDsaPointer)
+                    break;
+
+                if (deadline)
+                {
+                    TimestampTz now = GetCurrentTimestamp();
+
+                    if (now >= deadline)
+                        break;
+                    timeout_ms = TimestampDifferenceMilliseconds(now, deadline);
+                }
+
+                (void) ConditionVariableTimedSleep(&sub->cv, timeout_ms,
+                                                   spat_wait_event(&g_spat_wait_receive, "SpatReceive"));
+            }
+        }
+        PG_FINALLY();
+        {
+            pg_atomic_write_u32(&sub->sleeping, 0);
+            ConditionVariableCancelSleep();
+        }
+        PG_END_TRY();
+    }
+
+    if (msgptr == InvalidDsaPointer)
+        PG_RETURN_NULL();
+
+    msg = spat_message_get(g_spat_db, msgptr);
+    values[0] = PointerGetDatum(cstring_to_text_with_len(msg->data, msg->chanlen));
+    values[1] = PointerGetDatum(cstring_to_text_with_len(msg->data + msg->chanlen, msg->len));
+    spat_message_release(g_spat_db, msgptr);
+
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, isnull)));
+}
+
+PG_FUNCTION_INFO_V1(sp_pubsub_channels);
+
+/* The channels of the current DB having subscribers, and their delivery counters */
+Datum
+sp_pubsub_channels(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo* rsinfo = (ReturnSetInfo*)fcinfo->resultinfo;
+    dshash_table* htab;
+    dshash_seq_status status;
+    SpatChannel* chan;
+
+    InitMaterializedSRF(fcinfo, MAT_SRF_USE_EXPECTED_DESC);
+
+    spat_attach_shmem();
+
+    htab = spat_pubsub_channels(g_spat_db, false);
+    if (htab == NULL)
+        return (Datum) 0;
+
+    dshash_seq_init(&status, htab, false);
+    while ((chan = dshash_seq_next(&status)) != NULL)
+    {
+        Datum values[5];
+        bool nulls[5] = {0};
+
+        values[0] = PointerGetDatum(dss_to_text(g_spat_db->g_dsa, chan->name));
+        values[1] = Int32GetDatum((int32)chan->nsubscribers);
+        values[2] = Int64GetDatum((int64)pg_atomic_read_u64(&chan->published));
+        values[3] = Int64GetDatum((int64)pg_atomic_read_u64(&chan->delivered));
+        values[4] = Int64GetDatum((int64)pg_atomic_read_u64(&chan->dropped));
+
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+    }
+    dshash_seq_term(&status);
+
+    return (Datum) 0;
+}
+
+/*
+ * ---------------------------------------- Bulk loading
+ * ----------------------------------------
+ *
+ * sp_load runs a query and SETs the value in its second column at the key in
+ * its first, fetching SPAT_LOAD_BATCH_ROWS rows at a time through a cursor,
+ * so that memory stays flat however many rows it returns. Each batch is then
+ * written like an SPMSET, in visiting order. Columns that aren't text are
+ * converted with their output functions, as COPY would.
+ *
+ * dshash can't be created with a given size, so tables still grow by
+ * doubling as the load goes, which amortizes to little per row.
+ */
+#define SPAT_LOAD_BATCH_ROWS 10000
+
+/* Column col of tuple as text; typoutput is InvalidOid if it's text already */
+static text*
+spat_load_column(HeapTuple tuple, TupleDesc tupdesc, int col, Oid typoutput, const char* what)
+{
+    bool isnull;
+    Datum value = SPI_getbinval(tuple, tupdesc, col, &isnull);
+
+    if (isnull)
+        elog(ERROR, "%s cannot be NULL", what);
+
+    if (!OidIsValid(typoutput))
+        return DatumGetTextPP(value);
+
+    return cstring_to_text(OidOutputFunctionCall(typoutput, value));
+}
+
+static Oid
+spat_load_typoutput(TupleDesc tupdesc, int col)
+{
+    Oid typid = SPI_gettypeid(tupdesc, col);
+    Oid typoutput;
+    bool typisvarlena;
+
+    if (typid == TEXTOID || typid == VARCHAROID)
+        return InvalidOid;
+
+    getTypeOutputInfo(typid, &typoutput, &typisvarlena);
+    return typoutput;
+}
+
+/* SET the (key, value) rows of a query, with the same TTL; returns how many */
+SPAT_COMMAND(sp_load, SPAT_CMD_LOAD)
+{
+    char* query;
+    TimestampTz expireat;
+    MemoryContext batchcxt;
+    MemoryContext oldcontext;
+    SPIPlanPtr plan;
+    Portal portal;
+    int64 nloaded = 0;
+
+    if (PG_ARGISNULL(0))
+        elog(ERROR, "query cannot be NULL");
+
+    query = text_to_cstring(PG_GETARG_TEXT_PP(0));
+
+    /* All keys expire together, as if SET in the same instant */
+    expireat = spat_expireat(PG_ARGISNULL(1) ? NULL : PG_GETARG_INTERVAL_P(1));
+
+    spat_attach_shmem();
+
+    batchcxt = AllocSetContextCreate(CurrentMemoryContext, "spat load batch", ALLOCSET_DEFAULT_SIZES);
+
+    if (SPI_connect() != SPI_OK_CONNECT)
+        elog(ERROR, "SPI_connect failed");
+
+    plan = SPI_prepare(query, 0, NULL);
+    if (plan == NULL)
+        elog(ERROR, "could not prepare query: %s", SPI_result_code_string(SPI_result));
+    portal = SPI_cursor_open(NULL, plan, NULL, NULL, false);
+
+    for (;;)
+    {
+        SPITupleTable* tuptable;
+        TupleDesc tupdesc;
+        SpatBatchKey* keys;
+        text** values;
+        Oid keyout;
+        Oid valout;
+        int nrows;
+
+        SPI_cursor_fetch(portal, true, SPAT_LOAD_BATCH_ROWS);
+        if (SPI_processed == 0)
+            break;
+
+        tuptable = SPI_tuptable;
+        tupdesc = tuptable->tupdesc;
+        nrows = (int)SPI_processed;
+
+        if (tupdesc->natts < 2)
+            elog(ERROR, "query must return a key and a value column");
+
+        oldcontext = MemoryContextSwitchTo(batchcxt);
+
+        keyout = spat_load_typoutput(tupdesc, 1);
+        valout = spat_load_typoutput(tupdesc, 2);
+        keys = palloc(sizeof(SpatBatchKey) * nrows);
+        values = palloc(sizeof(text*) * nrows);
+        for (int i = 0; i < nrows; i++)
+        {
+            keys[i].idx = i;
+            keys[i].key = dss_new_local(spat_load_column(tuptable->vals[i], tupdesc, 1, keyout, "keys"));
+            values[i] = spat_load_column(tuptable->vals[i], tupdesc, 2, valout, "value");
+        }
+
+        spat_batch_sort(g_spat_db, keys, nrows);
+
+        for (int i = 0; i < nrows; i++)
+        {
+            SpatDBEntry* entry;
+
+            spdb_evict_if_needed(g_spat_db);
+            entry = spdb_set_string(g_spat_db, keys[i].key, values[keys[i].idx], expireat);
+            spdb_release_lock(g_spat_db, entry);
+        }
+
+        MemoryContextSwitchTo(oldcontext);
+        MemoryContextReset(batchcxt);
+        SPI_freetuptable(tuptable);
+
+        nloaded += nrows;
+        CHECK_FOR_INTERRUPTS();
+    }
+
+    SPI_cursor_close(portal);
+    SPI_finish();
+    MemoryContextDelete(batchcxt);
+
+    PG_RETURN_INT64(nloaded);
+}
+
+/*
+ * ---------------------------------------- Snapshots
+ * ----------------------------------------
+ *
+ * SP_SAVE writes the keys of a DB to a file that SP_LOAD_SNAPSHOT reads back.
+ * When spat is preloaded and spat.snapshot_dir is set, the background worker
+ * also saves every DB there each spat.snapshot_interval and at shutdown, and
+ * restores them all when it first starts. A snapshot holds the logical
+ * content of the DB, so it doesn't depend on encodings, shards or the hash
+ * function, and can be loaded into any DB:
+ *
+ *   header   "SPATSNAP", uint32 version, DB name
+ *   record   uint8 type, key, int64 expireat (SpMaxTTL if none), uint64 LSN, then
+ *              string  value
+ *              datum   the payload of a string SET from another type than text
+ *              list    uint32 n, n elements head to tail
+ *              set     uint32 n, n members
+ *              hash    uint32 n, n fields each followed by its value
+ *              zset    uint32 n, n members each followed by a float8 score, by rank
+ *   trailer  uint8 0, uint64 number of records, uint64 highest LSN, uint32 CRC-32C
+ *            of all the above
+ *
+ * Strings are a uint32 length followed by that many bytes, which is how
+ * SpatPack items are laid out too, and numbers are in native byte order,
+ * which the version word gives away.
+ *
+ * Both ways stream through a SPAT_SNAP_BUFSIZE buffer, so neither keeps a
+ * copy of the DB in backend memory. Saving lists the keys of each shard in
+ * turn, with one partition locked at a time like a scan, then writes them
+ * one by one: a string is copied out under its entry lock, a collection is
+ * pinned and serialized under its own lock only, and no write to the file
+ * happens with a partition locked. Every key is consistent, but keys written
+ * meanwhile may or may not make it. Only the keys of one shard are copied at
+ * a time. Loading first reads the whole file to check its CRC, so that a
+ * corrupt or truncated file loads nothing, then writes keys as SET, RPUSH,
+ * SADD, HSET and ZADD would, overwriting any keys already there, except those
+ * that logged a change newer than the snapshot's: as in replay, that change
+ * wins, so that what's written while the worker restores isn't rolled back.
+ * Unlogged changes don't have an LSN to tell, and are overwritten. Keys whose
+ * TTL has gone by since are skipped.
+ */
+
+#define SPAT_SNAP_MAGIC "SPATSNAP"
+#define SPAT_SNAP_VERSION 3
+#define SPAT_SNAP_BUFSIZE (64 * 1024)
+#define SPAT_SNAP_SUFFIX ".snap"
+
+#define SPAT_SNAP_END 0
+#define SPAT_SNAP_STRING 's'
+#define SPAT_SNAP_DATUM 'd'
+#define SPAT_SNAP_LIST 'l'
+#define SPAT_SNAP_SET 'e'
+#define SPAT_SNAP_HASH 'h'
+#define SPAT_SNAP_ZSET 'z'
+
+typedef struct SpatSnapFile
+{
+    int fd;
+    const char* what;           /* "snapshot" or "change log", for messages */
+    const char* path;
+    char* buf;                  /* SPAT_SNAP_BUFSIZE */
+    int pos;                    /* next byte of buf to read or write */
+    int len;                    /* bytes read into buf */
+    pg_crc32c crc;
+    uint64 nrecords;
+    uint64 maxlsn;              /* highest LSN of the records, from the trailer when reading */
+} SpatSnapFile;
+
+static void
+spat_snap_open(SpatSnapFile* f, const char* what, const char* path, int flags)
+{
+    f->fd = OpenTransientFile(path, flags | PG_BINARY);
+    if (f->fd < 0)
+        elog(ERROR, "could not open %s file \"%s\": %m", what, path);
+
+    f->what = what;
+    f->path = path;
+    f->buf = palloc(SPAT_SNAP_BUFSIZE);
+    f->pos = 0;
+    f->len = 0;
+    f->nrecords = 0;
+    f->maxlsn = 0;
+    INIT_CRC32C(f->crc);
+}
+
+static void
+spat_snap_close(SpatSnapFile* f)
+{
+    if (CloseTransientFile(f->fd) != 0)
+        elog(ERROR, "could not close %s file \"%s\": %m", f->what, f->path);
+    pfree(f->buf);
+}
+
+static void
+spat_snap_flush(SpatSnapFile* f)
+{
+    char* p = f->buf;
+
+    while (f->pos > 0)
+    {
+        ssize_t n = write(f->fd, p, f->pos);
+
+        if (n <= 0)
+        {
+            /* A short write without errno probably means ENOSPC */
+            if (n == 0 || errno == 0)
+                errno = ENOSPC;
+            elog(ERROR, "could not write %s file \"%s\": %m", f->what, f->path);
+        }
+        p += n;
+        f->pos -= n;
+    }
+}
+
+static void
+spat_snap_write(SpatSnapFile* f, const void* data, Size len)
+{
+    const char* p = data;
+
+    COMP_CRC32C(f->crc, data, len);
+    while (len > 0)
+    {
+        Size n = Min(len, (Size)(SPAT_SNAP_BUFSIZE - f->pos));
+
+        memcpy(f->buf + f->pos, p, n);
+        f->pos += n;
+        p += n;
+        len -= n;
+        if (f->pos == SPAT_SNAP_BUFSIZE)
+            spat_snap_flush(f);
+    }
+}
+
+static inline void
+spat_snap_write_u8(SpatSnapFile* f, uint8 v)
+{
+    spat_snap_write(f, &v, sizeof(v));
+}
+
+static inline void
+spat_snap_write_u32(SpatSnapFile* f, uint32 v)
+{
+    spat_snap_write(f, &v, sizeof(v));
+}
+
+static inline void
+spat_snap_write_str(SpatSnapFile* f, const char* str, uint32 len)
+{
+    spat_snap_write_u32(f, len);
+    spat_snap_write(f, str, len);
+}
+
+static inline void
+spat_snap_write_dss(SpatDB* db, SpatSnapFile* f, const dss* s)
+{
+    spat_snap_write_str(f, dss_ptr(db->g_dsa, s), s->len - 1);
+}
+
+/* Reads len bytes into data; false if the file ends first */
+static bool
+spat_snap_read_raw(SpatSnapFile* f, void* data, Size len)
+{
+    char* p = data;
+
+    while (len > 0)
+    {
+        Size n;
+
+        if (f->pos == f->len)
+        {
+            ssize_t nread = read(f->fd, f->buf, SPAT_SNAP_BUFSIZE);
+
+            if (nread < 0)
+                elog(ERROR, "could not read %s file \"%s\": %m", f->what, f->path);
+            if (nread == 0)
+                return false;
+            f->pos = 0;
+            f->len = (int)nread;
+        }
+
+        n = Min(len, (Size)(f->len - f->pos));
+        memcpy(p, f->buf + f->pos, n);
+        f->pos += n;
+        p += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+/* Past the CRC check a file can't end early, unless it's changed under us */
+static void
+spat_snap_read(SpatSnapFile* f, void* data, Size len)
+{
+    if (!spat_snap_read_raw(f, data, len))
+        elog(ERROR, "%s file \"%s\" is truncated", f->what, f->path);
+}
+
+static inline uint32
+spat_snap_read_u32(SpatSnapFile* f)
+{
+    uint32 v;
+
+    spat_snap_read(f, &v, sizeof(v));
+    return v;
+}
+
+/* A string, into buf, which keeps VARHDRSZ bytes in front so it can pass for a text */
+static void
+spat_snap_read_str(SpatSnapFile* f, StringInfo buf)
+{
+    uint32 len = spat_snap_read_u32(f);
+
+    if (len >= MaxAllocSize - VARHDRSZ)
+        elog(ERROR, "%s file \"%s\" is corrupt", f->what, f->path);
+
+    resetStringInfo(buf);
+    enlargeStringInfo(buf, VARHDRSZ + len);
+    spat_snap_read(f, buf->data + VARHDRSZ, len);
+    buf->len = VARHDRSZ + len;
+    buf->data[buf->len] = '\0';
+    SET_VARSIZE(buf->data, buf->len);
+}
+
+/* A lookup-only dss for a string read by spat_snap_read_str */
+static inline dss
+spat_snap_dss(StringInfo buf)
+{
+    return dss_new_local((text*)buf->data);
+}
+
+/* The record type of the value of entry */
+static uint8
+spat_snap_type(SpatDBEntry* entry)
+{
+    switch (entry->valtyp)
+    {
+    case SPVAL_STRING:
+        return entry->encoding == SPAT_ENC_DATUM ? SPAT_SNAP_DATUM : SPAT_SNAP_STRING;
+    case SPVAL_LIST:
+        return SPAT_SNAP_LIST;
+    case SPVAL_SET:
+        return SPAT_SNAP_SET;
+    case SPVAL_HASH:
+        return SPAT_SNAP_HASH;
+    case SPVAL_ZSET:
+        return SPAT_SNAP_ZSET;
+    default:
+        elog(ERROR, "unexpected value type %d", entry->valtyp);
+    }
+
+    return SPAT_SNAP_END;
+}
+
+/* The contents of coll, which is locked */
+static void
+spat_snap_write_coll(SpatDB* db, SpatSnapFile* f, SpatColl* coll)
+{
+    switch (coll->valtyp)
+    {
+    case SPVAL_LIST:
+        {
+            SpatListIter it;
+            char* item;
+
+            spat_snap_write_u32(f, coll->value.list.size);
+            if (coll->value.list.size == 0)
+                break;
+
+            /* Pack items are already laid out as snapshot strings */
+            spat_list_seek(db, coll, 0, &it);
+            while ((item = spat_list_next(db, &it)) != NULL)
+                spat_snap_write(f, item, SPAT_PACK_ITEM_HDRSZ + spat_pack_item_len(item));
+            break;
+        }
+
+    case SPVAL_SET:
+    case SPVAL_HASH:
+        {
+            bool isset = coll->valtyp == SPVAL_SET;
+            dshash_table_handle hndl = isset ? coll->value.set.hndl : coll->value.hash.hndl;
+
+            spat_snap_write_u32(f, isset ? coll->value.set.size : coll->value.hash.size);
+
+            if (coll->encoding == SPAT_ENC_LISTPACK)
+            {
+                SpatPack* pack = dsa_get_address(db->g_dsa, hndl);
+
+                /* A hash's fields and values alternate already */
+                spat_snap_write(f, SPAT_PACK_ITEMS(pack), pack->used);
+            }
+            else
+            {
+                dshash_table* htab = dshash_attach(db->g_dsa, isset ? &params_hashset : &sphash_params,
+                                                   hndl, NULL);
+                dshash_seq_status status;
+                void* item;
+
+                dshash_seq_init(&status, htab, false);
+                while ((item = dshash_seq_next(&status)) != NULL)
+                {
+                    spat_snap_write_dss(db, f, (dss*)item);
+                    if (!isset)
+                        spat_snap_write_dss(db, f, &((sphash_entry*)item)->value);
+                }
+                dshash_seq_term(&status);
+                dshash_detach(htab);
+            }
+            break;
+        }
+
+    case SPVAL_ZSET:
+        {
+            SpatZSkiplist* zsl = spat_zsl(db, coll);
+            dsa_pointer nodeptr = SPAT_ZNODE(db, zsl->header)->levels[0].forward;
+
+            spat_snap_write_u32(f, coll->value.zset.size);
+            while (DsaPointerIsValid(nodeptr))
+            {
+                SpatZNode* node = SPAT_ZNODE(db, nodeptr);
+
+                spat_snap_write_dss(db, f, &node->member);
+                spat_snap_write(f, &node->score, sizeof(node->score));
+                nodeptr = node->levels[0].forward;
+            }
+            break;
+        }
+
+    default:
+        elog(ERROR, "unexpected value type %d", coll->valtyp);
+    }
+}
+
+/*
+ * Write the record of key, unless it's gone or has expired by now. A string
+ * is copied out with its entry locked, a collection is pinned and serialized
+ * with only itself locked, so that the file is never written to with an entry
+ * locked, and thus the partition of other keys.
+ */
+static void
+spat_snap_write_key(SpatDB* db, SpatSnapFile* f, dss* key, TimestampTz now)
+{
+    dshash_table* htab = SPDB_HTAB_FOR(db, key);
+    SpatDBEntry* entry = dshash_find(htab, key, false);
+    struct varlena* str = NULL;
+    SpatColl* coll = NULL;
+    TimestampTz expireat;
+    uint64 lsn;
+    uint8 type;
+
+    if (entry == NULL)
+        return;
+    if (entry->valtyp == SPVAL_NULL || SPDB_ENTRY_EXPIRED(entry, now))
+    {
+        dshash_release_lock(htab, entry);
+        return;
+    }
+
+    type = spat_snap_type(entry);
+    expireat = entry->expireat;
+    lsn = entry->lsn;
+
+    if (SPDB_ENTRY_HAS_COLL(entry))
+    {
+        coll = spat_coll_pin(db, entry);
+        if (!spat_coll_lock_pinned(db, coll, LW_SHARED))
+        {
+            /* Replaced since, by a key written after the listing */
+            spat_coll_unpin(db, coll);
+            return;
+        }
+        lsn = Max(lsn, coll->lsn);
+    }
+    else
+    {
+        bool datum;
+
+        /* Datums are saved in their binary form */
+        str = spat_entry_string(db, entry, &datum);
+        dshash_release_lock(htab, entry);
+    }
+
+    spat_snap_write_u8(f, type);
+    spat_snap_write_dss(db, f, key);
+    spat_snap_write(f, &expireat, sizeof(expireat));
+    spat_snap_write(f, &lsn, sizeof(lsn));
+    f->maxlsn = Max(f->maxlsn, lsn);
+
+    if (coll)
+    {
+        spat_snap_write_coll(db, f, coll);
+        spat_coll_unlock(db, coll);
+    }
+    else
+    {
+        spat_snap_write_str(f, VARDATA(str), VARSIZE(str) - VARHDRSZ);
+        pfree(str);
+    }
+
+    f->nrecords++;
+}
+
+/* Save db to path, through a temporary file renamed over it. Returns the number of keys */
+static uint64
+spat_snapshot_save(SpatDB* db, const char* path)
+{
+    char tmppath[MAXPGPATH];
+    TimestampTz now = GetCurrentTimestamp();
+    const char* name = dsa_get_address(db->g_dsa, db->shared->name);
+    uint32 version = SPAT_SNAP_VERSION;
+    uint64 nrecords;
+    pg_crc32c crc;
+    SpatSnapFile f;
+    MemoryContext keycxt = AllocSetContextCreate(CurrentMemoryContext, "spat snapshot keys",
+                                                 ALLOCSET_DEFAULT_SIZES);
+
+    snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+    spat_snap_open(&f, "snapshot", tmppath, O_WRONLY | O_CREAT | O_TRUNC);
+
+    spat_snap_write(&f, SPAT_SNAP_MAGIC, strlen(SPAT_SNAP_MAGIC));
+    spat_snap_write_u32(&f, version);
+    spat_snap_write_str(&f, name, strlen(name));
+
+    for (int shard = 0; shard < db->shared->nshards; shard++)
+    {
+        MemoryContext oldcontext = MemoryContextSwitchTo(keycxt);
+        dshash_seq_status status;
+        SpatDBEntry* entry;
+        int maxkeys = 1024;
+        int nkeys = 0;
+        dss* keys = palloc(maxkeys * sizeof(dss));
+
+        /* List the keys first, the file is only written with no partition locked */
+        dshash_seq_init(&status, spdb_htab(db, shard), false);
+        while ((entry = dshash_seq_next(&status)) != NULL)
+        {
+            if (entry->valtyp == SPVAL_NULL || SPDB_ENTRY_EXPIRED(entry, now))
+                continue;
+
+            if (nkeys == maxkeys)
+            {
+                maxkeys *= 2;
+                keys = repalloc(keys, maxkeys * sizeof(dss));
+            }
+            keys[nkeys] = dss_new_local(dss_to_text(db->g_dsa, entry->key));
+            keys[nkeys].hash = entry->key.hash;
+            nkeys++;
+        }
+        dshash_seq_term(&status);
+        MemoryContextSwitchTo(oldcontext);
+
+        for (int i = 0; i < nkeys; i++)
+        {
+            spat_snap_write_key(db, &f, &keys[i], now);
+            if ((i + 1) % 1024 == 0)
+                CHECK_FOR_INTERRUPTS();
+        }
+        MemoryContextReset(keycxt);
+
+        CHECK_FOR_INTERRUPTS();
+    }
+    MemoryContextDelete(keycxt);
+
+    nrecords = f.nrecords;
+    spat_snap_write_u8(&f, SPAT_SNAP_END);
+    spat_snap_write(&f, &nrecords, sizeof(nrecords));
+    spat_snap_write(&f, &f.maxlsn, sizeof(f.maxlsn));
+
+    /* The CRC covers everything before it */
+    crc = f.crc;
+    FIN_CRC32C(crc);
+    spat_snap_write(&f, &crc, sizeof(crc));
+    spat_snap_flush(&f);
+
+    if (pg_fsync(f.fd) != 0)
+        elog(ERROR, "could not fsync snapshot file \"%s\": %m", tmppath);
+    spat_snap_close(&f);
+
+    durable_rename(tmppath, path, ERROR);
+
+    return nrecords;
+}
+
+/*
+ * Open a snapshot for restoring and check its CRC, leaving it right past its
+ * header, with maxlsn read from its trailer. If name is given, it gets the
+ * name of the DB that was saved. Returns false, with a WARNING, if the file
+ * is corrupt.
+ */
+static bool
+spat_snapshot_open(SpatSnapFile* f, const char* path, StringInfo name)
+{
+    char magic[sizeof(SPAT_SNAP_MAGIC) - 1];
+    uint32 version;
+    pg_crc32c crc;
+    pg_crc32c stored;
+    off_t size;
+    StringInfoData buf;
+
+    spat_snap_open(f, "snapshot", path, O_RDONLY);
+
+    size = lseek(f->fd, 0, SEEK_END);
+    if (size < 0 || lseek(f->fd, 0, SEEK_SET) != 0)
+        elog(ERROR, "could not seek in snapshot file \"%s\": %m", path);
+
+    if (size < (off_t)(sizeof(magic) + sizeof(version) + sizeof(f->maxlsn) + sizeof(crc)))
+        goto corrupt;
+
+    INIT_CRC32C(crc);
+    for (off_t left = size - sizeof(crc); left > 0;)
+    {
+        ssize_t n = read(f->fd, f->buf, Min(left, SPAT_SNAP_BUFSIZE));
+
+        if (n < 0)
+            elog(ERROR, "could not read snapshot file \"%s\": %m", path);
+        if (n == 0)
+            goto corrupt;
+        COMP_CRC32C(crc, f->buf, n);
+        left -= n;
+    }
+    FIN_CRC32C(crc);
+
+    if (!spat_snap_read_raw(f, &stored, sizeof(stored)) || !EQ_CRC32C(crc, stored))
+        goto corrupt;
+
+    if (pg_pread(f->fd, &f->maxlsn, sizeof(f->maxlsn),
+                 size - sizeof(crc) - sizeof(f->maxlsn)) != sizeof(f->maxlsn))
+        elog(ERROR, "could not read snapshot file \"%s\": %m", path);
+
+    if (lseek(f->fd, 0, SEEK_SET) != 0)
+        elog(ERROR, "could not seek in snapshot file \"%s\": %m", path);
+    f->pos = f->len = 0;
+
+    spat_snap_read(f, magic, sizeof(magic));
+    version = spat_snap_read_u32(f);
+    if (memcmp(magic, SPAT_SNAP_MAGIC, sizeof(magic)) != 0 || version != SPAT_SNAP_VERSION)
+        goto corrupt;
+
+    initStringInfo(&buf);
+    spat_snap_read_str(f, &buf);
+    if (name)
+        appendStringInfoString(name, buf.data + VARHDRSZ);
+    pfree(buf.data);
+
+    return true;
+
+corrupt:
+    elog(WARNING, "snapshot file \"%s\" is corrupt or from another version", path);
+    spat_snap_close(f);
+    return false;
+}
+
+/*
+ * The entry to restore key into, locked, or NULL if the key has logged a
+ * change newer than lsn meanwhile: as in replay, that change wins.
+ */
+static SpatDBEntry*
+spat_snap_entry_for(SpatDB* db, dss key, uint64 lsn, bool* found)
+{
+    SpatDBEntry* entry = spdb_find_or_insert(db, key, found);
+
+    if (*found && spdb_lsn(db, entry) > lsn)
+    {
+        spdb_release_lock(db, entry);
+        return NULL;
+    }
+
+    return entry;
+}
+
+/* The records of spat_snapshot_restore */
+static uint64
+spat_snapshot_restore_records(SpatDB* db, SpatSnapFile* f)
+{
+    TimestampTz now = GetCurrentTimestamp();
+    StringInfoData keybuf;
+    StringInfoData buf;
+    StringInfoData valbuf;
+    uint64 nrecords = 0;
+    uint64 nrestored = 0;
+    uint64 maxlsn = 0;
+    uint64 saved;
+    uint64 savedlsn;
+
+    initStringInfo(&keybuf);
+    initStringInfo(&buf);
+    initStringInfo(&valbuf);
+
+    /* Before any key is restored, so that changes made meanwhile log LSNs past the snapshot's */
+    spat_aof_advance_lsn(db, f->maxlsn);
+
+    for (;;)
+    {
+        uint8 type;
+        TimestampTz expireat;
+        uint64 lsn;
+        bool skip;
+        dss key;
+        SpatDBEntry* entry = NULL;
+        SpatColl* coll = NULL;
+        bool found;
+        uint32 n = 0;
+
+        spat_snap_read(f, &type, sizeof(type));
+        if (type == SPAT_SNAP_END)
+            break;
+
+        spat_snap_read_str(f, &keybuf);
+        spat_snap_read(f, &expireat, sizeof(expireat));
+        spat_snap_read(f, &lsn, sizeof(lsn));
+        key = spat_snap_dss(&keybuf);
+        maxlsn = Max(maxlsn, lsn);
+
+        /* The items of expired keys, or of keys written since, are still read through */
+        skip = expireat != SpMaxTTL && expireat <= now;
+        if (!skip)
+            spdb_evict_if_needed(db);
+
+        if (type == SPAT_SNAP_STRING || type == SPAT_SNAP_DATUM)
+        {
+            spat_snap_read_str(f, &buf);
+            if (!skip)
+                entry = spat_snap_entry_for(db, key, lsn, &found);
+            if (entry && type == SPAT_SNAP_STRING)
+                spdb_store_string(db, entry, found, (text*)buf.data, expireat);
+            else if (entry)
+                spdb_store_value(db, entry, found, SPAT_ENC_DATUM, VARDATA(buf.data),
+                                 VARSIZE(buf.data) - VARHDRSZ, expireat);
+        }
+        else
+        {
+            n = spat_snap_read_u32(f);
+            if (!skip)
+                entry = spat_snap_entry_for(db, key, lsn, &found);
+            skip |= entry == NULL;
+            if (entry && found && entry->valtyp != SPVAL_NULL)
+                spdb_free_value(db, entry);
+
+            switch (skip ? SPAT_SNAP_END : type)
+            {
+            case SPAT_SNAP_END:
+                break;
+            case SPAT_SNAP_LIST:
+                coll = spat_list_init(db, entry);
+                break;
+            case SPAT_SNAP_SET:
+                coll = spat_set_init(db, entry);
+                break;
+            case SPAT_SNAP_HASH:
+                coll = spat_hash_init(db, entry);
+                break;
+            case SPAT_SNAP_ZSET:
+                coll = spat_zset_init(db, entry);
+                break;
+            default:
+                elog(ERROR, "snapshot file \"%s\" is corrupt", f->path);
+            }
+        }
+
+        for (uint32 i = 0; i < n; i++)
+        {
+            dss elem;
+            dss value = {0};
+            double score = 0;
+
+            spat_snap_read_str(f, &buf);
+            elem = spat_snap_dss(&buf);
+            if (type == SPAT_SNAP_HASH)
+            {
+                spat_snap_read_str(f, &valbuf);
+                value = spat_snap_dss(&valbuf);
+            }
+            else if (type == SPAT_SNAP_ZSET)
+                spat_snap_read(f, &score, sizeof(score));
+
+            if (skip)
+                continue;
+
+            /* Nobody can pin the new collection before we release its entry */
+            if (type == SPAT_SNAP_LIST)
+                spat_list_push(db, coll, &entry->key, &elem, false);
+            else if (type == SPAT_SNAP_SET)
+                spat_set_add(db, coll, &entry->key, &elem);
+            else if (type == SPAT_SNAP_HASH)
+                spat_hash_set(db, coll, &entry->key, &elem, &value);
+            else
+                spat_zset_add(db, coll, &entry->key, score, &elem);
+        }
+
+        if (entry)
+        {
+            if (type != SPAT_SNAP_STRING && type != SPAT_SNAP_DATUM)
+                spdb_set_expire(db, entry, expireat);
+            entry->lsn = lsn;
+            spdb_release_lock(db, entry);
+            nrestored++;
+        }
+
+        if (++nrecords % 1024 == 0)
+            CHECK_FOR_INTERRUPTS();
+    }
+
+    spat_snap_read(f, &saved, sizeof(saved));
+    spat_snap_read(f, &savedlsn, sizeof(savedlsn));
+    if (saved != nrecords || savedlsn != maxlsn)
+        elog(ERROR, "snapshot file \"%s\" is corrupt", f->path);
+
+    spat_snap_close(f);
+    pfree(keybuf.data);
+    pfree(buf.data);
+    pfree(valbuf.data);
+
+    return nrestored;
+}
+
+/* Run restore, a snapshot restore or a log replay of f into db, without logging what it writes */
+static uint64
+spat_restore_unlogged(uint64 (*restore) (SpatDB* db, SpatSnapFile* f), SpatDB* db, SpatSnapFile* f)
+{
+    uint64 result = 0;
+
+    g_spat_aof_replaying = true;
+    PG_TRY();
+    {
+        result = restore(db, f);
+    }
+    PG_FINALLY();
+    {
+        g_spat_aof_replaying = false;
+    }
+    PG_END_TRY();
+
+    return result;
+}
+
+/*
+ * Restore the records of a snapshot opened by spat_snapshot_open into db,
+ * and close it. Returns the number of keys restored. Keys keep the LSNs they
+ * were saved with, so that a change log can be replayed on top.
+ */
+static uint64
+spat_snapshot_restore(SpatDB* db, SpatSnapFile* f)
+{
+    return spat_restore_unlogged(spat_snapshot_restore_records, db, f);
+}
+
+/* Snapshots are server files, like those of COPY */
+static void
+spat_snapshot_check_privs(bool save)
+{
+    Oid role = save ? ROLE_PG_WRITE_SERVER_FILES : ROLE_PG_READ_SERVER_FILES;
+
+    if (!has_privs_of_role(GetUserId(), role))
+        elog(ERROR, "must be superuser or have privileges of the %s role to %s snapshots",
+             save ? "pg_write_server_files" : "pg_read_server_files",
+             save ? "save" : "load");
+}
+
+PG_FUNCTION_INFO_V1(sp_save);
+
+/* Save the current DB to path; returns the number of keys saved */
 Datum
-spvalue_in(PG_FUNCTION_ARGS)
+sp_save(PG_FUNCTION_ARGS)
+{
+    char* path = text_to_cstring(PG_GETARG_TEXT_PP(0));
+
+    spat_snapshot_check_privs(true);
+    spat_attach_shmem();
+
+    PG_RETURN_INT64((int64)spat_snapshot_save(g_spat_db, path));
+}
+
+PG_FUNCTION_INFO_V1(sp_load_snapshot);
+
+/* Load a snapshot into the current DB, whichever DB it was saved from */
+Datum
+sp_load_snapshot(PG_FUNCTION_ARGS)
+{
+    char* path = text_to_cstring(PG_GETARG_TEXT_PP(0));
+    SpatSnapFile f;
+
+    spat_snapshot_check_privs(false);
+    spat_attach_shmem();
+
+    if (!spat_snapshot_open(&f, path, NULL))
+        elog(ERROR, "could not load snapshot file \"%s\"", path);
+
+    PG_RETURN_INT64((int64)spat_snapshot_restore(g_spat_db, &f));
+}
+
+/* A file of a DB in spat.snapshot_dir, by suffix; unsafe bytes of its name are %XX */
+static void
+spat_snapshot_path(char* path, const char* name, const char* suffix)
 {
-    elog(ERROR, "spvalue_in shouldn't be called");
+    StringInfoData buf;
+
+    initStringInfo(&buf);
+    appendStringInfo(&buf, "%s/", g_guc_spat_snapshot_dir);
+    for (const char* c = name; *c; c++)
+    {
+        if (isalnum((unsigned char)*c) || *c == '-' || *c == '_')
+            appendStringInfoChar(&buf, *c);
+        else
+            appendStringInfo(&buf, "%%%02X", (unsigned char)*c);
+    }
+    appendStringInfoString(&buf, suffix);
+
+    strlcpy(path, buf.data, MAXPGPATH);
+    pfree(buf.data);
 }
 
-PG_FUNCTION_INFO_V1(spvalue_out);
+/*
+ * ---------------------------------------- Change log
+ * ----------------------------------------
+ *
+ * With spat.appendonly on, every change to a DB is also appended to its
+ * change log, <name>.aof in spat.snapshot_dir, so that what was written since
+ * the last snapshot survives a restart too. Records are logical, like
+ * snapshots, and are logged by the primitives commands write through (storing
+ * and deleting keys, adding to and removing from collections), so that
+ * replaying them runs the same code:
+ *
+ *   header   "SPATLOG", uint32 version, DB name
+ *   record   uint32 length and uint32 CRC-32C of the rest, uint8 op, uint64
+ *            LSN, key, then the arguments of op, see SPAT_AOF_*
+ *
+ * Records are copied to a SPAT_AOF_BUFSIZE ring buffer in the DSA while their
+ * key, or the collection it holds, is still locked, so a key's records are in
+ * LSN order. Whoever writes the buffer out writes all of it, so that
+ * concurrent commits share one write and one fsync (group commit): with
+ * spat.appendfsync = always, commits wait for their records to be fsynced;
+ * with everysec, the worker writes the buffer out every cycle and fsyncs it
+ * once a second; with no, it leaves the fsync to the OS. A backend that finds
+ * the buffer full writes it out itself. Records are logged as changes are
+ * made, not at commit; like the rest of spat, they aren't transactional.
+ *
+ * Saving a snapshot is what rewrites the log. The worker first renames it to
+ * <name>.aof.old, so that changes made during the save go to a new log, and
+ * removes the old one once the snapshot is durable. Each key keeps the LSN of
+ * its last logged change (split with its collection, see spdb_lsn), which
+ * snapshots save too, and replay skips records no newer than the key they'd
+ * apply to: whether a change made during a save made it into the snapshot or
+ * not, it's applied exactly once. Records only ever write their own key, so
+ * this holds key by key. At startup, the worker replays <name>.aof.old, left
+ * by a save that didn't complete, and <name>.aof on top of each snapshot. It
+ * first seeds the LSNs of each DB past those of its files, which backends
+ * wait for before they log anything, so that changes made during the restore
+ * are newer than any they replay with. A log that ends in a torn record, as a
+ * crash in the middle of a write leaves it, is replayed up to there.
+ *
+ * spat isn't WAL-logged, so a standby starts cold. SP_REPLAY_LOG replays a log
+ * into the current DB though, so shipping the snapshot and logs of a primary
+ * lets a standby warm its DB with SP_LOAD_SNAPSHOT and SP_REPLAY_LOG, or have
+ * its worker restore them at startup. Like restored snapshots, replayed changes
+ * aren't logged again.
+ */
 
-Datum
-spvalue_out(PG_FUNCTION_ARGS)
+#define SPAT_AOF_MAGIC "SPATLOG"
+#define SPAT_AOF_VERSION 1
+#define SPAT_AOF_BUFSIZE (1024 * 1024)
+#define SPAT_AOF_HDRSZ (2 * sizeof(uint32))
+#define SPAT_AOF_SUFFIX ".aof"
+#define SPAT_AOF_OLD_SUFFIX ".aof.old"
+
+static StringInfoData g_spat_aof_rec;  /* the record being logged, see spat_aof_begin */
+
+static bool
+spat_aof_active(void)
 {
-    SPValue* input = (SPValue*)PG_GETARG_POINTER(0);
-    StringInfoData output;
+    return g_guc_spat_appendonly && g_spat_preloaded && !g_spat_aof_replaying &&
+        g_guc_spat_snapshot_dir[0] != '\0';
+}
 
-    /* Initialize output string */
-    initStringInfo(&output);
+/*
+ * Start logging op on key and give it the next LSN, stored to *lsn: that of
+ * its entry, or of its collection for ops that only change the collection,
+ * which must be locked exclusively. Arguments follow with spat_aof_put*, then
+ * spat_aof_end. Returns false, and logs nothing, when the log is off.
+ */
+static bool
+spat_aof_begin(SpatDB* db, const dss* key, uint64* lsn, uint8 op)
+{
+    uint32 hdr[2] = {0, 0};
 
-    /* Convert spval back to a string based on its type */
-    switch (input->typ)
+    if (!spat_aof_active())
+        return false;
+
+    if (g_spat_aof_rec.data == NULL)
     {
-    case SPVAL_STRING:
-        appendStringInfoString(&output, text_to_cstring(input->value.varlena_val));
-        break;
-    case SPVAL_INVALID:
-        appendStringInfoString(&output, "invalid");
-        break;
-    case SPVAL_NULL:
-        appendStringInfoString(&output, "null");
-        break;
-    case SPVAL_SET:
-        appendStringInfo(&output, "set (%d)", input->value.set.size);
-        break;
-    case SPVAL_LIST:
-        appendStringInfo(&output, "list (%d)", input->value.list.size);
-        break;
-    default:
-        appendStringInfoString(&output, "invalid");
-        break;
+        MemoryContext oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+        initStringInfo(&g_spat_aof_rec);
+        MemoryContextSwitchTo(oldcontext);
     }
+    resetStringInfo(&g_spat_aof_rec);
 
-    PG_RETURN_CSTRING(output.data);
+    *lsn = pg_atomic_add_fetch_u64(&db->shared->aof_lsn, 1);
+
+    /* Length and CRC are filled in by spat_aof_end */
+    spat_aof_put(hdr, sizeof(hdr));
+    spat_aof_put(&op, sizeof(op));
+    spat_aof_put(lsn, sizeof(*lsn));
+    spat_aof_put_dss(db, key);
+
+    return true;
 }
 
+static void
+spat_aof_put(const void* data, Size len)
+{
+    appendBinaryStringInfo(&g_spat_aof_rec, data, len);
+}
 
-PG_FUNCTION_INFO_V1(spat_db_name);
+/* Strings are laid out as in snapshots, which is how SpatPack items are too */
+static void
+spat_aof_put_str(const char* str, uint32 len)
+{
+    spat_aof_put(&len, sizeof(len));
+    spat_aof_put(str, len);
+}
 
-Datum
-spat_db_name(PG_FUNCTION_ARGS)
+static void
+spat_aof_put_dss(SpatDB* db, const dss* s)
 {
-    PG_RETURN_TEXT_P(cstring_to_text(g_guc_spat_db_name));
+    spat_aof_put_str(dss_ptr(db->g_dsa, s), s->len - 1);
 }
 
-PG_FUNCTION_INFO_V1(spat_db_created_at);
+/*
+ * This backend's descriptor for the current log of db, opened again when the
+ * log has been rotated, and created with its header if needed. Called with
+ * aof_write_lck held.
+ */
+static int
+spat_aof_fd(SpatDB* db)
+{
+    char path[MAXPGPATH];
+    int fd;
 
-Datum
-spat_db_created_at(PG_FUNCTION_ARGS)
+    if (db->aof_fd >= 0 && db->aof_generation == db->shared->aof_generation)
+        return db->aof_fd;
+
+    if (db->aof_fd >= 0)
+        close(db->aof_fd);
+    db->aof_fd = -1;
+
+    if (MakePGDirectory(g_guc_spat_snapshot_dir) < 0 && errno != EEXIST)
+        elog(ERROR, "could not create snapshot directory \"%s\": %m", g_guc_spat_snapshot_dir);
+
+    /* Kept open across transactions, so not a transient file */
+    spat_snapshot_path(path, db->name, SPAT_AOF_SUFFIX);
+    fd = BasicOpenFile(path, O_WRONLY | O_CREAT | O_APPEND | PG_BINARY);
+    if (fd < 0)
+        elog(ERROR, "could not open change log file \"%s\": %m", path);
+
+    if (lseek(fd, 0, SEEK_END) == 0)
+    {
+        StringInfoData hdr;
+        uint32 version = SPAT_AOF_VERSION;
+        uint32 len = strlen(db->name);
+
+        initStringInfo(&hdr);
+        appendBinaryStringInfo(&hdr, SPAT_AOF_MAGIC, strlen(SPAT_AOF_MAGIC));
+        appendBinaryStringInfo(&hdr, (char*)&version, sizeof(version));
+        appendBinaryStringInfo(&hdr, (char*)&len, sizeof(len));
+        appendBinaryStringInfo(&hdr, db->name, len);
+
+        if (write(fd, hdr.data, hdr.len) != hdr.len)
+        {
+            if (errno == 0)
+                errno = ENOSPC;
+            close(fd);
+            elog(ERROR, "could not write change log file \"%s\": %m", path);
+        }
+        pfree(hdr.data);
+    }
+
+    db->aof_fd = fd;
+    db->aof_generation = db->shared->aof_generation;
+
+    return fd;
+}
+
+static void
+spat_aof_write_raw(SpatDB* db, const char* data, Size len)
 {
-    spat_attach_shmem();
+    while (len > 0)
+    {
+        ssize_t n = write(db->aof_fd, data, len);
 
-    TimestampTz result;
+        if (n <= 0)
+        {
+            /* A short write without errno probably means ENOSPC */
+            if (n == 0 || errno == 0)
+                errno = ENOSPC;
+            elog(ERROR, "could not write change log of \"%s\": %m", db->name);
+        }
+        data += n;
+        len -= n;
+    }
+}
 
-    SPDB_LOCK_SHARED(g_spat_db);
+/*
+ * Write out the buffered records of db, with aof_write_lck held, and aof_lck
+ * too if locked. aof_written follows each piece, so that after a failed write
+ * the next one resumes where it stopped.
+ */
+static void
+spat_aof_write_buffered(SpatDB* db, bool locked)
+{
+    SpatDBShared* shared = db->shared;
+    uint64 start;
+    uint64 end;
+    char* buf;
+
+    if (!locked)
+        LWLockAcquire(&shared->aof_lck, LW_SHARED);
+    start = shared->aof_written;
+    end = shared->aof_inserted;
+    if (!locked)
+        LWLockRelease(&shared->aof_lck);
+
+    if (start == end)
+        return;
+
+    /* Appenders never overwrite what's not written yet, so this needs no aof_lck */
+    buf = dsa_get_address(db->g_dsa, shared->aof_buf);
+    spat_aof_fd(db);
+    while (start < end)
+    {
+        Size off = start % SPAT_AOF_BUFSIZE;
+        Size n = Min(end - start, SPAT_AOF_BUFSIZE - off);
 
-    result = g_spat_db->created_at;
+        spat_aof_write_raw(db, buf + off, n);
+        start += n;
 
-    SPDB_LOCK_RELEASE(g_spat_db);
+        if (!locked)
+            LWLockAcquire(&shared->aof_lck, LW_EXCLUSIVE);
+        shared->aof_written = start;
+        if (!locked)
+            LWLockRelease(&shared->aof_lck);
+    }
+}
 
-    spat_detach_shmem();
-    PG_RETURN_TIMESTAMPTZ(result);
+/* Write out the buffered records of db, and fsync them if sync, with aof_write_lck held */
+static void
+spat_aof_flush_locked(SpatDB* db, bool sync)
+{
+    SpatDBShared* shared = db->shared;
+    uint64 written;
+    uint64 synced;
+
+    spat_aof_write_buffered(db, false);
+    if (!sync)
+        return;
+
+    LWLockAcquire(&shared->aof_lck, LW_SHARED);
+    written = shared->aof_written;
+    synced = shared->aof_synced;
+    LWLockRelease(&shared->aof_lck);
+
+    if (synced < written)
+    {
+        if (pg_fsync(spat_aof_fd(db)) != 0)
+            elog(ERROR, "could not fsync change log of \"%s\": %m", db->name);
+
+        LWLockAcquire(&shared->aof_lck, LW_EXCLUSIVE);
+        shared->aof_synced = written;
+        LWLockRelease(&shared->aof_lck);
+    }
 }
 
-static SPValue* makeSpvalFromEntry(dsa_area* dsa, SpatDBEntry* entry)
+/*
+ * Make sure the log of db is written, or fsynced if sync, at least up to
+ * position upto. Like XLogFlush, whoever gets aof_write_lck writes out the
+ * whole buffer, and those who waited for it recheck before taking their turn,
+ * as they've most likely been done already.
+ */
+static void
+spat_aof_write(SpatDB* db, uint64 upto, bool sync)
 {
-    SPValue* result = (SPValue*)palloc(sizeof(SPValue));
+    SpatDBShared* shared = db->shared;
 
-    switch (entry->valtyp)
+    for (;;)
     {
-    case SPVAL_INVALID:
-    case SPVAL_NULL:
-        break;
-    case SPVAL_STRING:
-        {
-            Size realSize = entry->value.string.len;
+        uint64 done;
 
-            text* text_result = (text*)palloc(realSize);
-            SET_VARSIZE(text_result, realSize);
+        LWLockAcquire(&shared->aof_lck, LW_SHARED);
+        done = sync ? shared->aof_synced : shared->aof_written;
+        LWLockRelease(&shared->aof_lck);
 
-            memcpy(text_result, dsa_get_address(dsa, entry->value.string.str), realSize);
+        if (done >= upto)
+            return;
 
-            result->typ = SPVAL_STRING;
-            result->value.varlena_val = text_result;
+        if (LWLockAcquireOrWait(&shared->aof_write_lck, LW_EXCLUSIVE))
             break;
-        }
-    case SPVAL_SET:
-        result->typ = SPVAL_SET;
-        result->value.set.size = entry->value.set.size;
-        break;
-    case SPVAL_LIST:
-        result->typ = SPVAL_LIST;
-        result->value.list.size = entry->value.list.size;
-        break;
     }
 
-    return result;
+    spat_aof_flush_locked(db, sync);
+    LWLockRelease(&shared->aof_write_lck);
 }
 
-PG_FUNCTION_INFO_V1(spset_generic);
+/* Append a complete record to the log buffer of db */
+static void
+spat_aof_append(SpatDB* db, const char* rec, uint32 len)
+{
+    SpatDBShared* shared = db->shared;
+    char* buf;
 
-Datum
-spset_generic(PG_FUNCTION_ARGS)
+    if (len > SPAT_AOF_BUFSIZE)
+    {
+        /* Written out right away, after the buffer, with nothing inserted in between */
+        LWLockAcquire(&shared->aof_write_lck, LW_EXCLUSIVE);
+        LWLockAcquire(&shared->aof_lck, LW_EXCLUSIVE);
+        spat_aof_write_buffered(db, true);
+        spat_aof_fd(db);
+        spat_aof_write_raw(db, rec, len);
+        shared->aof_inserted += len;
+        shared->aof_written = shared->aof_inserted;
+        db->aof_pending = shared->aof_inserted;
+        LWLockRelease(&shared->aof_lck);
+        LWLockRelease(&shared->aof_write_lck);
+        return;
+    }
+
+    for (;;)
+    {
+        uint64 inserted;
+
+        LWLockAcquire(&shared->aof_lck, LW_EXCLUSIVE);
+        if (!DsaPointerIsValid(shared->aof_buf))
+            shared->aof_buf = spat_dsa_allocate(db->g_dsa, SPAT_AOF_BUFSIZE);
+
+        if (shared->aof_inserted - shared->aof_written + len <= SPAT_AOF_BUFSIZE)
+            break;
+
+        /* Full: make room by writing it out ourselves */
+        inserted = shared->aof_inserted;
+        LWLockRelease(&shared->aof_lck);
+        spat_aof_write(db, inserted, false);
+    }
+
+    buf = dsa_get_address(db->g_dsa, shared->aof_buf);
+    for (uint32 done = 0; done < len;)
+    {
+        Size off = (shared->aof_inserted + done) % SPAT_AOF_BUFSIZE;
+        Size n = Min(len - done, SPAT_AOF_BUFSIZE - off);
+
+        memcpy(buf + off, rec + done, n);
+        done += n;
+    }
+    shared->aof_inserted += len;
+    db->aof_pending = shared->aof_inserted;
+    LWLockRelease(&shared->aof_lck);
+}
+
+static void
+spat_aof_end(SpatDB* db)
 {
-    spat_attach_shmem();
+    char* rec = g_spat_aof_rec.data;
+    uint32 len = g_spat_aof_rec.len - SPAT_AOF_HDRSZ;
+    pg_crc32c crc;
 
-    /* Input */
-    dss key = PG_GETARG_DSS(0);
-    Datum value = PG_GETARG_DATUM(1);
-    Interval* ex = PG_ARGISNULL(2) ? NULL : PG_GETARG_INTERVAL_P(2);
-    bool nx = PG_ARGISNULL(3) ? NULL : PG_GETARG_BOOL(3);
-    bool xx = PG_ARGISNULL(4) ? NULL : PG_GETARG_BOOL(4);
+    INIT_CRC32C(crc);
+    COMP_CRC32C(crc, rec + SPAT_AOF_HDRSZ, len);
+    FIN_CRC32C(crc);
 
-    /* Info about value */
-    bool valueIsNull = PG_ARGISNULL(1);
-    Oid valueTypeOid;
-    bool valueTypByVal;
-    int16 valueTypLen;
+    memcpy(rec, &len, sizeof(len));
+    memcpy(rec + sizeof(len), &crc, sizeof(crc));
 
-    bool exclusive = false; /* TODO: This depends on the
-						 * xx / nx */
-    bool found;
-    SpatDBEntry* entry;
+    spat_aof_append(db, rec, g_spat_aof_rec.len);
+}
 
-    /* Input validation */
-    if (nx || xx)
-        elog(ERROR, "nx and xx are not implemented yet");
+/* Make sure LSNs handed out from now on are past lsn, after restoring or replaying */
+static void
+spat_aof_advance_lsn(SpatDB* db, uint64 lsn)
+{
+    uint64 current = pg_atomic_read_u64(&db->shared->aof_lsn);
 
-    if (valueIsNull)
-        elog(ERROR, "value cannot be NULL");
+    while (current < lsn &&
+           !pg_atomic_compare_exchange_u64(&db->shared->aof_lsn, &current, lsn))
+        ;
+}
 
-    /* Get value type info. We need this for the copying part */
-    valueTypeOid = get_fn_expr_argtype(fcinfo->flinfo, 1);
+/*
+ * With spat.appendfsync = always, a transaction that logged changes only
+ * commits once they're fsynced; commits waiting at the same time share it.
+ * Aborts let go of the collection an error left pinned, see spat_coll_lock.
+ */
+static void
+spat_xact_callback(XactEvent event, void* arg)
+{
+    HASH_SEQ_STATUS status;
+    SpatDB* db;
+
+    if (event == XACT_EVENT_ABORT || event == XACT_EVENT_PARALLEL_ABORT)
+    {
+        spat_coll_unpin_all();
+        spat_timing_reset();
+    }
+
+    if (event != XACT_EVENT_PRE_COMMIT || g_spat_attached == NULL)
+        return;
+
+    hash_seq_init(&status, g_spat_attached);
+    while ((db = hash_seq_search(&status)) != NULL)
+    {
+        if (db->aof_pending == 0)
+            continue;
+
+        if (g_guc_spat_appendfsync == SPAT_APPENDFSYNC_ALWAYS && spdb_is_attached(db))
+            spat_aof_write(db, db->aof_pending, true);
+        db->aof_pending = 0;
+    }
+}
+
+/*
+ * The worker's part of the log of db: write out what backends buffered, and
+ * fsync it once a second unless spat.appendfsync = no.
+ */
+static void
+spat_aof_background(SpatDB* db)
+{
+    TimestampTz now = GetCurrentTimestamp();
+    uint64 inserted;
+    bool sync;
+
+    if (g_guc_spat_snapshot_dir[0] == '\0')
+        return;
+
+    LWLockAcquire(&db->shared->aof_lck, LW_SHARED);
+    inserted = db->shared->aof_inserted;
+    LWLockRelease(&db->shared->aof_lck);
+
+    sync = g_guc_spat_appendfsync != SPAT_APPENDFSYNC_NO &&
+        TimestampDifferenceExceeds(db->aof_synced_at, now, 1000);
+
+    spat_aof_write(db, inserted, sync);
+    if (sync)
+        db->aof_synced_at = now;
+}
+
+/* Whether the log of db has grown past spat.appendonly_rewrite_size since it was rewritten */
+static bool
+spat_aof_needs_rewrite(SpatDB* db)
+{
+    uint64 size;
+
+    if (g_guc_spat_appendonly_rewrite_size == 0 || !spat_aof_active())
+        return false;
+
+    LWLockAcquire(&db->shared->aof_lck, LW_SHARED);
+    size = db->shared->aof_written - db->shared->aof_rotated;
+    LWLockRelease(&db->shared->aof_lck);
+
+    return size >= (uint64) g_guc_spat_appendonly_rewrite_size * 1024;
+}
+
+/*
+ * Before a snapshot of db: flush its log and rename it to <name>.aof.old,
+ * so that changes made during the save go to a new one. If there's an old log
+ * already, the last save didn't complete, and the current log goes on from
+ * where it is.
+ */
+static void
+spat_aof_rotate(SpatDB* db)
+{
+    char path[MAXPGPATH];
+    char oldpath[MAXPGPATH];
+    struct stat st;
+
+    spat_snapshot_path(path, db->name, SPAT_AOF_SUFFIX);
+    spat_snapshot_path(oldpath, db->name, SPAT_AOF_OLD_SUFFIX);
+
+    LWLockAcquire(&db->shared->aof_write_lck, LW_EXCLUSIVE);
+
+    spat_aof_flush_locked(db, true);
+    if (stat(path, &st) == 0 && stat(oldpath, &st) != 0 && errno == ENOENT)
+    {
+        durable_rename(path, oldpath, ERROR);
+        db->shared->aof_generation++;
+    }
+
+    LWLockAcquire(&db->shared->aof_lck, LW_EXCLUSIVE);
+    db->shared->aof_rotated = db->shared->aof_written;
+    LWLockRelease(&db->shared->aof_lck);
+
+    LWLockRelease(&db->shared->aof_write_lck);
+}
+
+/* Once a snapshot of db is durable, its old log isn't needed anymore */
+static void
+spat_aof_remove_old(SpatDB* db)
+{
+    char path[MAXPGPATH];
+
+    spat_snapshot_path(path, db->name, SPAT_AOF_OLD_SUFFIX);
+    if (unlink(path) != 0 && errno != ENOENT)
+        elog(WARNING, "could not remove change log file \"%s\": %m", path);
+
+    /* A log that isn't written to anymore would only roll keys back when replayed */
+    if (!spat_aof_active())
+    {
+        spat_snapshot_path(path, db->name, SPAT_AOF_SUFFIX);
+        if (unlink(path) != 0 && errno != ENOENT)
+            elog(WARNING, "could not remove change log file \"%s\": %m", path);
+    }
+}
+
+/*
+ * Open a change log for replaying, leaving it right past its header. If name
+ * is given, it gets the name of the DB that was logged. Returns false, with a
+ * WARNING, if the header is corrupt.
+ */
+static bool
+spat_aof_open(SpatSnapFile* f, const char* path, StringInfo name)
+{
+    char magic[sizeof(SPAT_AOF_MAGIC) - 1];
+    uint32 version;
+    uint32 len;
+    char namebuf[SPAT_NAME_MAXSIZE];
+
+    spat_snap_open(f, "change log", path, O_RDONLY);
+
+    if (!spat_snap_read_raw(f, magic, sizeof(magic)) ||
+        memcmp(magic, SPAT_AOF_MAGIC, sizeof(magic)) != 0 ||
+        !spat_snap_read_raw(f, &version, sizeof(version)) || version != SPAT_AOF_VERSION ||
+        !spat_snap_read_raw(f, &len, sizeof(len)) || len == 0 || len >= SPAT_NAME_MAXSIZE ||
+        !spat_snap_read_raw(f, namebuf, len))
+    {
+        elog(WARNING, "change log file \"%s\" is corrupt or from another version", path);
+        spat_snap_close(f);
+        return false;
+    }
+
+    if (name)
+        appendBinaryStringInfo(name, namebuf, len);
+
+    return true;
+}
+
+typedef struct SpatAofReader
+{
+    const char* pos;
+    const char* end;
+} SpatAofReader;
+
+/* Past its CRC check, a record can only be malformed if it's from a buggy writer */
+static void
+spat_aof_get(SpatAofReader* r, void* data, Size len)
+{
+    if ((Size)(r->end - r->pos) < len)
+        elog(ERROR, "change log record is malformed");
+    memcpy(data, r->pos, len);
+    r->pos += len;
+}
+
+/* A string, as a SpatPack item is laid out; it points into the record */
+static const char*
+spat_aof_get_str(SpatAofReader* r)
+{
+    const char* item = r->pos;
+    uint32 len;
+
+    spat_aof_get(r, &len, sizeof(len));
+    if ((Size)(r->end - r->pos) < len)
+        elog(ERROR, "change log record is malformed");
+    r->pos += len;
+
+    return item;
+}
+
+/* Make entry hold an empty collection of typ, unless it holds one already. Like spat_coll_held */
+static SpatColl*
+spat_aof_entry_as(SpatDB* db, SpatDBEntry* entry, spValueType typ)
+{
+    SpatColl* coll = NULL;
+
+    if (entry->valtyp == typ)
+        return spat_coll_held(db, entry, typ, LW_EXCLUSIVE);
+
+    if (entry->valtyp != SPVAL_NULL)
+        spdb_free_value(db, entry);
+
+    switch (typ)
+    {
+    case SPVAL_SET:
+        coll = spat_set_init(db, entry);
+        break;
+    case SPVAL_LIST:
+        coll = spat_list_init(db, entry);
+        break;
+    case SPVAL_HASH:
+        coll = spat_hash_init(db, entry);
+        break;
+    case SPVAL_ZSET:
+        coll = spat_zset_init(db, entry);
+        break;
+    default:
+        elog(ERROR, "unexpected value type %d", typ);
+    }
+
+    LWLockAcquire(&coll->lock, LW_EXCLUSIVE);
 
-    Assert(valueTypeOid == TEXTOID);
+    return coll;
+}
 
-    /* Insert the key */
-    entry = spdb_find_or_insert(g_spat_db, key, &found);
+/* Apply a record to db, unless its key has seen it already. True if it was applied */
+static bool
+spat_aof_apply(SpatDB* db, uint8 op, uint64 lsn, dss key, SpatAofReader* r)
+{
+    SpatDBEntry* entry;
+    SpatColl* coll = NULL;
+    bool found;
 
-    if (ex)
+    if (op == SPAT_AOF_DEL)
     {
-        /* if ttl interval is given */
-        entry->expireat = DatumGetTimestampTz(DirectFunctionCall2(
-            timestamptz_pl_interval,
-            TimestampTzGetDatum(GetCurrentTimestamp()),
-            PointerGetDatum(ex)));
+        entry = spdb_find(db, key, SPDB_ENTRY_LOCK_EXCLUSIVE);
+        if (entry && spdb_lsn(db, entry) < lsn)
+        {
+            spdb_delete_entry(db, entry);
+            return true;
+        }
+        if (entry)
+            spdb_release_lock(db, entry);
+        return false;
     }
 
-    entry->valtyp = SPVAL_STRING;
-    entry->value.string.len = VARSIZE_ANY(value);
-    entry->value.string.str = dsa_allocate(g_spat_db->g_dsa, VARSIZE_ANY(value));
-    memcpy(dsa_get_address(g_spat_db->g_dsa, entry->value.string.str), DatumGetPointer(value), VARSIZE_ANY(value));
-
-    /* Prepare the SPvalue to echo / return */
-    SPValue* result = makeSpvalFromEntry(g_spat_db->g_dsa, entry);
+    entry = spdb_find_or_insert(db, key, &found);
+    if (found && spdb_lsn(db, entry) >= lsn)
+    {
+        spdb_release_lock(db, entry);
+        return false;
+    }
 
-    spdb_release_lock(g_spat_db, entry);
+    switch (op)
+    {
+    case SPAT_AOF_SET:
+        {
+            TimestampTz expireat;
 
-    spat_detach_shmem();
+            spat_aof_get(r, &expireat, sizeof(expireat));
+            spdb_store_string(db, entry, found, spat_pack_item_text(spat_aof_get_str(r)), expireat);
+            break;
+        }
 
-    PG_RETURN_POINTER(result);
-}
+    case SPAT_AOF_SETDATUM:
+        {
+            TimestampTz expireat;
+            const char* item;
 
-PG_FUNCTION_INFO_V1(spget);
+            spat_aof_get(r, &expireat, sizeof(expireat));
+            item = spat_aof_get_str(r);
+            spdb_store_value(db, entry, found, SPAT_ENC_DATUM, item + SPAT_PACK_ITEM_HDRSZ,
+                             spat_pack_item_len(item), expireat);
+            break;
+        }
 
-Datum
-spget(PG_FUNCTION_ARGS)
-{
-    bool found = false;
-    SPValue* result;
+    case SPAT_AOF_SETINT:
+        {
+            int64 value;
 
-    /* Begin processing */
-    spat_attach_shmem();
-    dss key = PG_GETARG_DSS(0);
+            spat_aof_get(r, &value, sizeof(value));
+            spdb_free_value(db, entry);
+            spdb_set_valtyp(db, entry, SPVAL_STRING);
+            entry->encoding = SPAT_ENC_INT;
+            entry->value.integer = value;
+            break;
+        }
 
-    SpatDBEntry* entry = spdb_find(g_spat_db, key, false);
-    if (entry)
-    {
-        found = true;
-        result = makeSpvalFromEntry(g_spat_db->g_dsa, entry);
-        spdb_release_lock(g_spat_db, entry);
-    }
+    case SPAT_AOF_SADD:
+    case SPAT_AOF_SREM:
+        {
+            dss member = spat_pack_item_dss(spat_aof_get_str(r));
 
-    spat_detach_shmem();
+            if (op == SPAT_AOF_SADD)
+            {
+                coll = spat_aof_entry_as(db, entry, SPVAL_SET);
+                spat_set_add(db, coll, &key, &member);
+            }
+            else if ((coll = spat_coll_held(db, entry, SPVAL_SET, LW_EXCLUSIVE)) != NULL)
+                spat_set_remove(db, coll, &key, &member);
+            break;
+        }
 
-    if (!found)
-    {
-        PG_RETURN_NULL();
-    }
+    case SPAT_AOF_PUSH:
+    case SPAT_AOF_DROP:
+        {
+            uint8 head;
 
-    PG_RETURN_POINTER(result);
-}
+            spat_aof_get(r, &head, sizeof(head));
+            if (op == SPAT_AOF_PUSH)
+            {
+                dss elem = spat_pack_item_dss(spat_aof_get_str(r));
 
-PG_FUNCTION_INFO_V1(sptype);
+                coll = spat_aof_entry_as(db, entry, SPVAL_LIST);
+                spat_list_push(db, coll, &key, &elem, head);
+            }
+            else
+            {
+                uint32 n;
 
-Datum
-sptype(PG_FUNCTION_ARGS)
-{
-    spValueType result = SPVAL_NULL;
+                spat_aof_get(r, &n, sizeof(n));
+                if ((coll = spat_coll_held(db, entry, SPVAL_LIST, LW_EXCLUSIVE)) != NULL)
+                    spat_list_drop(db, coll, &key, Min(n, coll->value.list.size), head);
+            }
+            break;
+        }
 
-    /* Begin processing */
-    spat_attach_shmem();
-    dss key = PG_GETARG_DSS(0);
+    case SPAT_AOF_HSET:
+        {
+            dss field = spat_pack_item_dss(spat_aof_get_str(r));
+            dss value = spat_pack_item_dss(spat_aof_get_str(r));
 
-    SpatDBEntry* entry = spdb_find(g_spat_db, key, false);
-    if (entry)
-    {
-        result = entry->valtyp;
-        elog(DEBUG1, "valtyp=%d", entry->valtyp);
-        spdb_release_lock(g_spat_db, entry);
-    }
+            coll = spat_aof_entry_as(db, entry, SPVAL_HASH);
+            spat_hash_set(db, coll, &key, &field, &value);
+            break;
+        }
 
-    spat_detach_shmem();
+    case SPAT_AOF_ZADD:
+        {
+            double score;
+            dss member;
 
-    PG_RETURN_TEXT_P(cstring_to_text(spTypeName(result)));
-}
+            spat_aof_get(r, &score, sizeof(score));
+            member = spat_pack_item_dss(spat_aof_get_str(r));
+            coll = spat_aof_entry_as(db, entry, SPVAL_ZSET);
+            spat_zset_add(db, coll, &key, score, &member);
+            break;
+        }
 
+    case SPAT_AOF_ZREM:
+        {
+            dss member = spat_pack_item_dss(spat_aof_get_str(r));
 
-PG_FUNCTION_INFO_V1(getexpireat);
+            if ((coll = spat_coll_held(db, entry, SPVAL_ZSET, LW_EXCLUSIVE)) != NULL)
+                spat_zset_remove(db, coll, &key, &member);
+            break;
+        }
 
-Datum
-getexpireat(PG_FUNCTION_ARGS)
-{
-    spat_attach_shmem();
+    case SPAT_AOF_ZREMRANGE:
+        {
+            double min;
+            double max;
 
-    dss key = PG_GETARG_DSS(0);
+            spat_aof_get(r, &min, sizeof(min));
+            spat_aof_get(r, &max, sizeof(max));
+            if ((coll = spat_coll_held(db, entry, SPVAL_ZSET, LW_EXCLUSIVE)) != NULL)
+                spat_zset_remove_range(db, coll, &key, min, max);
+            break;
+        }
 
+    default:
+        elog(ERROR, "change log record has unknown op %d", op);
+    }
 
-    /* Output */
-    TimestampTz result;
+    if (coll)
+        LWLockRelease(&coll->lock);
 
-    bool found;
-    SpatDBEntry* entry = spdb_find(g_spat_db, key, false);
-    if (!entry)
-    {
-        found = false;
-    }
+    /* Removing from a key that's not there leaves nothing behind */
+    if (entry->valtyp == SPVAL_NULL)
+        spdb_delete_entry(db, entry);
     else
     {
-        found = true;
-        result = entry->expireat;
-        spdb_release_lock(g_spat_db, entry);
+        entry->lsn = lsn;
+        spdb_release_lock(db, entry);
     }
 
-    spat_detach_shmem();
-    if (!found || result == SpMaxTTL)
-        PG_RETURN_NULL();
-    PG_RETURN_TIMESTAMPTZ(result);
+    return true;
 }
 
-PG_FUNCTION_INFO_V1(sp_db_nitems);
-
-Datum
-sp_db_nitems(PG_FUNCTION_ARGS)
+/*
+ * Read the next record of a log into rec, past its length and CRC. Returns
+ * false at the end of the log, or at a torn or corrupt record, which ends it
+ * too, with a WARNING if warn.
+ */
+static bool
+spat_aof_read_record(SpatSnapFile* f, StringInfo rec, uint64 nrecords, bool warn)
 {
-    spat_attach_shmem();
-
-    int32 nitems = 0;
-
-    SpatDBEntry* entry;
-
-    dshash_seq_status status;
-
-    /* Initialize a sequential scan (non-exclusive lock assumed here). */
-    dshash_seq_init(&status, g_spat_db->g_htab, false);
+    uint32 hdr[2];
+    pg_crc32c crc;
+    bool ok;
 
-    while ((entry = dshash_seq_next(&status)) != NULL)
-        nitems++;
+    if (!spat_snap_read_raw(f, hdr, sizeof(hdr)))
+        return false;
 
-    dshash_seq_term(&status);
+    ok = hdr[0] < MaxAllocSize;
+    if (ok)
+    {
+        resetStringInfo(rec);
+        enlargeStringInfo(rec, hdr[0]);
+        ok = spat_snap_read_raw(f, rec->data, hdr[0]);
+        rec->len = hdr[0];
+    }
+    if (ok)
+    {
+        INIT_CRC32C(crc);
+        COMP_CRC32C(crc, rec->data, hdr[0]);
+        FIN_CRC32C(crc);
+        ok = EQ_CRC32C(crc, hdr[1]);
+    }
+    if (!ok && warn)
+        elog(WARNING, "change log file \"%s\" ends with a torn or corrupt record after "
+             UINT64_FORMAT " records, ignoring the rest", f->path, nrecords);
 
-    spat_detach_shmem();
-    PG_RETURN_INT32(nitems);
+    return ok;
 }
 
-PG_FUNCTION_INFO_V1(sp_db_size_bytes);
-
-Datum
-sp_db_size_bytes(PG_FUNCTION_ARGS)
+/* The highest LSN of a log opened by spat_aof_open, which it closes */
+static uint64
+spat_aof_scan_lsn(SpatSnapFile* f)
 {
-    spat_attach_shmem();
-    Size result = -1;
-    result = dsa_get_total_size(g_spat_db->g_dsa);
-    spat_detach_shmem();
-    PG_RETURN_INT64(result);
-}
-
-PG_FUNCTION_INFO_V1(dss_echo);
+    StringInfoData rec;
+    uint64 maxlsn = 0;
 
-Datum
-dss_echo(PG_FUNCTION_ARGS)
-{
-    spat_attach_shmem();
-    dss arg0 = PG_GETARG_DSS(0);
-    text* result = DSS_TO_TEXT(arg0);
+    initStringInfo(&rec);
+    while (spat_aof_read_record(f, &rec, 0, false))
+    {
+        SpatAofReader r;
+        uint8 op;
+        uint64 lsn;
+
+        r.pos = rec.data;
+        r.end = rec.data + rec.len;
+        spat_aof_get(&r, &op, sizeof(op));
+        spat_aof_get(&r, &lsn, sizeof(lsn));
+        maxlsn = Max(maxlsn, lsn);
+    }
 
-    spat_detach_shmem();
+    spat_snap_close(f);
+    pfree(rec.data);
 
-    PG_RETURN_TEXT_P(result);
+    return maxlsn;
 }
 
+/* The records of spat_aof_replay */
+static uint64
+spat_aof_replay_records(SpatDB* db, SpatSnapFile* f)
+{
+    MemoryContext replaycxt = AllocSetContextCreate(CurrentMemoryContext, "spat replay",
+                                                    ALLOCSET_DEFAULT_SIZES);
+    StringInfoData rec;
+    uint64 nrecords = 0;
+    uint64 napplied = 0;
+    uint64 maxlsn = 0;
 
-/* ---------------------------------------- SETS  ---------------------------------------- */
+    initStringInfo(&rec);
 
-static const dshash_parameters params_hashset = {
-    .key_size = sizeof(dss),
-    .entry_size = sizeof(dss),
-    .compare_function = dss_cmp,
-    .hash_function = dss_hash,
-    .copy_function = dss_copy
-};
+    while (spat_aof_read_record(f, &rec, nrecords, true))
+    {
+        SpatAofReader r;
+        MemoryContext oldcontext;
+        uint8 op;
+        uint64 lsn;
+        dss key;
+
+        r.pos = rec.data;
+        r.end = rec.data + rec.len;
+        spat_aof_get(&r, &op, sizeof(op));
+        spat_aof_get(&r, &lsn, sizeof(lsn));
+        key = spat_pack_item_dss(spat_aof_get_str(&r));
+        maxlsn = Max(maxlsn, lsn);
+
+        if (op != SPAT_AOF_DEL)
+            spdb_evict_if_needed(db);
+
+        oldcontext = MemoryContextSwitchTo(replaycxt);
+        if (spat_aof_apply(db, op, lsn, key, &r))
+            napplied++;
+        MemoryContextSwitchTo(oldcontext);
+        MemoryContextReset(replaycxt);
+
+        if (++nrecords % 1024 == 0)
+            CHECK_FOR_INTERRUPTS();
+    }
 
-PG_FUNCTION_INFO_V1(sadd);
+    spat_snap_close(f);
+    pfree(rec.data);
+    MemoryContextDelete(replaycxt);
 
-Datum
-sadd(PG_FUNCTION_ARGS)
-{
-    spat_attach_shmem();
+    spat_aof_advance_lsn(db, maxlsn);
 
-    dss key = PG_GETARG_DSS(0);
-    dss elem_dss = PG_GETARG_DSS(1);
+    return napplied;
+}
 
-    /* Insert/find the set in the global hash table */
-    bool dbentryfound;
-    dshash_table* htab;
-    dshash_table_handle htabhandl;
+/* Replay a log opened by spat_aof_open into db, and close it. Returns the number of changes applied */
+static uint64
+spat_aof_replay(SpatDB* db, SpatSnapFile* f)
+{
+    return spat_restore_unlogged(spat_aof_replay_records, db, f);
+}
 
-    SpatDBEntry* dbentry = spdb_find_or_insert(g_spat_db, key, &dbentryfound);
+/* Replay the logs of db in spat.snapshot_dir, the old one first, on behalf of the worker */
+static void
+spat_aof_replay_db(SpatDB* db)
+{
+    const char* suffixes[] = {SPAT_AOF_OLD_SUFFIX, SPAT_AOF_SUFFIX};
 
-    if (!dbentryfound)
-    {
-        dbentry->valtyp = SPVAL_SET;
-        htab = dshash_create(g_spat_db->g_dsa, &params_hashset, NULL);
-        htabhandl = dshash_get_hash_table_handle(htab);
-        dbentry->value.set.hndl = htabhandl;
-        dbentry->value.set.size = 0;
-    }
-    else
+    for (int i = 0; i < lengthof(suffixes); i++)
     {
-        /* Existing entry */
-        Assert(dbentry->valtyp == SPVAL_SET);
-        htabhandl = dbentry->value.set.hndl;
+        char path[MAXPGPATH];
+        SpatSnapFile f;
+        uint64 napplied;
 
-        htab = dshash_attach(g_spat_db->g_dsa, &params_hashset, htabhandl, NULL);
+        spat_snapshot_path(path, db->name, suffixes[i]);
+        if (access(path, F_OK) != 0 || !spat_aof_open(&f, path, NULL))
+            continue;
+
+        napplied = spat_aof_replay(db, &f);
+        elog(LOG, "spat: replayed " UINT64_FORMAT " changes to \"%s\" from \"%s\"", napplied, db->name, path);
     }
+}
 
-    /* Insert the dss element into the set */
-    bool setelementfound;
-    dss* elem = dshash_find_or_insert(htab, &elem_dss, &setelementfound);
-    //Using dss as element
-    if (!setelementfound)
-        dbentry->value.set.size++;
+PG_FUNCTION_INFO_V1(sp_replay_log);
 
-    elog(DEBUG1, "sadd: key=%s\tdbentryfound=%d\tsetelementfound=%d\tcard=%d", VARDATA_ANY(DSS_TO_TEXT(key)),
-         dbentryfound, setelementfound, dbentry->value.set.size);
+/* Replay a change log into the current DB, whichever DB it was logged for */
+Datum
+sp_replay_log(PG_FUNCTION_ARGS)
+{
+    char* path = text_to_cstring(PG_GETARG_TEXT_PP(0));
+    SpatSnapFile f;
 
-    /* Release locks */
-    dshash_release_lock(htab, elem);
-    dshash_detach(htab);
+    if (!has_privs_of_role(GetUserId(), ROLE_PG_READ_SERVER_FILES))
+        elog(ERROR, "must be superuser or have privileges of the pg_read_server_files role to replay change logs");
 
-    spdb_release_lock(g_spat_db, dbentry);
+    spat_attach_shmem();
 
+    if (!spat_aof_open(&f, path, NULL))
+        elog(ERROR, "could not replay change log file \"%s\"", path);
 
-    spat_detach_shmem();
-    PG_RETURN_VOID();
+    PG_RETURN_INT64((int64)spat_aof_replay(g_spat_db, &f));
 }
 
-PG_FUNCTION_INFO_V1(sismember);
+PG_FUNCTION_INFO_V1(sp_db_log_stats);
 
 Datum
-sismember(PG_FUNCTION_ARGS)
+sp_db_log_stats(PG_FUNCTION_ARGS)
 {
-    spat_attach_shmem();
-    dss key = PG_GETARG_DSS(0);
-
-    dss elem_dss = PG_GETARG_DSS(1);
+    SpatDBShared* shared;
+    TupleDesc tupdesc;
+    Datum values[4];
+    bool nulls[4] = {0};
 
-    bool result;
+    spat_attach_shmem();
+    shared = g_spat_db->shared;
 
-    SpatDBEntry* dbentry = spdb_find(g_spat_db, key, false);
-    if (dbentry)
-    {
-        /* Existing entry */
-        Assert(dbentry->valtyp == SPVAL_SET);
-        dshash_table* htab = dshash_attach(g_spat_db->g_dsa, &params_hashset, dbentry->value.set.hndl, NULL);
-        spdb_release_lock(g_spat_db, dbentry);
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        elog(ERROR, "return type must be a row type");
 
-        dss* elem = dshash_find(htab, &elem_dss, false);
-        if (elem)
-        {
-            dshash_release_lock(htab, elem);
-            result = true;
-        }
-        else
-        {
-            result = false;
-        }
-        dshash_detach(htab);
-    }
-    else
-    {
-        result = false;
-    }
+    LWLockAcquire(&shared->aof_lck, LW_SHARED);
+    values[0] = Int64GetDatum(pg_atomic_read_u64(&shared->aof_lsn));
+    values[1] = Int64GetDatum(shared->aof_inserted);
+    values[2] = Int64GetDatum(shared->aof_written);
+    values[3] = Int64GetDatum(shared->aof_synced);
+    LWLockRelease(&shared->aof_lck);
 
-    spat_detach_shmem();
-    PG_RETURN_BOOL(result);
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
 }
 
 /*
- * Remove the specified members from the set stored at key. Specified members
- * that are not a member of this set are ignored. If key does not exist, it
- * is treated as an empty set and this command returns 0. An error is
- * returned when the value stored at key is not a set.
+ * Save a DB to spat.snapshot_dir, on behalf of the worker. This is also how
+ * its change log is rewritten: records logged during the save go to a new
+ * log, and the old one goes once the snapshot is durable.
  */
-PG_FUNCTION_INFO_V1(srem);
-
-Datum
-srem(PG_FUNCTION_ARGS)
+static void
+spat_snapshot_save_db(const char* name)
 {
-    spat_attach_shmem();
-
-    dss key = PG_GETARG_DSS(0);
-    dss elem_dss = PG_GETARG_DSS(1);
+    char path[MAXPGPATH];
+    uint64 nkeys;
 
-    int32 result;
+    if (MakePGDirectory(g_guc_spat_snapshot_dir) < 0 && errno != EEXIST)
+        elog(ERROR, "could not create snapshot directory \"%s\": %m", g_guc_spat_snapshot_dir);
 
-    SpatDBEntry* dbentry = spdb_find(g_spat_db, key, true);
-    if (dbentry)
-    {
-        /* Existing entry */
-        Assert(dbentry->valtyp == SPVAL_SET);
+    spat_snapshot_path(path, name, SPAT_SNAP_SUFFIX);
 
-        dshash_table* htab = dshash_attach(g_spat_db->g_dsa, &params_hashset,
-                                           dbentry->value.set.hndl, NULL);
+    /* dss_* callbacks work on g_spat_db */
+    g_spat_db = spat_attach_db(name);
+    spat_aof_rotate(g_spat_db);
+    nkeys = spat_snapshot_save(g_spat_db, path);
+    spat_aof_remove_old(g_spat_db);
+    g_spat_db = NULL;
 
-        bool deleted = dshash_delete_key(htab, &elem_dss);
+    elog(DEBUG1, "spat: saved " UINT64_FORMAT " keys of \"%s\" to \"%s\"", nkeys, name, path);
+}
 
-        if (deleted)
-            dbentry->value.set.size--;
+/* Save every DB in names to spat.snapshot_dir */
+static void
+spat_snapshot_save_all(SpatDBName* names, int ndbs)
+{
+    for (int i = 0; i < ndbs; i++)
+        spat_snapshot_save_db(names[i]);
+}
 
-        result = deleted ? 1 : 0;
+static bool
+spat_snapshot_dir_entry(const struct dirent* de, const char* suffix, char* path)
+{
+    size_t len = strlen(de->d_name);
 
-        dshash_detach(htab);
-        spdb_release_lock(g_spat_db, dbentry);
-    }
-    else
-    {
-        result = 0;
-    }
+    if (len <= strlen(suffix) || strcmp(de->d_name + len - strlen(suffix), suffix) != 0)
+        return false;
 
-    spat_detach_shmem();
-    PG_RETURN_BOOL(result);
+    snprintf(path, MAXPGPATH, "%s/%s", g_guc_spat_snapshot_dir, de->d_name);
+    return true;
 }
 
-PG_FUNCTION_INFO_V1(scard);
-
-Datum
-scard(PG_FUNCTION_ARGS)
+/*
+ * Make sure that the LSNs handed out from now on are past those of every
+ * snapshot and log in spat.snapshot_dir, before any is restored. Backends log
+ * changes made during the restore to the very logs the worker replays, and,
+ * with lower LSNs, replay would take them for changes seen already after the
+ * next restart. This only reads the files, twice with the restore, and
+ * backends wait for it before they first attach, see spat_wait_lsns_seeded.
+ */
+static void
+spat_snapshot_seed_lsns(void)
 {
-    spat_attach_shmem();
-
-    /* Input key and value */
-    dss key = PG_GETARG_DSS(0);
+    DIR* dir;
+    struct dirent* de;
 
-    uint32 result;
-    bool isaset;
-    SpatDBEntry* dbentry = spdb_find(g_spat_db, key, false);
+    dir = AllocateDir(g_guc_spat_snapshot_dir);
+    if (dir == NULL && errno == ENOENT)
+        return;
 
-    if (dbentry)
+    while ((de = ReadDir(dir, g_guc_spat_snapshot_dir)) != NULL)
     {
-        if (dbentry->valtyp == SPVAL_SET)
+        char path[MAXPGPATH];
+        SpatSnapFile f;
+        StringInfoData name;
+        uint64 maxlsn;
+
+        initStringInfo(&name);
+        if (spat_snapshot_dir_entry(de, SPAT_SNAP_SUFFIX, path))
         {
-            isaset = true;
-            result = dbentry->value.set.size;
+            if (!spat_snapshot_open(&f, path, &name))
+                continue;
+            maxlsn = f.maxlsn;
+            spat_snap_close(&f);
+        }
+        else if (spat_snapshot_dir_entry(de, SPAT_AOF_SUFFIX, path) ||
+                 spat_snapshot_dir_entry(de, SPAT_AOF_OLD_SUFFIX, path))
+        {
+            if (!spat_aof_open(&f, path, &name))
+                continue;
+            maxlsn = spat_aof_scan_lsn(&f);
         }
         else
+            continue;
+
+        /* Restoring warns about invalid names */
+        if (name.len > 0 && name.len < SPAT_NAME_MAXSIZE)
         {
-            isaset = false;
+            g_spat_db = spat_attach_db(name.data);
+            spat_aof_advance_lsn(g_spat_db, maxlsn);
+            g_spat_db = NULL;
         }
-        spdb_release_lock(g_spat_db, dbentry);;
-    }
-    else
-    {
-        isaset = false;
+        pfree(name.data);
     }
-    spat_detach_shmem();
-
-    if (isaset)
-        PG_RETURN_INT32(result);
-    else
-        PG_RETURN_NULL();
+    FreeDir(dir);
 }
 
-PG_FUNCTION_INFO_V1(sinter);
-
-Datum
-sinter(PG_FUNCTION_ARGS)
+/* Let backends attach, whether seeding made it or not */
+static void
+spat_catalog_set_seeded(SpatCatalog* catalog)
 {
-    spat_attach_shmem();
-
-    dss key1 = PG_GETARG_DSS(0);
-    dss key2 = PG_GETARG_DSS(1);
-
-    spat_detach_shmem();
+    LWLockAcquire(&catalog->lck, LW_EXCLUSIVE);
+    catalog->seeded = true;
+    LWLockRelease(&catalog->lck);
+    ConditionVariableBroadcast(&catalog->seeded_cv);
 }
 
 /*
- * ---------------------------------------- LISTS ----------------------------------------
+ * Restore every snapshot in spat.snapshot_dir, into the DB it was saved from,
+ * and replay the change logs written since on top. The logs of DBs that
+ * hadn't been saved yet are replayed onto nothing. Only the first worker
+ * since startup does it, so that a restarted worker doesn't roll DBs back.
  */
-
-struct list_element
+static void
+spat_snapshot_restore_all(void)
 {
-    dss data;
+    SpatCatalog* catalog = spat_get_catalog();
+    DIR* dir;
+    struct dirent* de;
+    bool restored;
+    List* names = NIL;
+    ListCell* lc;
+
+    LWLockAcquire(&catalog->lck, LW_EXCLUSIVE);
+    restored = catalog->restored;
+    catalog->restored = true;
+    LWLockRelease(&catalog->lck);
+
+    PG_TRY();
+    {
+        if (!restored && g_guc_spat_snapshot_dir[0] != '\0')
+            spat_snapshot_seed_lsns();
+    }
+    PG_FINALLY();
+    {
+        spat_catalog_set_seeded(catalog);
+    }
+    PG_END_TRY();
+
+    if (restored || g_guc_spat_snapshot_dir[0] == '\0')
+        return;
+
+    dir = AllocateDir(g_guc_spat_snapshot_dir);
+    if (dir == NULL && errno == ENOENT)
+        return;
 
-    dsa_pointer prev;
-    dsa_pointer next;
-};
+    while ((de = ReadDir(dir, g_guc_spat_snapshot_dir)) != NULL)
+    {
+        char path[MAXPGPATH];
+        SpatSnapFile f;
+        StringInfoData name;
+        uint64 nkeys;
 
-#define LIST_NIL InvalidDsaPointer
+        if (!spat_snapshot_dir_entry(de, SPAT_SNAP_SUFFIX, path))
+            continue;
 
-PG_FUNCTION_INFO_V1(lpush);
+        initStringInfo(&name);
+        if (!spat_snapshot_open(&f, path, &name))
+            continue;
 
-Datum
-lpush(PG_FUNCTION_ARGS)
-{
-    spat_attach_shmem();
+        if (name.len == 0 || name.len >= SPAT_NAME_MAXSIZE)
+        {
+            elog(WARNING, "snapshot file \"%s\" has an invalid DB name", path);
+            spat_snap_close(&f);
+            continue;
+        }
 
-    /* Retrieve key and element arguments */
-    dss key = PG_GETARG_DSS(0);
-    dss elem = PG_GETARG_DSS(1);
+        g_spat_db = spat_attach_db(name.data);
+        nkeys = spat_snapshot_restore(g_spat_db, &f);
+        elog(LOG, "spat: restored " UINT64_FORMAT " keys of \"%s\" from \"%s\"", nkeys, name.data, path);
+        spat_aof_replay_db(g_spat_db);
+        g_spat_db = NULL;
 
-    /* Insert/find the list in the global hash table */
-    bool dbentryfound;
-    SpatDBEntry* dbentry = spdb_find_or_insert(g_spat_db, key, &dbentryfound);
+        names = lappend(names, name.data);
+    }
+    FreeDir(dir);
 
-    if (!dbentryfound)
+    dir = AllocateDir(g_guc_spat_snapshot_dir);
+    while ((de = ReadDir(dir, g_guc_spat_snapshot_dir)) != NULL)
     {
-        /* New list initialization */
-        dbentry->valtyp = SPVAL_LIST;
-        dbentry->value.list.size = 1;
+        char path[MAXPGPATH];
+        SpatSnapFile f;
+        StringInfoData name;
+        bool done = false;
+
+        if (!spat_snapshot_dir_entry(de, SPAT_AOF_SUFFIX, path) &&
+            !spat_snapshot_dir_entry(de, SPAT_AOF_OLD_SUFFIX, path))
+            continue;
+
+        initStringInfo(&name);
+        if (!spat_aof_open(&f, path, &name))
+            continue;
+        spat_snap_close(&f);
+
+        foreach(lc, names)
+            done |= strcmp(lfirst(lc), name.data) == 0;
+        if (done)
+            continue;
+
+        /* Both logs of the DB at once, in order */
+        g_spat_db = spat_attach_db(name.data);
+        spat_aof_replay_db(g_spat_db);
+        g_spat_db = NULL;
+
+        names = lappend(names, name.data);
+    }
+    FreeDir(dir);
+
+    list_free_deep(names);
+}
 
-        /* Allocate the first element */
-        dsa_pointer new_elem_ptr = dsa_allocate(g_spat_db->g_dsa, sizeof(list_element));
-        list_element* new_elem = dsa_get_address(g_spat_db->g_dsa, new_elem_ptr);
+/*
+ * ---------------------------------------- SCAN
+ * ----------------------------------------
+ *
+ * dshash can't resume a seq scan, nor seek, so cursors are hashes instead of
+ * positions: a scan returns items in hash order and the cursor is the hash of
+ * the next item, in the low 32 bits, with the keyspace shard in the high
+ * ones. Whatever the tables do in between, resizes included, every key there
+ * for the whole scan is returned exactly once, as SCAN promises in Redis.
+ *
+ * Every call walks its table, under one partition lock at a time, for the
+ * COUNT keys with the smallest hashes from the cursor's on, which MATCH too
+ * (and their ties, as items with the same hash must go together). Only those
+ * are copied out: the walk compares the hashes cached in the keys, and copies
+ * a key only when it may make it into the batch, dropping those pushed out.
+ * Calls keep no state, so a scan can go on from any backend. The walk still
+ * reads every entry of the shard, dshash being unable to seek, so a full scan
+ * is O(N^2 / (shards * COUNT)). That is the price of keeping writes free of a
+ * second, ordered index of the keyspace, which only scans would read; the
+ * README has the sizing rule, a COUNT of at least 1/50 of the keys per shard.
+ */
 
-        /* Set the element data */
-        new_elem->data = elem;
-        new_elem->prev = InvalidDsaPointer;
-        new_elem->next = InvalidDsaPointer;
+typedef enum SpatScanKind
+{
+    SPAT_SCAN_KEYS,
+    SPAT_SCAN_SET,
+    SPAT_SCAN_HASH
+} SpatScanKind;
 
-        /* Initialize head and tail */
-        dbentry->value.list.head = new_elem_ptr;
-        dbentry->value.list.tail = new_elem_ptr;
-    }
-    else
+typedef struct SpatScanItem
+{
+    dshash_hash hash;
+    text* key;
+    text* val;                  /* HSCAN's values */
+} SpatScanItem;
+
+/* The items of a call, see spat_scan_add */
+typedef struct SpatScanBatch
+{
+    uint32 from;                /* the cursor's hash */
+    int count;
+    bool bounded;
+    uint32 bound;               /* if bounded, items hashing above it can't make it */
+    bool more;                  /* items hashing above the batch were seen */
+    int nitems;
+    int cap;
+    SpatScanItem* items;
+} SpatScanBatch;
+
+#define SPAT_SCAN_CURSOR(shard, hash)   (((int64)(shard) << 32) | (uint32)(hash))
+#define SPAT_SCAN_CURSOR_SHARD(c)       ((int)((uint64)(c) >> 32))
+#define SPAT_SCAN_CURSOR_HASH(c)        ((uint32)(c))
+
+/* Redis-style glob matching: *, ?, [abc], [^a-z] and \ escapes */
+static bool
+spat_glob_match(const char* p, int plen, const char* s, int slen)
+{
+    while (plen > 0)
     {
-        /* Existing list handling */
-        if (dbentry->value.list.size == 0)
+        switch (*p)
         {
-            /* Reinitializing an emptied list */
-            dsa_pointer new_elem_ptr = dsa_allocate(g_spat_db->g_dsa, sizeof(list_element));
-            list_element* new_elem = dsa_get_address(g_spat_db->g_dsa, new_elem_ptr);
+        case '*':
+            while (plen > 1 && p[1] == '*')
+            {
+                p++;
+                plen--;
+            }
+            if (plen == 1)
+                return true;
+            for (int i = 0; i <= slen; i++)
+            {
+                if (spat_glob_match(p + 1, plen - 1, s + i, slen - i))
+                    return true;
+            }
+            return false;
 
-            /* Set the element data */
-            new_elem->data = elem;
-            new_elem->prev = InvalidDsaPointer;
-            new_elem->next = InvalidDsaPointer;
+        case '?':
+            if (slen == 0)
+                return false;
+            s++;
+            slen--;
+            break;
 
-            /* Reinitialize head and tail */
-            dbentry->value.list.head = new_elem_ptr;
-            dbentry->value.list.tail = new_elem_ptr;
+        case '[':
+            {
+                bool negate;
+                bool matched = false;
 
-            /* Reset the size */
-            dbentry->value.list.size = 1;
-        }
-        else
-        {
-            /* Normal LPUSH to the head of the list */
-            dsa_pointer head_ptr = dbentry->value.list.head;
-            dsa_pointer new_elem_ptr = dsa_allocate(g_spat_db->g_dsa, sizeof(list_element));
-            list_element* new_elem = dsa_get_address(g_spat_db->g_dsa, new_elem_ptr);
+                if (slen == 0)
+                    return false;
 
-            /* Set the new element's data */
-            new_elem->data = elem;
+                p++;
+                plen--;
+                negate = plen > 0 && *p == '^';
+                if (negate)
+                {
+                    p++;
+                    plen--;
+                }
 
-            /* Link the new element to the existing head */
-            new_elem->next = head_ptr;
-            new_elem->prev = InvalidDsaPointer;
+                while (plen > 0 && *p != ']')
+                {
+                    if (*p == '\\' && plen >= 2)
+                    {
+                        p++;
+                        plen--;
+                        matched |= *p == *s;
+                    }
+                    else if (plen >= 3 && p[1] == '-' && p[2] != ']')
+                    {
+                        char lo = Min(p[0], p[2]);
+                        char hi = Max(p[0], p[2]);
+
+                        matched |= *s >= lo && *s <= hi;
+                        p += 2;
+                        plen -= 2;
+                    }
+                    else
+                        matched |= *p == *s;
+                    p++;
+                    plen--;
+                }
 
-            /* Update the existing head's prev pointer */
-            list_element* head_elem = dsa_get_address(g_spat_db->g_dsa, head_ptr);
-            head_elem->prev = new_elem_ptr;
+                /* Unterminated class */
+                if (plen == 0 || matched == negate)
+                    return false;
+                s++;
+                slen--;
+                break;
+            }
 
-            /* Update the list's head pointer */
-            dbentry->value.list.head = new_elem_ptr;
+        case '\\':
+            if (plen >= 2)
+            {
+                p++;
+                plen--;
+            }
+            /* FALLTHROUGH */
 
-            /* Increment the size */
-            dbentry->value.list.size++;
+        default:
+            if (slen == 0 || *p != *s)
+                return false;
+            s++;
+            slen--;
+            break;
         }
-    }
 
-    spdb_release_lock(g_spat_db, dbentry);
-    spat_detach_shmem();
+        p++;
+        plen--;
+    }
 
-    PG_RETURN_VOID();
+    return slen == 0;
 }
 
-PG_FUNCTION_INFO_V1(llen);
+static inline bool
+spat_scan_match(const text* pattern, const text* key)
+{
+    return pattern == NULL ||
+        spat_glob_match(VARDATA_ANY(pattern), VARSIZE_ANY_EXHDR(pattern),
+                        VARDATA_ANY(key), VARSIZE_ANY_EXHDR(key));
+}
 
-Datum
-llen(PG_FUNCTION_ARGS)
+static int
+spat_scan_item_cmp(const void* a, const void* b)
 {
-    spat_attach_shmem();
+    dshash_hash ha = ((const SpatScanItem*)a)->hash;
+    dshash_hash hb = ((const SpatScanItem*)b)->hash;
 
-    /* Retrieve the key and the element arguments */
-    dss key = PG_GETARG_DSS(0);
+    return ha < hb ? -1 : ha > hb ? 1 : 0;
+}
 
-    /* Insert/find the list in the global hash table */
-    bool dbentryfound;
-    uint32 result;
+static void
+spat_scan_batch_init(SpatScanBatch* b, uint32 from, int count)
+{
+    b->from = from;
+    b->count = Max(count, 1);
+    b->bounded = false;
+    b->bound = 0;
+    b->more = false;
+    b->nitems = 0;
+    b->cap = Max(2 * b->count, 16);
+    b->items = palloc(sizeof(SpatScanItem) * b->cap);
+}
 
-    SpatDBEntry* dbentry = spdb_find_or_insert(g_spat_db, key, &dbentryfound);
+/* Whether an item of hash may make it into the batch, so that it's worth copying */
+static inline bool
+spat_scan_wants(SpatScanBatch* b, dshash_hash hash)
+{
+    if (hash < b->from)
+        return false;
 
-    if (dbentryfound)
+    if (b->bounded && hash > b->bound)
     {
-        result = dbentry->value.list.size;
+        b->more = true;
+        return false;
     }
 
-    spdb_release_lock(g_spat_db, dbentry);
-    spat_detach_shmem();
-
-    if (dbentryfound)
-        PG_RETURN_INT32(result);
-    else
-        PG_RETURN_NULL();
+    return true;
 }
 
-PG_FUNCTION_INFO_V1(lpop);
-
-Datum
-lpop(PG_FUNCTION_ARGS)
+/*
+ * Sort the batch and keep its count items with the smallest hashes, plus the
+ * ties of the last one, which then bounds what can still make it.
+ */
+static void
+spat_scan_trim(SpatScanBatch* b)
 {
-    spat_attach_shmem();
+    int keep = b->count;
 
-    /* Retrieve the key argument */
-    dss key = PG_GETARG_DSS(0);
+    qsort(b->items, b->nitems, sizeof(SpatScanItem), spat_scan_item_cmp);
 
-    /* Find the list in the global hash table */
-    bool dbentryfound;
-    SpatDBEntry* dbentry = spdb_find_or_insert(g_spat_db, key, &dbentryfound);
+    if (b->nitems <= keep)
+        return;
 
-    /*
-     * If the list does not exist or is empty, release the lock and
-     * return NULL
-     */
-    if (!dbentryfound || dbentry->valtyp != SPVAL_LIST || dbentry->value.list.size == 0)
+    while (keep < b->nitems && b->items[keep].hash == b->items[keep - 1].hash)
+        keep++;
+
+    for (int i = keep; i < b->nitems; i++)
     {
-        spdb_release_lock(g_spat_db, dbentry);
-        spat_detach_shmem();
-        PG_RETURN_NULL();
+        pfree(b->items[i].key);
+        if (b->items[i].val)
+            pfree(b->items[i].val);
     }
 
-    /* Retrieve the head of the list */
-    dsa_pointer head_ptr = dbentry->value.list.head;
-    list_element* head_elem = dsa_get_address(g_spat_db->g_dsa, head_ptr);
+    if (keep < b->nitems)
+        b->more = true;
+    b->nitems = keep;
+    b->bounded = true;
+    b->bound = b->items[keep - 1].hash;
+}
 
-    /* Prepare the return value (head element data) */
-    text* result = DSS_TO_TEXT(head_elem->data);
+/* Add an item spat_scan_wants, trimming the batch when it's full */
+static void
+spat_scan_add(SpatScanBatch* b, dshash_hash hash, text* key, text* val)
+{
+    if (b->nitems == b->cap)
+    {
+        spat_scan_trim(b);
 
-    /* Update the list to remove the head */
-    dbentry->value.list.head = head_elem->next;
+        /* Ties with the bound may have kept it full */
+        if (b->nitems == b->cap)
+        {
+            b->cap *= 2;
+            b->items = repalloc_huge(b->items, sizeof(SpatScanItem) * b->cap);
+        }
 
-    if (dbentry->value.list.head != InvalidDsaPointer)
-    {
-        /*
-         * Update the new head's `prev` pointer to
-         * `InvalidDsaPointer`
-         */
-        list_element* new_head = dsa_get_address(g_spat_db->g_dsa, dbentry->value.list.head);
-        new_head->prev = InvalidDsaPointer;
-    }
-    else
-    {
-        /* The list is now empty, update the tail pointer */
-        dbentry->value.list.tail = InvalidDsaPointer;
+        if (!spat_scan_wants(b, hash))
+        {
+            pfree(key);
+            if (val)
+                pfree(val);
+            return;
+        }
     }
 
-    /* Decrement the size of the list */
-    dbentry->value.list.size--;
-
-    /* Free the old head element from the DSA */
-    dsa_free(g_spat_db->g_dsa, head_ptr);
+    b->items[b->nitems].hash = hash;
+    b->items[b->nitems].key = key;
+    b->items[b->nitems].val = val;
+    b->nitems++;
+}
 
-    /* Release the lock on the hash table entry */
-    spdb_release_lock(g_spat_db, dbentry);
+/*
+ * Finish the batch. Returns whether the table has items past it, and if so
+ * sets *next to the hash to resume from, which is never 0.
+ */
+static bool
+spat_scan_finish(SpatScanBatch* b, uint32* next)
+{
+    spat_scan_trim(b);
 
-    spat_detach_shmem();
+    if (!b->more || b->nitems == 0)
+        return false;
 
-    /* Return the result */
-    PG_RETURN_TEXT_P(result);
+    /* An item hashing above the last one returned was seen, so it's below PG_UINT32_MAX */
+    *next = b->items[b->nitems - 1].hash + 1;
+    return true;
 }
 
-PG_FUNCTION_INFO_V1(rpush);
-
-Datum
-rpush(PG_FUNCTION_ARGS)
+/* Whether key, a dss in db, matches pattern, if any */
+static inline bool
+spat_scan_match_dss(SpatDB* db, const text* pattern, const dss* key)
 {
-    spat_attach_shmem();
+    return pattern == NULL ||
+        spat_glob_match(VARDATA_ANY(pattern), VARSIZE_ANY_EXHDR(pattern),
+                        dss_ptr(db->g_dsa, key), key->len - 1);
+}
 
-    /* Retrieve the key and the element arguments */
-    dss key = PG_GETARG_DSS(0);
-    dss elem = PG_GETARG_DSS(1);
+static Datum
+spat_scan_result(FunctionCallInfo fcinfo, int64 cursor, int narrays, List* a, List* b)
+{
+    TupleDesc tupdesc;
+    Datum values[3];
+    bool nulls[3] = {0};
+    List* arrays[2] = {a, b};
 
-    /* Insert/find the list in the global hash table */
-    bool dbentryfound;
-    SpatDBEntry* dbentry = spdb_find_or_insert(g_spat_db, key, &dbentryfound);
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        elog(ERROR, "return type must be a row type");
 
-    if (!dbentryfound || dbentry->value.list.size == 0)
+    values[0] = Int64GetDatum(cursor);
+    for (int i = 0; i < narrays; i++)
     {
-        /* If the list does not exist or is empty, initialize it */
-        dbentry->valtyp = SPVAL_LIST;
+        int n = list_length(arrays[i]);
+        Datum* elems = palloc(sizeof(Datum) * Max(n, 1));
 
+        for (int j = 0; j < n; j++)
+            elems[j] = PointerGetDatum(list_nth(arrays[i], j));
+        values[i + 1] = PointerGetDatum(construct_array_builtin(elems, n, TEXTOID));
+    }
 
-        /* Allocate and initialize the new element */
-        dsa_pointer new_elem_ptr = dsa_allocate(g_spat_db->g_dsa, sizeof(list_element));
-        list_element* new_elem = dsa_get_address(g_spat_db->g_dsa, new_elem_ptr);
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
 
-        new_elem->data = elem;
-        new_elem->prev = InvalidDsaPointer;
-        new_elem->next = InvalidDsaPointer;
+SPAT_COMMAND(spscan, SPAT_CMD_SCAN)
+{
+    int64 cursor;
+    text* match = PG_ARGISNULL(1) ? NULL : PG_GETARG_TEXT_PP(1);
+    int count;
+    int shard;
+    TimestampTz now = GetCurrentTimestamp();
+    SpatScanBatch b;
+    dshash_table* htab;
+    dshash_seq_status status;
+    SpatDBEntry* entry;
+    List* keys = NIL;
+    uint32 next;
+    int64 result;
 
-        /* Set the new element as both the head and tail of the list */
-        dbentry->value.list.head = new_elem_ptr;
-        dbentry->value.list.tail = new_elem_ptr;
+    if (PG_ARGISNULL(0) || PG_ARGISNULL(2))
+        elog(ERROR, "cursor and count cannot be NULL");
 
-        dbentry->value.list.size = 1;
-    }
-    else
-    {
-        /* Normal RPUSH to the tail of the list */
-        dsa_pointer tail_ptr = dbentry->value.list.tail;
-        dsa_pointer new_elem_ptr = dsa_allocate(g_spat_db->g_dsa, sizeof(list_element));
-        list_element* new_elem = dsa_get_address(g_spat_db->g_dsa, new_elem_ptr);
+    cursor = PG_GETARG_INT64(0);
+    count = PG_GETARG_INT32(2);
+    shard = SPAT_SCAN_CURSOR_SHARD(cursor);
 
-        /* Set the new element's data */
-        new_elem->data = elem;
+    spat_attach_shmem();
 
-        /* Link the new element to the existing tail */
-        new_elem->prev = tail_ptr;
-        new_elem->next = InvalidDsaPointer;
+    if (cursor < 0 || shard >= g_spat_db->shared->nshards)
+        elog(ERROR, "invalid cursor " INT64_FORMAT, cursor);
 
-        /* Update the existing tail's next pointer */
-        list_element* tail_elem = dsa_get_address(g_spat_db->g_dsa, tail_ptr);
-        tail_elem->next = new_elem_ptr;
+    htab = spdb_htab(g_spat_db, shard);
+    spat_scan_batch_init(&b, SPAT_SCAN_CURSOR_HASH(cursor), count);
 
-        /* Update the list's tail pointer */
-        dbentry->value.list.tail = new_elem_ptr;
+    /* Only live keys, and looking at them mustn't count as an access */
+    dshash_seq_init(&status, htab, false);
+    while ((entry = dshash_seq_next(&status)) != NULL)
+    {
+        dshash_hash hash = spdb_hash(g_spat_db, &entry->key);
 
-        /* Increment the size */
-        dbentry->value.list.size++;
-    }
+        if (!spat_scan_wants(&b, hash) || SPDB_ENTRY_EXPIRED(entry, now) ||
+            !spat_scan_match_dss(g_spat_db, match, &entry->key))
+            continue;
 
-    spdb_release_lock(g_spat_db, dbentry);
-    spat_detach_shmem();
+        spat_scan_add(&b, hash, dss_to_text(g_spat_db->g_dsa, entry->key), NULL);
+    }
+    dshash_seq_term(&status);
 
-    /* Return success */
-    PG_RETURN_VOID();
-}
+    if (spat_scan_finish(&b, &next))
+        result = SPAT_SCAN_CURSOR(shard, next);
+    else if (shard + 1 < g_spat_db->shared->nshards)
+        result = SPAT_SCAN_CURSOR(shard + 1, 0);
+    else
+        result = 0;
 
-PG_FUNCTION_INFO_V1(rpop);
+    for (int i = 0; i < b.nitems; i++)
+        keys = lappend(keys, b.items[i].key);
 
-Datum
-rpop(PG_FUNCTION_ARGS)
-{
+    return spat_scan_result(fcinfo, result, 1, keys, NIL);
 }
 
-/*
- * ---------------------------------------- HASHES
- * ----------------------------------------
- */
-
-typedef struct sphash_entry
+/* SSCAN and HSCAN, on the table of the collection stored at key */
+static Datum
+spat_scan_collection(FunctionCallInfo fcinfo, SpatScanKind kind)
 {
-    dss field;
-    dss value;
-} sphash_entry;
-
-static const dshash_parameters sphash_params = {
-    .key_size = sizeof(dss),
-    .entry_size = sizeof(sphash_entry),
-    .compare_function = dss_cmp,
-    .hash_function = dss_hash,
-    .copy_function = dss_copy
-};
-
-PG_FUNCTION_INFO_V1(hset);
+    text* keytxt;
+    int64 cursor;
+    text* match = PG_ARGISNULL(2) ? NULL : PG_GETARG_TEXT_PP(2);
+    int count;
+    spValueType valtyp = kind == SPAT_SCAN_SET ? SPVAL_SET : SPVAL_HASH;
+    const dshash_parameters* params = kind == SPAT_SCAN_SET ? &params_hashset : &sphash_params;
+    List* fields = NIL;
+    List* vals = NIL;
+    int64 result = 0;
+    SpatColl* coll;
+
+    if (PG_ARGISNULL(0) || PG_ARGISNULL(1) || PG_ARGISNULL(3))
+        elog(ERROR, "key, cursor and count cannot be NULL");
+
+    keytxt = PG_GETARG_TEXT_PP(0);
+    cursor = PG_GETARG_INT64(1);
+    count = PG_GETARG_INT32(3);
 
-Datum
-hset(PG_FUNCTION_ARGS)
-{
     spat_attach_shmem();
 
-    dss key = PG_GETARG_DSS(0);
-    dss field = PG_GETARG_DSS(1);
-    dss value = PG_GETARG_DSS(2);
-
-    bool dbentryfound;
-
-    SpatDBEntry* dbentry = spdb_find_or_insert(g_spat_db, key, &dbentryfound);
-    dshash_table* htab;
+    if (cursor < 0 || SPAT_SCAN_CURSOR_SHARD(cursor) != 0)
+        elog(ERROR, "invalid cursor " INT64_FORMAT, cursor);
 
-    if (!dbentryfound)
-    {
-        htab = dshash_create(g_spat_db->g_dsa, &sphash_params, NULL);
-        dbentry->valtyp = SPVAL_HASH;
-        dbentry->value.hash.hndl = dshash_get_hash_table_handle(htab);
-        dbentry->value.hash.size = 0;
-    }
-    else
+    coll = spat_coll_find(g_spat_db, dss_new_local(keytxt), valtyp, LW_SHARED, true);
+    if (coll)
     {
-        /* dbentryfound=true */
-        Assert(dbentry->valtyp == SPVAL_HASH);
-        htab = dshash_attach(g_spat_db->g_dsa, &sphash_params, dbentry->value.hash.hndl, NULL);
-    }
+        dshash_table* htab;
+        dshash_seq_status status;
+        void* item;
+        SpatScanBatch b;
+        uint32 next;
 
-    bool sphsntry_found;
-    sphash_entry* sphsntry = dshash_find_or_insert(htab, &field, &sphsntry_found);
+        if (coll->encoding == SPAT_ENC_LISTPACK)
+        {
+            /* Small enough to return in a single batch, like Redis does */
+            SpatPack* pack = dsa_get_address(g_spat_db->g_dsa,
+                                             kind == SPAT_SCAN_SET ? coll->value.set.hndl : coll->value.hash.hndl);
+            char* pitem = SPAT_PACK_ITEMS(pack);
 
-    if (!sphsntry_found)
-    {
-        sphsntry->field = field;
-        sphsntry->value = value;
-        dbentry->value.hash.size++;
-    }
-    else
-    {
-        sphsntry->value = value;
-    }
+            while (pitem < SPAT_PACK_END(pack))
+            {
+                text* field = spat_pack_item_text(pitem);
+                text* val = NULL;
 
-    dshash_release_lock(htab, sphsntry);
-    dshash_detach(htab);
+                pitem = spat_pack_item_next(pitem);
+                if (kind == SPAT_SCAN_HASH)
+                {
+                    val = spat_pack_item_text(pitem);
+                    pitem = spat_pack_item_next(pitem);
+                }
 
-    spdb_release_lock(g_spat_db, dbentry);
-    spat_detach_shmem();
+                if (!spat_scan_match(match, field))
+                    continue;
 
-    PG_RETURN_VOID();
-}
+                fields = lappend(fields, field);
+                if (kind == SPAT_SCAN_HASH)
+                    vals = lappend(vals, val);
+            }
 
-PG_FUNCTION_INFO_V1(hget);
+            spat_coll_unlock(g_spat_db, coll);
+            return spat_scan_result(fcinfo, 0, kind == SPAT_SCAN_HASH ? 2 : 1, fields, vals);
+        }
 
-Datum
-hget(PG_FUNCTION_ARGS)
-{
-    spat_attach_shmem();
+        /* The table can't go away while we hold its collection. Fields start their items */
+        htab = dshash_attach(g_spat_db->g_dsa, params,
+                             kind == SPAT_SCAN_SET ? coll->value.set.hndl : coll->value.hash.hndl,
+                             NULL);
+        spat_scan_batch_init(&b, SPAT_SCAN_CURSOR_HASH(cursor), count);
 
-    dss key = PG_GETARG_DSS(0);
-    dss field = PG_GETARG_DSS(1);
+        dshash_seq_init(&status, htab, false);
+        while ((item = dshash_seq_next(&status)) != NULL)
+        {
+            dss* field = (dss*)item;
+            dshash_hash hash = spdb_hash(g_spat_db, field);
 
-    bool sphashentryfound = false;
-    text* result;
+            if (!spat_scan_wants(&b, hash) || !spat_scan_match_dss(g_spat_db, match, field))
+                continue;
 
-    SpatDBEntry* dbentry = spdb_find(g_spat_db, key, false);
+            spat_scan_add(&b, hash, DSS_TO_TEXT(*field),
+                          kind == SPAT_SCAN_HASH ? DSS_TO_TEXT(((sphash_entry*)item)->value) : NULL);
+        }
+        dshash_seq_term(&status);
 
-    if (dbentry && dbentry->valtyp == SPVAL_HASH)
-    {
-        dshash_table* htab = dshash_attach(g_spat_db->g_dsa, &sphash_params,
-                                           dbentry->value.hash.hndl, NULL);
+        dshash_detach(htab);
+        spat_coll_unlock(g_spat_db, coll);
 
-        sphash_entry* sphsntry = dshash_find(htab, &field, false);
-        if (sphsntry != NULL)
+        if (spat_scan_finish(&b, &next))
+            result = SPAT_SCAN_CURSOR(0, next);
+
+        for (int i = 0; i < b.nitems; i++)
         {
-            result = DSS_TO_TEXT(sphsntry->value);
-            sphashentryfound = true;
-            dshash_release_lock(htab, sphsntry);
+            fields = lappend(fields, b.items[i].key);
+            if (kind == SPAT_SCAN_HASH)
+                vals = lappend(vals, b.items[i].val);
         }
-
-        dshash_detach(htab);
     }
 
-    if (dbentry)
-        spdb_release_lock(g_spat_db, dbentry);
+    return spat_scan_result(fcinfo, result, kind == SPAT_SCAN_HASH ? 2 : 1, fields, vals);
+}
 
-    spat_detach_shmem();
-    if (sphashentryfound)
-        PG_RETURN_TEXT_P(result);
+SPAT_COMMAND(sscan, SPAT_CMD_SSCAN)
+{
+    return spat_scan_collection(fcinfo, SPAT_SCAN_SET);
+}
 
-    PG_RETURN_NULL();
+SPAT_COMMAND(hscan, SPAT_CMD_HSCAN)
+{
+    return spat_scan_collection(fcinfo, SPAT_SCAN_HASH);
 }
 
 /*
- * To delete an entry we attempt to find it first If its not found do
- * nothing. If it's found though, it's not enought DEL the key, we also have
- * to cleanup the value itself based on the value typee.
+ * ---------------------------------------- Active Expiration
+ * ----------------------------------------
+ *
+ * Lazy expiration never reclaims keys that aren't accessed again. When spat
+ * is preloaded, the expirer background worker runs cycles over every DB in
+ * the catalog, popping due keys off each shard's expiry heap in batches of
+ * spat.expire_keys_per_loop, but never for more than a quarter of
+ * spat.expire_interval, so that a cycle can't turn into a latency spike.
+ * Keys that aren't due yet are never looked at.
  */
-PG_FUNCTION_INFO_V1(del);
 
-Datum
-del(PG_FUNCTION_ARGS)
+/*
+ * Pops up to spat.expire_keys_per_loop due keys off a shard's expiry heap and
+ * reclaims them. Returns the number of keys popped.
+ */
+static int
+spat_expire_loop(SpatDB* db, int shardno, TimestampTz now)
 {
-    bool found = false;
-    spat_attach_shmem();
-
-    dss key = PG_GETARG_DSS(0);
+    SpatDBShard* shard = &db->shard_hdrs[shardno];
+    dshash_table* htab = spdb_htab(db, shardno);
+    dsa_pointer* due = palloc(sizeof(dsa_pointer) * g_guc_spat_expire_keys_per_loop);
+    int ndue = 0;
+    int expired = 0;
+
+    /* Entry locks come before expire_lck, so pop first and look up later */
+    LWLockAcquire(&shard->expire_lck, LW_EXCLUSIVE);
+    while (ndue < g_guc_spat_expire_keys_per_loop && shard->expire_size > 0)
+    {
+        SpatExpireItem* heap = dsa_get_address(db->g_dsa, shard->expire_heap);
 
-    SPDB_LOCK_EXCLUSIVE(g_spat_db); /* sure about this ? */
+        if (heap[0].expireat > now)
+            break;
+        due[ndue++] = heap[0].node;
+        expire_heap_remove(db->g_dsa, shard, 0);
+    }
+    LWLockRelease(&shard->expire_lck);
 
-    /* Look up for the entry and if it's found lock it exclusively */
-    SpatDBEntry* entry = spdb_find(g_spat_db, key, SPDB_ENTRY_LOCK_EXCLUSIVE);
-    if (entry)
+    for (int i = 0; i < ndue; i++)
     {
-        found = true;
-        /* we begin by cleaning up the value */
+        SpatExpireNode* node = dsa_get_address(db->g_dsa, due[i]);
+        SpatDBEntry* entry = dshash_find(htab, &node->key, true);
 
-        /* toggle on the valtype to clean up properly */
-        switch (entry->valtyp)
+        /* The key may have been deleted or given a new TTL meanwhile */
+        if (entry && entry->expire_node == due[i] && SPDB_ENTRY_EXPIRED(entry, now))
         {
-        case SPVAL_STRING:
-            {
-                dsa_free(g_spat_db->g_dsa, entry->value.string.str);
-                break;
-            }
+            spdb_delete_entry(db, entry);
+            expired++;
+        }
+        else if (entry)
+            dshash_release_lock(htab, entry);
 
-        case SPVAL_LIST:
-            {
-                dsa_pointer current_ptr = entry->value.list.head;
+        SPDB_MEM_SUB(db, SPVAL_NULL, sizeof(SpatExpireNode) + node->key.len);
+        dss_free(db->g_dsa, &node->key);
+        dsa_free(db->g_dsa, due[i]);
+    }
+    pfree(due);
 
-                while (current_ptr != InvalidDsaPointer)
-                {
-                    list_element* current_elem = dsa_get_address(g_spat_db->g_dsa, current_ptr);
-                    dsa_pointer next_ptr = current_elem->next;
+    pg_atomic_fetch_add_u64(&db->shared->expired_active, expired);
 
-                    /* Free the current element */
-                    dsa_free(g_spat_db->g_dsa, current_ptr);
+    return ndue;
+}
 
-                    /* Move to the next element */
-                    current_ptr = next_ptr;
-                }
+static void
+spat_expire_cycle(SpatDB* db)
+{
+    TimestampTz start = GetCurrentTimestamp();
+    int budget_ms = Max(g_guc_spat_expire_interval / 4, 1);
 
-                /* Reset the list metadata */
-                entry->value.list.head = InvalidDsaPointer;
-                entry->value.list.tail = InvalidDsaPointer;
-                entry->value.list.size = 0;
+    bool in_budget = true;
 
-                break;
-            }
+    /* Resume from the shard where the previous cycle ran out of time */
+    for (int n = 0; n < db->shared->nshards && in_budget; n++)
+    {
+        int popped;
 
-        case SPVAL_HASH:
-            {
-                /* Attach to the hash table */
-                dshash_table_handle htabhandl = entry->value.hash.hndl;
-                dshash_table* htab = dshash_attach(g_spat_db->g_dsa, &sphash_params, htabhandl, NULL);
+        do
+        {
+            CHECK_FOR_INTERRUPTS();
+            popped = spat_expire_loop(db, db->expire_shard, GetCurrentTimestamp());
+            in_budget = !TimestampDifferenceExceeds(start, GetCurrentTimestamp(), budget_ms);
+        }
+        while (in_budget && popped == g_guc_spat_expire_keys_per_loop);
 
-                /* Iterate over all elements and delete them */
-                dshash_seq_status status;
-                dshash_seq_init(&status, htab, true);
+        /* A short batch means nothing else is due in this shard */
+        if (popped < g_guc_spat_expire_keys_per_loop)
+            db->expire_shard = (db->expire_shard + 1) % db->shared->nshards;
+    }
 
-                while (dshash_seq_next(&status) != NULL)
-                {
-                    dshash_delete_current(&status);
-                }
+    pg_atomic_fetch_add_u64(&db->shared->expire_cycles, 1);
+}
 
-                dshash_seq_term(&status);
+/* A copy of the catalog's names, so that its lock isn't held while working on them */
+static SpatDBName*
+spat_catalog_names(int* ndbs)
+{
+    SpatCatalog* catalog = spat_get_catalog();
+    SpatDBName* names;
 
-                /* Destroy the hash table */
-                dshash_destroy(htab);
+    LWLockAcquire(&catalog->lck, LW_SHARED);
+    *ndbs = catalog->ndbs;
+    names = palloc(sizeof(*names) * Max(*ndbs, 1));
+    memcpy(names, catalog->names, sizeof(*names) * *ndbs);
+    LWLockRelease(&catalog->lck);
 
-                /* Reset hash metadata */
-                entry->value.hash.hndl = InvalidDsaPointer;
-                entry->value.hash.size = 0;
+    return names;
+}
 
-                break;
-            }
+void
+spat_expirer_main(Datum main_arg)
+{
+    MemoryContext cycle_cxt;
+    TimestampTz last_snapshot;
+    SpatDBName* names;
+    int ndbs;
 
-        case SPVAL_SET:
-            {
-                /* Attach to the hash table */
-                dshash_table_handle htabhandl = entry->value.set.hndl;
-                dshash_table* htab = dshash_attach(g_spat_db->g_dsa, &params_hashset, htabhandl, NULL);
+    pqsignal(SIGHUP, SignalHandlerForConfigReload);
+    pqsignal(SIGTERM, SignalHandlerForShutdownRequest);
+    BackgroundWorkerUnblockSignals();
 
-                /* Iterate over all elements and delete them */
-                dshash_seq_status status;
-                dshash_seq_init(&status, htab, true);
+    cycle_cxt = AllocSetContextCreate(TopMemoryContext, "spat expirer", ALLOCSET_DEFAULT_SIZES);
 
-                while (dshash_seq_next(&status) != NULL)
-                {
-                    dshash_delete_current(&status);
-                }
+    spat_snapshot_restore_all();
+    last_snapshot = GetCurrentTimestamp();
 
-                /* Terminate sequence scan */
-                dshash_seq_term(&status);
+    while (!ShutdownRequestPending)
+    {
+        MemoryContext oldcontext = MemoryContextSwitchTo(cycle_cxt);
+
+        names = spat_catalog_names(&ndbs);
+
+        for (int i = 0; i < ndbs; i++)
+        {
+            /* dss_* callbacks work on g_spat_db */
+            g_spat_db = spat_attach_db(names[i]);
+            spat_expire_cycle(g_spat_db);
+            spat_aof_background(g_spat_db);
+            if (spat_aof_needs_rewrite(g_spat_db))
+                spat_snapshot_save_db(names[i]);
+            g_spat_db = NULL;
+        }
 
-                /* Destroy the hash table */
-                dshash_destroy(htab);
+        if (g_guc_spat_snapshot_dir[0] != '\0' && g_guc_spat_snapshot_interval > 0 &&
+            TimestampDifferenceExceeds(last_snapshot, GetCurrentTimestamp(),
+                                       g_guc_spat_snapshot_interval * 1000))
+        {
+            spat_snapshot_save_all(names, ndbs);
+            last_snapshot = GetCurrentTimestamp();
+        }
 
-                /* Reset set metadata */
-                entry->value.set.hndl = InvalidDsaPointer;
-                entry->value.set.size = 0;
+        MemoryContextSwitchTo(oldcontext);
+        MemoryContextReset(cycle_cxt);
 
-                break;
-            }
+        (void)WaitLatch(MyLatch,
+                        WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+                        g_guc_spat_expire_interval,
+                        spat_wait_event(&g_spat_wait_expirer, "SpatExpirerMain"));
+        ResetLatch(MyLatch);
 
-        case SPVAL_INVALID:
-        case SPVAL_NULL:
-        default:
-            break;
+        CHECK_FOR_INTERRUPTS();
+
+        if (ConfigReloadPending)
+        {
+            ConfigReloadPending = false;
+            ProcessConfigFile(PGC_SIGHUP);
         }
-        spdb_release_lock(g_spat_db, entry);
-        dshash_delete_key(g_spat_db->g_htab, &key);
     }
-    else
+
+    /* Nothing written since the last snapshot is lost on a clean shutdown */
+    if (g_guc_spat_snapshot_dir[0] != '\0')
     {
-        /* key not found - do nothing */
-        found = false;
+        names = spat_catalog_names(&ndbs);
+        spat_snapshot_save_all(names, ndbs);
     }
-    SPDB_LOCK_RELEASE(g_spat_db)
 
-    spat_detach_shmem();
-    PG_RETURN_BOOL(found);
+    proc_exit(0);
 }
@@ -19,7 +19,10 @@
 #include "common/hashfn.h"
 
 /* -------------------- DSS --------------------
- * A Dynamicaly-Shared String (DSS) is a null-terminated char* stored in a DSA
+ * A Dynamicaly-Shared String (DSS) is a null-terminated char* stored in a DSA.
+ * dss_new_local() builds a lookup-only dss pointing to backend-local memory.
+ * Short strings are kept inline in the dss itself, with no allocation.
+ * A dss caches its hash once it's been hashed as a dshash key.
  */
 
 struct dss;
@@ -27,17 +30,18 @@ typedef struct dss dss;
 
 extern dss dss_new(dsa_area* dsa, const text* txt);
 extern dss dss_new_extended(dsa_area* dsa, const char* str, Size len);
+extern dss dss_new_local(const text* txt);
 extern void dss_free(dsa_area* dsa, dss* dss);
 
 extern text* dss_to_text(dsa_area* dsa, dss dss);
 
 extern uint32_t hash_murmur3(const void* key, size_t len, void* arg);
+extern uint32_t hash_murmur3_seeded(const void* key, size_t len, uint32_t seed);
 
 /* necessary for dshash_parameters where dshash keys are dss */
 extern int dss_cmp_arg(const void* a, const void* b, size_t size, void* arg);
 extern int dss_cmp(const void* a, const void* b, size_t size, void* arg);
 
-extern dshash_hash dss_hash_arg(const void* key, size_t size, void* arg);
 extern dshash_hash dss_hash(const void* key, size_t size, void* arg);
 
 extern void dss_cpy_arg(void* dest, const void* src, size_t size, void* arg);
@@ -55,9 +59,12 @@ typedef enum spValueType
     SPVAL_STRING,
     SPVAL_SET,
     SPVAL_LIST,
-    SPVAL_HASH
+    SPVAL_HASH,
+    SPVAL_ZSET
 } spValueType;
 
+#define SPVAL_NTYPES (SPVAL_ZSET + 1)
+
 extern const char* spTypeName(spValueType t);
 
 struct SpatDBEntry;
@@ -74,5 +81,10 @@ extern SpatDBEntry* spdb_find(SpatDB* db, dss key, SPDB_LOCK_TYPE exclusive);
 extern SpatDBEntry* spdb_find_or_insert(SpatDB* db, dss key, bool* found);
 
 extern void spdb_release_lock(SpatDB* db, SpatDBEntry* entry);
+extern void spdb_delete_entry(SpatDB* db, SpatDBEntry* entry);
+
+/* TTLs. The entry must be locked exclusively */
+extern void spdb_set_expire(SpatDB* db, SpatDBEntry* entry, TimestampTz expireat);
+extern void spdb_clear_expire(SpatDB* db, SpatDBEntry* entry);
 
 #endif
@@ -0,0 +1,6 @@
+-- pgbench -n -f test/bench/del.sql -D keys=10000 -D key_size=16 -D value_size=64 -T 30
+-- DEL-heavy mix: as many deletions as writes, so keys are freed and inserted all the time.
+\set k random(1, :keys)
+SELECT SPSET(rpad('bench:del:' || :k, :key_size, '.'), repeat('v', :value_size));
+\set k random(1, :keys)
+SELECT DEL(rpad('bench:del:' || :k, :key_size, '.'));
@@ -0,0 +1,4 @@
+-- pgbench -n -f test/bench/get.sql -D keys=10000 -D key_size=16 -D hit_ratio=90 -T 30
+-- SPGET of the strings loaded by setup.sql; hit_ratio percent of the reads find their key.
+\set k random(1, :keys * 100 / :hit_ratio)
+SELECT SPGET(rpad('bench:' || :k, :key_size, '.'));
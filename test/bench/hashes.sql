@@ -0,0 +1,8 @@
+-- pgbench -n -f test/bench/hashes.sql -D keys=10000 -D key_size=16 -D value_size=64 -T 30
+-- HGET on the hash loaded by setup.sql, plus an HSET and an HINCRBY.
+\set k random(1, :keys)
+SELECT HGET('bench:hash', rpad('f:' || :k, :key_size, '.'));
+\set k random(1, :keys)
+SELECT HSET('bench:hash', rpad('f:' || :k, :key_size, '.'), repeat('v', :value_size));
+\set k random(1, :keys)
+SELECT HINCRBY('bench:counters', 'c:' || :k, 1);
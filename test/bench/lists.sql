@@ -0,0 +1,4 @@
+-- pgbench -n -f test/bench/lists.sql -D value_size=64 -T 30
+-- A queue: RPUSH at the tail of the list loaded by setup.sql, LPOP at its head.
+SELECT RPUSH('bench:list', repeat('v', :value_size));
+SELECT LPOP('bench:list');
@@ -0,0 +1,51 @@
+#!/usr/bin/env python3
+"""Plots the throughput in results/bench.csv against the number of clients.
+
+usage: plot.py [results/bench.csv] [plot.png]
+
+One panel per script, one line per key size, value size and hit ratio.
+"""
+import csv
+import sys
+from collections import defaultdict
+
+import matplotlib
+
+matplotlib.use("Agg")
+import matplotlib.pyplot as plt  # noqa: E402
+
+src = sys.argv[1] if len(sys.argv) > 1 else "results/bench.csv"
+dst = sys.argv[2] if len(sys.argv) > 2 else "plot.png"
+
+series = defaultdict(lambda: defaultdict(list))
+with open(src, newline="") as f:
+    for row in csv.DictReader(f):
+        if not row["tps"]:
+            continue
+        label = "%sB keys, %sB values" % (row["key_size"], row["value_size"])
+        if row["script"] == "get":
+            label += ", %s%% hits" % row["hit_ratio"]
+        series[row["script"]][label].append((int(row["clients"]), float(row["tps"])))
+
+scripts = list(series)
+cols = min(len(scripts), 3)
+rows = (len(scripts) + cols - 1) // cols
+fig, axes = plt.subplots(rows, cols, figsize=(5 * cols, 4 * rows), squeeze=False)
+
+for ax, script in zip(axes.flat, scripts):
+    for label, points in sorted(series[script].items()):
+        points.sort()
+        ax.plot([c for c, _ in points], [t for _, t in points], marker="o", label=label)
+    ax.set_title(script)
+    ax.set_xscale("log", base=2)
+    ax.set_xlabel("clients")
+    ax.set_ylabel("tps")
+    ax.grid(True, alpha=0.3)
+    ax.legend(fontsize="x-small")
+
+for ax in list(axes.flat)[len(scripts):]:
+    ax.set_visible(False)
+
+fig.tight_layout()
+fig.savefig(dst, dpi=100)
+print("wrote %s" % dst)
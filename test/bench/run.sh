@@ -0,0 +1,77 @@
+#!/bin/sh
+#
+# Runs the pgbench scripts in this directory against the server libpq points
+# to (PGHOST, PGDATABASE etc.), with spat installed, and writes their results
+# to results/bench.csv, and sp_hash_bench()'s to results/hash.csv.
+#
+# Every key and value size is loaded in a DB of its own, named after them, so
+# runs don't see each other's keys. They stay in memory until the server
+# restarts.
+
+set -e
+
+cd "$(dirname "$0")"
+
+BENCH_TIME=${BENCH_TIME:-10}
+BENCH_CLIENTS=${BENCH_CLIENTS:-"1 2 4 8 16 32 64 128"}
+BENCH_KEYS=${BENCH_KEYS:-10000}
+BENCH_KEY_SIZES=${BENCH_KEY_SIZES:-"16 256"}
+BENCH_VALUE_SIZES=${BENCH_VALUE_SIZES:-"16 1024"}
+BENCH_HIT_RATIOS=${BENCH_HIT_RATIOS:-"100 50"}
+BENCH_SCRIPTS=${BENCH_SCRIPTS:-"get set ttl del sets hashes lists"}
+PGBENCH=${PGBENCH:-pgbench}
+PSQL=${PSQL:-psql}
+
+mkdir -p results
+out=results/bench.csv
+echo "script,clients,key_size,value_size,hit_ratio,tps,latency_ms" > $out
+
+# script clients key_size value_size hit_ratio
+run() {
+    db="bench-k$3-v$4"
+    log=$(PGOPTIONS="-c spat.db=$db" $PGBENCH -n -f "$1.sql" -T "$BENCH_TIME" -c "$2" -j "$2" \
+          -D keys="$BENCH_KEYS" -D key_size="$3" -D value_size="$4" -D hit_ratio="$5" 2>&1) || {
+        echo "$log" >&2
+        exit 1
+    }
+    tps=$(echo "$log" | sed -n 's/^tps = \([0-9.]*\).*/\1/p' | head -n 1)
+    lat=$(echo "$log" | sed -n 's/^latency average = \([0-9.]*\) ms.*/\1/p')
+    echo "$1,$2,$3,$4,$5,$tps,$lat" >> $out
+    echo "$1: $2 clients, $3 byte keys, $4 byte values$([ "$1" = get ] && echo ", $5% hits"): $tps tps, $lat ms"
+}
+
+for ksize in $BENCH_KEY_SIZES; do
+    for vsize in $BENCH_VALUE_SIZES; do
+        PGOPTIONS="-c spat.db=bench-k$ksize-v$vsize" $PSQL -X -q -v ON_ERROR_STOP=1 \
+            -v keys="$BENCH_KEYS" -v key_size="$ksize" -v value_size="$vsize" -f setup.sql > /dev/null
+
+        for script in $BENCH_SCRIPTS; do
+            for clients in $BENCH_CLIENTS; do
+                # Only reads depend on the hit ratio
+                if [ "$script" = get ]; then
+                    for hits in $BENCH_HIT_RATIOS; do
+                        run $script $clients $ksize $vsize $hits
+                    done
+                else
+                    run $script $clients $ksize $vsize 100
+                fi
+            done
+        done
+    done
+done
+
+# Hashing alone, in C: ns per key and chain lengths for each spat.hash_function
+hash=results/hash.csv
+echo "min_len,max_len,hash_function,avg_key_len,ns_per_key,avg_probes,max_probes" > $hash
+for lens in "8 16" "16 64" "100 200" "1000 1000"; do
+    set -- $lens
+    $PSQL -X -q -A -t -F , -v ON_ERROR_STOP=1 \
+        -c "SELECT $1, $2, * FROM sp_hash_bench($BENCH_KEYS, $1, $2)" >> $hash
+done
+cat $hash
+
+if python3 -c "import matplotlib" 2> /dev/null; then
+    python3 plot.py $out plot.png
+else
+    echo "matplotlib not found, skipping plot.png"
+fi
@@ -0,0 +1,4 @@
+-- pgbench -n -f test/bench/set.sql -D keys=10000 -D key_size=16 -D value_size=64 -T 30
+-- SPSET overwriting the strings loaded by setup.sql.
+\set k random(1, :keys)
+SELECT SPSET(rpad('bench:' || :k, :key_size, '.'), repeat('v', :value_size));
@@ -0,0 +1,7 @@
+-- pgbench -n -f test/bench/sets.sql -D keys=10000 -D key_size=16 -T 30
+-- SISMEMBER on the set loaded by setup.sql, one SADD and SREM in ten.
+\set k random(1, :keys)
+SELECT SISMEMBER('bench:set', rpad('m:' || :k, :key_size, '.'));
+\set w random(1, 10)
+SELECT SADD('bench:set', rpad('m:' || :k, :key_size, '.')) WHERE :w = 1;
+SELECT SREM('bench:set', rpad('m:' || :k, :key_size, '.')) WHERE :w = 2;
@@ -0,0 +1,11 @@
+-- psql -v keys=10000 -v key_size=16 -v value_size=64 -f test/bench/setup.sql
+-- Loads the keys the other scripts read: :keys strings, and a set, a hash and
+-- a list of as many members each, with keys padded to :key_size bytes.
+CREATE EXTENSION IF NOT EXISTS spat;
+
+SELECT COUNT(SPSET(rpad('bench:' || k, :key_size, '.'), repeat('v', :value_size)))
+FROM generate_series(1, :keys) k;
+
+SELECT COUNT(SADD('bench:set', rpad('m:' || k, :key_size, '.'))) FROM generate_series(1, :keys) k;
+SELECT COUNT(HSET('bench:hash', rpad('f:' || k, :key_size, '.'), repeat('v', :value_size))) FROM generate_series(1, :keys) k;
+SELECT COUNT(RPUSH('bench:list', repeat('v', :value_size))) FROM generate_series(1, :keys) k;
@@ -0,0 +1,8 @@
+-- pgbench -n -f test/bench/ttl.sql -D keys=10000 -D key_size=16 -D value_size=64 -T 30
+-- TTL-heavy mix: every key is written with a TTL of up to a second, so most
+-- reads race with expiration, both lazy and by the expirer when preloaded.
+\set k random(1, :keys)
+\set ms random(1, 1000)
+SELECT SPSET(rpad('bench:ttl:' || :k, :key_size, '.'), repeat('v', :value_size), make_interval(secs => :ms / 1000.0));
+\set k random(1, :keys)
+SELECT SPGET(rpad('bench:ttl:' || :k, :key_size, '.'));
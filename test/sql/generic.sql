@@ -45,3 +45,273 @@ SELECT SPSET('key1', 'value1');
 SELECT SPTYPE('key1');
 
 SELECT SPTYPE('gsdgdf');
+
+-- lookups don't allocate in the DSA
+CREATE TEMP TABLE db_size AS SELECT SP_DB_SIZE_BYTES() AS bytes;
+SELECT COUNT(SPGET('key1')) FROM generate_series(1, 100000);
+SELECT SP_DB_SIZE_BYTES() = bytes FROM db_size;
+
+-- sharded keyspace
+SET spat.shards = 8;
+SET spat.db = 'test-spat-sharded';
+SELECT COUNT(SPSET('k' || i, 'v' || i)) FROM generate_series(1, 100) i;
+SELECT SP_DB_NITEMS(); --100
+SELECT SPGET('k42');
+SELECT DEL('k42');
+SELECT SPGET('k42');
+SELECT SP_DB_NITEMS(); --99
+RESET spat.shards;
+SET spat.db = 'spat-default';
+
+-- eviction
+SET spat.db = 'test-spat-evict';
+SET spat.maxmemory = '256kB';
+SET spat.maxmemory_policy = 'allkeys-lru';
+SELECT COUNT(SPSET('k' || i, repeat('x', 100))) FROM generate_series(1, 10000) i;
+SELECT SP_DB_NITEMS() < 10000;
+SELECT used_bytes < 300 * 1024, evictions > 0 FROM SP_DB_MEMORY_STATS();
+-- volatile-ttl evicts the keys expiring first
+SET spat.maxmemory_policy = 'volatile-ttl';
+SET spat.db = 'test-spat-evict-ttl';
+SELECT COUNT(SPSET('t' || i, repeat('x', 100), ttl=> i * interval '1 hour')) FROM generate_series(1, 3000) i;
+SELECT SPGET('t1') IS NULL, SPGET('t3000') IS NOT NULL;
+-- the limit is the DB's, whatever the session's settings are now
+RESET spat.maxmemory;
+RESET spat.maxmemory_policy;
+SET spat.db = 'test-spat-evict';
+SELECT COUNT(SPSET('r' || i, repeat('x', 100))) FROM generate_series(1, 10000) i;
+SELECT SP_DB_NITEMS() < 10000;
+SET spat.db = 'spat-default';
+
+-- multi-key commands
+SELECT SPMSET(ARRAY['mk1', 'mk2', 'mk3'], ARRAY['v1', 'v2', 'v3']);
+SELECT SPMGET(ARRAY['mk3', 'nokey', 'mk1']);
+SELECT SPDEL(ARRAY['mk1', 'mk2', 'nokey']);
+SELECT SPMGET(ARRAY['mk1', 'mk2', 'mk3']);
+SELECT SPDEL(ARRAY['mk3']);
+SELECT SPMGET(ARRAY['mk1', 'mk2', 'mk3']);
+SELECT SPMSET(ARRAY['mk1'], ARRAY['v1', 'v2']);
+
+-- SCAN
+SET spat.shards = 4;
+SET spat.db = 'test-spat-scan';
+SELECT COUNT(SPSET('scan:' || i, 'v')) FROM generate_series(1, 250) i;
+SELECT SPSET('other', 'v');
+WITH RECURSIVE s AS (
+    SELECT * FROM SPSCAN(0, count => 10)
+    UNION ALL
+    SELECT n.* FROM s, SPSCAN(s.next_cursor, count => 10) n WHERE s.next_cursor <> 0
+)
+SELECT COUNT(k), COUNT(DISTINCT k) FROM s, unnest(s.keys) k;
+WITH RECURSIVE s AS (
+    SELECT * FROM SPSCAN(0, count => 1)
+    UNION ALL
+    SELECT n.* FROM s, SPSCAN(s.next_cursor, count => 1) n WHERE s.next_cursor <> 0
+)
+SELECT SUM(cardinality(keys)), MAX(cardinality(keys)) FROM s;
+WITH RECURSIVE s AS (
+    SELECT * FROM SPSCAN(0, 'scan:2[0-4]')
+    UNION ALL
+    SELECT n.* FROM s, SPSCAN(s.next_cursor, 'scan:2[0-4]') n WHERE s.next_cursor <> 0
+)
+SELECT array_agg(k ORDER BY k) FROM s, unnest(s.keys) k;
+SELECT DEL('scan:1');
+WITH RECURSIVE s AS (
+    SELECT * FROM SPSCAN(0, 'scan:1*')
+    UNION ALL
+    SELECT n.* FROM s, SPSCAN(s.next_cursor, 'scan:1*') n WHERE s.next_cursor <> 0
+)
+SELECT COUNT(k) FROM s, unnest(s.keys) k; --110
+SELECT next_cursor FROM SPSCAN(-1);
+RESET spat.shards;
+SET spat.db = 'spat-default';
+
+-- maintained counters
+SET spat.db = 'test-spat-stats';
+SELECT COUNT(SPSET('s' || i, 'v' || i)) FROM generate_series(1, 10) i;
+SELECT COUNT(LPUSH('l', 'e' || i)) FROM generate_series(1, 5) i;
+SELECT COUNT(SADD('set' || i % 3, 'e' || i)) FROM generate_series(1, 9) i;
+SELECT HSET('h', 'f1', 'v1');
+SELECT SPSET('t', 'v', ttl=> interval '1 hour');
+SELECT keys, strings, lists, sets, hashes, ttl_keys FROM SPAT_STATS();
+SELECT SP_DB_NITEMS(); --16
+SELECT used_bytes = key_bytes + string_bytes + list_bytes + set_bytes + hash_bytes,
+       string_bytes > 0, list_bytes > 0, set_bytes > 0, hash_bytes > 0
+  FROM SPAT_STATS();
+SELECT SPDEL(ARRAY['s1', 's2', 's3', 's4', 's5', 's6', 's7', 's8', 's9', 's10', 't', 'l', 'set0', 'set1', 'set2', 'h']);
+SELECT keys, strings, lists, sets, hashes, ttl_keys FROM SPAT_STATS();
+SELECT string_bytes, list_bytes, set_bytes, hash_bytes FROM SPAT_STATS();
+SET spat.db = 'spat-default';
+
+SELECT SPSET('encstr', 'v'), SPOBJECT_ENCODING('encstr'); -- embstr
+SELECT DEL('encstr');
+
+-- counters
+SELECT INCR('cnt'), INCR('cnt'), INCRBY('cnt', 10), DECR('cnt'), DECRBY('cnt', 5);
+SELECT SPGET('cnt'), SPTYPE('cnt'), SPOBJECT_ENCODING('cnt'), SPMGET(ARRAY['cnt']);
+SELECT SPSET('cnt2', '-41');
+SELECT INCR('cnt2'), SPOBJECT_ENCODING('cnt2');
+SELECT SPSET('cntttl', '1', ttl=> interval '1 hour');
+SELECT INCR('cntttl'), TTL('cntttl') > interval '59 minutes';
+CREATE TEMP TABLE cnt_bytes AS SELECT string_bytes FROM SPAT_STATS();
+SELECT COUNT(INCR('cnt')) FROM generate_series(1, 1000);
+SELECT s.string_bytes = c.string_bytes, SPGET('cnt') FROM SPAT_STATS() s, cnt_bytes c;
+SELECT INCRBY('cnt', 9223372036854775807);
+SELECT SPSET('cnt', 'text again'), SPOBJECT_ENCODING('cnt');
+SELECT INCR('cnt');
+SELECT SPSET('cnt', ' 1');
+SELECT INCR('cnt');
+SELECT LPUSH('cntlist', 'a');
+SELECT INCR('cntlist');
+SELECT SPDEL(ARRAY['cnt', 'cnt2', 'cntttl', 'cntlist']);
+
+-- overwrites free or reuse the previous value
+SET spat.hash_max_compact_entries = 0;
+SET spat.db = 'test-spat-overwrite';
+SELECT COUNT(SPSET('ow' || i, repeat('x', 100))) FROM generate_series(1, 1000) i;
+CREATE TEMP TABLE ow_size AS SELECT SP_DB_SIZE_BYTES() AS bytes;
+SELECT COUNT(SPSET('ow' || i, repeat('y', 100 + j % 8))) FROM generate_series(1, 1000) i, generate_series(1, 20) j;
+SELECT SP_DB_SIZE_BYTES() = bytes FROM ow_size;
+SELECT string_bytes FROM SPAT_STATS(); -- 1000 * (104 + VARHDRSZ)
+SELECT COUNT(SPSET('ow' || i, repeat('z', 1000 * (j % 2) + 10))) FROM generate_series(1, 1000) i, generate_series(1, 20) j;
+SELECT string_bytes FROM SPAT_STATS(); -- 1000 * (10 + VARHDRSZ)
+SELECT COUNT(SADD('ows' || i, 'm' || j)) FROM generate_series(1, 10) i, generate_series(1, 200) j;
+SELECT sets, set_bytes > 0, strings FROM SPAT_STATS();
+SELECT COUNT(SPSET('ows' || i, 'v')) FROM generate_series(1, 10) i;
+SELECT sets, set_bytes, strings FROM SPAT_STATS();
+SELECT HSET('owh', 'f', 'v0');
+CREATE TEMP TABLE ow_hash AS SELECT hash_bytes FROM SPAT_STATS();
+SELECT COUNT(HSET('owh', 'f', 'v' || i % 10)) FROM generate_series(1, 1000) i;
+SELECT s.hash_bytes = h.hash_bytes FROM SPAT_STATS() s, ow_hash h;
+RESET spat.hash_max_compact_entries;
+SET spat.db = 'spat-default';
+
+-- short keys and strings are stored inline
+SELECT SPSET('k', 'xxxxxxxxxxxxxxxxxxxx'), SPOBJECT_ENCODING('k');
+SELECT SPSET('k', 'xxxxxxxxxxxxxxxxxxxxx'), SPOBJECT_ENCODING('k');
+SELECT SPSET('k', 'short'), SPOBJECT_ENCODING('k'), SPGET('k');
+SELECT SPSET(repeat('k', 23), 'v1'), SPSET(repeat('k', 24), 'v2'), SPSET(repeat('k', 200), 'v3');
+SELECT SPGET(repeat('k', 23)), SPGET(repeat('k', 24)), SPGET(repeat('k', 200)), SPGET(repeat('k', 22));
+SELECT SPSET(repeat('k', 23), 'v', ttl=> interval '1 hour'), TTL(repeat('k', 23)) > interval '59 minutes';
+SELECT SPDEL(ARRAY['k', repeat('k', 23), repeat('k', 24), repeat('k', 200)]);
+
+-- the hash function is fixed when a DB is created
+SET spat.hash_function = 'crc32c';
+SET spat.shards = 4;
+SET spat.db = 'test-spat-crc32c';
+SELECT SPAT_DB_HASH_FUNCTION();
+SELECT COUNT(SPSET('h' || i, 'v' || i)) FROM generate_series(1, 1000) i;
+SELECT COUNT(*) FROM generate_series(1, 1000) i WHERE SPGET('h' || i)::text = 'v' || i;
+SELECT COUNT(SADD('hs', 'm' || i)) FROM generate_series(1, 500) i;
+SELECT SCARD('hs'), SISMEMBER('hs', 'm250'), SPOBJECT_ENCODING('hs');
+SET spat.hash_function = 'murmur3';
+SELECT SPAT_DB_HASH_FUNCTION(), SPGET('h1');
+SET spat.db = 'test-spat-murmur3';
+SELECT SPAT_DB_HASH_FUNCTION(), SPSET('k', 'v'), SPGET('k');
+SET spat.hash_function = 'xxh3';
+RESET spat.hash_function;
+RESET spat.shards;
+SET spat.db = 'spat-default';
+SELECT COUNT(*), bool_and(avg_probes >= 1 AND max_probes >= 1 AND ns_per_key >= 0 AND avg_key_len BETWEEN 8 AND 16) FROM SP_HASH_BENCH(1000, 8, 16);
+SELECT * FROM SP_HASH_BENCH(0, 8, 16);
+
+-- bulk loading
+SET spat.db = 'test-spat-load';
+SELECT SP_LOAD($$SELECT 'l' || i, repeat('v', i % 40) FROM generate_series(1, 25000) i$$);
+SELECT SP_DB_NITEMS(), SPGET('l3'), SPGET('l24999')::text = repeat('v', 39);
+SELECT SP_LOAD('SELECT i, i * 2 FROM generate_series(1, 3) i', interval '1 hour');
+SELECT SPGET('1'), SPGET('3'), TTL('2') > interval '59 minutes', SPOBJECT_ENCODING('l3');
+SELECT SP_LOAD('SELECT 1');
+SELECT SP_LOAD('SELECT NULL::text, 1');
+SELECT SP_LOAD('SELECT 1 WHERE false');
+SET spat.db = 'spat-default';
+
+-- near cache
+SET spat.db = 'test-spat-near';
+SET spat.local_cache_size = '64kB';
+SELECT SPSET('flag', 'on');
+SELECT SPGET('flag'), SPGET('flag'), SPGET('nokey');
+SELECT keys, hits, misses, invalidations, evictions FROM SP_LOCAL_CACHE_STATS();
+SELECT SPSET('flag', 'off'), SPGET('flag'), SPGET('flag');
+SELECT INCR('cnt'), SPGET('cnt'), SPGET('cnt'), INCR('cnt'), SPGET('cnt');
+SELECT SPSET('tmp', 'v', ttl => interval '10 milliseconds'), SPGET('tmp'), pg_sleep(0.02);
+SELECT SPGET('tmp');
+SELECT keys, hits, misses, invalidations, evictions FROM SP_LOCAL_CACHE_STATS();
+SET spat.local_cache_size = '1kB';
+SELECT LENGTH(SPSET('big1', repeat('x', 600))::text), LENGTH(SPSET('big2', repeat('x', 600))::text);
+SELECT LENGTH(SPGET('big1')::text), LENGTH(SPGET('big2')::text);
+SELECT keys, evictions > 0 FROM SP_LOCAL_CACHE_STATS();
+RESET spat.local_cache_size;
+SELECT SPGET('flag');
+SELECT keys, bytes FROM SP_LOCAL_CACHE_STATS();
+SET spat.db = 'spat-default';
+
+-- typed getters
+SET spat.db = 'test-spat-getters';
+SELECT SPSET('j', '{"a": [1, 2]}'), SPSET('u', 'hello'), LENGTH(SPSET('big', repeat('x', 1000))::text);
+SELECT SPGET_TEXT('j'), SPGET_JSONB('j') -> 'a', SPGET_BYTEA('u'), SPGET_TEXT('nokey');
+SELECT INCR('cnt'), SPGET_TEXT('cnt'), SPGET_JSONB('cnt'), SPGETRANGE('cnt', 0, 1);
+SELECT SPGETRANGE('u', 1, 3), SPGETRANGE('u', -2, 10), SPGETRANGE('u', 10, 1), SPGETRANGE('u', -10, 2), SPGETRANGE('nokey', 0, 1);
+SELECT string_agg(SPGETRANGE('big', i * 300, 300), '' ORDER BY i) = SPGET_BYTEA('big') FROM generate_series(0, 3) i;
+SELECT SPGETRANGE('u', 0, -1);
+SELECT LPUSH('l', 'a');
+SELECT SPGET_TEXT('l');
+SELECT SPGETRANGE('l', 0, 1);
+SET spat.db = 'spat-default';
+
+-- values SET from other types
+SET spat.db = 'test-spat-datum';
+SELECT SPSET('j', '{"b": 2, "a": [1, 2]}'::jsonb), SPSET('i', 42), SPSET('b', 9000000000::bigint), SPSET('f', 1.5::float8);
+SELECT SPOBJECT_ENCODING('j'), SPOBJECT_ENCODING('i'), SPTYPE('j');
+SELECT SPGET('j')::jsonb -> 'a', SPGET('i')::int + 1, SPGET('b')::bigint, SPGET('f')::float8 * 2;
+SELECT SPGET('i')::bigint, SPGET_TEXT('j'), SPGET_JSONB('j') -> 'b', SPGETRANGE('j', 0, 5);
+SELECT SPGET_AS('j', NULL::jsonb) = '{"a": [1, 2], "b": 2}', SPGET_AS('i', NULL::int), SPGET_AS('i', NULL::numeric), SPGET_AS('nokey', NULL::int);
+SELECT SPSET('arr', ARRAY[1, 2, 3]), (SPGET_AS('arr', NULL::int[]))[2], SPMGET(ARRAY['i', 'f', 'arr']);
+SELECT SPSET('tj', '{"x": 1}'), SPGET('tj')::jsonb ->> 'x', SPGET_AS('tj', NULL::jsonb) -> 'x';
+SELECT INCR('i'), SPOBJECT_ENCODING('i'), SPGET('i')::int;
+SELECT LPUSH('l', 'a');
+SELECT SPGET('l')::int;
+CREATE TYPE spat_mood AS ENUM ('sad', 'happy');
+CREATE TYPE spat_pair AS (n int, s text);
+SELECT SPSET('enum', 'happy'::spat_mood), SPSET('pair', ROW(1, 'x')::spat_pair);
+SELECT SPOBJECT_ENCODING('enum'), SPOBJECT_ENCODING('pair');
+\c
+SET client_min_messages = ERROR;
+SET spat.db = 'test-spat-datum';
+SELECT SPGET('enum'), SPGET('pair'), SPGET_AS('enum', NULL::spat_mood) > 'sad', (SPGET_AS('pair', NULL::spat_pair)).s;
+DROP TYPE spat_mood, spat_pair;
+SET spat.db = 'spat-default';
+
+-- batches
+SET spat.db = 'test-spat-exec';
+SELECT SPEXEC('[["SET", "k", "v"], ["GET", "k"], ["INCR", "n"], ["INCRBY", "n", 41], ["DECR", "n"], ["GET", "n"]]');
+SELECT SPEXEC('[["RPUSH", "l", "a"], ["RPUSH", "l", "b"], ["LLEN", "l"], ["RPOPLPUSH", "l", "l2"], ["LPOP", "l2"], ["RPOP", "l2"]]');
+SELECT SPEXEC('[["SADD", "s", "m"], ["SISMEMBER", "s", "m"], ["SREM", "s", "m"], ["SCARD", "s"]]');
+SELECT SPEXEC('[["HSET", "h", "f", "v"], ["HINCRBY", "h", "c", 5], ["HGET", "h", "f"], ["ZADD", "z", 1.5, "m"], ["ZSCORE", "z", "m"], ["ZCARD", "z"], ["ZREM", "z", "m"]]');
+SELECT SPEXEC('[["DEL", "k"], ["GET", "k"], ["SET", "k", "w", "1 hour"], ["GET", "k"], ["DEL", "nokey"]]');
+SELECT GETEXPIREAT('k') > now(), LRANGE('l', 0, -1);
+SELECT SPEXEC('[]');
+SELECT SPEXEC('{"GET": "k"}');
+SELECT SPEXEC('[["NOPE", "k"]]');
+SELECT SPEXEC('[["GET"]]');
+SELECT SPEXEC('[["INCR", "c"], ["GET", {"a": 1}]]'); -- runs nothing
+SELECT SPEXEC('[["SET", "k", "x"], ["SADD", "k", "m"]]'); -- the SET stays
+SELECT SPGET('c') IS NULL, SPGET('k');
+SET spat.db = 'spat-default';
+
+-- timing
+SET spat.db = 'test-spat-timing';
+SELECT COUNT(*) FROM SPAT_COMMAND_STATS(); -- off by default
+SET spat.track_timing = on;
+SELECT SPSET('k', 'v'), SPGET('k'), SPGET('nokey'), INCR('n');
+SELECT LPUSH('l', 'a');
+SELECT SADD('s', 'a'), LINDEX('l', 0);
+SELECT * FROM SINTER('s', 's');
+SELECT command, calls, p50_ms <= p99_ms AS ordered, (SELECT SUM(b) FROM unnest(histogram) b) = calls AS bucketed
+FROM SPAT_COMMAND_STATS() ORDER BY command;
+SELECT SPAT_COMMAND_STATS_RESET();
+SELECT COUNT(*) FROM SPAT_COMMAND_STATS();
+RESET spat.track_timing;
+SELECT SPGET('k');
+SELECT COUNT(*) FROM SPAT_COMMAND_STATS();
+SET spat.db = 'spat-default';
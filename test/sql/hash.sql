@@ -11,3 +11,33 @@ SELECT HGET('h2', 'f1'); -- NULL - no previous HSET('h2')
 
 SELECT DEL('h1'); -- t
 SELECT DEL('h2'); -- f not exists
+
+-- HSCAN
+SELECT HSET('scanhash', 'f1', 'v1');
+SELECT HSET('scanhash', 'f2', 'v2');
+SELECT HSET('scanhash', 'g1', 'w1');
+SELECT f, v FROM HSCAN('scanhash', 0, 'f*'), unnest(fields, vals) AS u(f, v) ORDER BY f;
+SELECT DEL('scanhash');
+
+-- compact encoding
+SELECT HSET('enchash', 'f1', 'v1');
+SELECT HSET('enchash', 'f1', 'v1bis');
+SELECT SPOBJECT_ENCODING('enchash'); -- listpack
+SELECT HGET('enchash', 'f1'); -- v1bis
+SELECT HSET('enchash', 'f2', repeat('x', 100));
+SELECT SPOBJECT_ENCODING('enchash'); -- hashtable
+SELECT SPTYPE('enchash'), HGET('enchash', 'f1'), LENGTH(HGET('enchash', 'f2'));
+SELECT DEL('enchash');
+
+-- HINCRBY
+SET spat.hash_max_compact_entries = 2;
+SET spat.db = 'test-spat-hash-compact';
+SELECT HINCRBY('hcnt', 'f', 5), HINCRBY('hcnt', 'f', -2), HGET('hcnt', 'f');
+SELECT HSET('hcnt', 'g', 'abc');
+SELECT HINCRBY('hcnt', 'g', 1);
+SELECT HINCRBY('hcnt', 'h', 10), SPOBJECT_ENCODING('hcnt');
+SELECT HINCRBY('hcnt', 'f', 1), HINCRBY('hcnt', 'h', 1), HGET('hcnt', 'f'), HGET('hcnt', 'h');
+RESET spat.hash_max_compact_entries;
+SELECT HINCRBY('hcnt', 'h', 9223372036854775807);
+SELECT DEL('hcnt');
+SET spat.db = 'spat-default';
@@ -25,3 +25,56 @@ SELECT SPGET('list1');
 SELECT DEL('list1');
 
 SELECT DEL('list404');
+
+-- compact encoding
+SET spat.list_max_compact_entries = 3;
+SET spat.db = 'test-spat-list-compact';
+SELECT COUNT(LPUSH('enclist', 'e' || i)) FROM generate_series(1, 3) i;
+SELECT SPOBJECT_ENCODING('enclist'); -- listpack
+SELECT LPOP('enclist'); -- e3
+SELECT LPUSH('enclist', 'e3');
+SELECT LPUSH('enclist', 'e4');
+SELECT SPOBJECT_ENCODING('enclist'); -- quicklist
+SELECT SPTYPE('enclist'), LLEN('enclist');
+SELECT LPOP('enclist'), LPOP('enclist'), LPOP('enclist'), LPOP('enclist');
+SELECT DEL('enclist');
+
+-- quicklists, in chunks of 3
+SELECT COUNT(RPUSH('ql', 'e' || i)) FROM generate_series(1, 10) i;
+SELECT SPOBJECT_ENCODING('ql'); -- quicklist
+SELECT LRANGE('ql', 0, -1);
+SELECT LRANGE('ql', 2, 6);
+SELECT LRANGE('ql', -3, 100);
+SELECT LRANGE('ql', 5, 2);
+SELECT LINDEX('ql', 0), LINDEX('ql', 4), LINDEX('ql', -1), LINDEX('ql', -7), LINDEX('ql', 10);
+SELECT RPOP('ql'), LPOP('ql'); -- e10 e1
+SELECT LPUSH('ql', 'e0');
+SELECT LTRIM('ql', 2, -2);
+SELECT LRANGE('ql', 0, -1), LLEN('ql');
+SELECT LTRIM('ql', 4, 2);
+SELECT LRANGE('ql', 0, -1), LLEN('ql'), RPOP('ql');
+SELECT RPUSH('ql', 'again');
+SELECT LRANGE('ql', 0, -1);
+SELECT DEL('ql');
+SELECT COUNT(RPUSH('bigql', 'e' || i)) FROM generate_series(1, 1000) i;
+SELECT LINDEX('bigql', 777), LINDEX('bigql', -777), LRANGE('bigql', 499, 501);
+SELECT LRANGE('nosuchlist', 0, -1), LINDEX('nosuchlist', 0), RPOP('nosuchlist');
+RESET spat.list_max_compact_entries;
+SELECT DEL('bigql');
+SET spat.db = 'spat-default';
+SELECT SPSET('notalist', 'v');
+SELECT LRANGE('notalist', 0, -1);
+SELECT DEL('notalist');
+
+-- blocking pops
+SELECT COUNT(RPUSH('bl', 'e' || i)) FROM generate_series(1, 3) i;
+SELECT * FROM BLPOP(ARRAY['nosuchlist', 'bl'], '1 second');
+SELECT * FROM BRPOP(ARRAY['bl'], '1 second');
+SELECT * FROM BRPOP(ARRAY['bl']);
+SELECT * FROM BLPOP(ARRAY['bl', 'nosuchlist'], '10 ms'); -- times out
+SET statement_timeout = '50ms';
+SELECT * FROM BLPOP(ARRAY['bl']); -- cancelled
+RESET statement_timeout;
+SELECT blocked FROM SPAT_STATS();
+SELECT * FROM BLPOP(ARRAY['bl'], '-1 second');
+SELECT DEL('bl');
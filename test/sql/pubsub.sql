@@ -0,0 +1,39 @@
+/* -------------------- PUB/SUB -------------------- */
+SET spat.db = 'test-spat-pubsub';
+SELECT SPPUBLISH('news', 'nobody listens');
+SELECT * FROM SPRECEIVE('10 ms');
+SELECT SPSUBSCRIBE(ARRAY['news', 'alerts']);
+SELECT SPSUBSCRIBE(ARRAY['news']); -- already subscribed
+SELECT SPPUBLISH('news', 'hello'), SPPUBLISH('alerts', 'fire'), SPPUBLISH('news', 'world');
+SELECT * FROM SPRECEIVE();
+SELECT * FROM SPRECEIVE('1 second');
+SELECT * FROM SPRECEIVE('1 second');
+SELECT * FROM SPRECEIVE('10 ms'); -- times out
+SELECT * FROM SP_PUBSUB_CHANNELS() ORDER BY channel;
+SET statement_timeout = '50ms';
+SELECT * FROM SPRECEIVE(); -- cancelled
+RESET statement_timeout;
+SELECT * FROM SPRECEIVE('-1 second');
+SELECT SPUNSUBSCRIBE(ARRAY['alerts', 'nosuchchannel']);
+SELECT SPPUBLISH('alerts', 'gone');
+SELECT channel FROM SP_PUBSUB_CHANNELS();
+
+-- a full buffer drops new messages for its subscriber
+SELECT SPUNSUBSCRIBE();
+SET spat.pubsub_buffer_size = 2;
+SELECT SPSUBSCRIBE(ARRAY['news']);
+SELECT SPPUBLISH('news', 'm' || i) FROM generate_series(1, 3) i;
+SELECT * FROM SP_PUBSUB_CHANNELS();
+SELECT message FROM SPRECEIVE('1 second');
+SELECT message FROM SPRECEIVE('1 second');
+SELECT message FROM SPRECEIVE('10 ms');
+
+-- pending messages are dropped along with the last channel
+SELECT SPPUBLISH('news', 'pending');
+SELECT SPUNSUBSCRIBE();
+SELECT COUNT(*) FROM SP_PUBSUB_CHANNELS();
+SELECT * FROM SPRECEIVE('10 ms');
+SELECT SPSUBSCRIBE(ARRAY[NULL]);
+SELECT SPUNSUBSCRIBE();
+RESET spat.pubsub_buffer_size;
+SET spat.db = 'spat-default';
@@ -45,4 +45,91 @@ SELECT SPGET('set1');
 -- DEL set
 SELECT DEL('set1');
 SELECT DEL('set2');
-SELECT DEL('set404');
\ No newline at end of file
+SELECT DEL('set404');
+
+-- SSCAN
+SELECT COUNT(SADD('scanset', 'm' || i)) FROM generate_series(1, 50) i;
+WITH RECURSIVE s AS (
+    SELECT * FROM SSCAN('scanset', 0, count => 7)
+    UNION ALL
+    SELECT n.* FROM s, SSCAN('scanset', s.next_cursor, count => 7) n WHERE s.next_cursor <> 0
+)
+SELECT COUNT(m), COUNT(DISTINCT m) FROM s, unnest(s.members) m;
+SELECT next_cursor, array_agg(m ORDER BY m) FROM SSCAN('scanset', 0, 'm4?'), unnest(members) m GROUP BY 1;
+SELECT * FROM SSCAN('nosuchset', 0);
+SELECT DEL('scanset');
+
+-- compact encoding
+SET spat.set_max_compact_entries = 4;
+SET spat.db = 'test-spat-set-compact4';
+SELECT SADD('encset', 'a');
+SELECT SPOBJECT_ENCODING('encset'); -- listpack
+SELECT COUNT(SADD('encset', 'm' || i)) FROM generate_series(1, 3) i;
+SELECT SREM('encset', 'm3'); -- 1
+SELECT SADD('encset', 'm3');
+SELECT SPOBJECT_ENCODING('encset'); -- listpack
+SELECT SADD('encset', 'm4');
+SELECT SPOBJECT_ENCODING('encset'); -- hashtable
+SELECT SPTYPE('encset'), SCARD('encset'), SISMEMBER('encset', 'a'), SISMEMBER('encset', 'm4'), SISMEMBER('encset', 'm5');
+SELECT SADD('encset2', repeat('x', 65));
+SELECT SPOBJECT_ENCODING('encset2'); -- hashtable
+SELECT DEL('encset'), DEL('encset2');
+SELECT SPOBJECT_ENCODING('encset'); -- NULL
+
+RESET spat.set_max_compact_entries;
+SET spat.db = 'spat-default';
+
+-- set algebra
+SET spat.set_max_compact_entries = 3;
+SET spat.db = 'test-spat-set-compact3';
+SELECT COUNT(SADD('sa', m)) FROM unnest(ARRAY['a', 'b', 'c', 'd', 'e']) m;
+SELECT COUNT(SADD('sb', m)) FROM unnest(ARRAY['f', 'd', 'b']) m;
+SELECT SPOBJECT_ENCODING('sa'), SPOBJECT_ENCODING('sb');
+SELECT * FROM SINTER('sa', 'sb') ORDER BY 1;
+SELECT * FROM SINTER('sb', 'sa') ORDER BY 1;
+SELECT COUNT(*) FROM SINTER('sa', 'sb', 'nosuchset');
+SELECT * FROM SUNION('sa', 'sb', 'nosuchset') ORDER BY 1;
+SELECT * FROM SDIFF('sa', 'sb') ORDER BY 1;
+SELECT * FROM SDIFF('sb', 'sa');
+SELECT * FROM SDIFF('sb', 'nosuchset') ORDER BY 1;
+SELECT SINTERSTORE('sc', 'sa', 'sb');
+SELECT SPTYPE('sc'), SCARD('sc'), SISMEMBER('sc', 'd'), SISMEMBER('sc', 'a');
+SELECT SUNIONSTORE('sb', 'sa', 'sb'); -- dest is also a source
+SELECT SCARD('sb'), SPOBJECT_ENCODING('sb');
+SELECT SDIFFSTORE('sc', 'sa', 'sb'); -- empty result deletes dest
+SELECT SPTYPE('sc');
+SELECT SPSET('sstr', 'v');
+SELECT * FROM SINTER('sa', 'sstr');
+SELECT SDIFFSTORE('sstr', 'sa', 'sc'); -- replaces the string
+SELECT SPTYPE('sstr'), SCARD('sstr');
+SELECT DEL('sa'), DEL('sb'), DEL('sstr');
+SELECT COUNT(SADD('bi1', 'm' || i)) FROM generate_series(1, 300) i;
+SELECT COUNT(SADD('bi2', 'm' || i)) FROM generate_series(1, 300, 2) i;
+SELECT COUNT(*) FROM SINTER('bi1', 'bi2', 'bi1'); -- more than a batch
+SELECT COUNT(*) FROM SDIFF('bi1', 'bi2');
+SELECT COUNT(*) FROM SDIFF('bi1', 'bi2', 'bi1');
+SELECT COUNT(*), COUNT(DISTINCT m) FROM SUNION('bi2', 'bi1', 'bi2') m;
+SELECT SUNIONSTORE('bi3', 'bi2', 'bi1');
+SELECT SCARD('bi3');
+SELECT DEL('bi1'), DEL('bi2'), DEL('bi3');
+
+RESET spat.set_max_compact_entries;
+SET spat.db = 'spat-default';
+
+-- short and long members
+SET spat.set_max_compact_entries = 0;
+SET spat.db = 'test-spat-set-compact0';
+SELECT SADD('mixset', 'short'), SADD('mixset', repeat('m', 23)), SADD('mixset', repeat('m', 24)), SADD('mixset', 'short');
+SELECT SPOBJECT_ENCODING('mixset'), SCARD('mixset'), SISMEMBER('mixset', repeat('m', 23)), SISMEMBER('mixset', repeat('m', 24)), SISMEMBER('mixset', repeat('m', 22));
+SELECT SREM('mixset', repeat('m', 23)), SREM('mixset', repeat('m', 24)), SCARD('mixset');
+RESET spat.set_max_compact_entries;
+SELECT DEL('mixset');
+
+SET spat.db = 'spat-default';
+
+-- other types
+SELECT SPSET('sstr', 'v');
+SELECT SISMEMBER('sstr', 'v');
+SELECT SREM('sstr', 'v');
+SELECT SCARD('sstr') IS NULL;
+SELECT DEL('sstr');
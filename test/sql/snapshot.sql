@@ -0,0 +1,30 @@
+SET spat.db = 'test-spat-snap';
+SELECT SPSET('s', 'v'), LENGTH(SPSET('big', repeat('x', 1000))::text);
+SELECT SPSET('ttl', 'v', ttl => interval '1 hour'), INCR('cnt');
+SELECT LPUSH('l', 'b'), LPUSH('l', 'a');
+SELECT COUNT(RPUSH('ql', 'e' || i)) FROM generate_series(1, 300) i;
+SELECT SADD('st', 'm1'), SADD('st', 'm2');
+SELECT COUNT(SADD('bigset', 'm' || i)) FROM generate_series(1, 300) i;
+SELECT HSET('h', 'f', 'v');
+SELECT COUNT(HSET('bighash', 'f' || i, 'v' || i)) FROM generate_series(1, 300) i;
+SELECT ZADD('z', 2, 'b'), ZADD('z', 1, 'a');
+SELECT SPSET('gone', 'v', ttl => interval '1 millisecond'), pg_sleep(0.01);
+SELECT SP_SAVE('spat_regress.snap'); -- all but 'gone'
+
+-- load into a DB laid out differently, over existing keys
+SET spat.shards = 4;
+SET spat.hash_function = 'crc32c';
+SET spat.db = 'test-spat-snap-restore';
+SELECT SPSET('s', 'old'), LPUSH('l', 'old');
+SELECT SP_LOAD_SNAPSHOT('spat_regress.snap'), SP_DB_NITEMS();
+SELECT SPGET('s'), LENGTH(SPGET('big')::text), TTL('ttl') > interval '59 minutes', SPGET('cnt'), SPGET('gone');
+SELECT LRANGE('l', 0, -1), LLEN('ql'), LRANGE('ql', 0, 2), LINDEX('ql', -1), SPOBJECT_ENCODING('ql');
+SELECT SCARD('st'), SISMEMBER('st', 'm2'), SCARD('bigset'), SISMEMBER('bigset', 'm300'), SPOBJECT_ENCODING('bigset');
+SELECT HGET('h', 'f'), HGET('bighash', 'f300'), SPOBJECT_ENCODING('h'), SPOBJECT_ENCODING('bighash');
+SELECT * FROM ZRANGE('z', 0, -1);
+SELECT SP_LOAD_SNAPSHOT('spat_regress_missing.snap');
+SELECT * FROM SP_DB_LOG_STATS(); -- spat.appendonly needs preloading
+SELECT SP_REPLAY_LOG('spat_regress_missing.aof');
+RESET spat.shards;
+RESET spat.hash_function;
+SET spat.db = 'spat-default';
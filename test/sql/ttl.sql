@@ -2,3 +2,30 @@
 
 SELECT SPSET('expkey1', 'expvalue1', ttl=> '1 second');
 SELECT TTL('expkey1') < '1 second' ;
+
+-- expired keys are reclaimed on access
+SELECT SPSET('expkey2', 'expvalue2', ttl=> '10 milliseconds');
+SELECT pg_sleep(0.05);
+SELECT SPGET('expkey2');
+SELECT SPTYPE('expkey2');
+SELECT expired_lazy > 0 FROM SP_DB_EXPIRE_STATS();
+
+-- SET discards the previous TTL
+SELECT SPSET('expkey3', 'expvalue3', ttl=> '10 seconds');
+SELECT SPSET('expkey3', 'expvalue3');
+SELECT GETEXPIREAT('expkey3');
+
+-- keys with a TTL are indexed by expireat
+SET spat.db = 'test-spat-expiry';
+SELECT SP_DB_NEXT_EXPIRY();
+SELECT COUNT(SPSET('h' || i, 'v', ttl=> ((i * 7919) % 1000 + 1) * interval '1 minute')) FROM generate_series(1, 1000) i;
+SELECT SPSET('nottl', 'v');
+SELECT ttl_keys FROM SP_DB_EXPIRE_STATS(); --1000
+SELECT COUNT(*) FROM generate_series(1, 1000, 2) i WHERE DEL('h' || i);
+SELECT COUNT(SPSET('h' || i, 'v', ttl=> '1 day')) FROM generate_series(4, 1000, 4) i;
+SELECT ttl_keys FROM SP_DB_EXPIRE_STATS(); --500
+SELECT SP_DB_NEXT_EXPIRY() = (SELECT MIN(GETEXPIREAT('h' || i)) FROM generate_series(1, 1000) i);
+SELECT COUNT(SPSET('h' || i, 'v')) FROM generate_series(2, 1000, 2) i;
+SELECT ttl_keys FROM SP_DB_EXPIRE_STATS(); --0
+SELECT SP_DB_NEXT_EXPIRY();
+SET spat.db = 'spat-default';
@@ -0,0 +1,36 @@
+/* -------------------- SORTED SETS -------------------- */
+SELECT ZADD('z', 3, 'c'), ZADD('z', 1, 'a'), ZADD('z', 2, 'b');
+SELECT ZADD('z', 2, 'bb'), ZADD('z', 2, 'ba'); -- ties are ordered by member
+SELECT SPTYPE('z'), SPOBJECT_ENCODING('z'), ZCARD('z');
+SELECT * FROM ZRANGE('z', 0, -1);
+SELECT * FROM ZRANGE('z', -2, 10);
+SELECT COUNT(*) FROM ZRANGE('z', 3, 1);
+SELECT ZSCORE('z', 'ba'), ZSCORE('z', 'nosuchmember'), ZRANK('z', 'a'), ZRANK('z', 'bb'), ZRANK('z', 'nosuchmember');
+
+-- updating a score moves the member
+SELECT ZADD('z', 0.5, 'c'), ZADD('z', 0.5, 'c');
+SELECT ZRANK('z', 'c'), ZSCORE('z', 'c'), ZCARD('z');
+SELECT * FROM ZRANGEBYSCORE('z', 1, 2);
+SELECT * FROM ZRANGEBYSCORE('z', '-infinity', 1);
+SELECT COUNT(*) FROM ZRANGEBYSCORE('z', 5, 10);
+SELECT ZREM('z', 'b'), ZREM('z', 'b'), ZREM('nosuchzset', 'b');
+SELECT ZREMRANGEBYSCORE('z', 1, 2), ZCARD('z');
+SELECT * FROM ZRANGE('z', 0, -1);
+
+-- ranks and ranges over many levels
+SELECT COUNT(ZADD('bigz', (i * 7919) % 10000, 'm' || i)) FROM generate_series(1, 10000) i;
+SELECT ZCARD('bigz'), ZRANK('bigz', 'm1'), ZSCORE('bigz', 'm1');
+SELECT array_agg(member) FROM ZRANGE('bigz', 5000, 5002);
+SELECT COUNT(*), MIN(score), MAX(score) FROM ZRANGEBYSCORE('bigz', 100, 199.5);
+SELECT ZREMRANGEBYSCORE('bigz', 0, 4999), ZCARD('bigz'), ZRANK('bigz', 'm1');
+SELECT bool_and(ZRANK('bigz', member) = r - 1) FROM ZRANGE('bigz', 0, -1) WITH ORDINALITY AS t(member, score, r);
+SELECT DEL('bigz'), ZCARD('bigz');
+
+-- errors
+SELECT ZADD('z', 'NaN', 'x');
+SELECT * FROM ZRANGEBYSCORE('z', 'NaN', 1);
+SELECT SPSET('notazset', 'v');
+SELECT ZADD('notazset', 1, 'x');
+SELECT ZSCORE('notazset', 'x');
+SELECT DEL('notazset'), DEL('z');
+SELECT zsets, zset_bytes FROM SPAT_STATS();
@@ -0,0 +1,53 @@
+# Changes made while the worker restores a snapshot survive the next restart
+use strict;
+use warnings FATAL => 'all';
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node = PostgreSQL::Test::Cluster->new('restore');
+$node->init;
+$node->append_conf(
+	'postgresql.conf', q{
+shared_preload_libraries = 'spat'
+spat.snapshot_dir = 'pg_spat'
+spat.snapshot_interval = 0
+spat.appendonly = on
+spat.appendfsync = always
+});
+$node->start;
+$node->safe_psql('postgres', 'CREATE EXTENSION spat');
+
+# Enough keys for the restore to take a while, and k1 saved with one of the highest LSNs
+$node->safe_psql('postgres',
+	q{SELECT COUNT(SPSET('k' || i, 'v')) FROM generate_series(2, 200000) i});
+$node->safe_psql('postgres', q{SELECT SPSET('k1', 'saved')});
+
+# A clean shutdown saves a snapshot and starts a new log
+my $offset = -s $node->logfile;
+$node->restart;
+
+# Written as soon as we can connect, most likely while the worker still restores
+$node->safe_psql('postgres', q{SELECT SPSET('k1', 'during')});
+$node->wait_for_log(qr/spat: restored \d+ keys/, $offset);
+
+is($node->safe_psql('postgres', q{SELECT SPGET('k1')}),
+	'during', 'restoring doesn\'t roll back a key written meanwhile');
+cmp_ok($node->safe_psql('postgres', q{SELECT lsn FROM SP_DB_LOG_STATS()}),
+	'>', 200000, 'LSNs are past those of the snapshot');
+
+# No snapshot on the way down, so the change has to come from replaying the log
+$offset = -s $node->logfile;
+$node->stop('immediate');
+$node->start;
+$node->wait_for_log(qr/spat: replayed \d+ changes/, $offset);
+
+is($node->safe_psql('postgres', q{SELECT SPGET('k1')}),
+	'during', 'a change logged during the restore is replayed');
+is($node->safe_psql('postgres', q{SELECT SPGET('k200000')}),
+	'v', 'the snapshot is restored too');
+
+$node->stop;
+
+done_testing();